@@ -5,6 +5,9 @@
 // Header
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+// the QOI and PNG encoders, QOIWrite() and PNGWrite(), shared with the raycaster in p4
+#include "../p4/encoders.c"
 
 // create a stuct that represents a single pixel, same as what we did in class
 typedef struct PPMRGBpixel {
@@ -24,6 +27,8 @@ typedef struct PPMimage {
 // the buffer is used to store image data and some header data from ppm file
 // so that I could use the data from buffer when we write into output file
 PPMimage *buffer;
+// the KB of rows that the threads compress apart in a PNG file, 0 compresses the image as one stream
+double pngChunk = 0;
 
 PPMimage PPMRead(char *inputFilename);
 int PPMWrite(char *outPPMVersion, char *outputFilename);
@@ -91,6 +96,8 @@ PPMimage PPMRead(char *inputFilename) {
 		fprintf(stderr, "Error: the image has to be 8-bit per channel. \n");
 		exit(1);
 	}
+	// a single whitespace ends the header, the P6 body data starts right after it
+	fgetc(fh);
 
 	/* I did buffer->width * buffer->height * sizeof(PPMRGBpixel), so that each (buffer->width*buffer->height) number
 	of pixel memory will be allocated. Also, each pixel includes r, g, b. The reason I did it is that it makes me easier to read 
@@ -136,6 +143,32 @@ PPMimage PPMRead(char *inputFilename) {
 
 // this function writes the header data from buffer to output file
 int PPMWrite(char *outPPMVersion, char *outputFilename) {
+	// the compressed formats are written by the encoders, which report how fast and how small they were
+	if (strcmp(outPPMVersion, "PNG") == 0 || strcmp(outPPMVersion, "QOI") == 0) {
+		FILE *fh = fopen(outputFilename, "wb");
+		if (fh == NULL) {
+			fprintf(stderr, "Error: open the file unscuccessfully. \n");
+			return (1);
+		}
+		int failed;
+		if (outPPMVersion[0] == 'P') {
+			int chunkRows = pngChunk > 0 ? (int)(pngChunk * 1024 / (buffer->width * 3 + 1)) + 1 : 0;
+			failed = PNGWrite(fh, buffer->data, buffer->width, buffer->height, PNG_FILTER_ADAPTIVE, chunkRows);
+		}
+		else {
+			failed = QOIWrite(fh, buffer->data, buffer->width, buffer->height);
+		}
+		fclose(fh);
+		if (failed) {
+			fprintf(stderr, "Error: write the file unscuccessfully. \n");
+			return (1);
+		}
+		printf("The file saved successfully! \n");
+		printf("%s: %.2f MB to %.2f MB (ratio %.2f) in %.2f ms, %.1f MB/s \n", outPPMVersion, encodeStats.rawBytes / 1e6,
+			encodeStats.writtenBytes / 1e6, (double)encodeStats.rawBytes / encodeStats.writtenBytes, encodeStats.seconds * 1000,
+			encodeStats.rawBytes / 1e6 / (encodeStats.seconds > 0 ? encodeStats.seconds : 1e-9));
+		return (0);
+	}
 	int width = buffer->width;
 	int height = buffer->height;
 	int maxColorValue = buffer->maxColorValue;
@@ -184,16 +217,26 @@ int PPMDataWrite(char ppmVersionNum, FILE *outputFile) {
 //
 int main(int argc, char *argv[]) {
 	// the project requires the output looks like 'ppmrw 6 input.ppm out.ppm', so checking the number of arguments is necessary
-	if (argc != 4) {
+	// 'ppmrw png input.ppm out.png' can also take the KB of rows every thread compresses, as in 'ppmrw png input.ppm out.png 256'
+	if (argc != 4 && !(argc == 5 && strcmp(argv[1], "png") == 0)) {
 		fprintf(stderr, "Error: the magic number, input file name and output file name are required. \n");
 		return (1);
 	}
+	if (argc == 5) {
+		pngChunk = atof(argv[4]);
+	}
 	char *ppmVersion = argv[1];
 	char *inputFilename = argv[2];
 	char *outputFilename = argv[3];
 
 	PPMRead(inputFilename);
-	if (*ppmVersion == '6') {
+	if (strcmp(ppmVersion, "png") == 0) {
+		PPMWrite("PNG", outputFilename);
+	}
+	else if (strcmp(ppmVersion, "qoi") == 0) {
+		PPMWrite("QOI", outputFilename);
+	}
+	else if (*ppmVersion == '6') {
 		PPMWrite("P6", outputFilename);
 	}
 	else if (*ppmVersion == '3') {
@@ -0,0 +1,78 @@
+// Area lights
+// A light with "radius": r is a sphere, a light with "edge_u" and "edge_v" is a rectangle with
+// these two edges around its position. An area light is shaded like a point light in its
+// center, times the share of its surface the point sees, which gives soft shadows. The share
+// is found with shadow rays to points on the light, one in each cell of a grid over the light
+// (stratified). The first AREA_FIRST_SAMPLES rays go to the 4 quarters of the light; when
+// they agree the point is fully lit or fully in shadow, which is most points, and it costs 4
+// shadow rays that the occluder cache mostly stops early in the shadow. Only in the penumbra,
+// where they disagree, -areasamples n more rays go to a grid of sqrt(n) x sqrt(n) cells.
+
+#define AREA_FIRST_SAMPLES 4
+
+// areaLightPoint() sets y to the point of the area light for the numbers u and v in [0, 1),
+// a sphere is sampled on the disk of its radius that faces the point Ron
+static void areaLightPoint(Object* light, double* Ron, double u, double v, double* y) {
+	double* c = light->light.position;
+	int a;
+	if (light->light.shape == 2) {
+		for (a = 0; a < 3; a++) {
+			y[a] = c[a] + (u - 0.5) * light->light.edgeU[a] + (v - 0.5) * light->light.edgeV[a];
+		}
+		return;
+	}
+	double w[3] = { Ron[0] - c[0], Ron[1] - c[1], Ron[2] - c[2] };
+	double t[3], b[3];
+	normalize(w);
+	orthonormalBasis(w, t, b);
+	// the concentric map keeps the cells of the square compact on the disk
+	double x = 2 * u - 1, z = 2 * v - 1, r, phi;
+	if (x == 0 && z == 0) {
+		r = 0;
+		phi = 0;
+	}
+	else if (fabs(x) > fabs(z)) {
+		r = x;
+		phi = M_PI / 4 * z / x;
+	}
+	else {
+		r = z;
+		phi = M_PI / 2 - M_PI / 4 * x / z;
+	}
+	r *= light->light.radius;
+	for (a = 0; a < 3; a++) {
+		y[a] = c[a] + r * (cos(phi) * t[a] + sin(phi) * b[a]);
+	}
+}
+
+// litSamples() traces a shadow ray from Ron to a random point in each cell of a side x side
+// grid over the area light n of the light table and returns how many were not blocked
+static int litSamples(int intersection, int n, Object* light, double* Ron, int side) {
+	int lit = 0, s;
+	for (s = 0; s < side * side; s++) {
+		double y[3], Rdn[3];
+		areaLightPoint(light, Ron, (s % side + random01()) / side, (s / side + random01()) / side, y);
+		Rdn[0] = y[0] - Ron[0];
+		Rdn[1] = y[1] - Ron[1];
+		Rdn[2] = y[2] - Ron[2];
+		double lightDistance = sqrt(sqr(Rdn[0]) + sqr(Rdn[1]) + sqr(Rdn[2]));
+		normalize(Rdn);
+		lit += !shadowed(intersection, n, Ron, Rdn, lightDistance);
+	}
+	stats.areaShadowRays += side * side;
+	return lit;
+}
+
+// areaVisibility() returns the share of the area light n of the light table that the point
+// Ron of the primitive intersection sees
+double areaVisibility(int intersection, int n, Object* light, double* Ron) {
+	stats.areaLightPoints += 1;
+	int lit = litSamples(intersection, n, light, Ron, 2);
+	if (lit == 0 || lit == AREA_FIRST_SAMPLES) {
+		return (double)lit / AREA_FIRST_SAMPLES;
+	}
+	stats.penumbraPoints += 1;
+	int side = (int)sqrt(options.areaSamples);
+	lit += litSamples(intersection, n, light, Ron, side);
+	return (double)lit / (AREA_FIRST_SAMPLES + side * side);
+}
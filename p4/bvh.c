@@ -0,0 +1,742 @@
+// Bounding volume hierarchy over the spheres
+// Planes have no bounds and are still tested one by one. The hierarchy is built as a binary
+// tree with the surface area heuristic and then collapsed into a wide tree: every wide node
+// holds 4 children whose bounds are stored as 8 bit steps inside the bounds of the node, so
+// a node is one 64 byte cache line, and the 4 boxes are tested at once with SSE.
+// -bvh binary traces the binary tree instead, -bvh none loops over all spheres.
+// Instances and mesh triangles use the same trees through a bounds callback and a leaf test.
+// When only the sphere positions change between frames the tree is refit instead of rebuilt,
+// and subtrees are only rebuilt once their surface area cost gets too far from the built one.
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define BVH_BINS 12
+#define BVH_LEAF_SIZE 4
+// below this depth the builder splits the list in half, so no tree gets deeper than
+// BVH_MAX_DEPTH + 32 levels and the fixed traversal stacks cannot overflow
+#define BVH_MAX_DEPTH 64
+#define WIDE_EMPTY 255
+
+typedef struct {
+	double lo[3];
+	double hi[3];
+	int offset; // inner node: index of the right child, the left child follows the node. leaf: first primitive
+	int count;  // number of primitives in a leaf, 0 for an inner node
+} BVHNode;
+
+typedef struct {
+	float origin[3];         // lower corner of the node, the child bounds are counted from here
+	signed char exponent[3]; // one step on each axis is 2^exponent
+	unsigned char count[4];  // primitives of a leaf child, 0 for an inner child, WIDE_EMPTY for no child
+	unsigned char unused;
+	unsigned char qlo[3][4]; // child bounds in steps, by axis first so one axis of all 4 children loads at once
+	unsigned char qhi[3][4];
+	uint32_t child[4];       // inner child: index of its wide node. leaf child: first primitive
+	uint32_t padding;
+} WideNode;
+
+typedef struct BVH {
+	int* prims;     // primitive indices, the leaves point into this list
+	int count;      // number of primitives
+	void (*bounds)(void* data, int i, double* lo, double* hi); // box of primitive i
+	void* data;     // the primitives that bounds() reads, the sphere array for spheres
+	int mapped;     // the arrays are part of a mapped file and are not freed
+	BVHNode* nodes;
+	int nodeCount;
+	WideNode* wide;
+	int wideCount;
+	int* wideSource;    // the 4 binary nodes that each wide node was built from, -1 for an empty slot
+	double* builtArea;  // area of each binary node when it was built
+	double builtCost;   // surface area cost of the tree when it was built
+} BVH;
+
+// bounds of sphere i of the sphere array data
+static void sphereBounds(void* data, int i, double* lo, double* hi) {
+	double* spheres = data;
+	int a;
+	for (a = 0; a < 3; a++) {
+		lo[a] = spheres[i * 4 + a] - spheres[i * 4 + 3];
+		hi[a] = spheres[i * 4 + a] + spheres[i * 4 + 3];
+	}
+}
+
+// half the surface area of a box, enough to compare costs
+static inline double boxArea(double* lo, double* hi) {
+	double dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+	if (dx < 0 || dy < 0 || dz < 0) return 0;
+	return dx * dy + dy * dz + dz * dx;
+}
+
+static inline void growBox(double* lo, double* hi, double* blo, double* bhi) {
+	int a;
+	for (a = 0; a < 3; a++) {
+		if (blo[a] < lo[a]) lo[a] = blo[a];
+		if (bhi[a] > hi[a]) hi[a] = bhi[a];
+	}
+}
+
+// center of the box of primitive p on axis a
+static inline double primitiveCenter(BVH* bvh, int p, int a) {
+	double lo[3], hi[3];
+	bvh->bounds(bvh->data, p, lo, hi);
+	return (lo[a] + hi[a]) / 2;
+}
+
+// build the subtree of bvh->prims[start] ... bvh->prims[end - 1] at the given depth, returns the node index
+static int buildBinaryNode(BVH* bvh, int start, int end, int depth) {
+	int index = bvh->nodeCount++;
+	BVHNode* node = &bvh->nodes[index];
+	double clo[3] = { INFINITY, INFINITY, INFINITY };
+	double chi[3] = { -INFINITY, -INFINITY, -INFINITY };
+	int i, a, b;
+	for (a = 0; a < 3; a++) {
+		node->lo[a] = INFINITY;
+		node->hi[a] = -INFINITY;
+	}
+	for (i = start; i < end; i++) {
+		double lo[3], hi[3];
+		bvh->bounds(bvh->data, bvh->prims[i], lo, hi);
+		growBox(node->lo, node->hi, lo, hi);
+		double c[3] = { (lo[0] + hi[0]) / 2, (lo[1] + hi[1]) / 2, (lo[2] + hi[2]) / 2 };
+		growBox(clo, chi, c, c);
+	}
+	int count = end - start;
+	node->offset = start;
+	node->count = count;
+	if (count <= 1) {
+		return index;
+	}
+
+	// binned surface area heuristic over all three axes
+	double leafCost = count;
+	double bestCost = INFINITY;
+	int bestAxis = -1, bestSplit = 0;
+	for (a = 0; a < 3; a++) {
+		if (chi[a] <= clo[a]) continue;
+		int binCount[BVH_BINS] = { 0 };
+		double binLo[BVH_BINS][3], binHi[BVH_BINS][3];
+		for (b = 0; b < BVH_BINS; b++) {
+			binLo[b][0] = binLo[b][1] = binLo[b][2] = INFINITY;
+			binHi[b][0] = binHi[b][1] = binHi[b][2] = -INFINITY;
+		}
+		double k = BVH_BINS / (chi[a] - clo[a]);
+		for (i = start; i < end; i++) {
+			double lo[3], hi[3];
+			bvh->bounds(bvh->data, bvh->prims[i], lo, hi);
+			b = (int)(((lo[a] + hi[a]) / 2 - clo[a]) * k);
+			if (b >= BVH_BINS) b = BVH_BINS - 1;
+			binCount[b] += 1;
+			growBox(binLo[b], binHi[b], lo, hi);
+		}
+		// sweep from the right to get the cost of every right side, then from the left
+		double rightArea[BVH_BINS];
+		int rightCount[BVH_BINS];
+		double lo[3] = { INFINITY, INFINITY, INFINITY }, hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+		int n = 0;
+		for (b = BVH_BINS - 1; b > 0; b--) {
+			growBox(lo, hi, binLo[b], binHi[b]);
+			n += binCount[b];
+			rightArea[b] = boxArea(lo, hi);
+			rightCount[b] = n;
+		}
+		lo[0] = lo[1] = lo[2] = INFINITY;
+		hi[0] = hi[1] = hi[2] = -INFINITY;
+		n = 0;
+		for (b = 0; b < BVH_BINS - 1; b++) {
+			growBox(lo, hi, binLo[b], binHi[b]);
+			n += binCount[b];
+			if (n == 0 || rightCount[b + 1] == 0) continue;
+			double cost = 1 + (boxArea(lo, hi) * n + rightArea[b + 1] * rightCount[b + 1]) / boxArea(node->lo, node->hi);
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = a;
+				bestSplit = b;
+			}
+		}
+	}
+	if (count <= BVH_LEAF_SIZE && (bestAxis < 0 || bestCost >= leafCost)) {
+		return index;
+	}
+
+	int middle = start;
+	if (bestAxis < 0 || depth >= BVH_MAX_DEPTH) {
+		// every center is in the same spot and the leaf would be too big, or the tree is already
+		// deep: split the list in half
+		middle = (start + end) / 2;
+	}
+	else {
+		// partition the primitives around the chosen bin
+		double k = BVH_BINS / (chi[bestAxis] - clo[bestAxis]);
+		for (i = start; i < end; i++) {
+			b = (int)((primitiveCenter(bvh, bvh->prims[i], bestAxis) - clo[bestAxis]) * k);
+			if (b >= BVH_BINS) b = BVH_BINS - 1;
+			if (b <= bestSplit) {
+				int t = bvh->prims[i];
+				bvh->prims[i] = bvh->prims[middle];
+				bvh->prims[middle++] = t;
+			}
+		}
+	}
+	buildBinaryNode(bvh, start, middle, depth + 1);
+	int right = buildBinaryNode(bvh, middle, end, depth + 1);
+	node = &bvh->nodes[index];
+	node->offset = right;
+	node->count = 0;
+	return index;
+}
+
+// largest float that is not above v
+static inline float floatBelow(double v) {
+	float f = (float)v;
+	return f > v ? nextafterf(f, -INFINITY) : f;
+}
+
+// quantize the bound v of a child to a step counted from origin, down for a lower bound and up for an upper one
+static inline unsigned char quantize(double v, float origin, int exponent, int up) {
+	double q = (v - origin) / ldexp(1, exponent);
+	q = up ? ceil(q) : floor(q);
+	if (q < 0) q = 0;
+	if (q > 254) q = 254;
+	return (unsigned char)q;
+}
+
+// quantizeWideNode() sets the bounds of the wide node from the binary nodes in source.
+// The wide node bounds are the union of the children, counted in 254 steps at most.
+static void quantizeWideNode(BVH* bvh, WideNode* node, int* source) {
+	double lo[3] = { INFINITY, INFINITY, INFINITY }, hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+	int i, a;
+	for (i = 0; i < 4 && source[i] >= 0; i++) {
+		growBox(lo, hi, bvh->nodes[source[i]].lo, bvh->nodes[source[i]].hi);
+	}
+	for (a = 0; a < 3; a++) {
+		node->origin[a] = floatBelow(lo[a]);
+		int e;
+		frexp((hi[a] - node->origin[a]) / 254, &e);
+		if (e < -126) e = -126;
+		if (e > 127) e = 127;
+		node->exponent[a] = (signed char)e;
+	}
+	for (i = 0; i < 4 && source[i] >= 0; i++) {
+		BVHNode* c = &bvh->nodes[source[i]];
+		for (a = 0; a < 3; a++) {
+			node->qlo[a][i] = quantize(c->lo[a], node->origin[a], node->exponent[a], 0);
+			node->qhi[a][i] = quantize(c->hi[a], node->origin[a], node->exponent[a], 1);
+		}
+	}
+}
+
+// build the wide node for the binary node b and its subtree, returns the wide node index
+static int buildWideNode(BVH* bvh, int b) {
+	int index = bvh->wideCount++;
+	int children[4];
+	int n = 1, i;
+	children[0] = b;
+	// open the inner child with the largest area until there are 4 children
+	while (n < 4) {
+		int best = -1;
+		double bestArea = -1;
+		for (i = 0; i < n; i++) {
+			BVHNode* c = &bvh->nodes[children[i]];
+			if (c->count == 0 && boxArea(c->lo, c->hi) > bestArea) {
+				bestArea = boxArea(c->lo, c->hi);
+				best = i;
+			}
+		}
+		if (best < 0) break;
+		int open = children[best];
+		children[best] = open + 1;
+		children[n++] = bvh->nodes[open].offset;
+	}
+
+	WideNode node;
+	memset(&node, 0, sizeof(WideNode));
+	for (i = 0; i < 4; i++) {
+		bvh->wideSource[index * 4 + i] = i < n ? children[i] : -1;
+		node.count[i] = WIDE_EMPTY;
+		if (i < n) {
+			node.count[i] = (unsigned char)bvh->nodes[children[i]].count;
+			node.child[i] = bvh->nodes[children[i]].offset;
+		}
+	}
+	quantizeWideNode(bvh, &node, &bvh->wideSource[index * 4]);
+	// children are built after the node is stored, they get the indices that follow it
+	bvh->wide[index] = node;
+	for (i = 0; i < n; i++) {
+		if (bvh->nodes[children[i]].count == 0) {
+			int w = buildWideNode(bvh, children[i]);
+			bvh->wide[index].child[i] = (uint32_t)w;
+		}
+	}
+	return index;
+}
+
+// sahCost() is the surface area cost of the binary tree, relative to the root
+static double sahCost(BVH* bvh) {
+	double cost = 0;
+	int i;
+	for (i = 0; i < bvh->nodeCount; i++) {
+		BVHNode* node = &bvh->nodes[i];
+		cost += boxArea(node->lo, node->hi) * (node->count > 0 ? node->count : 1);
+	}
+	double root = boxArea(bvh->nodes[0].lo, bvh->nodes[0].hi);
+	return root > 0 ? cost / root : cost;
+}
+
+// build both layouts over count primitives with the boxes from bounds(), returns NULL when
+// there are none
+BVH* buildPrimitiveBVH(int count, void (*bounds)(void* data, int i, double* lo, double* hi), void* data) {
+	if (count == 0) {
+		return NULL;
+	}
+	BVH* bvh = calloc(1, sizeof(BVH));
+	int i;
+	bvh->count = count;
+	bvh->bounds = bounds;
+	bvh->data = data;
+	bvh->prims = malloc(sizeof(int) * bvh->count);
+	bvh->nodes = malloc(sizeof(BVHNode) * 2 * bvh->count);
+	bvh->wide = malloc(sizeof(WideNode) * 2 * bvh->count);
+	bvh->wideSource = malloc(sizeof(int) * 8 * bvh->count);
+	bvh->builtArea = malloc(sizeof(double) * 2 * bvh->count);
+	if (bvh->prims == NULL || bvh->nodes == NULL || bvh->wide == NULL || bvh->wideSource == NULL || bvh->builtArea == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the bvh.\n");
+		exit(1);
+	}
+	for (i = 0; i < bvh->count; i++) {
+		bvh->prims[i] = i;
+	}
+	buildBinaryNode(bvh, 0, bvh->count, 0);
+	// a root that is a leaf becomes the only child of the root wide node
+	buildWideNode(bvh, 0);
+	for (i = 0; i < bvh->nodeCount; i++) {
+		bvh->builtArea[i] = boxArea(bvh->nodes[i].lo, bvh->nodes[i].hi);
+	}
+	bvh->builtCost = sahCost(bvh);
+	return bvh;
+}
+
+// build both layouts over count spheres (center and radius each)
+BVH* buildBVH(double* spheres, int count) {
+	return buildPrimitiveBVH(count, sphereBounds, spheres);
+}
+
+// refitNode() recomputes the bounds of node i from its spheres or its two children
+static inline void refitNode(BVH* bvh, int i) {
+	BVHNode* node = &bvh->nodes[i];
+	int k, a;
+	for (a = 0; a < 3; a++) {
+		node->lo[a] = INFINITY;
+		node->hi[a] = -INFINITY;
+	}
+	if (node->count == 0) {
+		growBox(node->lo, node->hi, bvh->nodes[i + 1].lo, bvh->nodes[i + 1].hi);
+		growBox(node->lo, node->hi, bvh->nodes[node->offset].lo, bvh->nodes[node->offset].hi);
+		return;
+	}
+	for (k = node->offset; k < node->offset + node->count; k++) {
+		double lo[3], hi[3];
+		bvh->bounds(bvh->data, bvh->prims[k], lo, hi);
+		growBox(node->lo, node->hi, lo, hi);
+	}
+}
+
+// the binary nodes of a subtree are stored one after the other, this returns the index after
+// the last node of the subtree of node i
+static int subtreeEnd(BVH* bvh, int i) {
+	while (bvh->nodes[i].count == 0) {
+		i = bvh->nodes[i].offset;
+	}
+	return i + 1;
+}
+
+// refitBVH() moves the bounds of every node to the new sphere positions without changing the
+// tree, in O(n). The subtrees a few levels down are refit in parallel, every one of them is a
+// block of nodes where the children come after their parent, so one backwards loop refits it.
+void refitBVH(BVH* bvh) {
+	// split the tree into the nodes above depth 6 and the subtrees below them
+	int top[128], roots[64];
+	int depth[128];
+	int topCount = 0, rootCount = 0, i;
+	top[topCount] = 0;
+	depth[topCount++] = 0;
+	for (i = 0; i < topCount; i++) {
+		BVHNode* node = &bvh->nodes[top[i]];
+		if (node->count > 0 || depth[i] == 6) {
+			roots[rootCount++] = top[i];
+			top[i] = -1;
+			continue;
+		}
+		top[topCount] = top[i] + 1;
+		depth[topCount++] = depth[i] + 1;
+		top[topCount] = node->offset;
+		depth[topCount++] = depth[i] + 1;
+	}
+	#pragma omp parallel for schedule(dynamic)
+	for (i = 0; i < rootCount; i++) {
+		int k;
+		for (k = subtreeEnd(bvh, roots[i]) - 1; k >= roots[i]; k--) {
+			refitNode(bvh, k);
+		}
+	}
+	// the nodes above are in breadth first order, so backwards every child is done before its parent
+	for (i = topCount - 1; i >= 0; i--) {
+		if (top[i] >= 0) {
+			refitNode(bvh, top[i]);
+		}
+	}
+	#pragma omp parallel for
+	for (i = 0; i < bvh->wideCount; i++) {
+		quantizeWideNode(bvh, &bvh->wide[i], &bvh->wideSource[i * 4]);
+	}
+}
+
+// rebuildNode() copies the subtree of node i of the old tree into bvh and builds every subtree
+// whose area grew past limit times its built area again, returns the new index of the node.
+// rebuilt counts the spheres below the subtrees that were built again.
+static int rebuildNode(BVH* bvh, BVHNode* old, double* oldArea, int i, int depth, double limit, int* rebuilt) {
+	BVHNode* node = &old[i];
+	int index, k;
+	if (node->count == 0 && boxArea(node->lo, node->hi) > limit * oldArea[i]) {
+		// the spheres of the subtree go from its first leaf to the end of its last one
+		int first = i, last = i;
+		while (old[first].count == 0) first += 1;
+		while (old[last].count == 0) last = old[last].offset;
+		int start = bvh->nodeCount;
+		index = buildBinaryNode(bvh, old[first].offset, old[last].offset + old[last].count, depth);
+		for (k = start; k < bvh->nodeCount; k++) {
+			bvh->builtArea[k] = boxArea(bvh->nodes[k].lo, bvh->nodes[k].hi);
+		}
+		*rebuilt += old[last].offset + old[last].count - old[first].offset;
+		return index;
+	}
+	index = bvh->nodeCount++;
+	bvh->nodes[index] = *node;
+	bvh->builtArea[index] = oldArea[i];
+	if (node->count == 0) {
+		rebuildNode(bvh, old, oldArea, i + 1, depth + 1, limit, rebuilt);
+		int right = rebuildNode(bvh, old, oldArea, node->offset, depth + 1, limit, rebuilt);
+		bvh->nodes[index].offset = right;
+	}
+	return index;
+}
+
+// updateBVH() moves the tree to the new sphere positions of an animation frame. The tree is
+// refit, and when its surface area cost gets worse than limit times the cost it was built
+// with, the subtrees that grew the most are built again, or the whole tree when that is not
+// enough. Returns 0 for a refit, 1 for a partial and 2 for a full rebuild.
+int updateBVH(BVH* bvh, double* spheres, double limit) {
+	bvh->data = spheres;
+	refitBVH(bvh);
+	if (sahCost(bvh) <= limit * bvh->builtCost) {
+		return 0;
+	}
+	BVHNode* old = malloc(sizeof(BVHNode) * bvh->nodeCount);
+	double* oldArea = malloc(sizeof(double) * bvh->nodeCount);
+	if (old == NULL || oldArea == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the bvh.\n");
+		exit(1);
+	}
+	memcpy(old, bvh->nodes, sizeof(BVHNode) * bvh->nodeCount);
+	memcpy(oldArea, bvh->builtArea, sizeof(double) * bvh->nodeCount);
+	int rebuilt = 0, result = 1, i;
+	bvh->nodeCount = 0;
+	rebuildNode(bvh, old, oldArea, 0, 0, limit, &rebuilt);
+	free(old);
+	free(oldArea);
+	double cost = sahCost(bvh);
+	if (rebuilt < bvh->count && cost > limit * bvh->builtCost) {
+		// the cost is spread over the whole tree
+		bvh->nodeCount = 0;
+		buildBinaryNode(bvh, 0, bvh->count, 0);
+		for (i = 0; i < bvh->nodeCount; i++) {
+			bvh->builtArea[i] = boxArea(bvh->nodes[i].lo, bvh->nodes[i].hi);
+		}
+		cost = sahCost(bvh);
+		rebuilt = bvh->count;
+	}
+	if (rebuilt == bvh->count) {
+		bvh->builtCost = cost;
+		result = 2;
+	}
+	bvh->wideCount = 0;
+	buildWideNode(bvh, 0);
+	return result;
+}
+
+void freeBVH(BVH* bvh) {
+	if (bvh == NULL) {
+		return;
+	}
+	if (bvh->mapped) {
+		free(bvh);
+		return;
+	}
+	free(bvh->prims);
+	free(bvh->nodes);
+	free(bvh->wide);
+	free(bvh->wideSource);
+	free(bvh->builtArea);
+	free(bvh);
+}
+
+// a ray prepared for the box tests
+typedef struct {
+	double o[3];
+	double inv[3];
+	float of[3];
+	float invf[3];
+} BoxRay;
+
+static inline void prepareRay(BoxRay* ray, double* Ro, double* Rd) {
+	int a;
+	for (a = 0; a < 3; a++) {
+		// no infinities, 0 * inf would give NaN in the slab test
+		double d = fabs(Rd[a]) < 1e-30 ? (Rd[a] < 0 ? -1e-30 : 1e-30) : Rd[a];
+		ray->o[a] = Ro[a];
+		ray->inv[a] = 1 / d;
+		ray->of[a] = (float)Ro[a];
+		ray->invf[a] = (float)(1 / d);
+	}
+}
+
+// slab test of a binary node, returns the entry distance or INFINITY for a miss
+static inline double binaryBoxHit(BVHNode* node, BoxRay* ray, double maxT) {
+	double tmin = 0, tmax = maxT;
+	int a;
+	for (a = 0; a < 3; a++) {
+		double t0 = (node->lo[a] - ray->o[a]) * ray->inv[a];
+		double t1 = (node->hi[a] - ray->o[a]) * ray->inv[a];
+		if (t0 > t1) {
+			double t = t0;
+			t0 = t1;
+			t1 = t;
+		}
+		if (t0 > tmin) tmin = t0;
+		if (t1 < tmax) tmax = t1;
+	}
+	return tmin <= tmax ? tmin : INFINITY;
+}
+
+// 2^e as a float, built from the bits so it is cheaper than ldexpf()
+static inline float stepSize(int e) {
+	uint32_t bits = (uint32_t)(e + 127) << 23;
+	float f;
+	memcpy(&f, &bits, 4);
+	return f;
+}
+
+// test the 4 children of a wide node, tnear gets the entry distances and the bits of the
+// returned mask say which children are hit
+static inline int wideBoxHit(WideNode* node, BoxRay* ray, float maxT, float* tnear) {
+	// float rounding in the dequantized bounds and the slab test is covered by a small margin
+	const float grow = 1 + 1e-5f;
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128();
+	__m128 tmin = _mm_setzero_ps();
+	__m128 tmax = _mm_set1_ps(maxT * grow);
+	int a;
+	for (a = 0; a < 3; a++) {
+		float step = stepSize(node->exponent[a]);
+		int32_t lo32, hi32;
+		memcpy(&lo32, node->qlo[a], 4);
+		memcpy(&hi32, node->qhi[a], 4);
+		__m128 qlo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(lo32), zero), zero));
+		__m128 qhi = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(hi32), zero), zero));
+		__m128 origin = _mm_set1_ps(node->origin[a] - ray->of[a]);
+		__m128 scale = _mm_set1_ps(step);
+		__m128 inv = _mm_set1_ps(ray->invf[a]);
+		__m128 t0 = _mm_mul_ps(_mm_add_ps(origin, _mm_mul_ps(qlo, scale)), inv);
+		__m128 t1 = _mm_mul_ps(_mm_add_ps(origin, _mm_mul_ps(qhi, scale)), inv);
+		tmin = _mm_max_ps(tmin, _mm_min_ps(t0, t1));
+		tmax = _mm_min_ps(tmax, _mm_max_ps(t0, t1));
+	}
+	tmax = _mm_mul_ps(tmax, _mm_set1_ps(grow));
+	tmin = _mm_mul_ps(tmin, _mm_set1_ps(1 / grow));
+	_mm_storeu_ps(tnear, tmin);
+	int mask = _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+#else
+	int mask = 0, i, a;
+	for (i = 0; i < 4; i++) {
+		float tmin = 0, tmax = maxT * grow;
+		for (a = 0; a < 3; a++) {
+			float step = stepSize(node->exponent[a]);
+			float t0 = (node->origin[a] - ray->of[a] + node->qlo[a][i] * step) * ray->invf[a];
+			float t1 = (node->origin[a] - ray->of[a] + node->qhi[a][i] * step) * ray->invf[a];
+			if (t0 > t1) {
+				float t = t0;
+				t0 = t1;
+				t1 = t;
+			}
+			if (t0 > tmin) tmin = t0;
+			if (t1 < tmax) tmax = t1;
+		}
+		tnear[i] = tmin / grow;
+		if (tmin / grow <= tmax * grow) mask |= 1 << i;
+	}
+#endif
+	// empty slots never count
+	int i2;
+	for (i2 = 0; i2 < 4; i2++) {
+		if (node->count[i2] == WIDE_EMPTY) mask &= ~(1 << i2);
+	}
+	return mask;
+}
+
+// closest sphere hit with the binary tree, bestT comes in as the distance to beat
+int binaryIntersect(BVH* bvh, double* spheres, double* Ro, double* Rd, double* bestT) {
+	BoxRay ray;
+	// a level adds at most one entry, and BVH_MAX_DEPTH keeps the tree under 100 levels
+	int stack[256];
+	double stackT[256];
+	int top = 0, closest = -1, i;
+	prepareRay(&ray, Ro, Rd);
+	if (binaryBoxHit(&bvh->nodes[0], &ray, *bestT) == INFINITY) {
+		return -1;
+	}
+	stack[top] = 0;
+	stackT[top++] = 0;
+	while (top > 0) {
+		top -= 1;
+		if (stackT[top] > *bestT) continue;
+		int index = stack[top];
+		BVHNode* node = &bvh->nodes[index];
+		if (node->count > 0) {
+			for (i = node->offset; i < node->offset + node->count; i++) {
+				int p = bvh->prims[i];
+				double t = sphereIntersection(Ro, Rd, &spheres[p * 4], spheres[p * 4 + 3]);
+				if (t > 0 && t < *bestT) {
+					*bestT = t;
+					closest = p;
+				}
+			}
+			continue;
+		}
+		// push the farther child first so the closer one is visited first
+		int near = index + 1;
+		int far = node->offset;
+		double tn = binaryBoxHit(&bvh->nodes[near], &ray, *bestT);
+		double tf = binaryBoxHit(&bvh->nodes[far], &ray, *bestT);
+		if (tf < tn) {
+			double t = tn;
+			tn = tf;
+			tf = t;
+			near = node->offset;
+			far = index + 1;
+		}
+		if (tf != INFINITY) {
+			stack[top] = far;
+			stackT[top++] = tf;
+		}
+		if (tn != INFINITY) {
+			stack[top] = near;
+			stackT[top++] = tn;
+		}
+	}
+	return closest;
+}
+
+// a leaf test gets primitive p of a leaf and returns the id of the hit and lowers bestT when the
+// ray hits it before bestT, or returns -1. The primitive skip never counts.
+typedef int (*LeafTest)(void* data, int p, double* Ro, double* Rd, double* bestT, int skip);
+
+// wideTraverse() walks the wide tree and returns the closest hit of the leaf test before bestT,
+// or with anyHit the first one it finds. It is inlined into every caller, so the leaf test
+// is a direct call.
+static inline int wideTraverse(BVH* bvh, double* Ro, double* Rd, double* bestT, int skip, int anyHit, LeafTest test, void* data) {
+	BoxRay ray;
+	// a level adds at most three entries, and BVH_MAX_DEPTH keeps the tree under 100 levels
+	uint32_t stack[512];
+	float stackT[512];
+	int top = 0, closest = -1, i, c;
+	prepareRay(&ray, Ro, Rd);
+	stack[top] = 0;
+	stackT[top++] = 0;
+	while (top > 0) {
+		top -= 1;
+		if (stackT[top] > *bestT) continue;
+		WideNode* node = &bvh->wide[stack[top]];
+		float tnear[4];
+		int mask = wideBoxHit(node, &ray, (float)*bestT, tnear);
+		// push the hit inner children far to near and test the leaves right away
+		int order[4], n = 0;
+		for (c = 0; c < 4; c++) {
+			if (!(mask & (1 << c))) continue;
+			if (node->count[c] > 0) {
+				for (i = (int)node->child[c]; i < (int)node->child[c] + node->count[c]; i++) {
+					int hit = test(data, bvh->prims[i], Ro, Rd, bestT, skip);
+					if (hit >= 0) {
+						if (anyHit) return hit;
+						closest = hit;
+					}
+				}
+				continue;
+			}
+			int k = n++;
+			while (k > 0 && tnear[order[k - 1]] < tnear[c]) {
+				order[k] = order[k - 1];
+				k -= 1;
+			}
+			order[k] = c;
+		}
+		for (i = 0; i < n; i++) {
+			stack[top] = node->child[order[i]];
+			stackT[top++] = tnear[order[i]];
+		}
+	}
+	return closest;
+}
+
+// the leaf test of the sphere array data
+static inline int sphereLeaf(void* data, int p, double* Ro, double* Rd, double* bestT, int skip) {
+	double* spheres = data;
+	if (p == skip) {
+		return -1;
+	}
+	double t = sphereIntersection(Ro, Rd, &spheres[p * 4], spheres[p * 4 + 3]);
+	if (t > 0 && t < *bestT) {
+		*bestT = t;
+		return p;
+	}
+	return -1;
+}
+
+// closest sphere hit with the wide tree, bestT comes in as the distance to beat
+int wideIntersect(BVH* bvh, double* spheres, double* Ro, double* Rd, double* bestT) {
+	return wideTraverse(bvh, Ro, Rd, bestT, -1, 0, sphereLeaf, spheres);
+}
+
+// any sphere other than skip between Ro and maxT along Rd, returns it or -1
+int wideOccluded(BVH* bvh, double* spheres, double* Ro, double* Rd, double maxT, int skip) {
+	return wideTraverse(bvh, Ro, Rd, &maxT, skip, 1, sphereLeaf, spheres);
+}
+
+// any sphere other than skip between Ro and maxT along Rd with the binary tree
+int binaryOccluded(BVH* bvh, double* spheres, double* Ro, double* Rd, double maxT, int skip) {
+	BoxRay ray;
+	// a level adds at most one entry, and BVH_MAX_DEPTH keeps the tree under 100 levels
+	int stack[256];
+	int top = 0, i;
+	prepareRay(&ray, Ro, Rd);
+	stack[top++] = 0;
+	while (top > 0) {
+		int index = stack[--top];
+		BVHNode* node = &bvh->nodes[index];
+		if (binaryBoxHit(node, &ray, maxT) == INFINITY) continue;
+		if (node->count == 0) {
+			stack[top++] = node->offset;
+			stack[top++] = index + 1;
+			continue;
+		}
+		for (i = node->offset; i < node->offset + node->count; i++) {
+			int p = bvh->prims[i];
+			if (p == skip) continue;
+			double t = sphereIntersection(Ro, Rd, &spheres[p * 4], spheres[p * 4 + 3]);
+			if (t > 0 && t < maxT) {
+				return p;
+			}
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,310 @@
+// Auxiliary outputs and denoising
+// With -aov prefix or -denoise n, rayCasting() keeps more than the color of every pixel: the
+// depth and the normal of the primary hit, the diffuse color of its material (the albedo) and
+// the primitive it hit. -aov writes them as images prefix-depth.ppm, prefix-normal.ppm,
+// prefix-albedo.ppm and prefix-id.ppm.
+// -denoise n smooths the noise of -lightbudget with n passes of the edge-avoiding a-trous
+// wavelet filter: every pass averages a 5 x 5 pattern of pixels that are 1, 2, 4, ... pixels
+// apart, and a neighbour counts less the more its color, normal and depth differ, and not at
+// all when it shows another primitive. The color is divided by the albedo first and multiplied
+// back at the end, so the filter only smooths the light and keeps the colors of the materials.
+// The color limit is halved in every pass, as the noise gets smaller. The passes run on all
+// threads and with SSE2 on 4 pixels at once.
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// the limits of the color (after dividing by the albedo), the normal and the relative depth
+#define DENOISE_SIGMA_COLOR 6.0f
+#define DENOISE_SIGMA_NORMAL 0.1f
+#define DENOISE_SIGMA_DEPTH 0.1f
+
+typedef struct {
+	int width;
+	int height;
+	// planes of width * height floats in the order of the image, rows from the top
+	float* color;       // 3 planes, the color before it is clamped
+	float* albedo;      // 3 planes
+	float* normal;      // 3 planes, 0 for the background
+	float* depth;       // distance along the primary ray, 1 for the background
+	int* id;            // primitive of the primary hit, -1 for the background
+} Aovs;
+
+// the buffers that rayCasting() fills with -aov or -denoise, NULL otherwise
+Aovs* aovs;
+// how long the last denoise() took, for -stats
+double denoiseSeconds;
+
+Aovs* newAovs(int w, int h) {
+	Aovs* a = malloc(sizeof(Aovs));
+	size_t size = (size_t)w * h;
+	a->width = w;
+	a->height = h;
+	a->color = malloc(sizeof(float) * 3 * size);
+	a->albedo = malloc(sizeof(float) * 3 * size);
+	a->normal = malloc(sizeof(float) * 3 * size);
+	a->depth = malloc(sizeof(float) * size);
+	a->id = malloc(sizeof(int) * size);
+	if (a->color == NULL || a->albedo == NULL || a->normal == NULL || a->depth == NULL || a->id == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the auxiliary outputs.\n");
+		exit(1);
+	}
+	return a;
+}
+
+void freeAovs(Aovs* a) {
+	if (a == NULL) {
+		return;
+	}
+	free(a->color);
+	free(a->albedo);
+	free(a->normal);
+	free(a->depth);
+	free(a->id);
+	free(a);
+}
+
+// storeAovs() keeps pixel p (counted from the top row) of the primary ray Rd that hit primitive
+// id at t = depth and was shaded with color
+void storeAovs(Aovs* a, int p, int id, double* Rd, double depth, double* color) {
+	size_t size = (size_t)a->width * a->height;
+	int c;
+	a->id[p] = id;
+	if (id < 0) {
+		for (c = 0; c < 3; c++) {
+			a->color[c * size + p] = 0;
+			a->albedo[c * size + p] = 0;
+			a->normal[c * size + p] = 0;
+		}
+		a->depth[p] = 1;
+		return;
+	}
+	double hit[3] = { depth * Rd[0], depth * Rd[1], depth * Rd[2] };
+	double N[3];
+	surfaceNormal(id, hit, Rd, N);
+	Material textured;
+	Material* material = textureMaterial(id, hit, N, Rd, &textured);
+	for (c = 0; c < 3; c++) {
+		a->color[c * size + p] = color[c];
+		a->albedo[c * size + p] = material->diffuseColor[c];
+		a->normal[c * size + p] = N[c];
+	}
+	a->depth[p] = depth;
+}
+
+// the weights of the 5 taps of the a-trous filter (B3 spline)
+static const float atrousKernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+
+// edgeWeight() is about exp(-e) for e >= 0, as (1 - e / 256)^256 so that the SSE2 version
+// gives the same numbers
+static inline float edgeWeight(float e) {
+	float t = 1 - e * (1.0f / 256);
+	int k;
+	t = t > 0 ? t : 0;
+	for (k = 0; k < 8; k++) {
+		t *= t;
+	}
+	return t;
+}
+
+// filterPixel() computes pixel x of row y of one a-trous pass from src into dst
+static void filterPixel(Aovs* a, float* src, float* dst, int x, int y, int step, float colorScale, float depthScale) {
+	int w = a->width, h = a->height, dx, dy;
+	size_t size = (size_t)w * h, p = (size_t)y * w + x;
+	int id = a->id[p];
+	float c0 = src[p], c1 = src[size + p], c2 = src[2 * size + p];
+	float n0 = a->normal[p], n1 = a->normal[size + p], n2 = a->normal[2 * size + p];
+	float z = a->depth[p];
+	float zScale = depthScale / (z * z);
+	float sum0 = 0, sum1 = 0, sum2 = 0, weights = 0;
+	for (dy = -2; dy <= 2; dy++) {
+		int yy = y + dy * step;
+		if (yy < 0 || yy >= h) continue;
+		for (dx = -2; dx <= 2; dx++) {
+			int xx = x + dx * step;
+			if (xx < 0 || xx >= w) continue;
+			size_t q = (size_t)yy * w + xx;
+			if (a->id[q] != id) continue;
+			float d0 = src[q] - c0, d1 = src[size + q] - c1, d2 = src[2 * size + q] - c2;
+			float nn = n0 * a->normal[q] + n1 * a->normal[size + q] + n2 * a->normal[2 * size + q];
+			float dz = a->depth[q] - z;
+			float e = (d0 * d0 + d1 * d1 + d2 * d2) * colorScale + (1 - nn) * (1 / DENOISE_SIGMA_NORMAL) + dz * dz * zScale;
+			float weight = atrousKernel[dx + 2] * atrousKernel[dy + 2] * edgeWeight(e);
+			sum0 += weight * src[q];
+			sum1 += weight * src[size + q];
+			sum2 += weight * src[2 * size + q];
+			weights += weight;
+		}
+	}
+	// the pixel itself always counts
+	dst[p] = sum0 / weights;
+	dst[size + p] = sum1 / weights;
+	dst[2 * size + p] = sum2 / weights;
+}
+
+#ifdef __SSE2__
+// filterPixels4() is filterPixel() for the pixels x to x + 3 of row y, the whole pattern has to
+// lie inside the row
+static void filterPixels4(Aovs* a, float* src, float* dst, int x, int y, int step, float colorScale, float depthScale) {
+	int w = a->width, h = a->height, dx, dy, k;
+	size_t size = (size_t)w * h, p = (size_t)y * w + x;
+	__m128i id = _mm_loadu_si128((__m128i*)&a->id[p]);
+	__m128 c0 = _mm_loadu_ps(&src[p]), c1 = _mm_loadu_ps(&src[size + p]), c2 = _mm_loadu_ps(&src[2 * size + p]);
+	__m128 n0 = _mm_loadu_ps(&a->normal[p]), n1 = _mm_loadu_ps(&a->normal[size + p]), n2 = _mm_loadu_ps(&a->normal[2 * size + p]);
+	__m128 z = _mm_loadu_ps(&a->depth[p]);
+	__m128 zScale = _mm_div_ps(_mm_set1_ps(depthScale), _mm_mul_ps(z, z));
+	__m128 scale = _mm_set1_ps(colorScale);
+	__m128 normalScale = _mm_set1_ps(1 / DENOISE_SIGMA_NORMAL);
+	__m128 one = _mm_set1_ps(1), zero = _mm_setzero_ps(), step256 = _mm_set1_ps(1.0f / 256);
+	__m128 sum0 = zero, sum1 = zero, sum2 = zero, weights = zero;
+	for (dy = -2; dy <= 2; dy++) {
+		int yy = y + dy * step;
+		if (yy < 0 || yy >= h) continue;
+		for (dx = -2; dx <= 2; dx++) {
+			size_t q = (size_t)yy * w + x + dx * step;
+			__m128 same = _mm_castsi128_ps(_mm_cmpeq_epi32(id, _mm_loadu_si128((__m128i*)&a->id[q])));
+			__m128 s0 = _mm_loadu_ps(&src[q]), s1 = _mm_loadu_ps(&src[size + q]), s2 = _mm_loadu_ps(&src[2 * size + q]);
+			__m128 d0 = _mm_sub_ps(s0, c0), d1 = _mm_sub_ps(s1, c1), d2 = _mm_sub_ps(s2, c2);
+			__m128 nn = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n0, _mm_loadu_ps(&a->normal[q])), _mm_mul_ps(n1, _mm_loadu_ps(&a->normal[size + q]))),
+				_mm_mul_ps(n2, _mm_loadu_ps(&a->normal[2 * size + q])));
+			__m128 dz = _mm_sub_ps(_mm_loadu_ps(&a->depth[q]), z);
+			__m128 e = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(d0, d0), _mm_mul_ps(d1, d1)), _mm_mul_ps(d2, d2)), scale);
+			e = _mm_add_ps(e, _mm_mul_ps(_mm_sub_ps(one, nn), normalScale));
+			e = _mm_add_ps(e, _mm_mul_ps(_mm_mul_ps(dz, dz), zScale));
+			__m128 t = _mm_max_ps(_mm_sub_ps(one, _mm_mul_ps(e, step256)), zero);
+			for (k = 0; k < 8; k++) {
+				t = _mm_mul_ps(t, t);
+			}
+			__m128 weight = _mm_and_ps(same, _mm_mul_ps(_mm_set1_ps(atrousKernel[dx + 2] * atrousKernel[dy + 2]), t));
+			sum0 = _mm_add_ps(sum0, _mm_mul_ps(weight, s0));
+			sum1 = _mm_add_ps(sum1, _mm_mul_ps(weight, s1));
+			sum2 = _mm_add_ps(sum2, _mm_mul_ps(weight, s2));
+			weights = _mm_add_ps(weights, weight);
+		}
+	}
+	_mm_storeu_ps(&dst[p], _mm_div_ps(sum0, weights));
+	_mm_storeu_ps(&dst[size + p], _mm_div_ps(sum1, weights));
+	_mm_storeu_ps(&dst[2 * size + p], _mm_div_ps(sum2, weights));
+}
+#endif
+
+// denoise() filters the color of the buffers with the given number of passes and writes the
+// result into color (3 planes like in the buffers)
+void denoise(Aovs* a, int passes, float* color) {
+	int w = a->width, h = a->height, pass;
+	size_t size = (size_t)w * h, i;
+	float* buffers[2];
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	buffers[0] = malloc(sizeof(float) * 3 * size);
+	buffers[1] = malloc(sizeof(float) * 3 * size);
+	if (buffers[0] == NULL || buffers[1] == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the denoiser.\n");
+		exit(1);
+	}
+	// the light without the color of the material, dark materials are left as they are
+	#pragma omp parallel for schedule(static)
+	for (i = 0; i < 3 * size; i++) {
+		float albedo = a->albedo[i];
+		buffers[0][i] = a->color[i] / (albedo > 0.01f ? albedo : 1);
+	}
+	for (pass = 0; pass < passes; pass++) {
+		float* src = buffers[pass & 1];
+		float* dst = buffers[(pass + 1) & 1];
+		int step = 1 << pass;
+		// the color limit halves with every pass
+		float sigma = DENOISE_SIGMA_COLOR / (1 << pass);
+		float colorScale = 1 / (sigma * sigma);
+		float depthScale = 1 / (DENOISE_SIGMA_DEPTH * DENOISE_SIGMA_DEPTH * step * step);
+		int y;
+		#pragma omp parallel for schedule(dynamic, 4)
+		for (y = 0; y < h; y++) {
+			int x = 0;
+#ifdef __SSE2__
+			// the pixels whose pattern lies inside the row go 4 at a time
+			for (x = 0; x < 2 * step && x < w; x++) {
+				filterPixel(a, src, dst, x, y, step, colorScale, depthScale);
+			}
+			for (; x + 3 + 2 * step < w; x += 4) {
+				filterPixels4(a, src, dst, x, y, step, colorScale, depthScale);
+			}
+#endif
+			for (; x < w; x++) {
+				filterPixel(a, src, dst, x, y, step, colorScale, depthScale);
+			}
+		}
+	}
+	float* result = buffers[passes & 1];
+	#pragma omp parallel for schedule(static)
+	for (i = 0; i < 3 * size; i++) {
+		float albedo = a->albedo[i];
+		color[i] = result[i] * (albedo > 0.01f ? albedo : 1);
+	}
+	free(buffers[0]);
+	free(buffers[1]);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	denoiseSeconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+// writeAovImage() writes 3 planes of values between 0 and 1 as a P6 image
+static void writeAovImage(char* filename, int w, int h, float* planes) {
+	size_t size = (size_t)w * h, i;
+	int c;
+	PPMimage image;
+	image.width = w;
+	image.height = h;
+	image.data = malloc(3 * size);
+	if (image.data == NULL) {
+		fprintf(stderr, "Error: allocate the memory un successfully. \n");
+		exit(1);
+	}
+	for (i = 0; i < size; i++) {
+		for (c = 0; c < 3; c++) {
+			image.data[i * 3 + c] = (unsigned char)(255 * clamp(planes[c * size + i]) + 0.5);
+		}
+	}
+	PPMWrite("P6", filename, &image);
+	free(image.data);
+}
+
+// writeAovs() writes the buffers as images named prefix-depth.ppm, prefix-normal.ppm,
+// prefix-albedo.ppm and prefix-id.ppm. The depth is scaled so that the farthest hit is white,
+// the normal is mapped from [-1, 1] to [0, 1] and every primitive gets a color of its own.
+void writeAovs(Aovs* a, char* prefix) {
+	size_t size = (size_t)a->width * a->height, i;
+	int c;
+	char name[1100];
+	float* planes = malloc(sizeof(float) * 3 * size);
+	if (planes == NULL) {
+		fprintf(stderr, "Error: allocate the memory un successfully. \n");
+		exit(1);
+	}
+	float far = 0;
+	for (i = 0; i < size; i++) {
+		if (a->id[i] >= 0 && a->depth[i] > far) far = a->depth[i];
+	}
+	for (i = 0; i < size; i++) {
+		float value = a->id[i] >= 0 ? a->depth[i] / far : 0;
+		planes[i] = planes[size + i] = planes[2 * size + i] = value;
+	}
+	snprintf(name, sizeof(name), "%s-depth.ppm", prefix);
+	writeAovImage(name, a->width, a->height, planes);
+	for (i = 0; i < 3 * size; i++) {
+		planes[i] = a->id[i % size] >= 0 ? a->normal[i] * 0.5f + 0.5f : 0;
+	}
+	snprintf(name, sizeof(name), "%s-normal.ppm", prefix);
+	writeAovImage(name, a->width, a->height, planes);
+	snprintf(name, sizeof(name), "%s-albedo.ppm", prefix);
+	writeAovImage(name, a->width, a->height, a->albedo);
+	for (i = 0; i < size; i++) {
+		// the bits of a hash of the primitive give its color
+		unsigned int hash = a->id[i] < 0 ? 0 : ((unsigned int)a->id[i] + 1) * 2654435761u;
+		for (c = 0; c < 3; c++) {
+			planes[c * size + i] = ((hash >> (8 * c + 8)) & 255) / 255.0f;
+		}
+	}
+	snprintf(name, sizeof(name), "%s-id.ppm", prefix);
+	writeAovImage(name, a->width, a->height, planes);
+	free(planes);
+}
@@ -0,0 +1,750 @@
+// Compressed image files
+// Besides PPM the images can be written as QOI or PNG, both made here without a library.
+// QOIWrite() follows the QOI format: every pixel is a run of the last pixel, the index of a
+// recently seen color, a small difference to the last pixel or the color itself, so it is one
+// pass over the pixels with no search and about as fast as copying them.
+// PNGWrite() writes the rows with one of the PNG filters in front of every row (with
+// PNG_FILTER_ADAPTIVE the one whose bytes have the smallest sum of absolute values, the usual
+// guess for the filter that compresses best) and compresses them with deflate: LZ77 with hash
+// chains and one step of lazy matching, then blocks with their own Huffman codes, or stored when
+// that is smaller. With chunkRows > 0 the rows are cut into chunks of that many rows that are
+// filtered and compressed apart on all threads: every chunk ends on a byte with an empty stored
+// block, so the chunks are one zlib stream, and goes into an IDAT chunk of its own. The chunks
+// do not see each other's bytes, which costs a little of the ratio, and the file does not depend
+// on the number of threads. The last call leaves its sizes and time in encodeStats.
+// p1/ppmrw.c includes this file as well, so it must not use anything of the raycaster.
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define PNG_FILTER_ADAPTIVE 5
+
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 15
+// the longest hash chain followed for a match
+#define DEFLATE_CHAIN 64
+// a match this long is taken without looking further or one byte later
+#define DEFLATE_NICE 128
+#define DEFLATE_LAZY 32
+// after a match this long the next position only follows a quarter of the chain
+#define DEFLATE_GOOD 8
+// symbols of a block, after which its Huffman codes are made
+#define DEFLATE_BLOCK 32768
+
+typedef struct {
+	size_t rawBytes;     // 3 bytes per pixel
+	size_t writtenBytes;
+	double seconds;
+} EncodeStats;
+
+EncodeStats encodeStats;
+
+typedef struct {
+	unsigned char* data;
+	size_t size;
+	size_t capacity;
+	uint64_t bits;  // not written yet, the lowest bit first
+	int count;
+} BitStream;
+
+// a literal when length is 0, a match of length bytes at distance value otherwise
+typedef struct {
+	uint16_t length;
+	uint16_t value;
+} DeflateSymbol;
+
+static const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99,
+	115, 131, 163, 195, 227, 258 };
+static const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025,
+	1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12,
+	12, 13, 13 };
+static const uint8_t codeLengthOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// the code of every match length, and of the distances up to 256 and above by 128
+static uint8_t lengthCode[259];
+static uint8_t distanceLow[256];
+static uint8_t distanceHigh[256];
+static uint32_t crcTable[256];
+static int encoderTablesReady = 0;
+
+static void encoderTables() {
+	int code, i;
+	if (encoderTablesReady) {
+		return;
+	}
+	for (code = 0; code < 29; code++) {
+		for (i = lengthBase[code]; i < lengthBase[code] + (1 << lengthExtra[code]) && i <= 258; i++) {
+			lengthCode[i] = (uint8_t)code;
+		}
+	}
+	// 258 has a code of its own, not the end of the range of 227
+	lengthCode[258] = 28;
+	for (code = 0; code < 30; code++) {
+		for (i = distanceBase[code]; i < distanceBase[code] + (1 << distanceExtra[code]); i++) {
+			if (i <= 256) {
+				distanceLow[i - 1] = (uint8_t)code;
+			}
+			else {
+				distanceHigh[(i - 1) >> 7] = (uint8_t)code;
+			}
+		}
+	}
+	for (i = 0; i < 256; i++) {
+		uint32_t c = (uint32_t)i;
+		int k;
+		for (k = 0; k < 8; k++) {
+			c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		}
+		crcTable[i] = c;
+	}
+	encoderTablesReady = 1;
+}
+
+static inline int distanceCode(int distance) {
+	return distance <= 256 ? distanceLow[distance - 1] : distanceHigh[(distance - 1) >> 7];
+}
+
+static uint32_t crc32(uint32_t crc, const unsigned char* data, size_t size) {
+	size_t i;
+	crc = ~crc;
+	for (i = 0; i < size; i++) {
+		crc = crcTable[(crc ^ data[i]) & 255] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+static uint32_t adler32(const unsigned char* data, size_t size) {
+	uint32_t a = 1, b = 0;
+	while (size > 0) {
+		// 5552 bytes cannot overflow the sums before they are reduced
+		size_t n = size < 5552 ? size : 5552, i;
+		for (i = 0; i < n; i++) {
+			a += data[i];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+		data += n;
+		size -= n;
+	}
+	return b << 16 | a;
+}
+
+// adler32Combine() returns the checksum of two buffers from their checksums, size2 is the length of the second
+static uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, size_t size2) {
+	uint32_t base = 65521, remainder = (uint32_t)(size2 % base);
+	uint32_t sum1 = adler1 & 0xFFFF;
+	uint32_t sum2 = (uint32_t)((uint64_t)remainder * sum1 % base);
+	sum1 += (adler2 & 0xFFFF) + base - 1;
+	sum2 += (adler1 >> 16) + (adler2 >> 16) + base - remainder;
+	if (sum1 >= base) sum1 -= base;
+	if (sum1 >= base) sum1 -= base;
+	if (sum2 >= base << 1) sum2 -= base << 1;
+	if (sum2 >= base) sum2 -= base;
+	return sum2 << 16 | sum1;
+}
+
+static void reserveBytes(BitStream* s, size_t more) {
+	if (s->size + more <= s->capacity) {
+		return;
+	}
+	size_t capacity = s->capacity * 2 > s->size + more ? s->capacity * 2 : s->size + more + 4096;
+	unsigned char* data = realloc(s->data, capacity);
+	if (data == NULL) {
+		fprintf(stderr, "Error: allocate the memory unsuccessfully. \n");
+		exit(1);
+	}
+	s->data = data;
+	s->capacity = capacity;
+}
+
+static inline void putByte(BitStream* s, unsigned char byte) {
+	reserveBytes(s, 1);
+	s->data[s->size++] = byte;
+}
+
+static inline void putBits(BitStream* s, uint32_t value, int n) {
+	s->bits |= (uint64_t)value << s->count;
+	s->count += n;
+	while (s->count >= 8) {
+		putByte(s, (unsigned char)s->bits);
+		s->bits >>= 8;
+		s->count -= 8;
+	}
+}
+
+static void alignBits(BitStream* s) {
+	if (s->count > 0) {
+		putByte(s, (unsigned char)s->bits);
+	}
+	s->bits = 0;
+	s->count = 0;
+}
+
+static void putBigEndian(BitStream* s, uint32_t value) {
+	putByte(s, (unsigned char)(value >> 24));
+	putByte(s, (unsigned char)(value >> 16));
+	putByte(s, (unsigned char)(value >> 8));
+	putByte(s, (unsigned char)value);
+}
+
+// huffmanLengths() sets the code lengths of the n symbols that occur counts times, none longer than
+// maxBits. Symbols that do not occur get no code, and at least two symbols get one, so the code
+// is always complete. When the tree is too deep the counts are halved until it fits.
+static void huffmanLengths(const uint32_t* counts, int n, int maxBits, uint8_t* lengths) {
+	uint32_t freq[320];
+	int order[320], parent[640], depth[640];
+	uint32_t weight[640];
+	int i, used = 0;
+	for (i = 0; i < n; i++) {
+		freq[i] = counts[i];
+		used += freq[i] > 0;
+	}
+	for (i = 0; used < 2; i++) {
+		if (freq[i] == 0) {
+			freq[i] = 1;
+			used += 1;
+		}
+	}
+	for (;;) {
+		// the leaves sorted by count, by insertion as there are at most 286
+		int leaves = 0;
+		for (i = 0; i < n; i++) {
+			if (freq[i] == 0) continue;
+			int k = leaves++;
+			while (k > 0 && freq[order[k - 1]] > freq[i]) {
+				order[k] = order[k - 1];
+				k--;
+			}
+			order[k] = i;
+		}
+		for (i = 0; i < leaves; i++) {
+			weight[i] = freq[order[i]];
+		}
+		// the inner nodes are made in order of their weight, so two queues find the smallest two
+		int nextLeaf = 0, nextInner = leaves, nodes = leaves;
+		while (nodes < 2 * leaves - 1) {
+			int pick[2], p;
+			for (p = 0; p < 2; p++) {
+				if (nextLeaf < leaves && (nextInner >= nodes || weight[nextLeaf] <= weight[nextInner])) {
+					pick[p] = nextLeaf++;
+				}
+				else {
+					pick[p] = nextInner++;
+				}
+			}
+			weight[nodes] = weight[pick[0]] + weight[pick[1]];
+			parent[pick[0]] = nodes;
+			parent[pick[1]] = nodes;
+			nodes++;
+		}
+		depth[nodes - 1] = 0;
+		int deepest = 0;
+		for (i = nodes - 2; i >= 0; i--) {
+			depth[i] = depth[parent[i]] + 1;
+			if (depth[i] > deepest) deepest = depth[i];
+		}
+		if (deepest <= maxBits) {
+			memset(lengths, 0, n);
+			for (i = 0; i < leaves; i++) {
+				lengths[order[i]] = (uint8_t)depth[i];
+			}
+			return;
+		}
+		for (i = 0; i < n; i++) {
+			if (freq[i] > 0) {
+				freq[i] = (freq[i] >> 1) | 1;
+			}
+		}
+	}
+}
+
+// huffmanCodes() sets the canonical codes of the lengths, with their bits reversed as deflate
+// writes the bits of a code from the highest
+static void huffmanCodes(const uint8_t* lengths, int n, uint16_t* codes) {
+	int count[16] = { 0 }, next[16], i, code = 0, bits;
+	for (i = 0; i < n; i++) {
+		count[lengths[i]] += 1;
+	}
+	count[0] = 0;
+	for (bits = 1; bits < 16; bits++) {
+		code = (code + count[bits - 1]) << 1;
+		next[bits] = code;
+	}
+	for (i = 0; i < n; i++) {
+		int length = lengths[i];
+		if (length == 0) continue;
+		int c = next[length]++, reversed = 0, k;
+		for (k = 0; k < length; k++) {
+			reversed = (reversed << 1) | ((c >> k) & 1);
+		}
+		codes[i] = (uint16_t)reversed;
+	}
+}
+
+// putStored() writes the bytes as stored blocks that are not final
+static void putStored(BitStream* s, const unsigned char* data, size_t size) {
+	do {
+		size_t n = size < 65535 ? size : 65535;
+		putBits(s, 0, 3);
+		alignBits(s);
+		putByte(s, (unsigned char)n);
+		putByte(s, (unsigned char)(n >> 8));
+		putByte(s, (unsigned char)~n);
+		putByte(s, (unsigned char)(~n >> 8));
+		reserveBytes(s, n);
+		memcpy(&s->data[s->size], data, n);
+		s->size += n;
+		data += n;
+		size -= n;
+	} while (size > 0);
+}
+
+// putBlock() writes the symbols, which encode the size bytes at data, as a block that is not
+// final, with Huffman codes made for them or stored when that is shorter
+static void putBlock(BitStream* s, const DeflateSymbol* symbols, int count, const unsigned char* data, size_t size) {
+	uint32_t literalCounts[286] = { 0 }, distanceCounts[30] = { 0 }, lengthCounts[19] = { 0 };
+	uint8_t lengths[286 + 30], lengthLengths[19];
+	uint16_t literalCodes[286], distanceCodes[30], lengthCodes[19];
+	int i;
+	for (i = 0; i < count; i++) {
+		if (symbols[i].length == 0) {
+			literalCounts[symbols[i].value] += 1;
+		}
+		else {
+			literalCounts[257 + lengthCode[symbols[i].length]] += 1;
+			distanceCounts[distanceCode(symbols[i].value)] += 1;
+		}
+	}
+	literalCounts[256] = 1;
+	huffmanLengths(literalCounts, 286, 15, lengths);
+	huffmanLengths(distanceCounts, 30, 15, lengths + 286);
+	int literals = 286, distances = 30;
+	while (literals > 257 && lengths[literals - 1] == 0) literals--;
+	while (distances > 1 && lengths[286 + distances - 1] == 0) distances--;
+	// the lengths of both codes in a row, with runs as the symbols 16, 17 and 18
+	uint8_t all[286 + 30];
+	uint8_t runs[286 + 30][2];
+	int total = literals + distances, runCount = 0;
+	memcpy(all, lengths, literals);
+	memcpy(all + literals, lengths + 286, distances);
+	for (i = 0; i < total;) {
+		int length = all[i], run = 1;
+		while (i + run < total && all[i + run] == length) run++;
+		if (length == 0 && run >= 11) {
+			run = run > 138 ? 138 : run;
+			runs[runCount][0] = 18;
+			runs[runCount++][1] = (uint8_t)(run - 11);
+		}
+		else if (length == 0 && run >= 3) {
+			runs[runCount][0] = 17;
+			runs[runCount++][1] = (uint8_t)(run - 3);
+		}
+		else if (length != 0 && run >= 4) {
+			run = run > 7 ? 7 : run;
+			runs[runCount][0] = (uint8_t)length;
+			runs[runCount++][1] = 0;
+			runs[runCount][0] = 16;
+			runs[runCount++][1] = (uint8_t)(run - 4);
+		}
+		else {
+			run = 1;
+			runs[runCount][0] = (uint8_t)length;
+			runs[runCount++][1] = 0;
+		}
+		i += run;
+	}
+	for (i = 0; i < runCount; i++) {
+		lengthCounts[runs[i][0]] += 1;
+	}
+	huffmanLengths(lengthCounts, 19, 7, lengthLengths);
+	int lengthCount = 19;
+	while (lengthCount > 4 && lengthLengths[codeLengthOrder[lengthCount - 1]] == 0) lengthCount--;
+	// the size of the block in bits, to compare it with storing the bytes
+	uint64_t bits = 3 + 14 + 3 * lengthCount;
+	for (i = 0; i < runCount; i++) {
+		int symbol = runs[i][0];
+		bits += lengthLengths[symbol] + (symbol == 16 ? 2 : symbol == 17 ? 3 : symbol == 18 ? 7 : 0);
+	}
+	for (i = 0; i < 286; i++) {
+		bits += (uint64_t)literalCounts[i] * lengths[i] + (i >= 257 ? (uint64_t)literalCounts[i] * lengthExtra[i - 257] : 0);
+	}
+	for (i = 0; i < 30; i++) {
+		bits += (uint64_t)distanceCounts[i] * (lengths[286 + i] + distanceExtra[i]);
+	}
+	if (bits >= 8 * (size + 5 * (size / 65535 + 1))) {
+		putStored(s, data, size);
+		return;
+	}
+	huffmanCodes(lengths, 286, literalCodes);
+	huffmanCodes(lengths + 286, 30, distanceCodes);
+	huffmanCodes(lengthLengths, 19, lengthCodes);
+	putBits(s, 2 << 1, 3);
+	putBits(s, literals - 257, 5);
+	putBits(s, distances - 1, 5);
+	putBits(s, lengthCount - 4, 4);
+	for (i = 0; i < lengthCount; i++) {
+		putBits(s, lengthLengths[codeLengthOrder[i]], 3);
+	}
+	for (i = 0; i < runCount; i++) {
+		int symbol = runs[i][0];
+		putBits(s, lengthCodes[symbol], lengthLengths[symbol]);
+		if (symbol >= 16) {
+			putBits(s, runs[i][1], symbol == 16 ? 2 : symbol == 17 ? 3 : 7);
+		}
+	}
+	for (i = 0; i < count; i++) {
+		if (symbols[i].length == 0) {
+			putBits(s, literalCodes[symbols[i].value], lengths[symbols[i].value]);
+		}
+		else {
+			int code = lengthCode[symbols[i].length];
+			putBits(s, literalCodes[257 + code], lengths[257 + code]);
+			putBits(s, symbols[i].length - lengthBase[code], lengthExtra[code]);
+			code = distanceCode(symbols[i].value);
+			putBits(s, distanceCodes[code], lengths[286 + code]);
+			putBits(s, symbols[i].value - distanceBase[code], distanceExtra[code]);
+		}
+	}
+	putBits(s, literalCodes[256], lengths[256]);
+}
+
+// matchLength() returns how many of the first maxLength bytes of a and b are the same, 8 at a time
+static inline int matchLength(const unsigned char* a, const unsigned char* b, int maxLength) {
+	int n = 0;
+	while (n + 8 <= maxLength) {
+		uint64_t x, y;
+		memcpy(&x, a + n, 8);
+		memcpy(&y, b + n, 8);
+		if (x != y) {
+			// the first different byte is the lowest one on little endian machines
+			uint16_t one = 1;
+			if (*(unsigned char*)&one) {
+				return n + __builtin_ctzll(x ^ y) / 8;
+			}
+			break;
+		}
+		n += 8;
+	}
+	while (n < maxLength && a[n] == b[n]) n++;
+	return n;
+}
+
+static inline uint32_t deflateHash(const unsigned char* p) {
+	return ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16) * 2654435761u >> (32 - DEFLATE_HASH_BITS);
+}
+
+// deflateBytes() compresses the bytes into blocks that are not final and ends on a byte
+static void deflateBytes(BitStream* s, const unsigned char* data, size_t size) {
+	int* head = malloc(sizeof(int) * (1 << DEFLATE_HASH_BITS));
+	int* previous = malloc(sizeof(int) * DEFLATE_WINDOW);
+	DeflateSymbol* symbols = malloc(sizeof(DeflateSymbol) * DEFLATE_BLOCK);
+	if (head == NULL || previous == NULL || symbols == NULL) {
+		fprintf(stderr, "Error: allocate the memory unsuccessfully. \n");
+		exit(1);
+	}
+	memset(head, 0xFF, sizeof(int) * (1 << DEFLATE_HASH_BITS));
+	int count = 0;
+	size_t blockStart = 0, i = 0;
+	// the match found at the byte before i, which is taken unless i has a longer one
+	int pending = 0, pendingLength = 0, pendingDistance = 0;
+	while (i < size) {
+		int length = 0, distance = 0;
+		if (i + 3 <= size) {
+			uint32_t hash = deflateHash(&data[i]);
+			if (pendingLength < DEFLATE_LAZY) {
+				int maxLength = size - i < 258 ? (int)(size - i) : 258;
+				int candidate = head[hash], chain = pendingLength >= DEFLATE_GOOD ? DEFLATE_CHAIN / 4 : DEFLATE_CHAIN;
+				// a match has to be longer than the best so far, which starts below the shortest match
+				length = 2;
+				while (candidate >= 0 && (int)i - candidate < DEFLATE_WINDOW && chain-- > 0) {
+					const unsigned char* a = &data[candidate];
+					const unsigned char* b = &data[i];
+					if (a[length] == b[length] && a[length - 1] == b[length - 1] && a[0] == b[0] && a[1] == b[1]) {
+						int n = matchLength(a, b, maxLength);
+						if (n > length) {
+							length = n;
+							distance = (int)i - candidate;
+							if (n >= DEFLATE_NICE || n == maxLength) break;
+						}
+					}
+					candidate = previous[candidate & (DEFLATE_WINDOW - 1)];
+				}
+				if (length < 3) length = 0;
+			}
+			previous[i & (DEFLATE_WINDOW - 1)] = head[hash];
+			head[hash] = (int)i;
+		}
+		if (pending && pendingLength >= 3 && length <= pendingLength) {
+			// the match of the byte before wins, the bytes it covers go into the chains
+			size_t start = i - 1, end = start + pendingLength, p;
+			for (p = i + 1; p < end && p + 3 <= size; p++) {
+				uint32_t hash = deflateHash(&data[p]);
+				previous[p & (DEFLATE_WINDOW - 1)] = head[hash];
+				head[hash] = (int)p;
+			}
+			symbols[count].length = (uint16_t)pendingLength;
+			symbols[count++].value = (uint16_t)pendingDistance;
+			i = end;
+			pending = 0;
+			pendingLength = 0;
+		}
+		else {
+			if (pending) {
+				symbols[count].length = 0;
+				symbols[count++].value = data[i - 1];
+			}
+			pending = 1;
+			pendingLength = length;
+			pendingDistance = distance;
+			i++;
+		}
+		if (count >= DEFLATE_BLOCK - 2) {
+			// the pending byte belongs to the next block
+			size_t end = pending ? i - 1 : i;
+			putBlock(s, symbols, count, &data[blockStart], end - blockStart);
+			blockStart = end;
+			count = 0;
+		}
+	}
+	if (pending) {
+		symbols[count].length = 0;
+		symbols[count++].value = data[size - 1];
+	}
+	if (count > 0) {
+		putBlock(s, symbols, count, &data[blockStart], size - blockStart);
+	}
+	// an empty stored block ends the bytes on a byte boundary
+	putStored(s, data, 0);
+	free(head);
+	free(previous);
+	free(symbols);
+}
+
+static inline int paeth(int a, int b, int c) {
+	int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// filterRow() writes the filter byte and the filtered bytes of row to out, above is the row
+// before it or a row of zeros for the first row
+static void filterRow(int filter, const unsigned char* row, const unsigned char* above, int size, unsigned char* out) {
+	int i;
+	out[0] = (unsigned char)filter;
+	out++;
+	// the first pixel has no pixel to its left
+	switch (filter) {
+	case 0:
+		memcpy(out, row, size);
+		break;
+	case 1:
+		memcpy(out, row, 3);
+		for (i = 3; i < size; i++) out[i] = (unsigned char)(row[i] - row[i - 3]);
+		break;
+	case 2:
+		for (i = 0; i < size; i++) out[i] = (unsigned char)(row[i] - above[i]);
+		break;
+	case 3:
+		for (i = 0; i < 3; i++) out[i] = (unsigned char)(row[i] - (above[i] >> 1));
+		for (i = 3; i < size; i++) out[i] = (unsigned char)(row[i] - ((row[i - 3] + above[i]) >> 1));
+		break;
+	default:
+		for (i = 0; i < 3; i++) out[i] = (unsigned char)(row[i] - above[i]);
+		for (i = 3; i < size; i++) out[i] = (unsigned char)(row[i] - paeth(row[i - 3], above[i], above[i - 3]));
+		break;
+	}
+}
+
+// filterRows() filters the rows first..first + rows - 1 of the w x h pixels into out
+static void filterRows(const unsigned char* pixels, int w, int first, int rows, int filter, unsigned char* out) {
+	int size = w * 3, k;
+	unsigned char* trial = malloc(size + 1);
+	unsigned char* zeros = calloc(size, 1);
+	if (trial == NULL || zeros == NULL) {
+		fprintf(stderr, "Error: allocate the memory unsuccessfully. \n");
+		exit(1);
+	}
+	for (k = first; k < first + rows; k++) {
+		const unsigned char* row = &pixels[(size_t)k * size];
+		const unsigned char* above = k > 0 ? row - size : zeros;
+		unsigned char* to = &out[(size_t)(k - first) * (size + 1)];
+		if (filter != PNG_FILTER_ADAPTIVE) {
+			filterRow(filter, row, above, size, to);
+			continue;
+		}
+		long best = -1;
+		int f, i;
+		for (f = 0; f < 5; f++) {
+			filterRow(f, row, above, size, trial);
+			long sum = 0;
+			for (i = 1; i <= size; i++) {
+				sum += abs((signed char)trial[i]);
+			}
+			if (best < 0 || sum < best) {
+				best = sum;
+				memcpy(to, trial, size + 1);
+			}
+		}
+	}
+	free(trial);
+	free(zeros);
+}
+
+static void putChunk(FILE* file, const char* type, const unsigned char* data, size_t size) {
+	unsigned char header[8] = { (unsigned char)(size >> 24), (unsigned char)(size >> 16), (unsigned char)(size >> 8), (unsigned char)size,
+		(unsigned char)type[0], (unsigned char)type[1], (unsigned char)type[2], (unsigned char)type[3] };
+	uint32_t crc = crc32(crc32(0, header + 4, 4), data, size);
+	unsigned char trailer[4] = { (unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8), (unsigned char)crc };
+	fwrite(header, 1, 8, file);
+	fwrite(data, 1, size, file);
+	fwrite(trailer, 1, 4, file);
+	encodeStats.writtenBytes += size + 12;
+}
+
+static double encodeSeconds(struct timespec* start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+// PNGWrite() writes the w x h pixels, 3 bytes each and the rows from the top, as a PNG file.
+// filter is 0 to 4 for one PNG filter on every row or PNG_FILTER_ADAPTIVE, and with chunkRows > 0
+// the rows are compressed in chunks of that many rows by all threads
+int PNGWrite(FILE* file, const unsigned char* pixels, int w, int h, int filter, int chunkRows) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	encoderTables();
+	encodeStats.rawBytes = (size_t)w * h * 3;
+	encodeStats.writtenBytes = 8;
+	static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+	fwrite(signature, 1, 8, file);
+	unsigned char header[13] = { (unsigned char)(w >> 24), (unsigned char)(w >> 16), (unsigned char)(w >> 8), (unsigned char)w,
+		(unsigned char)(h >> 24), (unsigned char)(h >> 16), (unsigned char)(h >> 8), (unsigned char)h, 8, 2, 0, 0, 0 };
+	putChunk(file, "IHDR", header, 13);
+	if (chunkRows <= 0 || chunkRows > h) {
+		chunkRows = h;
+	}
+	int chunks = (h + chunkRows - 1) / chunkRows, c;
+	size_t rowSize = (size_t)w * 3 + 1;
+	BitStream* streams = calloc(chunks, sizeof(BitStream));
+	uint32_t* adlers = malloc(sizeof(uint32_t) * chunks);
+	if (streams == NULL || adlers == NULL) {
+		fprintf(stderr, "Error: allocate the memory unsuccessfully. \n");
+		exit(1);
+	}
+	#pragma omp parallel for schedule(dynamic)
+	for (c = 0; c < chunks; c++) {
+		int first = c * chunkRows, rows = first + chunkRows <= h ? chunkRows : h - first;
+		unsigned char* filtered = malloc(rowSize * rows);
+		if (filtered == NULL) {
+			fprintf(stderr, "Error: allocate the memory unsuccessfully. \n");
+			exit(1);
+		}
+		filterRows(pixels, w, first, rows, filter, filtered);
+		adlers[c] = adler32(filtered, rowSize * rows);
+		BitStream* s = &streams[c];
+		reserveBytes(s, rowSize * rows / 2 + 64);
+		if (c == 0) {
+			// the zlib header: deflate with a 32K window, default compression
+			putByte(s, 0x78);
+			putByte(s, 0x9C);
+		}
+		deflateBytes(s, filtered, rowSize * rows);
+		free(filtered);
+	}
+	uint32_t adler = adlers[0];
+	for (c = 0; c < chunks; c++) {
+		if (c > 0) {
+			int rows = (c + 1) * chunkRows <= h ? chunkRows : h - c * chunkRows;
+			adler = adler32Combine(adler, adlers[c], rowSize * rows);
+		}
+		putChunk(file, "IDAT", streams[c].data, streams[c].size);
+		free(streams[c].data);
+	}
+	// the final block is an empty stored block, then the checksum of the filtered rows
+	unsigned char end[9] = { 1, 0, 0, 0xFF, 0xFF, (unsigned char)(adler >> 24), (unsigned char)(adler >> 16), (unsigned char)(adler >> 8),
+		(unsigned char)adler };
+	putChunk(file, "IDAT", end, 9);
+	putChunk(file, "IEND", NULL, 0);
+	free(streams);
+	free(adlers);
+	encodeStats.seconds = encodeSeconds(&start);
+	return ferror(file) ? 1 : 0;
+}
+
+// QOIWrite() writes the w x h pixels, 3 bytes each and the rows from the top, as a QOI file
+int QOIWrite(FILE* file, const unsigned char* pixels, int w, int h) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	BitStream s = { NULL, 0, 0, 0, 0 };
+	size_t size = (size_t)w * h, i;
+	// at most 4 bytes a pixel, plus the header and the end
+	reserveBytes(&s, size * 4 + 22);
+	memcpy(s.data, "qoif", 4);
+	s.size = 4;
+	putBigEndian(&s, (uint32_t)w);
+	putBigEndian(&s, (uint32_t)h);
+	putByte(&s, 3);
+	putByte(&s, 0);
+	// the colors seen by their hash, -1 until one is seen, as the reader starts with transparent black
+	int seen[64][3];
+	memset(seen, 0xFF, sizeof(seen));
+	unsigned char* out = s.data + s.size;
+	int r = 0, g = 0, b = 0, run = 0;
+	for (i = 0; i < size; i++) {
+		const unsigned char* p = &pixels[i * 3];
+		if (p[0] == r && p[1] == g && p[2] == b) {
+			run++;
+			if (run == 62 || i == size - 1) {
+				*out++ = (unsigned char)(0xC0 | (run - 1));
+				run = 0;
+			}
+			continue;
+		}
+		if (run > 0) {
+			*out++ = (unsigned char)(0xC0 | (run - 1));
+			run = 0;
+		}
+		// the alpha of every pixel is 255
+		int index = (p[0] * 3 + p[1] * 5 + p[2] * 7 + 255 * 11) & 63;
+		if (seen[index][0] == p[0] && seen[index][1] == p[1] && seen[index][2] == p[2]) {
+			*out++ = (unsigned char)index;
+		}
+		else {
+			seen[index][0] = p[0];
+			seen[index][1] = p[1];
+			seen[index][2] = p[2];
+			signed char dr = (signed char)(p[0] - r), dg = (signed char)(p[1] - g), db = (signed char)(p[2] - b);
+			signed char drg = (signed char)(dr - dg), dbg = (signed char)(db - dg);
+			if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+				*out++ = (unsigned char)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+			}
+			else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+				*out++ = (unsigned char)(0x80 | (dg + 32));
+				*out++ = (unsigned char)((drg + 8) << 4 | (dbg + 8));
+			}
+			else {
+				*out++ = 0xFE;
+				*out++ = p[0];
+				*out++ = p[1];
+				*out++ = p[2];
+			}
+		}
+		r = p[0];
+		g = p[1];
+		b = p[2];
+	}
+	static const unsigned char ending[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	memcpy(out, ending, 8);
+	out += 8;
+	s.size = out - s.data;
+	fwrite(s.data, 1, s.size, file);
+	free(s.data);
+	encodeStats.rawBytes = size * 3;
+	encodeStats.writtenBytes = s.size;
+	encodeStats.seconds = encodeSeconds(&start);
+	return ferror(file) ? 1 : 0;
+}
@@ -0,0 +1,191 @@
+// G-buffer for relighting
+// With -gbuffer file the primary hit of every pixel is saved after the render: the primitive,
+// the point, the normal and the view direction. -relight file makes the image again from that
+// file without any primary ray, only the lights, the shadow rays and the reflection and
+// refraction rays are traced. So lights can be moved, recolored or changed in any other way
+// and so can the materials, as the material is looked up from the primitive again. The
+// geometry, the camera and the image size have to stay the same; the file keeps a hash of them
+// and -relight stops when the scene does not match it any more.
+
+#define GBUFFER_MAGIC "GBUFFER1"
+
+typedef struct {
+	int id;             // primitive of the primary hit, -1 for the background
+	int unused;
+	double position[3];
+	double normal[3];   // unit normal, facing the ray for triangles
+	double view[3];     // unit direction of the primary ray
+} GBufferPixel;
+
+typedef struct {
+	char magic[8];
+	int width;
+	int height;
+	uint64_t sceneHash;
+} GBufferHeader;
+
+typedef struct {
+	int width;
+	int height;
+	GBufferPixel* pixels;
+} GBuffer;
+
+// the G-buffer that rayCasting() fills with -gbuffer, NULL otherwise
+GBuffer* gbuffer;
+
+GBuffer* newGBuffer(int w, int h) {
+	GBuffer* g = malloc(sizeof(GBuffer));
+	g->width = w;
+	g->height = h;
+	g->pixels = calloc((size_t)w * h, sizeof(GBufferPixel));
+	if (g->pixels == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the g-buffer.\n");
+		exit(1);
+	}
+	return g;
+}
+
+void freeGBuffer(GBuffer* g) {
+	if (g == NULL) {
+		return;
+	}
+	free(g->pixels);
+	free(g);
+}
+
+// storeGBuffer() keeps the primary hit of pixel p, the ray Ro + t*Rd hits primitive id at t = depth
+void storeGBuffer(GBuffer* g, int p, int id, double* Ro, double* Rd, double depth) {
+	GBufferPixel* pixel = &g->pixels[p];
+	pixel->id = id;
+	memcpy(pixel->view, Rd, sizeof(pixel->view));
+	if (id < 0) {
+		return;
+	}
+	int a;
+	for (a = 0; a < 3; a++) {
+		pixel->position[a] = depth * Rd[a] + Ro[a];
+	}
+	surfaceNormal(id, pixel->position, Rd, pixel->normal);
+}
+
+// hashBytes() mixes size bytes of data into the hash h, 8 bytes at a time
+static uint64_t hashBytes(uint64_t h, const void* data, size_t size) {
+	const unsigned char* bytes = data;
+	size_t i;
+	for (i = 0; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, bytes + i, 8);
+		h = (h ^ word) * 0x100000001B3ULL;
+		h ^= h >> 29;
+	}
+	for (; i < size; i++) {
+		h = (h ^ bytes[i]) * 0x100000001B3ULL;
+	}
+	return h;
+}
+
+// sceneHash() hashes everything that decides the primary hits of a w x h image: the camera
+// and the geometry of the scene, but not the lights and the materials
+uint64_t sceneHash(Object** objects, int w, int h) {
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	double width, height;
+	int m;
+	cameraSize(objects, &width, &height);
+	double view[2] = { width, height };
+	int size[2] = { w, h };
+	hash = hashBytes(hash, view, sizeof(view));
+	hash = hashBytes(hash, size, sizeof(size));
+	hash = hashBytes(hash, &scene->sphereCount, sizeof(int));
+	hash = hashBytes(hash, scene->spheres, sizeof(double) * 4 * (size_t)scene->sphereCount);
+	hash = hashBytes(hash, &scene->planeCount, sizeof(int));
+	hash = hashBytes(hash, scene->planes, sizeof(double) * 6 * (size_t)scene->planeCount);
+	hash = hashBytes(hash, &scene->instanceCount, sizeof(int));
+	hash = hashBytes(hash, scene->instancePrototype, sizeof(int) * scene->instanceCount);
+	hash = hashBytes(hash, scene->instanceTransform, sizeof(double) * 12 * scene->instanceCount);
+	hash = hashBytes(hash, scene->prototypeStart, sizeof(int) * (scene->prototypeCount + 1));
+	hash = hashBytes(hash, scene->prototypeSpheres, sizeof(double) * 4 * scene->prototypeStart[scene->prototypeCount]);
+	hash = hashBytes(hash, &scene->meshCount, sizeof(int));
+	for (m = 0; m < scene->meshCount; m++) {
+		Mesh* mesh = &scene->meshes[m];
+		hash = hashBytes(hash, mesh->position, sizeof(mesh->position));
+		hash = hashBytes(hash, &mesh->scale, sizeof(mesh->scale));
+		hash = hashBytes(hash, &mesh->triangleCount, sizeof(int));
+		hash = hashBytes(hash, mesh->vertices, sizeof(float) * 3 * (size_t)mesh->vertexCount);
+		hash = hashBytes(hash, mesh->indices, sizeof(uint32_t) * 3 * (size_t)mesh->triangleCount);
+	}
+	return hash;
+}
+
+// saveGBuffer() writes the G-buffer and the hash of the scene it was made from to a file
+void saveGBuffer(char* filename, GBuffer* g, uint64_t hash) {
+	GBufferHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, GBUFFER_MAGIC, 8);
+	header.width = g->width;
+	header.height = g->height;
+	header.sceneHash = hash;
+	FILE* file = fopen(filename, "wb");
+	if (file == NULL) {
+		fprintf(stderr, "Error: Could not write the g-buffer %s.\n", filename);
+		exit(1);
+	}
+	size_t count = (size_t)g->width * g->height;
+	if (fwrite(&header, sizeof(header), 1, file) != 1 || fwrite(g->pixels, sizeof(GBufferPixel), count, file) != count) {
+		fprintf(stderr, "Error: Could not write the g-buffer %s.\n", filename);
+		exit(1);
+	}
+	fclose(file);
+}
+
+// loadGBuffer() reads a G-buffer file and sets hash to the hash of the scene it was made from
+GBuffer* loadGBuffer(char* filename, uint64_t* hash) {
+	GBufferHeader header;
+	FILE* file = fopen(filename, "rb");
+	if (file == NULL || fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, GBUFFER_MAGIC, 8) != 0 ||
+		header.width <= 0 || header.height <= 0) {
+		fprintf(stderr, "Error: %s is not a g-buffer.\n", filename);
+		exit(1);
+	}
+	GBuffer* g = newGBuffer(header.width, header.height);
+	size_t count = (size_t)g->width * g->height;
+	if (fread(g->pixels, sizeof(GBufferPixel), count, file) != count) {
+		fprintf(stderr, "Error: the g-buffer %s is cut short.\n", filename);
+		exit(1);
+	}
+	fclose(file);
+	*hash = header.sceneHash;
+	return g;
+}
+
+// relight() makes the image of the G-buffer with the lights and materials of the current scene
+PPMimage* relight(GBuffer* g, Object** objects) {
+	int w = g->width, h = g->height;
+	int j, k;
+	PPMimage* buffer = newImage(w, h);
+	prepareFrame(objects, w);
+	if (options.layersFile != NULL) {
+		freeLightLayers(lightLayers);
+		lightLayers = buildLightLayers(objects, w, h);
+	}
+	for (k = 0; k < h; k++) {
+		int count = (h - k - 1) * w * 3;
+		for (j = 0; j < w; j++) {
+			GBufferPixel* pixel = &g->pixels[k * w + j];
+			if (pixel->id < 0) {
+				buffer->hdr[count++] = 0;
+				buffer->hdr[count++] = 0;
+				buffer->hdr[count++] = 0;
+				continue;
+			}
+			seedRandom((unsigned long long)k * w + j);
+			layerPixel = k * w + j;
+			layerWeight = 1;
+			double* color = shadeSurface(pixel->view, pixel->position, pixel->normal, objects, 0, 0, pixel->id);
+			buffer->hdr[count++] = (float)color[0];
+			buffer->hdr[count++] = (float)color[1];
+			buffer->hdr[count++] = (float)color[2];
+			free(color);
+		}
+	}
+	return buffer;
+}
@@ -1,7 +1,30 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <time.h>
 #include "newParser.c"
+#include "vector.h"
+
+// the options from the command line and the counters for -stats
+RenderOptions options;
+// every thread counts for itself, the path tracer adds the counts of its threads to the main thread
+_Thread_local RenderStats stats;
+// the spheres, planes and materials, built from the objects when the scene is read
+Scene* scene;
+
+#include "random.c"
+#include "pointCloud.c"
+#include "scene.c"
+#include "lightGrid.c"
+#include "lightTree.c"
+#include "occluderCache.c"
+
+// the light table and culling grid of the scene, built in rayCasting()
+LightGrid* lightGrid;
+// the tree for -lightbudget, NULL when every light is shaded
+LightTree* lightTree;
+// the candidate occluders of each light for -occludergrid, NULL when it is not used
+OccluderGrid* occluderGrid;
 
 
 // create a stuct that represents a single pixel, same as what we did in class
@@ -17,29 +40,83 @@ typedef struct PPMimage {
 	int height;
 	int maxColorValue;
 	unsigned char *data;
+	float *hdr;   // the colors of a render before the tone mapping, in the order of data, NULL for a read image
 } PPMimage;
 
-
-// return the square value of v
-static inline double sqr(double v) {
-	return v*v;
-}
-
-// normalize the vector to a 3d unit vector
-static inline void normalize(double* v) {
-	double len = sqrt(sqr(v[0]) + sqr(v[1]) + sqr(v[2]));
-	v[0] /= len;
-	v[1] /= len;
-	v[2] /= len;
+// the PPMRead function of project 1, it reads a P3 or P6 file into buffer with 3 bytes per pixel
+int PPMRead(char *inputFilename, PPMimage* buffer) {
+	FILE* fh = fopen(inputFilename, "rb");
+	// check whether the file open successfully. If not, show the error message
+	if (fh == NULL) {
+		fprintf(stderr, "Error: open the file %s unsuccessfully. \n", inputFilename);
+		exit(1);
+	}
+	int c = fgetc(fh);
+	// check the file type, if the file does not start with the 'P'
+	if (c != 'P') {
+		fprintf(stderr, "Error: incorrect input file formart, the file should be a PPM file. \n");
+		exit(1);
+	}
+	char ppmVersionNum = fgetc(fh);
+	if (ppmVersionNum != '3' && ppmVersionNum != '6') {
+		fprintf(stderr, "Error: invalid magic number, the ppm version should be either P3 or P6. \n");
+		exit(1);
+	}
+	c = ppmVersionNum;
+	while (c != '\n' && c != EOF) {
+		c = fgetc(fh);
+	}
+	// skip comments
+	c = fgetc(fh);
+	while (c == '#') {
+		while (c != '\n' && c != EOF) {
+			c = fgetc(fh);
+		}
+		c = fgetc(fh);
+	}
+	ungetc(c, fh);
+	if (fscanf(fh, "%d %d", &buffer->width, &buffer->height) != 2 || buffer->width <= 0 || buffer->height <= 0) {
+		fprintf(stderr, "Error: the size of image has to include width and height, invalid data for image. \n");
+		exit(1);
+	}
+	if (fscanf(fh, "%d", &buffer->maxColorValue) != 1 || buffer->maxColorValue != 255) {
+		fprintf(stderr, "Error: the image has to be 8-bit per channel. \n");
+		exit(1);
+	}
+	// the single whitespace after the max color value
+	fgetc(fh);
+	buffer->hdr = NULL;
+	size_t size = (size_t)buffer->width * buffer->height * 3;
+	buffer->data = (unsigned char*)malloc(size);
+	if (buffer->data == NULL) {
+		fprintf(stderr, "Error: allocate the memory unsuccessfully. \n");
+		exit(1);
+	}
+	if (ppmVersionNum == '3') {
+		size_t i;
+		for (i = 0; i < size; i++) {
+			int value;
+			if (fscanf(fh, "%d", &value) != 1) {
+				fprintf(stderr, "Error: read size and real size are not match");
+				exit(1);
+			}
+			buffer->data[i] = (unsigned char)value;
+		}
+	}
+	else if (fread(buffer->data, 1, size, fh) != size) {
+		fprintf(stderr, "Error: read size and real size are not match");
+		exit(1);
+	}
+	fclose(fh);
+	return 0;
 }
 
-
 // this function writes the body data from buffer->data to output file
 int PPMDataWrite(char ppmVersionNum, FILE *outputFile, PPMimage* buffer) {
 	// write image data to the file if the ppm version is P6
 	if (ppmVersionNum == '6') {
-		// using fwrite to write data, basically it just like copy and paste data for P6
-		fwrite(buffer->data, sizeof(PPMRGBpixel), buffer->width*buffer->height, outputFile);
+		// using fwrite to write data, basically it just like copy and paste data for P6, 3 bytes per pixel
+		fwrite(buffer->data, 3, buffer->width*buffer->height, outputFile);
 		printf("The file saved successfully! \n");
 		return (0);
 	}
@@ -63,8 +140,46 @@ int PPMDataWrite(char ppmVersionNum, FILE *outputFile, PPMimage* buffer) {
 	}
 }
 
+// QOIWrite() and PNGWrite() write the compressed formats
+#include "encoders.c"
+
+// outputFormat() returns the format PPMWrite() writes the file name in, from its extension
+char* outputFormat(char* filename) {
+	size_t length = strlen(filename);
+	if (length >= 4 && strcmp(&filename[length - 4], ".png") == 0) {
+		return "PNG";
+	}
+	if (length >= 4 && strcmp(&filename[length - 4], ".qoi") == 0) {
+		return "QOI";
+	}
+	return "P6";
+}
+
 // this function writes the header data from buffer to output file
 int PPMWrite(char *outPPMVersion, char *outputFilename, PPMimage* buffer) {
+	if (strcmp(outPPMVersion, "PNG") == 0 || strcmp(outPPMVersion, "QOI") == 0) {
+		FILE *fh = fopen(outputFilename, "wb");
+		if (fh == NULL) {
+			fprintf(stderr, "Error: open the file unscuccessfully. \n");
+			return (1);
+		}
+		int failed;
+		if (outPPMVersion[0] == 'P') {
+			// the rows of options.pngChunk KB are compressed by the threads
+			int chunkRows = options.pngChunk > 0 ? (int)(options.pngChunk * 1024 / (buffer->width * 3 + 1)) + 1 : 0;
+			failed = PNGWrite(fh, buffer->data, buffer->width, buffer->height, options.pngFilter, chunkRows);
+		}
+		else {
+			failed = QOIWrite(fh, buffer->data, buffer->width, buffer->height);
+		}
+		fclose(fh);
+		if (failed) {
+			fprintf(stderr, "Error: write the file %s unsuccessfully. \n", outputFilename);
+			return (1);
+		}
+		printf("The file saved successfully! \n");
+		return (0);
+	}
 	int width = buffer->width;
 	int height = buffer->height;
 	int maxColorValue = buffer->maxColorValue;
@@ -81,6 +196,9 @@ int PPMWrite(char *outPPMVersion, char *outputFilename, PPMimage* buffer) {
 	fclose(fh);
 }
 
+// the renderers keep float colors that the tone mapping turns into the bytes of the image
+#include "toneMap.c"
+
 
 double sphereIntersection(double* Ro, double* Rd, double* Center, double r) {
 	// x = Rox + Rdx*t
@@ -131,47 +249,73 @@ double planeIntersection(double* Ro, double* Rd, double* position, double* norma
 	return -1;
 }
 
-// intersect function takes in object index, objects and Rd.
-// returns the pointer of type double that contains the closest object index and the closest t value
-// when the closest t is smaller than 0, there is no intersection point
-double* intersect(double* Ro, double* Rd, int objectNum, Object** objects) {
-	int closestObjectNum = -1;
-	double bestT = INFINITY;
+#include "bvh.c"
+#include "instance.c"
+#include "mesh.c"
+#include "tiles.c"
+#include "shadeCache.c"
+#include "reproject.c"
+#include "texture.c"
+
+// the hierarchy over the spheres, NULL with -bvh none
+BVH* bvh;
+// the two level hierarchy over the instances, NULL when the scene has none
+InstanceTree* instances;
+
+// intersect function returns the closest primitive that the ray hits and sets bestT to its
+// distance. When there is no intersection point it returns -1
+int intersect(double* Ro, double* Rd, double* bestT) {
+	int closest = -1;
 	int i;
 	double t;
-	for (i = 0; i<objectNum; i++) {
-		if (objects[i]->kind == 1) {
-			t = sphereIntersection(Ro, Rd, objects[i]->sphere.position, objects[i]->sphere.radius);
-			if (t) {
-				if (t > 0 && t <= bestT) {
-					bestT = t;
-					closestObjectNum = i;
-				}
-			}
-			else {
-				fprintf(stderr, "Error: finding the distance unsuccessfully.\n");
-				exit(1);
+	*bestT = INFINITY;
+	if (bvh != NULL) {
+		closest = options.bvh == 1 ? binaryIntersect(bvh, scene->spheres, Ro, Rd, bestT) : wideIntersect(bvh, scene->spheres, Ro, Rd, bestT);
+	}
+	for (i = 0; i < scene->sphereCount && bvh == NULL; i++) {
+		double* sphere = &scene->spheres[i * 4];
+		t = sphereIntersection(Ro, Rd, sphere, sphere[3]);
+		if (t) {
+			if (t > 0 && t <= *bestT) {
+				*bestT = t;
+				closest = i;
 			}
 		}
-		else if (objects[i]->kind == 2) {
-			t = planeIntersection(Ro, Rd, objects[i]->plane.position, objects[i]->plane.normal);
-			if (t) {
-				if (t > 0 && t <= bestT) {
-					bestT = t;
-					closestObjectNum = i;
-				}
-			}
-			else {
-				fprintf(stderr, "Error: finding the distance unsuccessfully.\n");
-				exit(1);
+		else {
+			fprintf(stderr, "Error: finding the distance unsuccessfully.\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < scene->planeCount; i++) {
+		double* plane = &scene->planes[i * 6];
+		t = planeIntersection(Ro, Rd, plane, &plane[3]);
+		if (t) {
+			if (t > 0 && t <= *bestT) {
+				*bestT = t;
+				closest = scene->sphereCount + i;
 			}
 		}
+		else {
+			fprintf(stderr, "Error: finding the distance unsuccessfully.\n");
+			exit(1);
+		}
 	}
-	double* result;
-	result = malloc(sizeof(double) * 2);
-	result[0] = (double)closestObjectNum;
-	result[1] = bestT;
-	return result;
+	if (instances != NULL) {
+		int hit = instanceIntersect(instances, Ro, Rd, bestT);
+		if (hit >= 0) {
+			closest = hit;
+		}
+	}
+	if (scene->meshCount > 0) {
+		int hit = meshIntersect(scene, Ro, Rd, bestT);
+		if (hit >= 0) {
+			closest = hit;
+		}
+	}
+	if (tileDeps != NULL) {
+		recordSegment(Ro, Rd, *bestT);
+	}
+	return closest;
 }
 
 // radial attenuation
@@ -236,34 +380,23 @@ double fang(int lightIndex, double* intersectPosition, Object** objects) {
 // diffuse reflection
 // if NL>0, do the KI(NL), where N is the normal, L is the light,
 // K is the diffuse color and I is the light color
-double* diffuse(int objectIndex, int lightIndex, double* N, double* L, Object** objects) {
+double* diffuse(Material* material, int lightIndex, double* N, double* L, Object** objects) {
 	double NL = N[0] * L[0] + N[1] * L[1] + N[2] * L[2]; // N*L
 	double* result;
-	double* KI;
+	double KI[3];
 	result = malloc(sizeof(double) * 3);
-	KI = malloc(sizeof(double) * 3);
 	if (NL <= 0) {
 		result[0] = 0;
 		result[1] = 0;
 		result[2] = 0;
 	}
 	else {
-		if (objects[objectIndex]->kind == 1) {
-			KI[0] = objects[objectIndex]->sphere.diffuseColor[0] * objects[lightIndex]->light.color[0];
-			KI[1] = objects[objectIndex]->sphere.diffuseColor[1] * objects[lightIndex]->light.color[1];
-			KI[2] = objects[objectIndex]->sphere.diffuseColor[2] * objects[lightIndex]->light.color[2];
-			result[0] = KI[0] * NL;
-			result[1] = KI[1] * NL;
-			result[2] = KI[2] * NL;
-		}
-		else if (objects[objectIndex]->kind == 2) {
-			KI[0] = objects[objectIndex]->plane.diffuseColor[0] * objects[lightIndex]->light.color[0];
-			KI[1] = objects[objectIndex]->plane.diffuseColor[1] * objects[lightIndex]->light.color[1];
-			KI[2] = objects[objectIndex]->plane.diffuseColor[2] * objects[lightIndex]->light.color[2];
-			result[0] = KI[0] * NL;
-			result[1] = KI[1] * NL;
-			result[2] = KI[2] * NL;
-		}
+		KI[0] = material->diffuseColor[0] * objects[lightIndex]->light.color[0];
+		KI[1] = material->diffuseColor[1] * objects[lightIndex]->light.color[1];
+		KI[2] = material->diffuseColor[2] * objects[lightIndex]->light.color[2];
+		result[0] = KI[0] * NL;
+		result[1] = KI[1] * NL;
+		result[2] = KI[2] * NL;
 	}
 	return result;
 }
@@ -273,34 +406,23 @@ double* diffuse(int objectIndex, int lightIndex, double* N, double* L, Object**
 // if NL>0 and RV>0, then do the KI(RV)^ns, where R is the reflection of the L,
 // V is the unit vector points from camera to the object, equals to Rd.
 // Also, K is the specular color, I is the light color and ns ---> phong model, represents shiniess
-double* specular(int objectIndex, int lightIndex, double NL, double* V, double* R, Object** objects) {
+double* specular(Material* material, int lightIndex, double NL, double* V, double* R, Object** objects) {
 	double VR = V[0] * R[0] + V[1] * R[1] + V[2] * R[2];
 	double* result;
-	double* KI;
+	double KI[3];
 	result = malloc(sizeof(double) * 3);
-	KI = malloc(sizeof(double) * 3);
 	if (NL <= 0 || VR <= 0) {
 		result[0] = 0;
 		result[1] = 0;
 		result[2] = 0;
 	}
 	else {
-		if (objects[objectIndex]->kind == 1) {
-			KI[0] = objects[objectIndex]->sphere.specularColor[0] * objects[lightIndex]->light.color[0];
-			KI[1] = objects[objectIndex]->sphere.specularColor[1] * objects[lightIndex]->light.color[1];
-			KI[2] = objects[objectIndex]->sphere.specularColor[2] * objects[lightIndex]->light.color[2];
-			result[0] = KI[0] * pow(VR, objects[lightIndex]->light.ns);  // I set up the ns to 20
-			result[1] = KI[1] * pow(VR, objects[lightIndex]->light.ns);
-			result[2] = KI[2] * pow(VR, objects[lightIndex]->light.ns);
-		}
-		else if (objects[objectIndex]->kind == 2) {
-			KI[0] = objects[objectIndex]->plane.specularColor[0] * objects[lightIndex]->light.color[0];
-			KI[1] = objects[objectIndex]->plane.specularColor[1] * objects[lightIndex]->light.color[1];
-			KI[2] = objects[objectIndex]->plane.specularColor[2] * objects[lightIndex]->light.color[2];
-			result[0] = KI[0] * pow(VR, objects[lightIndex]->light.ns);  // I set up the ns to 20
-			result[1] = KI[1] * pow(VR, objects[lightIndex]->light.ns);
-			result[2] = KI[2] * pow(VR, objects[lightIndex]->light.ns);
-		}
+		KI[0] = material->specularColor[0] * objects[lightIndex]->light.color[0];
+		KI[1] = material->specularColor[1] * objects[lightIndex]->light.color[1];
+		KI[2] = material->specularColor[2] * objects[lightIndex]->light.color[2];
+		result[0] = KI[0] * pow(VR, objects[lightIndex]->light.ns);  // I set up the ns to 20
+		result[1] = KI[1] * pow(VR, objects[lightIndex]->light.ns);
+		result[2] = KI[2] * pow(VR, objects[lightIndex]->light.ns);
 	}
 	return result;
 }
@@ -318,9 +440,285 @@ double clamp(double num) {
 	return num;
 }
 
+// the light layers use clamp() above
+#include "layers.c"
 
-// use 0 represents not inside the sphere, and 1 represents inside the sphere
-double* recursiveShoot(int objectNum, double* Rd, double* Ro, Object** objects, int recursiveDepth, int insideSphere) {
+// occluderBlocks() returns 1 if the primitive w is between Ron and the light
+static inline int occluderBlocks(int w, double* Ron, double* Rdn, double lightDistance) {
+	double t;
+	if (isSpherePrimitive(scene, w)) {
+		double buffer[4];
+		double* sphere = primitiveSphere(scene, w, buffer);
+		t = sphereIntersection(Ron, Rdn, sphere, sphere[3]);
+	}
+	else if (w >= triangleBase(scene)) {
+		t = triangleIntersection(scene, w, Ron, Rdn);
+	}
+	else {
+		double* plane = &scene->planes[(w - scene->sphereCount) * 6];
+		t = planeIntersection(Ron, Rdn, plane, &plane[3]);
+	}
+	return t > 0 && t < lightDistance;
+}
+
+// shadowed() returns 1 if any primitive other than the one we hit (intersection) is between
+// Ron and light n of the light table, Rdn is the unit vector from Ron towards the light.
+// The last occluder of the light is tested first, then the candidates from the occluder
+// grid or every primitive when there is no grid
+int shadowed(int intersection, int n, double* Ron, double* Rdn, double lightDistance) {
+	int w, k;
+	stats.shadowRays += 1;
+	if (tileDeps != NULL) {
+		recordSegment(Ron, Rdn, lightDistance);
+	}
+	int* cached = cachedOccluder(n, lightGrid->count);
+	if (*cached >= 0 && *cached != intersection && occluderBlocks(*cached, Ron, Rdn, lightDistance)) {
+		stats.occluderCacheHits += 1;
+		stats.shadowedRays += 1;
+		return 1;
+	}
+	if (instances != NULL) {
+		w = instanceOccluded(instances, Ron, Rdn, lightDistance, intersection);
+		if (w >= 0) {
+			*cached = w;
+			stats.shadowedRays += 1;
+			return 1;
+		}
+	}
+	if (scene->meshCount > 0) {
+		w = meshOccluded(scene, Ron, Rdn, lightDistance, intersection);
+		if (w >= 0) {
+			*cached = w;
+			stats.shadowedRays += 1;
+			return 1;
+		}
+	}
+	// the cells of the grid are seen from the center of the light, the rays to an area light
+	// leave it elsewhere
+	if (occluderGrid != NULL && lightGrid->shapeRadius[n] == 0) {
+		// the cell is looked up with the direction from the light to the point
+		double d[3] = { -Rdn[0], -Rdn[1], -Rdn[2] };
+		int count;
+		int* list = occluderCandidates(occluderGrid, n, d, &count);
+		for (k = 0; k < count + occluderGrid->planeCount; k++) {
+			w = k < count ? list[k] : occluderGrid->planes[k - count];
+			if (w != intersection && w != *cached && occluderBlocks(w, Ron, Rdn, lightDistance)) {
+				*cached = w;
+				stats.shadowedRays += 1;
+				return 1;
+			}
+		}
+		return 0;
+	}
+	w = 0;
+	if (bvh != NULL) {
+		int skip = intersection < scene->sphereCount ? intersection : -1;
+		w = options.bvh == 1 ? binaryOccluded(bvh, scene->spheres, Ron, Rdn, lightDistance, skip) : wideOccluded(bvh, scene->spheres, Ron, Rdn, lightDistance, skip);
+		if (w >= 0) {
+			*cached = w;
+			stats.shadowedRays += 1;
+			return 1;
+		}
+		// only the planes are left
+		w = scene->sphereCount;
+	}
+	for (; w < scene->sphereCount + scene->planeCount; w++) {
+		if (w != intersection && w != *cached && occluderBlocks(w, Ron, Rdn, lightDistance)) {
+			*cached = w;
+			stats.shadowedRays += 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// the soft shadows of area lights use shadowed() above
+#include "areaLights.c"
+
+// directLight() adds the diffuse and specular light of light n of the light table at the point
+// Ron with the material to color, scaled by weight. Nothing is added if the point is in the
+// shadow of the light, and only the share the point sees of an area light
+void directLight(int intersection, Material* material, int n, double* N, double* V, double* Ron, Object** objects, double* color, double weight) {
+	int z = lightGrid->index[n];
+	if (tileDeps != NULL) {
+		recordLight(n);
+	}
+	double L[3];
+	double R[3];
+	double Rdn[3]; // Rdn = light position - Ron;
+	Rdn[0] = objects[z]->light.position[0] - Ron[0];
+	Rdn[1] = objects[z]->light.position[1] - Ron[1];
+	Rdn[2] = objects[z]->light.position[2] - Ron[2];
+	double lightDistance = sqrt(sqr(Rdn[0]) + sqr(Rdn[1]) + sqr(Rdn[2]));
+	normalize(Rdn);
+	// shading part
+	// the shading cache only knows whether a light is blocked, not how much of it
+	int area = lightGrid->shapeRadius[n] > 0;
+	int blocked = shadeCache != NULL && !area ? lookupShadeCache(shadeCache, z) : -1;
+	if (blocked >= 0) {
+		// the shadow ray of the cache still counts for the tiles of -incremental
+		if (tileDeps != NULL) {
+			recordSegment(Ron, Rdn, lightDistance);
+		}
+	}
+	else if (area) {
+		double visible = areaVisibility(intersection, n, objects[z], Ron);
+		blocked = visible == 0;
+		weight *= visible;
+	}
+	else if (shadeCache != NULL) {
+		// some of the traced rays are timed, clock_gettime() is not free
+		int timed = shadeCache->tracedRays++ % SHADE_CACHE_TIMING == 0;
+		struct timespec start, end;
+		if (timed) clock_gettime(CLOCK_MONOTONIC, &start);
+		blocked = shadowed(intersection, n, Ron, Rdn, lightDistance);
+		if (timed) {
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			shadeCache->timedRays += 1;
+			shadeCache->timedSeconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+		}
+		storeShadeCache(shadeCache, z, blocked ? *cachedOccluder(n, lightGrid->count) : -1);
+	}
+	else {
+		blocked = shadowed(intersection, n, Ron, Rdn, lightDistance);
+	}
+	if (blocked) {
+		return;
+	}
+	L[0] = Rdn[0];
+	L[1] = Rdn[1];
+	L[2] = Rdn[2];
+	normalize(L);
+	// R= L-(2N*L)N
+	// dot product for N*L
+	double NL = N[0] * L[0] + N[1] * L[1] + N[2] * L[2];
+	R[0] = -2 * NL*N[0] + L[0];
+	R[1] = -2 * NL*N[1] + L[1];
+	R[2] = -2 * NL*N[2] + L[2];
+	double* diff;
+	double* spec;
+	double fr, fa;
+	fr = frad(z, Ron, objects);
+	fa = fang(z, Ron, objects);
+	diff = diffuse(material, z, N, L, objects);
+	spec = specular(material, z, NL, V, R, objects);
+	color[0] += weight*fr*fa*(diff[0] + spec[0]);
+	color[1] += weight*fr*fa*(diff[1] + spec[1]);
+	color[2] += weight*fr*fa*(diff[2] + spec[2]);
+	free(diff);
+	free(spec);
+	if (lightLayers != NULL) {
+		// the same terms for a light of color 1
+		double VR = V[0] * R[0] + V[1] * R[1] + V[2] * R[2];
+		double unitDiffuse[3], unitSpecular[3];
+		int a;
+		for (a = 0; a < 3; a++) {
+			unitDiffuse[a] = NL > 0 ? weight*fr*fa*material->diffuseColor[a] * NL : 0;
+			unitSpecular[a] = NL > 0 && VR > 0 ? weight*fr*fa*material->specularColor[a] * pow(VR, objects[z]->light.ns) : 0;
+		}
+		addLayerLight(n, unitDiffuse, unitSpecular);
+	}
+}
+
+double* recursiveShoot(double* Rd, double* Ro, Object** objects, int recursiveDepth, int insideSphere);
+
+// surfaceNormal() sets N to the unit normal of the primitive intersection at the point Ron,
+// a triangle has two sides and gets the normal that faces the ray direction Rd
+void surfaceNormal(int intersection, double* Ron, double* Rd, double* N) {
+	if (isSpherePrimitive(scene, intersection)) {
+		double buffer[4];
+		double* sphere = primitiveSphere(scene, intersection, buffer);
+		N[0] = Ron[0] - sphere[0];
+		N[1] = Ron[1] - sphere[1];
+		N[2] = Ron[2] - sphere[2];
+	}
+	else if (intersection >= triangleBase(scene)) {
+		triangleNormal(scene, intersection, N);
+		if (N[0] * Rd[0] + N[1] * Rd[1] + N[2] * Rd[2] > 0) {
+			N[0] = -N[0];
+			N[1] = -N[1];
+			N[2] = -N[2];
+		}
+	}
+	else {
+		double* plane = &scene->planes[(intersection - scene->sphereCount) * 6];
+		N[0] = plane[3];
+		N[1] = plane[4];
+		N[2] = plane[5];
+	}
+	normalize(N);
+}
+
+// refractionDirection() sets newRd to the direction of the ray Rd refracted at the unit normal
+// N, ior is the ratio of the indices of refraction. It returns 0 for a total internal reflection
+int refractionDirection(double* Rd, double* N, double ior, double* newRd) {
+	double a[3];
+	double b[3];
+	double sinPhi, cosPhi;
+	// n x ur = {ny*urz-nz*ury, nz*urx-nx*urz, nx*ury-ny*urx}
+	a[0] = N[1] * Rd[2] - N[2] * Rd[1];
+	a[1] = N[2] * Rd[0] - N[0] * Rd[2];
+	a[2] = N[0] * Rd[1] - N[1] * Rd[0];
+	normalize(a);
+	// b = a x n
+	b[0] = a[1] * N[2] - a[2] * N[1];
+	b[1] = a[2] * N[0] - a[0] * N[2];
+	b[2] = a[0] * N[1] - a[1] * N[0];
+	sinPhi = ior*(Rd[0] * b[0] + Rd[1] * b[1] + Rd[2] * b[2]);
+	cosPhi = sqrt(1 - sqr(sinPhi));
+	// ut = -ncosPhi + bsinPhi
+	newRd[0] = -N[0] * cosPhi + b[0] * sinPhi;
+	newRd[1] = -N[1] * cosPhi + b[1] * sinPhi;
+	newRd[2] = -N[2] * cosPhi + b[2] * sinPhi;
+	return sqr(sinPhi) <= 1;
+}
+
+// the caustics follow photons with intersect(), surfaceNormal() and refractionDirection() above
+#include "photonMap.c"
+
+// shadeLights() adds the direct light at the point Ron of the primitive intersection with the
+// material to color: every light that reaches the point, or options.lightBudget lights sampled
+// from the light tree, and the caustics of the photon map
+void shadeLights(int intersection, Material* material, double* N, double* V, double* Ron, Object** objects, double* color) {
+	int k;
+	if (lightTree != NULL) {
+		// many-light mode, a fixed number of lights is picked from the light tree
+		for (k = 0; k < options.lightBudget; k++) {
+			double pdf;
+			int n = sampleLightTree(lightTree, lightGrid, Ron, N, &pdf);
+			if (n < 0) {
+				continue;
+			}
+			stats.lightsConsidered += 1;
+			directLight(intersection, material, n, N, V, Ron, objects, color, 1 / (pdf * options.lightBudget));
+		}
+	}
+	else {
+		// only the lights whose influence radius covers this point are shaded, the global
+		// lights come first and then the lights stored in the grid cell of the point
+		int cellCount;
+		int* cell = lightGridCell(lightGrid, Ron, &cellCount);
+		for (k = 0; k < lightGrid->globalCount + cellCount; k++) {
+			int n = k < lightGrid->globalCount ? lightGrid->global[k] : cell[k - lightGrid->globalCount];
+			if (!lightReaches(lightGrid, n, Ron)) {
+				continue;
+			}
+			stats.lightsConsidered += 1;
+			directLight(intersection, material, n, N, V, Ron, objects, color, 1);
+		}
+	}
+	if (photonMap != NULL) {
+		causticLight(photonMap, material, Ron, N, color);
+	}
+}
+
+// -supersample shares the lights of shadeLights() between the rays of a pixel
+#include "supersample.c"
+
+// shadeSurface() returns the color of the primitive intersection at the point Ron with the
+// unit normal N, seen along the ray direction Rd: the light of every light that reaches the
+// point plus the colors of the reflection and refraction rays
+double* shadeSurface(double* Rd, double* Ron, double* N, Object** objects, int recursiveDepth, int insideSphere, int intersection) {
 	double* color;
 	color = malloc(sizeof(double) * 3);
 	color[0] = 0;
@@ -329,216 +727,148 @@ double* recursiveShoot(int objectNum, double* Rd, double* Ro, Object** objects,
 	double reflectivity;
 	double refractivity;
 	double ior;
-	if (recursiveDepth > 7) {
-		return color;
-	}
-	double* inter;
-	inter = malloc(sizeof(double) * 2);
-
-	inter = intersect(Ro, Rd, objectNum, objects);
-	int intersection = (int)inter[0];
-	double bestT = inter[1];
-	int hasShadow = 0;
-	if (intersection >= 0) {
-		double Ron[3];
-		double N[3];
-		double V[3];
-		V[0] = Rd[0];
-		V[1] = Rd[1];
-		V[2] = Rd[2];
-		Ron[0] = bestT*Rd[0] + Ro[0];
-		Ron[1] = bestT*Rd[1] + Ro[1];
-		Ron[2] = bestT*Rd[2] + Ro[2];
-		if (objects[intersection]->kind == 1) {
-			N[0] = Ron[0] - objects[intersection]->sphere.position[0];
-			N[1] = Ron[1] - objects[intersection]->sphere.position[1];
-			N[2] = Ron[2] - objects[intersection]->sphere.position[2];
-			reflectivity = objects[intersection]->sphere.reflectivity;
-			refractivity = objects[intersection]->sphere.refractivity;
-			ior = objects[intersection]->sphere.ior;
-		}
-		else if (objects[intersection]->kind == 2) {
-			N[0] = objects[intersection]->plane.normal[0];
-			N[1] = objects[intersection]->plane.normal[1];
-			N[2] = objects[intersection]->plane.normal[2];
-			reflectivity = objects[intersection]->plane.reflectivity;
-			refractivity = objects[intersection]->plane.refractivity;
-			ior = objects[intersection]->plane.ior;
-		}
-		normalize(N);
-		double intersectPosition[3];
-		intersectPosition[0] = Ron[0];
-		intersectPosition[1] = Ron[1];
-		intersectPosition[2] = Ron[2];
-		double L[3];
-		double R[3];
-		double Rdn[3]; // Rdn = light position - Ron;
-		int z;
-		for (z = 0; objects[z] != 0; z++) {
-			if (objects[z]->kind == 3) {
-				Rdn[0] = objects[z]->light.position[0] - Ron[0];
-				Rdn[1] = objects[z]->light.position[1] - Ron[1];
-				Rdn[2] = objects[z]->light.position[2] - Ron[2];
-				double t;
-				double lightDistance = sqrt(sqr(Rdn[0]) + sqr(Rdn[1]) + sqr(Rdn[2]));
-				t = lightDistance;
-				normalize(Rdn);
-				int w;
-				// shading part
-				for (w = 0; objects[w] != 0; w++) {
-					if (w != intersection) {
-						if (objects[w]->kind == 1) {
-							t = sphereIntersection(Ron, Rdn, objects[w]->sphere.position, objects[w]->sphere.radius);
-							if (t > 0 && t < lightDistance) {
-								hasShadow = 1;
-							}
-						}
-						else if (objects[w]->kind == 2) {
-							t = planeIntersection(Ron, Rdn, objects[w]->plane.position, objects[w]->plane.normal);
-							if (t > 0 && t < lightDistance) {
-								hasShadow = 1;
-							}
-						}
-					}
-				}
-				if (hasShadow == 0) {
-					L[0] = Rdn[0];
-					L[1] = Rdn[1];
-					L[2] = Rdn[2];
-					normalize(L);
-					// R= L-(2N*L)N
-					// dot product for N*L
-					double NL = N[0] * L[0] + N[1] * L[1] + N[2] * L[2];
-					R[0] = -2 * NL*N[0] + L[0];
-					R[1] = -2 * NL*N[1] + L[1];
-					R[2] = -2 * NL*N[2] + L[2];
-					double* diff;
-					double* spec;
-					diff = malloc(sizeof(double) * 3);
-					spec = malloc(sizeof(double) * 3);
-					double fr, fa;
-					fr = frad(z, intersectPosition, objects);
-					fa = fang(z, intersectPosition, objects);
-					diff = diffuse(intersection, z, N, L, objects);
-					spec = specular(intersection, z, NL, V, R, objects);
-					color[0] += fr*fa*(diff[0] + spec[0]);
-					color[1] += fr*fa*(diff[1] + spec[1]);
-					color[2] += fr*fa*(diff[2] + spec[2]);
-
-					double newRo[3];
-					newRo[0] = Ron[0];
-					newRo[1] = Ron[1];
-					newRo[2] = Ron[2];
-					double newRd[3];
-					double* reflectionColor;
-					double* refractionColor;
-					reflectionColor = malloc(sizeof(double) * 3);
-					refractionColor = malloc(sizeof(double) * 3);
-					reflectionColor[0] = 0;
-					reflectionColor[1] = 0;
-					reflectionColor[2] = 0;
-					refractionColor[0] = 0;
-					refractionColor[1] = 0;
-					refractionColor[2] = 0;
-					if (reflectivity > 0) {
-						if (reflectivity > 1){
-							reflectivity = 1;
-						}
-						// reflection part
-						double NRd = N[0]*Rd[0]+N[1]*Rd[1]+N[2]*Rd[2];
-						newRd[0] = Rd[0]-2*NRd*N[0];
-						newRd[1] = Rd[1]-2*NRd*N[1];
-						newRd[2] = Rd[2]-2*NRd*N[2];
-						// avoid intersecting with the same object again
-						double offset[3] = { 0, 0, 0 };
-						offset[0] = newRd[0] * 0.0001;
-						offset[1] = newRd[1] * 0.0001;
-						offset[2] = newRd[2] * 0.0001;
-						newRo[0] = newRo[0] + offset[0];
-						newRo[1] = newRo[1] + offset[1];
-						newRo[2] = newRo[2] + offset[2];
-						normalize(newRd);
-						reflectionColor = recursiveShoot(objectNum, newRd, newRo, objects, recursiveDepth + 1, insideSphere);
-					}
-					if (refractivity > 0) {
-						if (refractivity > 1){
-							refractivity = 1;
-						}
-						if (ior <= 0){
-							fprintf(stderr, "Error: invalid value of ior\n");
-						}
-						if (insideSphere == 1) {
-							ior = 1 / ior;
-						}
-						if (objects[intersection]->kind == 1 && insideSphere == 0) {
-							insideSphere = 1;
-						}
-						else if (objects[intersection]->kind == 1 && insideSphere == 1) {
-							insideSphere = 0;
-						}
-						// refraction part
-						double a[3];
-						double b[3];
-						double sinPhi, cosPhi;
-						// n x ur = {ny*urz-nz*ury, nz*urx-nx*urz, nx*ury-ny*urx}
-						a[0] = N[1] * Rd[2] - N[2] * Rd[1];
-						a[1] = N[2] * Rd[0] - N[0] * Rd[2];
-						a[2] = N[0] * Rd[1] - N[1] * Rd[0];
-						normalize(a);
-						// b = a x n
-						b[0] = a[1] * N[2] - a[2] * N[1];
-						b[1] = a[2] * N[0] - a[0] * N[2];
-						b[2] = a[0] * N[1] - a[1] * N[0];
-						sinPhi = ior*(Rd[0] * b[0] + Rd[1] * b[1] + Rd[2] * b[2]);
-						cosPhi = sqrt(1 - sqr(sinPhi));
-						// ut = -ncosPhi + bsinPhi
-						newRd[0] = -N[0] * cosPhi + b[0] * sinPhi;
-						newRd[1] = -N[1] * cosPhi + b[1] * sinPhi;
-						newRd[2] = -N[2] * cosPhi + b[2] * sinPhi;
-						// avoid intersecting with the same object again
-						double offset[3] = { 0, 0, 0 };
-						offset[0] = newRd[0] * 0.0001;
-						offset[1] = newRd[1] * 0.0001;
-						offset[2] = newRd[2] * 0.0001;
-						newRo[0] = newRo[0] + offset[0];
-						newRo[1] = newRo[1] + offset[1];
-						newRo[2] = newRo[2] + offset[2];
-						normalize(newRd);
-						refractionColor = recursiveShoot(objectNum, newRd, newRo, objects, recursiveDepth + 1, insideSphere);
-					}
-					if (reflectivity < 0){
-						reflectivity = 0;
-					}
-					if (refractivity <0){
-						refractivity = 0;
-					}
-					color[0] = (1 - reflectivity - refractivity)*color[0] + refractionColor[0] * refractivity + reflectionColor[0] * reflectivity;
-					color[1] = (1 - reflectivity - refractivity)*color[1] + refractionColor[1] * refractivity + reflectionColor[1] * reflectivity;
-					color[2] = (1 - reflectivity - refractivity)*color[2] + refractionColor[2] * refractivity + reflectionColor[2] * reflectivity;
-				}
-			}
+	double V[3];
+	V[0] = Rd[0];
+	V[1] = Rd[1];
+	V[2] = Rd[2];
+	int isSphere = isSpherePrimitive(scene, intersection);
+	Material textured;
+	Material* material = textureMaterial(intersection, Ron, N, Rd, &textured);
+	reflectivity = material->reflectivity;
+	refractivity = material->refractivity;
+	ior = material->ior;
+
+	stats.shadingPoints += 1;
+	// for -layers, the lights of this point only keep the share of the color that is not
+	// reflected or refracted, the share of the other rays is passed on to them
+	double pathWeight = layerWeight;
+	double kept = 1 - (reflectivity < 0 ? 0 : (reflectivity > 1 ? 1 : reflectivity)) - (refractivity < 0 ? 0 : (refractivity > 1 ? 1 : refractivity));
+	layerWeight = pathWeight * kept;
+	if (shadeCache != NULL) {
+		beginShadeCachePoint(shadeCache, intersection, Ron, N, objects);
+	}
+	if (sampleCache != NULL && recursiveDepth == 0) {
+		sampleLights(sampleCache, intersection, material, N, V, Ron, objects, color);
+	}
+	else {
+		shadeLights(intersection, material, N, V, Ron, objects, color);
+	}
+
+	double newRo[3];
+	newRo[0] = Ron[0];
+	newRo[1] = Ron[1];
+	newRo[2] = Ron[2];
+	double newRd[3];
+	double* reflectionColor = NULL;
+	double* refractionColor = NULL;
+	double zero[3] = { 0, 0, 0 };
+	if (reflectivity > 0) {
+		if (reflectivity > 1){
+			reflectivity = 1;
+		}
+		// reflection part
+		double NRd = N[0]*Rd[0]+N[1]*Rd[1]+N[2]*Rd[2];
+		newRd[0] = Rd[0]-2*NRd*N[0];
+		newRd[1] = Rd[1]-2*NRd*N[1];
+		newRd[2] = Rd[2]-2*NRd*N[2];
+		// avoid intersecting with the same object again
+		double offset[3] = { 0, 0, 0 };
+		offset[0] = newRd[0] * 0.0001;
+		offset[1] = newRd[1] * 0.0001;
+		offset[2] = newRd[2] * 0.0001;
+		newRo[0] = newRo[0] + offset[0];
+		newRo[1] = newRo[1] + offset[1];
+		newRo[2] = newRo[2] + offset[2];
+		normalize(newRd);
+		layerWeight = pathWeight * reflectivity;
+		reflectionColor = recursiveShoot(newRd, newRo, objects, recursiveDepth + 1, insideSphere);
+	}
+	if (refractivity > 0) {
+		if (refractivity > 1){
+			refractivity = 1;
+		}
+		if (ior <= 0){
+			fprintf(stderr, "Error: invalid value of ior\n");
+		}
+		if (insideSphere == 1) {
+			ior = 1 / ior;
+		}
+		if (isSphere && insideSphere == 0) {
+			insideSphere = 1;
 		}
+		else if (isSphere && insideSphere == 1) {
+			insideSphere = 0;
+		}
+		// refraction part
+		refractionDirection(Rd, N, ior, newRd);
+		// avoid intersecting with the same object again
+		double offset[3] = { 0, 0, 0 };
+		offset[0] = newRd[0] * 0.0001;
+		offset[1] = newRd[1] * 0.0001;
+		offset[2] = newRd[2] * 0.0001;
+		newRo[0] = newRo[0] + offset[0];
+		newRo[1] = newRo[1] + offset[1];
+		newRo[2] = newRo[2] + offset[2];
+		normalize(newRd);
+		layerWeight = pathWeight * refractivity;
+		refractionColor = recursiveShoot(newRd, newRo, objects, recursiveDepth + 1, insideSphere);
+	}
+	if (reflectivity < 0){
+		reflectivity = 0;
+	}
+	if (refractivity <0){
+		refractivity = 0;
 	}
+	double* reflected = reflectionColor != NULL ? reflectionColor : zero;
+	double* refracted = refractionColor != NULL ? refractionColor : zero;
+	color[0] = (1 - reflectivity - refractivity)*color[0] + refracted[0] * refractivity + reflected[0] * reflectivity;
+	color[1] = (1 - reflectivity - refractivity)*color[1] + refracted[1] * refractivity + reflected[1] * reflectivity;
+	color[2] = (1 - reflectivity - refractivity)*color[2] + refracted[2] * refractivity + reflected[2] * reflectivity;
+	free(reflectionColor);
+	free(refractionColor);
+	layerWeight = pathWeight;
 	return color;
 }
 
-// raycasting function
-PPMimage* rayCasting(char* filename, int w, int h, Object** objects) {
-	PPMimage* buffer = (PPMimage*)malloc(sizeof(PPMimage));
+// shadeHit() returns the color of the ray Ro + t*Rd which hits the primitive intersection at
+// t = bestT, intersection is -1 when the ray does not hit anything
+double* shadeHit(double* Rd, double* Ro, Object** objects, int recursiveDepth, int insideSphere, int intersection, double bestT) {
+	if (intersection < 0) {
+		return calloc(3, sizeof(double));
+	}
+	double Ron[3];
+	double N[3];
+	Ron[0] = bestT*Rd[0] + Ro[0];
+	Ron[1] = bestT*Rd[1] + Ro[1];
+	Ron[2] = bestT*Rd[2] + Ro[2];
+	surfaceNormal(intersection, Ron, Rd, N);
+	return shadeSurface(Rd, Ron, N, objects, recursiveDepth, insideSphere, intersection);
+}
+
+// use 0 represents not inside the sphere, and 1 represents inside the sphere
+double* recursiveShoot(double* Rd, double* Ro, Object** objects, int recursiveDepth, int insideSphere) {
+	if (recursiveDepth > 7) {
+		return calloc(3, sizeof(double));
+	}
+	double bestT;
+	int intersection = intersect(Ro, Rd, &bestT);
+	return shadeHit(Rd, Ro, objects, recursiveDepth, insideSphere, intersection, bestT);
+}
+
+// cameraSize() sets width and height to the size of the view of the camera
+void cameraSize(Object** objects, double* width, double* height) {
 	if (objects[0] == NULL) {
 		fprintf(stderr, "Error: no object found");
 		exit(1);
 	}
 	int cameraFound = 0;
-	double width;
-	double height;
 	int i;
 	for (i = 0; objects[i] != 0; i += 1) {
 		if (objects[i]->kind == 0) {
 			cameraFound = 1;
-			width = objects[i]->camera.width;
-			height = objects[i]->camera.height;
-			if (width <= 0 || height <= 0) {
+			*width = objects[i]->camera.width;
+			*height = objects[i]->camera.height;
+			if (*width <= 0 || *height <= 0) {
 				fprintf(stderr, "Error: invalid size for camera");
 				exit(1);
 			}
@@ -548,48 +878,683 @@ PPMimage* rayCasting(char* filename, int w, int h, Object** objects) {
 		fprintf(stderr, "Error: Camera is not found");
 		exit(1);
 	}
+}
 
-	buffer->data = (unsigned char*)malloc(w*h * sizeof(PPMRGBpixel));
-	PPMRGBpixel *pixel = (PPMRGBpixel*)malloc(sizeof(PPMRGBpixel));
-	if (buffer->data == NULL || buffer == NULL) {
-		fprintf(stderr, "Error: allocate the memory un successfully. \n");
-		exit(1);
+// prepareLights() builds the light table, the light tree and the occluder grid of the frame
+void prepareLights(Object** objects) {
+	// the light slots can change from one frame to the next
+	free(occluderCache);
+	occluderCache = NULL;
+	freeLightGrid(lightGrid);
+	lightGrid = buildLightGrid(objects, options.cutoff);
+	// sampling only pays off when there are more lights than the budget
+	freeLightTree(lightTree);
+	lightTree = NULL;
+	if (options.lightBudget > 0 && options.lightBudget < lightGrid->count) {
+		lightTree = buildLightTree(objects, lightGrid);
+	}
+	freeOccluderGrid(occluderGrid);
+	occluderGrid = NULL;
+	if (options.occluderGrid > 0) {
+		occluderGrid = buildOccluderGrid(scene, lightGrid, options.occluderGrid);
+	}
+}
+
+// prepareFrame() sets up what rendering and relighting an image w pixels wide have in common:
+// the angle of a pixel that picks the texture levels, the lights and the photons of -caustics
+void prepareFrame(Object** objects, int w) {
+	double width, height;
+	cameraSize(objects, &width, &height);
+	pixelAngle = width / w;
+	prepareLights(objects);
+	if (options.caustics > 0) {
+		freePhotonMap(photonMap);
+		photonMap = buildPhotonMap(objects, options.caustics);
+	}
+}
+
+// the modules below use the intersection and shading functions above
+#include "visibility.c"
+#include "gbuffer.c"
+#include "denoise.c"
+#include "pathTracer.c"
+#include "variableRate.c"
+
+// raycasting function
+PPMimage* rayCasting(char* filename, int w, int h, Object** objects) {
+	PPMimage* buffer = newImage(w, h);
+	double width;
+	double height;
+	cameraSize(objects, &width, &height);
+
+	PPMRGBpixel pixelColor;
+	PPMRGBpixel *pixel = &pixelColor;
+
+	prepareFrame(objects, w);
+	if (options.layersFile != NULL) {
+		freeLightLayers(lightLayers);
+		lightLayers = buildLightLayers(objects, w, h);
+	}
+	if (tileDeps != NULL) {
+		beginTiles(tileDeps, scene, instances, w, h);
+	}
+	if (reprojection != NULL) {
+		beginReprojection(reprojection, w, h, width, height);
+	}
+	// with -aov or -denoise the depth, normal, albedo and primitive of every pixel are kept
+	if (options.aovPrefix != NULL || options.denoise > 0) {
+		freeAovs(aovs);
+		aovs = newAovs(w, h);
+	}
+	// with -gbuffer the primary hits are kept for -relight
+	if (options.gbufferFile != NULL) {
+		freeGBuffer(gbuffer);
+		gbuffer = newGBuffer(w, h);
 	}
 
-	double pixwidth = width / w;
-	double pixheight = height / h;
-	double pointx, pointy, pointz;
-	int j, k;
+	// with -raster the primary hits come from the visibility buffer
+	VisibilityBuffer* vis = NULL;
+	if (options.raster) {
+		vis = rasterizeVisibility(scene, w, h, width, height);
+	}
+
+	int j, k, j0, k0;
 	double Ro[3] = { 0, 0, 0 };
-	for (k = 0; k<h; k++) {
-		int count = (h - k - 1)*w * 3;
-		double vy = -height / 2 + pixheight * (k + 0.5);
-		for (j = 0; j<w; j++) {
-			double vx = -width / 2 + pixwidth * (j + 0.5);
-			double Rd[3] = { vx, vy, 1 };
-
-			normalize(Rd);
+	if (options.pathSamples > 0) {
+		pathTrace(buffer->hdr, w, h, width, height, objects);
+	}
+	else if (options.variableRate > 1) {
+		variableRate(buffer->hdr, w, h, width, height, objects);
+	}
+	if (options.supersample > 1) {
+		if (sampleCache == NULL) {
+			sampleCache = newSampleCache();
+		}
+		sampleCache->samples = 0;
+		sampleCache->shaded = 0;
+	}
+	// the rows go by in bands of TILE_SIZE, and with -supersample every band in tiles, so the
+	// sample cache only holds one tile. Without it a band is one tile and the rows go in order
+	int blockWidth = options.supersample > 1 ? TILE_SIZE : w;
+	for (k0 = 0; k0 < h && options.pathSamples == 0 && options.variableRate <= 1; k0 += TILE_SIZE)
+	for (j0 = 0; j0 < w; j0 += blockWidth) {
+		if (sampleCache != NULL) {
+			beginSampleTile(sampleCache);
+		}
+	for (k = k0; k < k0 + TILE_SIZE && k < h; k++) {
+		int count = ((h - k - 1)*w + j0) * 3;
+		for (j = j0; j < j0 + blockWidth && j < w; j++) {
+			if (tileDeps != NULL) {
+				// a tile that nothing changed for keeps its pixels of the last frame
+				tileCurrent = (k / TILE_SIZE) * tileDeps->tilesX + j / TILE_SIZE;
+				if (!tileDeps->dirty[tileCurrent]) {
+					memcpy(&buffer->hdr[count], &tileDeps->previous[count], sizeof(float) * 3);
+					count += 3;
+					continue;
+				}
+			}
+			double Rd[3];
+			pixelDirection(width, height, w, h, j, k, Rd);
+			if (sampleCache != NULL) {
+				double color[3];
+				supersamplePixel(width, height, w, h, j, k, objects, color);
+				buffer->hdr[count++] = (float)color[0];
+				buffer->hdr[count++] = (float)color[1];
+				buffer->hdr[count++] = (float)color[2];
+				if (aovs != NULL) {
+					// the guides of the filter come from the ray through the center
+					double depth;
+					int id = intersect(Ro, Rd, &depth);
+					storeAovs(aovs, (h - k - 1) * w + j, id, Rd, depth, color);
+				}
+				continue;
+			}
 			pixel->r = 0;
 			pixel->g = 0;
 			pixel->b = 0;
 			int recursiveDepth = 0;
 			int insideSphere = 0;
-			double* color = recursiveShoot(i, Rd, Ro, objects, recursiveDepth, insideSphere);
+			seedRandom((unsigned long long)k * w + j);
+			layerPixel = k * w + j;
+			layerWeight = 1;
+			double* color;
+			int id;
+			double depth;
+			if (vis != NULL) {
+				id = vis->id[k * w + j];
+				depth = vis->depth[k * w + j];
+				// the instances and meshes are not drawn into the buffer, their hits are still traced
+				if (instances != NULL) {
+					int hit = instanceIntersect(instances, Ro, Rd, &depth);
+					if (hit >= 0) {
+						id = hit;
+					}
+				}
+				if (scene->meshCount > 0) {
+					int hit = meshIntersect(scene, Ro, Rd, &depth);
+					if (hit >= 0) {
+						id = hit;
+					}
+				}
+				if (tileDeps != NULL) {
+					recordSegment(Ro, Rd, depth);
+				}
+			}
+			else {
+				stats.primaryRays += 1;
+				id = intersect(Ro, Rd, &depth);
+			}
+			if (gbuffer != NULL) {
+				storeGBuffer(gbuffer, k * w + j, id, Ro, Rd, depth);
+			}
+			if (reprojection != NULL && reprojectPixel(reprojection, j, k, id, Rd, depth, objects, &buffer->hdr[count])) {
+				count += 3;
+				continue;
+			}
+			if (vis != NULL && id < 0) {
+				// nothing to shade for the background
+				stats.backgroundPixels += 1;
+				if (aovs != NULL) {
+					storeAovs(aovs, (h - k - 1) * w + j, id, Rd, depth, NULL);
+				}
+				buffer->hdr[count++] = 0;
+				buffer->hdr[count++] = 0;
+				buffer->hdr[count++] = 0;
+				continue;
+			}
+			color = shadeHit(Rd, Ro, objects, recursiveDepth, insideSphere, id, depth);
 			pixel->r = color[0];
 			pixel->g = color[1];
 			pixel->b = color[2];
-			buffer->data[count++] = (unsigned char)255 * clamp(pixel->r);
-			buffer->data[count++] = (unsigned char)255 * clamp(pixel->g);
-			buffer->data[count++] = (unsigned char)255 * clamp(pixel->b);
+			buffer->hdr[count++] = (float)pixel->r;
+			buffer->hdr[count++] = (float)pixel->g;
+			buffer->hdr[count++] = (float)pixel->b;
+			if (aovs != NULL) {
+				storeAovs(aovs, (h - k - 1) * w + j, id, Rd, depth, color);
+			}
+			free(color);
+			if (reprojection != NULL) {
+				keepSample(reprojection, j, k, id, Rd, depth, &buffer->hdr[count - 3]);
+			}
 		}
 	}
+	}
+	if (tileDeps != NULL) {
+		endTiles(tileDeps, buffer->hdr);
+	}
+	if (reprojection != NULL) {
+		endReprojection(reprojection);
+	}
+	if (options.denoise > 0) {
+		size_t size = (size_t)w * h, i;
+		float* denoised = malloc(sizeof(float) * 3 * size);
+		if (denoised == NULL) {
+			fprintf(stderr, "Error: allocate the memory un successfully. \n");
+			exit(1);
+		}
+		denoise(aovs, options.denoise, denoised);
+		for (i = 0; i < size; i++) {
+			buffer->hdr[i * 3] = denoised[i];
+			buffer->hdr[i * 3 + 1] = denoised[size + i];
+			buffer->hdr[i * 3 + 2] = denoised[2 * size + i];
+		}
+		free(denoised);
+	}
+	if (vis != NULL) {
+		free(vis->id);
+		free(vis->depth);
+		free(vis);
+	}
 	return buffer;
 }
 
 
+// parseOptions() reads the optional flags which come after the output file name
+void parseOptions(int argc, char **argv) {
+	int i;
+	options.cutoff = 0;
+	options.stats = 0;
+	options.lightBudget = 0;
+	options.occluderGrid = 0;
+	options.raster = 0;
+	options.bvh = 2;
+	options.bvhBench = 0;
+	options.frames = 0;
+	options.sahLimit = 1.5;
+	options.gbufferFile = NULL;
+	options.relightFile = NULL;
+	options.layersFile = NULL;
+	options.recomposeFile = NULL;
+	options.incremental = 0;
+	options.shadeCache = 0;
+	options.reproject = 0;
+	options.aovPrefix = NULL;
+	options.denoise = 0;
+	options.pathSamples = 0;
+	options.pathError = 0.02;
+	options.sampler = 1;
+	options.areaSamples = 64;
+	options.caustics = 0;
+	options.textureCache = 64;
+	options.supersample = 1;
+	options.sampleCell = 1;
+	options.variableRate = 1;
+	options.hdrFile = NULL;
+	options.fromHdrFile = NULL;
+	options.exposure = 0;
+	options.toneCurve = 0;
+	options.srgb = 0;
+	options.dither = 0;
+	options.pngFilter = PNG_FILTER_ADAPTIVE;
+	options.pngChunk = 0;
+	for (i = 5; i < argc; i++) {
+		if (strcmp(argv[i], "-cutoff") == 0 && i + 1 < argc) {
+			options.cutoff = atof(argv[++i]);
+			if (options.cutoff < 0) {
+				fprintf(stderr, "Error: the luminance cutoff cannot be negative!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-lightbudget") == 0 && i + 1 < argc) {
+			options.lightBudget = atoi(argv[++i]);
+			if (options.lightBudget < 0) {
+				fprintf(stderr, "Error: the light budget cannot be negative!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-occludergrid") == 0 && i + 1 < argc) {
+			options.occluderGrid = atoi(argv[++i]);
+			if (options.occluderGrid < 0 || options.occluderGrid > 64) {
+				fprintf(stderr, "Error: the occluder grid size has to be between 0 and 64!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-raster") == 0) {
+			options.raster = 1;
+		}
+		else if (strcmp(argv[i], "-bvh") == 0 && i + 1 < argc) {
+			i += 1;
+			if (strcmp(argv[i], "none") == 0) options.bvh = 0;
+			else if (strcmp(argv[i], "binary") == 0) options.bvh = 1;
+			else if (strcmp(argv[i], "wide") == 0) options.bvh = 2;
+			else {
+				fprintf(stderr, "Error: -bvh has to be none, binary or wide!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-bvhbench") == 0) {
+			options.bvhBench = 1;
+		}
+		else if (strcmp(argv[i], "-frames") == 0 && i + 1 < argc) {
+			options.frames = atoi(argv[++i]);
+			if (options.frames < 0) {
+				fprintf(stderr, "Error: the number of frames cannot be negative!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-sahlimit") == 0 && i + 1 < argc) {
+			options.sahLimit = atof(argv[++i]);
+			if (options.sahLimit < 1) {
+				fprintf(stderr, "Error: the sah limit cannot be below 1!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-gbuffer") == 0 && i + 1 < argc) {
+			options.gbufferFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "-relight") == 0 && i + 1 < argc) {
+			options.relightFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "-layers") == 0 && i + 1 < argc) {
+			options.layersFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "-recompose") == 0 && i + 1 < argc) {
+			options.recomposeFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "-incremental") == 0) {
+			options.incremental = 1;
+		}
+		else if (strcmp(argv[i], "-shadecache") == 0 && i + 1 < argc) {
+			options.shadeCache = atof(argv[++i]);
+			if (options.shadeCache <= 0) {
+				fprintf(stderr, "Error: the shading cache cell size has to be greater than 0!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-reproject") == 0 && i + 1 < argc) {
+			options.reproject = atof(argv[++i]);
+			if (options.reproject <= 0 || options.reproject > 1) {
+				fprintf(stderr, "Error: the refresh fraction of -reproject has to be above 0 and at most 1!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-aov") == 0 && i + 1 < argc) {
+			options.aovPrefix = argv[++i];
+		}
+		else if (strcmp(argv[i], "-denoise") == 0 && i + 1 < argc) {
+			options.denoise = atoi(argv[++i]);
+			if (options.denoise < 1 || options.denoise > 10) {
+				fprintf(stderr, "Error: the number of denoise passes has to be between 1 and 10!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-pathtrace") == 0 && i + 1 < argc) {
+			options.pathSamples = atoi(argv[++i]);
+			if (options.pathSamples < 1) {
+				fprintf(stderr, "Error: the path tracer needs at least 1 sample per pixel!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-patherror") == 0 && i + 1 < argc) {
+			options.pathError = atof(argv[++i]);
+			if (options.pathError < 0) {
+				fprintf(stderr, "Error: the path error cannot be negative!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-sampler") == 0 && i + 1 < argc) {
+			i += 1;
+			if (strcmp(argv[i], "random") == 0) options.sampler = 0;
+			else if (strcmp(argv[i], "sobol") == 0) options.sampler = 1;
+			else {
+				fprintf(stderr, "Error: -sampler has to be random or sobol!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-areasamples") == 0 && i + 1 < argc) {
+			options.areaSamples = atoi(argv[++i]);
+			if (options.areaSamples < 1) {
+				fprintf(stderr, "Error: the area light samples have to be at least 1!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-caustics") == 0 && i + 1 < argc) {
+			options.caustics = atoi(argv[++i]);
+			if (options.caustics < 1) {
+				fprintf(stderr, "Error: the caustics need at least 1 photon!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-texturecache") == 0 && i + 1 < argc) {
+			options.textureCache = atof(argv[++i]);
+			if (options.textureCache <= 0) {
+				fprintf(stderr, "Error: the texture cache needs more than 0 MB!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-supersample") == 0 && i + 1 < argc) {
+			options.supersample = atoi(argv[++i]);
+			if (options.supersample < 1 || options.supersample > 16) {
+				fprintf(stderr, "Error: -supersample has to be between 1 and 16!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-samplecell") == 0 && i + 1 < argc) {
+			options.sampleCell = atof(argv[++i]);
+			if (options.sampleCell < 0) {
+				fprintf(stderr, "Error: the sample cell cannot be negative!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-variablerate") == 0 && i + 1 < argc) {
+			options.variableRate = atoi(argv[++i]);
+			if (options.variableRate != 1 && options.variableRate != 2 && options.variableRate != 4) {
+				fprintf(stderr, "Error: -variablerate has to be 1, 2 or 4!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-hdr") == 0 && i + 1 < argc) {
+			options.hdrFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "-fromhdr") == 0 && i + 1 < argc) {
+			options.fromHdrFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "-exposure") == 0 && i + 1 < argc) {
+			options.exposure = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-tonemap") == 0 && i + 1 < argc) {
+			i += 1;
+			if (strcmp(argv[i], "clamp") == 0) {
+				options.toneCurve = 0;
+			}
+			else if (strcmp(argv[i], "reinhard") == 0) {
+				options.toneCurve = 1;
+			}
+			else if (strcmp(argv[i], "aces") == 0) {
+				options.toneCurve = 2;
+			}
+			else {
+				fprintf(stderr, "Error: -tonemap has to be clamp, reinhard or aces!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-srgb") == 0) {
+			options.srgb = 1;
+		}
+		else if (strcmp(argv[i], "-dither") == 0) {
+			options.dither = 1;
+		}
+		else if (strcmp(argv[i], "-pngfilter") == 0 && i + 1 < argc) {
+			char* names[6] = { "none", "sub", "up", "average", "paeth", "adaptive" };
+			int f;
+			i += 1;
+			for (f = 0; f < 6 && strcmp(argv[i], names[f]) != 0; f++);
+			if (f == 6) {
+				fprintf(stderr, "Error: -pngfilter has to be none, sub, up, average, paeth or adaptive!");
+				exit(1);
+			}
+			options.pngFilter = f;
+		}
+		else if (strcmp(argv[i], "-pngchunk") == 0 && i + 1 < argc) {
+			options.pngChunk = atof(argv[++i]);
+			if (options.pngChunk < 0) {
+				fprintf(stderr, "Error: the PNG chunk cannot be negative!");
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-stats") == 0) {
+			options.stats = 1;
+		}
+		else {
+			fprintf(stderr, "Error: unknown option %s", argv[i]);
+			exit(1);
+		}
+	}
+	if (options.gbufferFile != NULL && options.relightFile != NULL) {
+		fprintf(stderr, "Error: -gbuffer and -relight cannot be used together!");
+		exit(1);
+	}
+	if (options.recomposeFile != NULL && (options.layersFile != NULL || options.gbufferFile != NULL || options.relightFile != NULL)) {
+		fprintf(stderr, "Error: -recompose does not render and cannot be used with -layers, -gbuffer or -relight!");
+		exit(1);
+	}
+	if (options.incremental && (options.layersFile != NULL || options.gbufferFile != NULL || options.relightFile != NULL ||
+		options.recomposeFile != NULL)) {
+		fprintf(stderr, "Error: -incremental keeps only the image of the last frame and cannot be used with -layers, -gbuffer, -relight or -recompose!");
+		exit(1);
+	}
+	if (options.reproject > 0 && (options.incremental || options.layersFile != NULL || options.relightFile != NULL ||
+		options.recomposeFile != NULL)) {
+		fprintf(stderr, "Error: -reproject shades only some pixels and cannot be used with -incremental, -layers, -relight or -recompose!");
+		exit(1);
+	}
+	if ((options.aovPrefix != NULL || options.denoise > 0) && (options.incremental || options.reproject > 0 ||
+		options.relightFile != NULL || options.recomposeFile != NULL)) {
+		fprintf(stderr, "Error: -aov and -denoise need every pixel traced and cannot be used with -incremental, -reproject, -relight or -recompose!");
+		exit(1);
+	}
+	if (options.pathSamples > 0 && (options.incremental || options.reproject > 0 || options.shadeCache > 0 || options.raster ||
+		options.gbufferFile != NULL || options.layersFile != NULL || options.relightFile != NULL || options.recomposeFile != NULL)) {
+		fprintf(stderr, "Error: -pathtrace cannot be used with -incremental, -reproject, -shadecache, -raster, -gbuffer, -layers, -relight or -recompose!");
+		exit(1);
+	}
+	if (options.supersample > 1 && (options.pathSamples > 0 || options.raster || options.reproject > 0 || options.gbufferFile != NULL ||
+		options.layersFile != NULL || options.relightFile != NULL || options.recomposeFile != NULL)) {
+		fprintf(stderr, "Error: -supersample traces its own primary rays and cannot be used with -pathtrace, -raster, -reproject, -gbuffer, -layers, -relight or -recompose!");
+		exit(1);
+	}
+	if (options.variableRate > 1 && (options.pathSamples > 0 || options.supersample > 1 || options.raster || options.incremental ||
+		options.reproject > 0 || options.gbufferFile != NULL || options.layersFile != NULL || options.relightFile != NULL ||
+		options.recomposeFile != NULL || options.aovPrefix != NULL || options.denoise > 0)) {
+		fprintf(stderr, "Error: -variablerate traces its own primary rays and cannot be used with -pathtrace, -supersample, -raster, -incremental, -reproject, -gbuffer, -layers, -relight, -recompose, -aov or -denoise!");
+		exit(1);
+	}
+	if (options.caustics > 0 && (options.incremental || options.reproject > 0 || options.layersFile != NULL || options.recomposeFile != NULL)) {
+		fprintf(stderr, "Error: -caustics can move with any edit and has no light layer, it cannot be used with -incremental, -reproject, -layers or -recompose!");
+		exit(1);
+	}
+}
+
+// printStats() prints the counters of the render when -stats is given
+void printStats() {
+	// nothing was rendered with -recompose
+	if (options.stats == 0 || scene == NULL) {
+		return;
+	}
+	fprintf(stderr, "primary rays:      %ld\n", stats.primaryRays);
+	if (options.raster) {
+		fprintf(stderr, "background pixels: %ld (skipped by -raster)\n", stats.backgroundPixels);
+	}
+	fprintf(stderr, "shadow rays:       %ld (%ld blocked)\n", stats.shadowRays, stats.shadowedRays);
+	fprintf(stderr, "occluder cache:    %ld hits, %.1f%% of the blocked rays\n", stats.occluderCacheHits,
+		stats.shadowedRays > 0 ? 100.0 * stats.occluderCacheHits / stats.shadowedRays : 0.0);
+	fprintf(stderr, "shading points:    %ld\n", stats.shadingPoints);
+	fprintf(stderr, "primitives:        %d spheres, %d planes, %d materials\n", scene->sphereCount, scene->planeCount, scene->materialCount);
+	if (instances != NULL) {
+		fprintf(stderr, "instances:         %d of %d prototypes, %d spheres placed from %d stored\n", scene->instanceCount,
+			scene->prototypeCount, scene->instanceFirst[scene->instanceCount], scene->prototypeStart[scene->prototypeCount]);
+	}
+	if (pointCloudSpheres > 0) {
+		fprintf(stderr, "point clouds:      %ld spheres, %.1f MB read in %.2f ms (%.0f MB/s)\n", pointCloudSpheres,
+			pointCloudBytes / 1e6, pointCloudSeconds * 1000, pointCloudBytes / 1e6 / pointCloudSeconds);
+	}
+	if (scene->meshCount > 0) {
+		double vertexCount = 0, bvhBytes = 0;
+		int m;
+		for (m = 0; m < scene->meshCount; m++) {
+			Mesh* mesh = &scene->meshes[m];
+			vertexCount += mesh->vertexCount;
+			if (mesh->bvh != NULL) {
+				bvhBytes += (double)mesh->bvh->count * sizeof(int) + (double)mesh->bvh->nodeCount * sizeof(BVHNode) +
+					(double)mesh->bvh->wideCount * sizeof(WideNode);
+			}
+		}
+		int triangleCount = scene->meshFirst[scene->meshCount];
+		fprintf(stderr, "meshes:            %d with %d triangles, %d from the cache, loaded in %.2f ms\n", scene->meshCount,
+			triangleCount, meshCacheHits, meshLoadSeconds * 1000);
+		if (triangleCount > 0) {
+			fprintf(stderr, "mesh memory:       %.1f bytes per triangle, %.1f more for the bvh\n",
+				(vertexCount * 3 * sizeof(float) + triangleCount * 3.0 * sizeof(uint32_t)) / triangleCount, bvhBytes / triangleCount);
+		}
+	}
+	if (bvh != NULL) {
+		fprintf(stderr, "bvh nodes:         %d binary (%.1f bytes per sphere), %d wide (%.1f bytes per sphere)\n",
+			bvh->nodeCount, (double)bvh->nodeCount * sizeof(BVHNode) / bvh->count,
+			bvh->wideCount, (double)bvh->wideCount * sizeof(WideNode) / bvh->count);
+	}
+	fprintf(stderr, "lights in scene:   %d (%d never culled)\n", lightGrid->count, lightGrid->globalCount);
+	fprintf(stderr, "lights per point:  %.2f\n", stats.shadingPoints > 0 ? (double)stats.lightsConsidered / stats.shadingPoints : 0.0);
+	if (stats.areaLightPoints > 0) {
+		fprintf(stderr, "area lights:       %.1f%% of %ld shaded in the penumbra, %.2f shadow rays each\n",
+			100.0 * stats.penumbraPoints / stats.areaLightPoints, stats.areaLightPoints, (double)stats.areaShadowRays / stats.areaLightPoints);
+	}
+	if (textureCount > 0) {
+		long lookups = 0, hits = 0, tiles = 0;
+		int t;
+		for (t = 0; t < TEXTURE_SHARDS; t++) {
+			lookups += tileShards[t].lookups;
+			hits += tileShards[t].hits;
+			tiles += tileShards[t].count;
+		}
+		fprintf(stderr, "textures:          %d, %d from the tile files, loaded in %.2f ms\n", textureCount, textureCacheHits,
+			textureLoadSeconds * 1000);
+		fprintf(stderr, "texture cache:     %.2f%% of %ld tile lookups hit, %ld tiles resident (%.1f MB of %.1f MB)\n",
+			lookups > 0 ? 100.0 * hits / lookups : 0.0, lookups, tiles, tiles * sizeof(TileEntry) / 1e6, options.textureCache);
+	}
+	if (stats.causticLookups > 0) {
+		fprintf(stderr, "caustics:          %ld lookups, %.1f photons found each\n", stats.causticLookups,
+			(double)stats.causticPhotons / stats.causticLookups);
+	}
+}
+
+// seconds between two clock readings
+double elapsed(struct timespec* start, struct timespec* end) {
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+// benchmarkBVH() traces the primary rays of a w x h image through both layouts of the bvh and
+// prints how many rays per second each one does
+void benchmarkBVH(Object** objects, int w, int h) {
+	double width = 0, height = 0;
+	int i, j, k, pass, round;
+	for (i = 0; objects[i] != 0; i++) {
+		if (objects[i]->kind == 0) {
+			width = objects[i]->camera.width;
+			height = objects[i]->camera.height;
+		}
+	}
+	if (bvh == NULL || width <= 0 || height <= 0) {
+		fprintf(stderr, "Error: -bvhbench needs a camera and at least one sphere\n");
+		return;
+	}
+	long hits[2] = { 0, 0 };
+	for (pass = 0; pass < 2; pass++) {
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		// a few rounds so small images still take long enough to time
+		for (round = 0; round < 4; round++) {
+			for (k = 0; k < h; k++) {
+				for (j = 0; j < w; j++) {
+					double Ro[3] = { 0, 0, 0 };
+					double Rd[3];
+					double t = INFINITY;
+					pixelDirection(width, height, w, h, j, k, Rd);
+					int p = pass == 0 ? binaryIntersect(bvh, scene->spheres, Ro, Rd, &t) : wideIntersect(bvh, scene->spheres, Ro, Rd, &t);
+					hits[pass] += p >= 0;
+				}
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double seconds = elapsed(&start, &end);
+		fprintf(stderr, "%s bvh: %.2f Mrays/s, %.1f bytes per sphere, %ld hits\n", pass == 0 ? "binary" : "wide  ",
+			4.0 * w * h / seconds / 1e6,
+			pass == 0 ? (double)bvh->nodeCount * sizeof(BVHNode) / bvh->count : (double)bvh->wideCount * sizeof(WideNode) / bvh->count,
+			hits[pass] / 4);
+	}
+}
+
+// printEncodeStats() prints with -stats how fast the image of frame f was compressed into the
+// file name and how much smaller it got, for the PNG and QOI files
+void printEncodeStats(int f, char* name) {
+	if (!options.stats || strcmp(outputFormat(name), "P6") == 0) {
+		return;
+	}
+	fprintf(stderr, "frame %d: %s written in %.2f ms, %.1f MB/s, %.2f MB to %.2f MB (ratio %.2f)\n", f, outputFormat(name),
+		encodeStats.seconds * 1000, encodeStats.rawBytes / 1e6 / fmax(encodeStats.seconds, 1e-9), encodeStats.rawBytes / 1e6,
+		encodeStats.writtenBytes / 1e6, (double)encodeStats.rawBytes / encodeStats.writtenBytes);
+}
+
+// frameName() writes the file name of frame f to name. With -frames the file names on the
+// command line are patterns like frame%03d.json and the frame number goes where the %d is.
+void frameName(char* pattern, int f, char* name, int size) {
+	if (options.frames == 0) {
+		snprintf(name, size, "%s", pattern);
+		return;
+	}
+	// only one %d with an optional width is allowed, the pattern goes to snprintf()
+	char* p = strchr(pattern, '%');
+	char* q = p != NULL ? p + 1 : NULL;
+	while (q != NULL && *q >= '0' && *q <= '9') q++;
+	if (q == NULL || *q != 'd' || strchr(q, '%') != NULL) {
+		fprintf(stderr, "Error: with -frames the file name %s needs one %%d for the frame number!", pattern);
+		exit(1);
+	}
+	snprintf(name, size, pattern, f);
+}
+
 int main(int argc, char **argv) {
-	if (argc != 5) {
-		fprintf(stderr, "Error: incorrect format('raycast width height input.json output.ppm')");
+	if (argc < 5) {
+		fprintf(stderr, "Error: incorrect format('raycast width height input.json output.ppm [options]')");
 		return (1);
 	}
 	char *w = argv[1];
@@ -597,7 +1562,6 @@ int main(int argc, char **argv) {
 	char *inputFilename = argv[3];
 	char *outputFilename = argv[4];
 
-	Object** objects = malloc(sizeof(Object*) * 128);
 	int width = atoi(w);
 	int height = atoi(h);
 	if (width <= 0) {
@@ -608,10 +1572,221 @@ int main(int argc, char **argv) {
 		fprintf(stderr, "Error: Invalid height input!");
 		return (1);
 	}
-	readScene(inputFilename, objects);
-	PPMimage* buffer = rayCasting(inputFilename, width, height, objects);
-	buffer->width = width;
-	buffer->height = height;
-	PPMWrite("P6", outputFilename, buffer);
+	parseOptions(argc, argv);
+	Object** objects = NULL;
+	// the G-buffer of -relight, read once for all frames
+	GBuffer* saved = NULL;
+	uint64_t savedHash = 0;
+	// the layers of -recompose, also read once
+	LightLayers* composed = NULL;
+	int frames = options.frames > 0 ? options.frames : 1;
+	int f;
+	for (f = 0; f < frames; f++) {
+		char inputName[1024];
+		char outputName[1024];
+		frameName(inputFilename, f, inputName, sizeof(inputName));
+		frameName(outputFilename, f, outputName, sizeof(outputName));
+		struct timespec start, loaded, ready;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (options.fromHdrFile != NULL) {
+			// the saved colors are only tone mapped again, no scene is read
+			char hdrName[1024];
+			frameName(options.fromHdrFile, f, hdrName, sizeof(hdrName));
+			PPMimage* image = PFMRead(hdrName);
+			if (image->width != width || image->height != height) {
+				fprintf(stderr, "Error: %s is %d x %d, not %d x %d!", hdrName, image->width, image->height, width, height);
+				exit(1);
+			}
+			toneMap(image);
+			if (options.stats) {
+				fprintf(stderr, "frame %d: tone mapped in %.2f ms\n", f, toneMapSeconds * 1000);
+			}
+			PPMWrite(outputFormat(outputName), outputName, image);
+			printEncodeStats(f, outputName);
+			freeImage(image);
+			continue;
+		}
+		// the objects of the last frame are kept until -incremental compared them
+		Object** previousObjects = objects;
+		objects = readScene(inputName);
+		if (options.recomposeFile != NULL) {
+			// only the light colors are needed, no scene is built and no ray is traced
+			if (composed == NULL) {
+				composed = loadLightLayers(options.recomposeFile, width, height);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &loaded);
+			PPMimage* image = recompose(composed, objects);
+			clock_gettime(CLOCK_MONOTONIC, &ready);
+			if (options.stats) {
+				fprintf(stderr, "frame %d: %d layers recomposed in %.2f ms\n", f, composed->count, elapsed(&loaded, &ready) * 1000);
+			}
+			image->width = width;
+			image->height = height;
+			if (options.hdrFile != NULL) {
+				char hdrName[1024];
+				frameName(options.hdrFile, f, hdrName, sizeof(hdrName));
+				PFMWrite(hdrName, image);
+			}
+			toneMap(image);
+			PPMWrite(outputFormat(outputName), outputName, image);
+			printEncodeStats(f, outputName);
+			freeImage(image);
+			if (previousObjects != NULL) {
+				freeObjects(previousObjects);
+			}
+			continue;
+		}
+		Scene* previous = scene;
+		scene = buildScene(objects);
+		clock_gettime(CLOCK_MONOTONIC, &loaded);
+		// when only the spheres moved the bvh of the last frame is refit
+		char* update = "built";
+		if (bvh != NULL && previous->sphereCount == scene->sphereCount) {
+			int result = updateBVH(bvh, scene->spheres, options.sahLimit);
+			update = result == 0 ? "refit" : (result == 1 ? "partly rebuilt" : "rebuilt");
+		}
+		else {
+			freeBVH(bvh);
+			bvh = options.bvh > 0 ? buildBVH(scene->spheres, scene->sphereCount) : NULL;
+		}
+		// what changed since the last frame, compared once for all the caches that carry over frames
+		SceneEdits* edits = NULL;
+		if (previous != NULL && (options.incremental || options.shadeCache > 0 || options.reproject > 0)) {
+			edits = findSceneEdits(previous, scene, instances, previousObjects, objects);
+		}
+		if (options.incremental) {
+			if (tileDeps == NULL) {
+				tileDeps = newTileDependencies();
+			}
+			else if (!markEditedTiles(tileDeps, edits, previousObjects, objects)) {
+				tileDeps->valid = 0;
+			}
+		}
+		if (options.shadeCache > 0) {
+			if (shadeCache == NULL) {
+				int count = 0;
+				while (objects[count] != 0) count++;
+				shadeCache = newShadeCache(options.shadeCache, count);
+			}
+			else {
+				editShadeCache(shadeCache, edits, previousObjects, objects);
+			}
+		}
+		if (options.reproject > 0) {
+			if (reprojection == NULL) {
+				reprojection = newReprojection(options.reproject, width, height);
+			}
+			else {
+				editReprojection(reprojection, edits, previousObjects, objects);
+			}
+		}
+		freeSceneEdits(edits);
+		if (previousObjects != NULL) {
+			freeObjects(previousObjects);
+		}
+		if (previous != NULL) {
+			freeInstanceTree(instances, previous);
+			freeMeshes(previous);
+			freeScene(previous);
+		}
+		instances = buildInstanceTree(scene);
+		loadMeshes(scene);
+		loadTextures();
+		clock_gettime(CLOCK_MONOTONIC, &ready);
+		if (options.stats && options.frames > 0 && bvh != NULL) {
+			fprintf(stderr, "frame %d: scene read in %.2f ms, bvh %s in %.2f ms, cost %.2f of the built tree\n", f,
+				elapsed(&start, &loaded) * 1000, update, elapsed(&loaded, &ready) * 1000, sahCost(bvh) / bvh->builtCost);
+		}
+		PPMimage* buffer;
+		struct timespec rendered;
+		if (options.relightFile != NULL) {
+			if (saved == NULL) {
+				saved = loadGBuffer(options.relightFile, &savedHash);
+			}
+			if (saved->width != width || saved->height != height || sceneHash(objects, width, height) != savedHash) {
+				fprintf(stderr, "Error: %s was saved for other geometry, another camera or another image size!", options.relightFile);
+				exit(1);
+			}
+			buffer = relight(saved, objects);
+		}
+		else {
+			buffer = rayCasting(inputName, width, height, objects);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &rendered);
+		if (options.stats) {
+			fprintf(stderr, "frame %d: %s in %.2f ms\n", f, options.relightFile != NULL ? "relit from the g-buffer" : "rendered",
+				elapsed(&ready, &rendered) * 1000);
+		}
+		if (options.stats && tileDeps != NULL) {
+			fprintf(stderr, "frame %d: %d of %d tiles traced (%.1f%%)\n", f, tileDeps->dirtyCount, tileDeps->tileCount,
+				100.0 * tileDeps->dirtyCount / tileDeps->tileCount);
+		}
+		if (options.stats && reprojection != NULL) {
+			fprintf(stderr, "frame %d: %d of %d pixels shaded (%.1f%%): %d disoccluded, %d with changed light, %d refreshed\n", f,
+				reprojection->traced, width * height, 100.0 * reprojection->traced / (width * height), reprojection->disoccluded,
+				reprojection->shadingChanged, reprojection->refreshed);
+		}
+		if (options.stats && shadeCache != NULL) {
+			// a hit would have cost as much as the average shadow ray traced after a miss
+			double saved = shadeCache->timedRays > 0 ? shadeCache->hits * shadeCache->timedSeconds / shadeCache->timedRays : 0;
+			fprintf(stderr, "frame %d: shading cache hit %ld of %ld lookups (%.1f%%), %ld stale, about %.2f ms of shadow rays saved\n",
+				f, shadeCache->hits, shadeCache->lookups, shadeCache->lookups > 0 ? 100.0 * shadeCache->hits / shadeCache->lookups : 0.0,
+				shadeCache->stale, saved * 1000);
+		}
+		if (options.stats && options.pathSamples > 0) {
+			fprintf(stderr, "frame %d: %.1f paths per pixel, %.1f%% of the pixels converged before %d\n", f,
+				(double)pathSamples / (width * height), 100.0 * pathConverged / (width * height), options.pathSamples);
+		}
+		if (options.stats && sampleCache != NULL) {
+			fprintf(stderr, "frame %d: %d x %d samples per pixel, %ld of %ld samples shaded (%.3f shading per visibility sample)\n", f,
+				options.supersample, options.supersample, sampleCache->shaded, sampleCache->samples,
+				sampleCache->samples > 0 ? (double)sampleCache->shaded / sampleCache->samples : 0.0);
+		}
+		if (options.stats && options.variableRate > 1) {
+			fprintf(stderr, "frame %d: %ld of %d pixels traced (%.2f rays per pixel), %ld of %ld blocks interpolated\n", f,
+				variableRays, width * height, (double)variableRays / ((double)width * height), variableFlat, variableBlocks);
+		}
+		if (options.stats && photonMap != NULL) {
+			fprintf(stderr, "frame %d: %d caustic photons stored of %d emitted, traced in %.2f ms, tree built in %.2f ms\n", f,
+				photonMap->count, photonMap->emitted, photonMap->traceSeconds * 1000, photonMap->buildSeconds * 1000);
+		}
+		if (options.stats && options.denoise > 0) {
+			fprintf(stderr, "frame %d: denoised with %d passes in %.2f ms\n", f, options.denoise, denoiseSeconds * 1000);
+		}
+		if (options.aovPrefix != NULL) {
+			char prefix[1024];
+			frameName(options.aovPrefix, f, prefix, sizeof(prefix));
+			writeAovs(aovs, prefix);
+		}
+		if (options.gbufferFile != NULL) {
+			saveGBuffer(options.gbufferFile, gbuffer, sceneHash(objects, width, height));
+		}
+		if (options.layersFile != NULL) {
+			saveLightLayers(options.layersFile, lightLayers);
+		}
+		buffer->width = width;
+		buffer->height = height;
+		if (options.hdrFile != NULL) {
+			char hdrName[1024];
+			frameName(options.hdrFile, f, hdrName, sizeof(hdrName));
+			PFMWrite(hdrName, buffer);
+		}
+		toneMap(buffer);
+		if (options.stats) {
+			fprintf(stderr, "frame %d: tone mapped in %.2f ms\n", f, toneMapSeconds * 1000);
+		}
+		PPMWrite(outputFormat(outputName), outputName, buffer);
+		printEncodeStats(f, outputName);
+		freeImage(buffer);
+	}
+	freeGBuffer(saved);
+	freeLightLayers(composed);
+	freeShadeCache(shadeCache);
+	freeReprojection(reprojection);
+	freeAovs(aovs);
+	printStats();
+	if (options.bvhBench) {
+		benchmarkBVH(objects, width, height);
+	}
 	return (0);
 }
@@ -0,0 +1,117 @@
+// Two-level instancing
+// Every prototype gets its own bvh over its spheres in prototype space (the bottom level), and
+// one more bvh is built over a bounding sphere of every instance (the top level). A ray that
+// reaches an instance is moved into the space of its prototype and traced through the bottom
+// level bvh. The scale and rotation are applied to the direction without normalizing it, so
+// the distance t along the ray is the same in both spaces and hits can be compared directly.
+// Memory grows with the prototype spheres, an instance only costs its transform.
+
+typedef struct {
+	BVH** prototypes;      // bottom level bvh of every prototype
+	double* prototypeBounds; // bounding sphere of every prototype in its own space
+	double* instanceBounds;  // bounding sphere of every instance in the world
+	BVH* top;              // top level bvh over the instance bounds
+	Scene* scene;
+} InstanceTree;
+
+// buildInstanceTree() builds both levels for the instances of the scene, NULL when there are none
+InstanceTree* buildInstanceTree(Scene* scene) {
+	if (scene->instanceCount == 0) {
+		return NULL;
+	}
+	InstanceTree* tree = malloc(sizeof(InstanceTree));
+	tree->scene = scene;
+	tree->prototypes = malloc(sizeof(BVH*) * scene->prototypeCount);
+	tree->prototypeBounds = malloc(sizeof(double) * 4 * scene->prototypeCount);
+	tree->instanceBounds = malloc(sizeof(double) * 4 * scene->instanceCount);
+	if (tree->prototypes == NULL || tree->prototypeBounds == NULL || tree->instanceBounds == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the instances.\n");
+		exit(1);
+	}
+	int i, j, a;
+	for (j = 0; j < scene->prototypeCount; j++) {
+		int count = scene->prototypeStart[j + 1] - scene->prototypeStart[j];
+		tree->prototypes[j] = buildBVH(&scene->prototypeSpheres[scene->prototypeStart[j] * 4], count);
+		if (tree->prototypes[j] == NULL) {
+			continue;
+		}
+		// the sphere around the root box of the prototype
+		BVHNode* root = &tree->prototypes[j]->nodes[0];
+		double r2 = 0;
+		for (a = 0; a < 3; a++) {
+			tree->prototypeBounds[j * 4 + a] = (root->lo[a] + root->hi[a]) / 2;
+			r2 += sqr(root->hi[a] - root->lo[a]) / 4;
+		}
+		tree->prototypeBounds[j * 4 + 3] = sqrt(r2);
+	}
+	for (i = 0; i < scene->instanceCount; i++) {
+		double* m = &scene->instanceTransform[i * 12];
+		double* local = &tree->prototypeBounds[scene->instancePrototype[i] * 4];
+		for (a = 0; a < 3; a++) {
+			tree->instanceBounds[i * 4 + a] = m[a * 3] * local[0] + m[a * 3 + 1] * local[1] + m[a * 3 + 2] * local[2] + m[9 + a];
+		}
+		tree->instanceBounds[i * 4 + 3] = local[3] * sqrt(sqr(m[0]) + sqr(m[1]) + sqr(m[2]));
+	}
+	tree->top = buildBVH(tree->instanceBounds, scene->instanceCount);
+	return tree;
+}
+
+void freeInstanceTree(InstanceTree* tree, Scene* scene) {
+	if (tree == NULL) {
+		return;
+	}
+	int j;
+	for (j = 0; j < scene->prototypeCount; j++) {
+		freeBVH(tree->prototypes[j]);
+	}
+	free(tree->prototypes);
+	free(tree->prototypeBounds);
+	free(tree->instanceBounds);
+	freeBVH(tree->top);
+	free(tree);
+}
+
+// the ray Ro + t * Rd in the space of the prototype of instance i
+static inline void instanceRay(Scene* scene, int i, double* Ro, double* Rd, double* localRo, double* localRd) {
+	double* m = &scene->instanceTransform[i * 12];
+	double* inverse = &scene->instanceInverse[i * 9];
+	double o[3] = { Ro[0] - m[9], Ro[1] - m[10], Ro[2] - m[11] };
+	int a;
+	for (a = 0; a < 3; a++) {
+		localRo[a] = inverse[a * 3] * o[0] + inverse[a * 3 + 1] * o[1] + inverse[a * 3 + 2] * o[2];
+		localRd[a] = inverse[a * 3] * Rd[0] + inverse[a * 3 + 1] * Rd[1] + inverse[a * 3 + 2] * Rd[2];
+	}
+}
+
+// the leaf test of the top level. The ray is moved into the space of the prototype of instance
+// i and traced through its bvh, with anyHit only until the first hit.
+static inline int instanceTest(InstanceTree* tree, int i, double* Ro, double* Rd, double* bestT, int skip, int anyHit) {
+	Scene* scene = tree->scene;
+	int j = scene->instancePrototype[i];
+	double localRo[3], localRd[3];
+	instanceRay(scene, i, Ro, Rd, localRo, localRd);
+	int base = scene->sphereCount + scene->planeCount + scene->instanceFirst[i];
+	int k = wideTraverse(tree->prototypes[j], localRo, localRd, bestT, skip - base, anyHit, sphereLeaf,
+		&scene->prototypeSpheres[scene->prototypeStart[j] * 4]);
+	return k >= 0 ? base + k : -1;
+}
+
+// the leaf tests of the closest and of any hit, data is the instance tree
+static inline int instanceLeaf(void* data, int i, double* Ro, double* Rd, double* bestT, int skip) {
+	return instanceTest(data, i, Ro, Rd, bestT, skip, 0);
+}
+
+static inline int instanceAnyLeaf(void* data, int i, double* Ro, double* Rd, double* bestT, int skip) {
+	return instanceTest(data, i, Ro, Rd, bestT, skip, 1);
+}
+
+// closest instanced sphere that the ray hits before bestT, returns its primitive or -1
+int instanceIntersect(InstanceTree* tree, double* Ro, double* Rd, double* bestT) {
+	return wideTraverse(tree->top, Ro, Rd, bestT, -1, 0, instanceLeaf, tree);
+}
+
+// any instanced sphere other than the primitive skip between Ro and maxT along Rd, returns
+// its primitive or -1
+int instanceOccluded(InstanceTree* tree, double* Ro, double* Rd, double maxT, int skip) {
+	return wideTraverse(tree->top, Ro, Rd, &maxT, skip, 1, instanceAnyLeaf, tree);
+}
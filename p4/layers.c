@@ -0,0 +1,206 @@
+// Light layers
+// The color of a pixel is a sum over the lights, and every light adds its color times a factor
+// that only depends on the geometry, the materials and the light position: the diffuse and
+// specular terms, the attenuation, the shadow test and the reflectivity and refractivity of
+// the surfaces along the way. With -layers file the render keeps that factor of every light in
+// a float buffer of its own and saves the buffers. -recompose file makes the image again as the
+// sum of the layers times the light colors of the scene, without tracing a single ray, so a
+// color or intensity edit costs one pass over the buffers.
+// Lights with the same "layer" name share one buffer, which is scaled by the color of the
+// first light of the layer; the other lights of the layer keep their color relative to it.
+// Recomposing is exact unless -cutoff or -lightbudget is used, as both pick lights by color.
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define LAYERS_MAGIC "LAYERS1"
+
+typedef struct {
+	int count;          // number of layers
+	int lightCount;
+	int* lightLayer;    // layer of every light of the light table
+	double* tint;       // 3 per light: its color relative to the first light of its layer
+	int* first;         // object index of the first light of every layer
+	int width;
+	int height;
+	float* data;        // layer l is width * height * 3 floats from data + l * width * height * 3
+} LightLayers;
+
+typedef struct {
+	char magic[8];
+	int width;
+	int height;
+	int count;
+	int unused;
+} LayersHeader;
+
+// the layers that the render fills with -layers, NULL otherwise
+LightLayers* lightLayers;
+// the pixel that is shaded and the weight that a light adds to it with along the current ray,
+// the product of the reflectivity or refractivity of the surfaces the ray came from
+int layerPixel;
+double layerWeight;
+
+// buildLightLayers() gives every light of the objects its layer, in the order the lights come
+// in the scene. The buffers are only allocated for w x h images, w = 0 leaves them out.
+LightLayers* buildLightLayers(Object** objects, int w, int h) {
+	LightLayers* layers = calloc(1, sizeof(LightLayers));
+	int i, n = 0, a;
+	for (i = 0; objects[i] != 0; i++) {
+		if (objects[i]->kind == 3) layers->lightCount += 1;
+	}
+	layers->lightLayer = malloc(sizeof(int) * (layers->lightCount + 1));
+	layers->tint = malloc(sizeof(double) * 3 * (layers->lightCount + 1));
+	layers->first = malloc(sizeof(int) * (layers->lightCount + 1));
+	// layer of every named layer, -1 until its first light is found
+	int* named = malloc(sizeof(int) * (layerNameCount + 1));
+	if (layers->lightLayer == NULL || layers->tint == NULL || layers->first == NULL || named == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the light layers.\n");
+		exit(1);
+	}
+	for (i = 0; i < layerNameCount; i++) {
+		named[i] = -1;
+	}
+	for (i = 0; objects[i] != 0; i++) {
+		if (objects[i]->kind != 3) continue;
+		int name = objects[i]->light.layer;
+		int l = name >= 0 ? named[name] : -1;
+		if (l < 0) {
+			l = layers->count++;
+			layers->first[l] = i;
+			if (name >= 0) named[name] = l;
+		}
+		layers->lightLayer[n] = l;
+		double* color = objects[i]->light.color;
+		double* reference = objects[layers->first[l]]->light.color;
+		for (a = 0; a < 3; a++) {
+			// a channel that is black in the first light stays black for the whole layer
+			layers->tint[n * 3 + a] = layers->first[l] == i ? 1 : (reference[a] != 0 ? color[a] / reference[a] : 0);
+		}
+		n += 1;
+	}
+	free(named);
+	layers->width = w;
+	layers->height = h;
+	if (w > 0) {
+		layers->data = calloc((size_t)layers->count * w * h * 3, sizeof(float));
+		if (layers->data == NULL) {
+			fprintf(stderr, "Error: Could not allocate memory for %d light layers.\n", layers->count);
+			exit(1);
+		}
+	}
+	return layers;
+}
+
+void freeLightLayers(LightLayers* layers) {
+	if (layers == NULL) {
+		return;
+	}
+	free(layers->lightLayer);
+	free(layers->tint);
+	free(layers->first);
+	free(layers->data);
+	free(layers);
+}
+
+// addLayerLight() adds the factor of light n of the light table at the current pixel, diffuse
+// and specular are the factors of the material for a white light of color 1
+static inline void addLayerLight(int n, double* diffuse, double* specular) {
+	int l = lightLayers->lightLayer[n];
+	float* p = &lightLayers->data[((size_t)l * lightLayers->width * lightLayers->height + layerPixel) * 3];
+	int a;
+	for (a = 0; a < 3; a++) {
+		p[a] += layerWeight * lightLayers->tint[n * 3 + a] * (diffuse[a] + specular[a]);
+	}
+}
+
+// saveLightLayers() writes the layers to a file
+void saveLightLayers(char* filename, LightLayers* layers) {
+	LayersHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, LAYERS_MAGIC, 8);
+	header.width = layers->width;
+	header.height = layers->height;
+	header.count = layers->count;
+	FILE* file = fopen(filename, "wb");
+	size_t size = (size_t)layers->count * layers->width * layers->height * 3;
+	if (file == NULL || fwrite(&header, sizeof(header), 1, file) != 1 || fwrite(layers->data, sizeof(float), size, file) != size) {
+		fprintf(stderr, "Error: Could not write the light layers %s.\n", filename);
+		exit(1);
+	}
+	fclose(file);
+}
+
+// loadLightLayers() reads the layers of a w x h image from a file, only the buffers are read,
+// recompose() takes the lights of each layer from the scene
+LightLayers* loadLightLayers(char* filename, int w, int h) {
+	LayersHeader header;
+	FILE* file = fopen(filename, "rb");
+	if (file == NULL || fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, LAYERS_MAGIC, 8) != 0 ||
+		header.count < 0) {
+		fprintf(stderr, "Error: %s is not a light layers file.\n", filename);
+		exit(1);
+	}
+	if (header.width != w || header.height != h) {
+		fprintf(stderr, "Error: %s has layers of %d x %d, not %d x %d.\n", filename, header.width, header.height, w, h);
+		exit(1);
+	}
+	LightLayers* layers = calloc(1, sizeof(LightLayers));
+	size_t size = (size_t)header.count * w * h * 3;
+	layers->count = header.count;
+	layers->width = w;
+	layers->height = h;
+	layers->data = malloc(sizeof(float) * (size + 1));
+	if (layers->data == NULL || fread(layers->data, sizeof(float), size, file) != size) {
+		fprintf(stderr, "Error: Could not read the light layers %s.\n", filename);
+		exit(1);
+	}
+	fclose(file);
+	return layers;
+}
+
+// recompose() sums the saved layers times the color of the first light of each layer of the
+// objects into a new image, the objects need to have as many layers as were saved
+PPMimage* recompose(LightLayers* layers, Object** objects) {
+	int w = layers->width, h = layers->height;
+	LightLayers* lights = buildLightLayers(objects, 0, 0);
+	if (lights->count != layers->count) {
+		fprintf(stderr, "Error: the layers were saved for %d lights or layers, the scene has %d.\n", layers->count, lights->count);
+		exit(1);
+	}
+	size_t size = (size_t)w * h * 3, i;
+	int l, k;
+	float* sum = calloc(size + 12, sizeof(float));
+	PPMimage* buffer = newImage(w, h);
+	if (sum == NULL) {
+		fprintf(stderr, "Error: allocate the memory un successfully. \n");
+		exit(1);
+	}
+	for (l = 0; l < layers->count; l++) {
+		double* color = objects[lights->first[l]]->light.color;
+		float* layer = &layers->data[l * size];
+		i = 0;
+#ifdef __SSE2__
+		// 12 floats are 4 pixels, so the color repeats in the same 3 vectors
+		__m128 c0 = _mm_setr_ps(color[0], color[1], color[2], color[0]);
+		__m128 c1 = _mm_setr_ps(color[1], color[2], color[0], color[1]);
+		__m128 c2 = _mm_setr_ps(color[2], color[0], color[1], color[2]);
+		for (; i + 12 <= size; i += 12) {
+			_mm_storeu_ps(&sum[i], _mm_add_ps(_mm_loadu_ps(&sum[i]), _mm_mul_ps(_mm_loadu_ps(&layer[i]), c0)));
+			_mm_storeu_ps(&sum[i + 4], _mm_add_ps(_mm_loadu_ps(&sum[i + 4]), _mm_mul_ps(_mm_loadu_ps(&layer[i + 4]), c1)));
+			_mm_storeu_ps(&sum[i + 8], _mm_add_ps(_mm_loadu_ps(&sum[i + 8]), _mm_mul_ps(_mm_loadu_ps(&layer[i + 8]), c2)));
+		}
+#endif
+		for (; i < size; i++) {
+			sum[i] += layer[i] * (float)color[i % 3];
+		}
+	}
+	// the rows are flipped like in rayCasting()
+	for (k = 0; k < h; k++) {
+		memcpy(&buffer->hdr[(size_t)(h - k - 1) * w * 3], &sum[(size_t)k * w * 3], sizeof(float) * w * 3);
+	}
+	free(sum);
+	freeLightLayers(lights);
+	return buffer;
+}
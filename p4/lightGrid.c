@@ -0,0 +1,252 @@
+// Light culling
+// The radial attenuation 1 / (a0 + a1*d + a2*d^2) gets small very quickly, so far away
+// lights add almost nothing to a shading point. Every light gets an influence radius, the
+// distance where its luminance drops below options.cutoff, and the lights are put in a
+// uniform grid so a shading point only looks at the lights whose radius covers it.
+
+typedef struct {
+	int count;        // number of lights in the scene
+	int* index;       // object index of each light
+	double* position; // 3 doubles per light, copied so the query does not touch the objects
+	double* radius2;  // squared influence radius, INFINITY if the light is never culled
+	double* shapeRadius; // radius of the shape of each light, 0 for a point light
+	int globalCount;  // lights with an infinite radius, these are tested at every point
+	int* global;
+	double min[3];    // lower corner of the grid
+	double cellSize;
+	int dim[3];       // number of cells on each axis
+	int* cellStart;   // the lights of cell c are cellLights[cellStart[c]] ... cellLights[cellStart[c + 1] - 1]
+	int* cellLights;
+} LightGrid;
+
+// luminance of the light color, Rec. 709 weights
+double lightLuminance(Object* light) {
+	return 0.2126 * light->light.color[0] + 0.7152 * light->light.color[1] + 0.0722 * light->light.color[2];
+}
+
+// lightShapeRadius() returns the distance from the position of a light to the farthest point of
+// its shape, 0 for a point light
+double lightShapeRadius(Object* light) {
+	if (light->light.shape == 1) {
+		return light->light.radius;
+	}
+	if (light->light.shape == 2) {
+		double* u = light->light.edgeU;
+		double* v = light->light.edgeV;
+		double plus = sqr(u[0] + v[0]) + sqr(u[1] + v[1]) + sqr(u[2] + v[2]);
+		double minus = sqr(u[0] - v[0]) + sqr(u[1] - v[1]) + sqr(u[2] - v[2]);
+		return sqrt(fmax(plus, minus)) / 2;
+	}
+	return 0;
+}
+
+// lightInfluenceRadius() solves luminance / (a0 + a1*d + a2*d^2) = cutoff for d.
+// returns INFINITY when the cutoff is off or the light does not fall off with distance
+double lightInfluenceRadius(Object* light, double cutoff) {
+	double a0 = light->light.radialA0;
+	double a1 = light->light.radialA1;
+	double a2 = light->light.radialA2;
+	double luminance = lightLuminance(light);
+	if (cutoff <= 0 || (a1 <= 0 && a2 <= 0)) {
+		return INFINITY;
+	}
+	if (luminance <= 0) {
+		return 0;
+	}
+	// a2*d^2 + a1*d + (a0 - luminance / cutoff) = 0
+	double c = a0 - luminance / cutoff;
+	if (c >= 0) {
+		// the light is already below the cutoff at distance 0
+		return 0;
+	}
+	if (a2 <= 0) {
+		return -c / a1;
+	}
+	return (-a1 + sqrt(sqr(a1) - 4 * a2 * c)) / (2 * a2);
+}
+
+// squared distance from p to the box [lo, hi]
+static double boxDistance2(double* p, double* lo, double* hi) {
+	double d = 0;
+	int a;
+	for (a = 0; a < 3; a++) {
+		if (p[a] < lo[a]) d += sqr(lo[a] - p[a]);
+		else if (p[a] > hi[a]) d += sqr(p[a] - hi[a]);
+	}
+	return d;
+}
+
+// build the light table and the grid for all lights in the scene
+LightGrid* buildLightGrid(Object** objects, double cutoff) {
+	LightGrid* grid = calloc(1, sizeof(LightGrid));
+	int i, a;
+	for (i = 0; objects[i] != 0; i++) {
+		if (objects[i]->kind == 3) grid->count += 1;
+	}
+	grid->index = malloc(sizeof(int) * (grid->count + 1));
+	grid->position = malloc(sizeof(double) * 3 * (grid->count + 1));
+	grid->radius2 = malloc(sizeof(double) * (grid->count + 1));
+	grid->global = malloc(sizeof(int) * (grid->count + 1));
+	grid->shapeRadius = malloc(sizeof(double) * (grid->count + 1));
+	if (grid->index == NULL || grid->position == NULL || grid->radius2 == NULL || grid->global == NULL || grid->shapeRadius == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the light grid.\n");
+		exit(1);
+	}
+
+	// fill the light table and find the bounds of all finite influence spheres
+	double lo[3] = { INFINITY, INFINITY, INFINITY };
+	double hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+	double radiusSum = 0;
+	int finite = 0;
+	int n = 0;
+	for (i = 0; objects[i] != 0; i++) {
+		if (objects[i]->kind != 3) continue;
+		double r = lightInfluenceRadius(objects[i], cutoff);
+		grid->index[n] = i;
+		for (a = 0; a < 3; a++) {
+			grid->position[n * 3 + a] = objects[i]->light.position[a];
+		}
+		grid->radius2[n] = r == INFINITY ? INFINITY : sqr(r);
+		grid->shapeRadius[n] = lightShapeRadius(objects[i]);
+		double* u = objects[i]->light.edgeU;
+		double* v = objects[i]->light.edgeV;
+		if (objects[i]->light.shape == 2 && (sqr(u[0]) + sqr(u[1]) + sqr(u[2]) == 0 || sqr(v[0]) + sqr(v[1]) + sqr(v[2]) == 0 ||
+			objects[i]->light.radius > 0)) {
+			fprintf(stderr, "Error: a rectangle light needs both edge_u and edge_v and no radius!\n");
+			exit(1);
+		}
+		if (r == INFINITY) {
+			grid->global[grid->globalCount++] = n;
+		}
+		else if (r > 0) {
+			for (a = 0; a < 3; a++) {
+				if (objects[i]->light.position[a] - r < lo[a]) lo[a] = objects[i]->light.position[a] - r;
+				if (objects[i]->light.position[a] + r > hi[a]) hi[a] = objects[i]->light.position[a] + r;
+			}
+			radiusSum += r;
+			finite += 1;
+		}
+		n += 1;
+	}
+
+	if (finite == 0) {
+		// nothing to put in the grid, every query only sees the global lights
+		grid->dim[0] = grid->dim[1] = grid->dim[2] = 0;
+		grid->cellStart = calloc(1, sizeof(int));
+		grid->cellLights = NULL;
+		return grid;
+	}
+
+	// aim for about two cells per light, but never make the cells much smaller than the
+	// lights themselves or every light would be copied into a lot of cells
+	double extent[3];
+	double volume = 1;
+	for (a = 0; a < 3; a++) {
+		extent[a] = hi[a] - lo[a];
+		volume *= extent[a];
+	}
+	int target = finite * 2;
+	if (target > 1 << 21) target = 1 << 21;
+	grid->cellSize = cbrt(volume / target);
+	if (grid->cellSize < 0.5 * radiusSum / finite) {
+		grid->cellSize = 0.5 * radiusSum / finite;
+	}
+	// at most 256 cells along an axis, a long row of lights gets bigger cells instead of
+	// a grid that stops short of the lights at the far end
+	double maxExtent = fmax(extent[0], fmax(extent[1], extent[2]));
+	if (maxExtent > 256 * grid->cellSize) {
+		grid->cellSize = maxExtent / 256;
+	}
+	long cells = 1;
+	for (a = 0; a < 3; a++) {
+		grid->min[a] = lo[a];
+		grid->dim[a] = (int)ceil(extent[a] / grid->cellSize);
+		if (grid->dim[a] < 1) grid->dim[a] = 1;
+		if (grid->dim[a] > 256) grid->dim[a] = 256;
+		cells *= grid->dim[a];
+	}
+
+	// two passes over the lights, first count how many lights each cell gets and then fill them in
+	grid->cellStart = calloc(cells + 1, sizeof(int));
+	int pass;
+	for (pass = 0; pass < 2; pass++) {
+		int* fill = NULL;
+		if (pass == 1) {
+			for (i = 0; i < cells; i++) {
+				grid->cellStart[i + 1] += grid->cellStart[i];
+			}
+			grid->cellLights = malloc(sizeof(int) * (grid->cellStart[cells] + 1));
+			fill = malloc(sizeof(int) * cells);
+			memcpy(fill, grid->cellStart, sizeof(int) * cells);
+		}
+		for (n = 0; n < grid->count; n++) {
+			if (grid->radius2[n] == INFINITY || grid->radius2[n] <= 0) continue;
+			double* p = &grid->position[n * 3];
+			double r = sqrt(grid->radius2[n]);
+			int c0[3], c1[3];
+			for (a = 0; a < 3; a++) {
+				c0[a] = (int)floor((p[a] - r - grid->min[a]) / grid->cellSize);
+				c1[a] = (int)floor((p[a] + r - grid->min[a]) / grid->cellSize);
+				if (c0[a] < 0) c0[a] = 0;
+				if (c1[a] > grid->dim[a] - 1) c1[a] = grid->dim[a] - 1;
+			}
+			int x, y, z;
+			for (z = c0[2]; z <= c1[2]; z++) {
+				for (y = c0[1]; y <= c1[1]; y++) {
+					for (x = c0[0]; x <= c1[0]; x++) {
+						double cellLo[3] = { grid->min[0] + x * grid->cellSize, grid->min[1] + y * grid->cellSize, grid->min[2] + z * grid->cellSize };
+						double cellHi[3] = { cellLo[0] + grid->cellSize, cellLo[1] + grid->cellSize, cellLo[2] + grid->cellSize };
+						// the corners of the box around the sphere do not touch it
+						if (boxDistance2(p, cellLo, cellHi) > grid->radius2[n]) continue;
+						int c = (z * grid->dim[1] + y) * grid->dim[0] + x;
+						if (pass == 0) grid->cellStart[c + 1] += 1;
+						else grid->cellLights[fill[c]++] = n;
+					}
+				}
+			}
+		}
+		free(fill);
+	}
+	return grid;
+}
+
+void freeLightGrid(LightGrid* grid) {
+	if (grid == NULL) {
+		return;
+	}
+	free(grid->index);
+	free(grid->position);
+	free(grid->radius2);
+	free(grid->shapeRadius);
+	free(grid->global);
+	free(grid->cellStart);
+	free(grid->cellLights);
+	free(grid);
+}
+
+// lightGridCell() returns the lights stored in the cell that contains p, count is set to the
+// number of lights in the list. Points outside the grid cannot be reached by any finite light.
+int* lightGridCell(LightGrid* grid, double* p, int* count) {
+	int cell[3];
+	int a;
+	*count = 0;
+	if (grid->cellLights == NULL) {
+		return NULL;
+	}
+	for (a = 0; a < 3; a++) {
+		double f = (p[a] - grid->min[a]) / grid->cellSize;
+		if (!(f >= 0) || f >= grid->dim[a]) {
+			return NULL;
+		}
+		cell[a] = (int)f;
+	}
+	int c = (cell[2] * grid->dim[1] + cell[1]) * grid->dim[0] + cell[0];
+	*count = grid->cellStart[c + 1] - grid->cellStart[c];
+	return &grid->cellLights[grid->cellStart[c]];
+}
+
+// lightReaches() does the exact test for one light, the cell only says that it might reach p
+static inline int lightReaches(LightGrid* grid, int n, double* p) {
+	double* q = &grid->position[n * 3];
+	return sqr(q[0] - p[0]) + sqr(q[1] - p[1]) + sqr(q[2] - p[2]) < grid->radius2[n];
+}
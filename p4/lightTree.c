@@ -0,0 +1,262 @@
+// Many-light sampling
+// With -lightbudget n a shading point does not loop over all its lights. A binary tree is
+// built over the light table, and each of the n samples walks down the tree picking a child
+// with a probability proportional to an estimate of how much light it sends to the point
+// (power, radial attenuation, the spot cone from theta/angular-a0 and the surface normal).
+// The sampled light is weighted by 1 / (pdf * n), so on average we get the same image as
+// shading every light.
+
+typedef struct {
+	double lo[3];       // bounds of the light positions below this node
+	double hi[3];
+	double axis[3];     // axis of the cone that holds every spot direction below
+	double spread;      // half angle of that cone, PI for point lights
+	double power;       // summed power of the lights below
+	double a0, a1, a2;  // smallest radial coefficients below, so the estimate is never too low
+	int left;           // child nodes, -1 for a leaf
+	int right;
+	int light;          // slot in the light table for a leaf, -1 otherwise
+} LightNode;
+
+typedef struct {
+	LightNode* nodes;
+	int count;
+	int root;
+} LightTree;
+
+// sort state for qsort() while the tree is built
+static double* sortPositions;
+static int sortAxis;
+
+static int compareLights(const void* a, const void* b) {
+	double pa = sortPositions[*(const int*)a * 3 + sortAxis];
+	double pb = sortPositions[*(const int*)b * 3 + sortAxis];
+	return pa < pb ? -1 : (pa > pb ? 1 : 0);
+}
+
+// rotate the unit vector v towards the unit vector w by the angle a
+static void rotateTowards(double* v, double* w, double a) {
+	double d = v[0] * w[0] + v[1] * w[1] + v[2] * w[2];
+	double u[3] = { w[0] - d * v[0], w[1] - d * v[1], w[2] - d * v[2] };
+	double len = sqrt(sqr(u[0]) + sqr(u[1]) + sqr(u[2]));
+	if (len < 1e-12) {
+		return;
+	}
+	int i;
+	for (i = 0; i < 3; i++) {
+		v[i] = cos(a) * v[i] + sin(a) * u[i] / len;
+	}
+	normalize(v);
+}
+
+// mergeCones() sets node to the smallest cone that holds the cones of a and b
+static void mergeCones(LightNode* node, LightNode* a, LightNode* b) {
+	if (a->spread >= M_PI || b->spread >= M_PI) {
+		node->axis[0] = 0;
+		node->axis[1] = 0;
+		node->axis[2] = 1;
+		node->spread = M_PI;
+		return;
+	}
+	if (b->spread > a->spread) {
+		LightNode* t = a;
+		a = b;
+		b = t;
+	}
+	double d = a->axis[0] * b->axis[0] + a->axis[1] * b->axis[1] + a->axis[2] * b->axis[2];
+	double between = acos(d < -1 ? -1 : (d > 1 ? 1 : d));
+	memcpy(node->axis, a->axis, sizeof(node->axis));
+	if (a->spread >= between + b->spread) {
+		node->spread = a->spread;
+		return;
+	}
+	double spread = (a->spread + between + b->spread) / 2;
+	if (spread >= M_PI) {
+		node->spread = M_PI;
+		return;
+	}
+	rotateTowards(node->axis, b->axis, spread - a->spread);
+	node->spread = spread;
+}
+
+// build the subtree for slots[start] ... slots[end - 1], returns the node index
+static int buildLightNode(LightTree* tree, Object** objects, LightGrid* grid, int* slots, int start, int end) {
+	int index = tree->count++;
+	LightNode* node = &tree->nodes[index];
+	int a;
+	if (end - start == 1) {
+		int n = slots[start];
+		Object* light = objects[grid->index[n]];
+		for (a = 0; a < 3; a++) {
+			node->lo[a] = grid->position[n * 3 + a];
+			node->hi[a] = grid->position[n * 3 + a];
+		}
+		// fang() only narrows the light when angular-a0 is set
+		if (light->light.angularA0 != 0) {
+			memcpy(node->axis, light->light.direction, sizeof(node->axis));
+			normalize(node->axis);
+			node->spread = fabs(light->light.theta) < M_PI ? fabs(light->light.theta) : M_PI;
+		}
+		else {
+			node->axis[0] = 0;
+			node->axis[1] = 0;
+			node->axis[2] = 1;
+			node->spread = M_PI;
+		}
+		// the average of the channels, so a light is only skipped when it is black
+		node->power = (fabs(light->light.color[0]) + fabs(light->light.color[1]) + fabs(light->light.color[2])) / 3;
+		node->a0 = light->light.radialA0;
+		node->a1 = light->light.radialA1;
+		node->a2 = light->light.radialA2;
+		node->left = -1;
+		node->right = -1;
+		node->light = n;
+		return index;
+	}
+
+	// split the lights at the median of the longest axis of their positions
+	double lo[3] = { INFINITY, INFINITY, INFINITY };
+	double hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+	int i;
+	for (i = start; i < end; i++) {
+		for (a = 0; a < 3; a++) {
+			double p = grid->position[slots[i] * 3 + a];
+			if (p < lo[a]) lo[a] = p;
+			if (p > hi[a]) hi[a] = p;
+		}
+	}
+	sortAxis = 0;
+	for (a = 1; a < 3; a++) {
+		if (hi[a] - lo[a] > hi[sortAxis] - lo[sortAxis]) sortAxis = a;
+	}
+	sortPositions = grid->position;
+	qsort(&slots[start], end - start, sizeof(int), compareLights);
+	int middle = (start + end) / 2;
+	int left = buildLightNode(tree, objects, grid, slots, start, middle);
+	int right = buildLightNode(tree, objects, grid, slots, middle, end);
+
+	// the nodes array does not move while building, it is allocated for the whole tree
+	node = &tree->nodes[index];
+	LightNode* l = &tree->nodes[left];
+	LightNode* r = &tree->nodes[right];
+	for (a = 0; a < 3; a++) {
+		node->lo[a] = l->lo[a] < r->lo[a] ? l->lo[a] : r->lo[a];
+		node->hi[a] = l->hi[a] > r->hi[a] ? l->hi[a] : r->hi[a];
+	}
+	mergeCones(node, l, r);
+	node->power = l->power + r->power;
+	node->a0 = l->a0 < r->a0 ? l->a0 : r->a0;
+	node->a1 = l->a1 < r->a1 ? l->a1 : r->a1;
+	node->a2 = l->a2 < r->a2 ? l->a2 : r->a2;
+	node->left = left;
+	node->right = right;
+	node->light = -1;
+	return index;
+}
+
+// build the light tree over the light table of the grid, returns NULL for a scene without lights
+LightTree* buildLightTree(Object** objects, LightGrid* grid) {
+	if (grid->count == 0) {
+		return NULL;
+	}
+	LightTree* tree = malloc(sizeof(LightTree));
+	int* slots = malloc(sizeof(int) * grid->count);
+	tree->nodes = malloc(sizeof(LightNode) * (2 * grid->count - 1));
+	if (tree == NULL || slots == NULL || tree->nodes == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the light tree.\n");
+		exit(1);
+	}
+	int i;
+	for (i = 0; i < grid->count; i++) {
+		slots[i] = i;
+	}
+	tree->count = 0;
+	tree->root = buildLightNode(tree, objects, grid, slots, 0, grid->count);
+	free(slots);
+	return tree;
+}
+
+void freeLightTree(LightTree* tree) {
+	if (tree == NULL) {
+		return;
+	}
+	free(tree->nodes);
+	free(tree);
+}
+
+// lightImportance() estimates how much light the node sends to the point p with normal N.
+// It is only 0 when no light below the node can light the point.
+static double lightImportance(LightNode* node, LightGrid* grid, double* p, double* N) {
+	if (node->light >= 0 && !lightReaches(grid, node->light, p)) {
+		return 0;
+	}
+	double c[3];
+	double w[3];
+	double halfDiagonal2 = 0;
+	int a;
+	for (a = 0; a < 3; a++) {
+		c[a] = (node->lo[a] + node->hi[a]) / 2;
+		w[a] = c[a] - p[a];
+		halfDiagonal2 += sqr(node->hi[a] - node->lo[a]) / 4;
+	}
+	double distance2 = sqr(w[0]) + sqr(w[1]) + sqr(w[2]);
+	// inside the bounds we cannot tell which light is closer
+	double d = sqrt(distance2 > halfDiagonal2 ? distance2 : halfDiagonal2);
+	double attenuation = node->a0 + node->a1 * d + node->a2 * sqr(d);
+	if (attenuation < 1e-12) {
+		attenuation = 1e-12;
+	}
+	double importance = node->power / attenuation;
+	if (distance2 <= halfDiagonal2 || distance2 == 0) {
+		return importance;
+	}
+	double distance = sqrt(distance2);
+	w[0] /= distance;
+	w[1] /= distance;
+	w[2] /= distance;
+	// angle that the bounds take up as seen from p
+	double bounds = asin(sqrt(halfDiagonal2 / distance2));
+
+	// the point has to be inside the spot cone, the cone points from the lights to p
+	if (node->spread < M_PI) {
+		double cosCone = -(node->axis[0] * w[0] + node->axis[1] * w[1] + node->axis[2] * w[2]);
+		double angle = acos(cosCone < -1 ? -1 : (cosCone > 1 ? 1 : cosCone));
+		if (angle - node->spread - bounds > 0) {
+			return 0;
+		}
+	}
+	// and the lights have to be above the surface
+	double cosSurface = N[0] * w[0] + N[1] * w[1] + N[2] * w[2];
+	double angle = acos(cosSurface < -1 ? -1 : (cosSurface > 1 ? 1 : cosSurface)) - bounds;
+	if (angle >= M_PI / 2) {
+		return 0;
+	}
+	return angle > 0 ? importance * cos(angle) : importance;
+}
+
+// sampleLightTree() picks one light for the point p with normal N and returns its slot in the
+// light table, pdf is set to the probability of that pick. -1 means no light reaches p.
+int sampleLightTree(LightTree* tree, LightGrid* grid, double* p, double* N, double* pdf) {
+	LightNode* node = &tree->nodes[tree->root];
+	*pdf = 1;
+	if (lightImportance(node, grid, p, N) <= 0) {
+		return -1;
+	}
+	while (node->light < 0) {
+		double left = lightImportance(&tree->nodes[node->left], grid, p, N);
+		double right = lightImportance(&tree->nodes[node->right], grid, p, N);
+		if (left + right <= 0) {
+			return -1;
+		}
+		double pLeft = left / (left + right);
+		if (random01() < pLeft) {
+			node = &tree->nodes[node->left];
+			*pdf *= pLeft;
+		}
+		else {
+			node = &tree->nodes[node->right];
+			*pdf *= 1 - pLeft;
+		}
+	}
+	return node->light;
+}
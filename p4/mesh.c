@@ -0,0 +1,649 @@
+// Triangle meshes
+// A mesh object reads its triangles from an OBJ or PLY file. The vertices are kept as float32
+// and the triangles as uint32 vertex indices, and every mesh gets its own bvh. After a file is
+// read the first time, the arrays and the bvh are written to file.cache next to it. The next
+// time the cache is mapped with mmap() and used as it is, nothing is parsed or built, so a big
+// mesh loads as fast as the disk can read it. The cache is only used while the size and the
+// modification time of the mesh file match the ones stored in it.
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MESH_CACHE_MAGIC "RCMESH1"
+
+typedef struct {
+	char magic[8];
+	long long sourceSize;   // size and modification time of the mesh file the cache was made from
+	long long sourceTime;
+	int vertexCount;
+	int triangleCount;
+	int nodeCount;
+	int wideCount;
+	long long vertexOffset; // where each array starts in the file, every one on a 64 byte boundary
+	long long indexOffset;
+	long long primOffset;
+	long long nodeOffset;
+	long long wideOffset;
+	long long size;         // size of the whole cache file
+} MeshCacheHeader;
+
+// what loadMeshes() did, for -stats
+int meshCacheHits;
+double meshLoadSeconds;
+
+// growArray() makes room for at least needed elements of size bytes in data
+static void* growArray(void* data, long* capacity, long needed, size_t size) {
+	if (needed <= *capacity) {
+		return data;
+	}
+	long grown = *capacity > 0 ? *capacity : 1024;
+	while (grown < needed) {
+		grown *= 2;
+	}
+	data = realloc(data, size * grown);
+	if (data == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the mesh.\n");
+		exit(1);
+	}
+	*capacity = grown;
+	return data;
+}
+
+// readOBJ() reads the vertices ("v x y z") and faces ("f a b c ...") of an OBJ file, one line
+// at a time. Faces with more than 3 corners are split into a fan of triangles, the texture
+// and normal indices after the slashes are skipped and negative indices count from the end.
+static void readOBJ(FILE* file, Mesh* mesh) {
+	char* text = NULL;
+	size_t textSize = 0;
+	long vertexCapacity = 0, indexCapacity = 0, cornerCapacity = 0;
+	long vertexCount = 0, triangleCount = 0;
+	float* vertices = NULL;
+	uint32_t* indices = NULL;
+	long* corners = NULL;
+	int lineNumber = 0;
+	while (getline(&text, &textSize, file) > 0) {
+		lineNumber += 1;
+		char* p = text;
+		char* end;
+		while (*p == ' ' || *p == '\t') p++;
+		if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+			vertices = growArray(vertices, &vertexCapacity, (vertexCount + 1) * 3, sizeof(float));
+			int a;
+			p += 1;
+			for (a = 0; a < 3; a++) {
+				vertices[vertexCount * 3 + a] = strtof(p, &end);
+				if (end == p) {
+					fprintf(stderr, "Error: a vertex needs 3 numbers on line %d of %s.\n", lineNumber, mesh->file);
+					exit(1);
+				}
+				p = end;
+			}
+			vertexCount += 1;
+		}
+		else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+			int n = 0, k;
+			p += 1;
+			while (1) {
+				long index = strtol(p, &end, 10);
+				if (end == p) break;
+				p = end;
+				while (*p != 0 && !isspace((unsigned char)*p)) p++;
+				if (index < 0) {
+					index += vertexCount + 1;
+				}
+				if (index < 1) {
+					fprintf(stderr, "Error: a face uses a missing vertex on line %d of %s.\n", lineNumber, mesh->file);
+					exit(1);
+				}
+				corners = growArray(corners, &cornerCapacity, n + 1, sizeof(long));
+				corners[n++] = index - 1;
+			}
+			if (n < 3) {
+				fprintf(stderr, "Error: a face needs 3 vertices on line %d of %s.\n", lineNumber, mesh->file);
+				exit(1);
+			}
+			indices = growArray(indices, &indexCapacity, (triangleCount + n - 2) * 3, sizeof(uint32_t));
+			for (k = 1; k + 1 < n; k++) {
+				indices[triangleCount * 3] = (uint32_t)corners[0];
+				indices[triangleCount * 3 + 1] = (uint32_t)corners[k];
+				indices[triangleCount * 3 + 2] = (uint32_t)corners[k + 1];
+				triangleCount += 1;
+			}
+		}
+	}
+	free(text);
+	free(corners);
+	mesh->vertexCount = (int)vertexCount;
+	mesh->triangleCount = (int)triangleCount;
+	mesh->vertices = vertices;
+	mesh->indices = indices;
+}
+
+// the size of a PLY property type, 0 for an unknown type
+static int plyTypeSize(char* type) {
+	if (strcmp(type, "char") == 0 || strcmp(type, "uchar") == 0 || strcmp(type, "int8") == 0 || strcmp(type, "uint8") == 0) return 1;
+	if (strcmp(type, "short") == 0 || strcmp(type, "ushort") == 0 || strcmp(type, "int16") == 0 || strcmp(type, "uint16") == 0) return 2;
+	if (strcmp(type, "int") == 0 || strcmp(type, "uint") == 0 || strcmp(type, "int32") == 0 || strcmp(type, "uint32") == 0 ||
+		strcmp(type, "float") == 0 || strcmp(type, "float32") == 0) return 4;
+	if (strcmp(type, "double") == 0 || strcmp(type, "float64") == 0) return 8;
+	return 0;
+}
+
+// plyValue() reads one value of the given type, as text or as little endian binary
+static double plyValue(FILE* file, int ascii, char* type) {
+	if (ascii) {
+		double value;
+		if (fscanf(file, "%lf", &value) != 1) {
+			fprintf(stderr, "Error: the PLY file ends too early.\n");
+			exit(1);
+		}
+		return value;
+	}
+	unsigned char bytes[8];
+	int size = plyTypeSize(type);
+	if (fread(bytes, 1, size, file) != (size_t)size) {
+		fprintf(stderr, "Error: the PLY file ends too early.\n");
+		exit(1);
+	}
+	if (strcmp(type, "float") == 0 || strcmp(type, "float32") == 0) {
+		float f;
+		memcpy(&f, bytes, 4);
+		return f;
+	}
+	if (size == 8) {
+		double d;
+		memcpy(&d, bytes, 8);
+		return d;
+	}
+	int isSigned = type[0] != 'u';
+	if (size == 1) return isSigned ? (double)(signed char)bytes[0] : (double)bytes[0];
+	if (size == 2) {
+		uint16_t u;
+		memcpy(&u, bytes, 2);
+		return isSigned ? (double)(int16_t)u : (double)u;
+	}
+	uint32_t u;
+	memcpy(&u, bytes, 4);
+	return isSigned ? (double)(int32_t)u : (double)u;
+}
+
+#define PLY_MAX_ELEMENTS 16
+#define PLY_MAX_PROPERTIES 32
+
+typedef struct {
+	char name[64];
+	long count;
+	int propertyCount;
+	char property[PLY_MAX_PROPERTIES][64];
+	char type[PLY_MAX_PROPERTIES][16];      // type of the value, or of the items of a list
+	char countType[PLY_MAX_PROPERTIES][16]; // type of the length of a list, empty for a value
+} PLYElement;
+
+// readPLY() reads the x, y and z of the "vertex" element and the vertex_indices lists of the
+// "face" element of an ascii or binary little endian PLY file. Other elements and properties
+// are read and skipped.
+static void readPLY(FILE* file, Mesh* mesh) {
+	char text[256];
+	PLYElement elements[PLY_MAX_ELEMENTS];
+	int elementCount = 0, ascii = -1, e, k;
+	if (fgets(text, sizeof(text), file) == NULL || strncmp(text, "ply", 3) != 0) {
+		fprintf(stderr, "Error: %s is not a PLY file.\n", mesh->file);
+		exit(1);
+	}
+	while (1) {
+		if (fgets(text, sizeof(text), file) == NULL) {
+			fprintf(stderr, "Error: the header of %s has no end_header.\n", mesh->file);
+			exit(1);
+		}
+		char word[4][64];
+		int words = sscanf(text, "%63s %63s %63s %63s", word[0], word[1], word[2], word[3]);
+		if (words <= 0) continue;
+		if (strcmp(word[0], "end_header") == 0) break;
+		if (strcmp(word[0], "format") == 0 && words >= 2) {
+			if (strcmp(word[1], "ascii") == 0) ascii = 1;
+			else if (strcmp(word[1], "binary_little_endian") == 0) ascii = 0;
+			else {
+				fprintf(stderr, "Error: the PLY format %s of %s is not supported.\n", word[1], mesh->file);
+				exit(1);
+			}
+		}
+		else if (strcmp(word[0], "element") == 0 && words >= 3) {
+			if (elementCount == PLY_MAX_ELEMENTS) {
+				fprintf(stderr, "Error: %s has too many elements.\n", mesh->file);
+				exit(1);
+			}
+			PLYElement* element = &elements[elementCount++];
+			memset(element, 0, sizeof(PLYElement));
+			strcpy(element->name, word[1]);
+			// the vertices and triangle corners are numbered with ints
+			char* end;
+			element->count = strtol(word[2], &end, 10);
+			if (*end != 0 || element->count < 0 || element->count > INT_MAX / 3) {
+				fprintf(stderr, "Error: the element %s of %s has an invalid count.\n", element->name, mesh->file);
+				exit(1);
+			}
+		}
+		else if (strcmp(word[0], "property") == 0 && elementCount > 0) {
+			PLYElement* element = &elements[elementCount - 1];
+			if (element->propertyCount == PLY_MAX_PROPERTIES) {
+				fprintf(stderr, "Error: %s has too many properties.\n", mesh->file);
+				exit(1);
+			}
+			k = element->propertyCount++;
+			char* type = NULL;
+			char* countType = "";
+			if (strcmp(word[1], "list") == 0 && words == 4) {
+				// property list <count type> <item type> <name>
+				countType = word[2];
+				type = word[3];
+				sscanf(text, "%*s %*s %*s %*s %63s", element->property[k]);
+			}
+			else if (words >= 3) {
+				type = word[1];
+				strcpy(element->property[k], word[2]);
+			}
+			// the names of all known types fit into the type fields, others are rejected before they are copied
+			if (type == NULL || plyTypeSize(type) == 0 || (countType[0] != 0 && plyTypeSize(countType) == 0)) {
+				fprintf(stderr, "Error: unknown PLY property type in %s.\n", mesh->file);
+				exit(1);
+			}
+			strcpy(element->type[k], type);
+			strcpy(element->countType[k], countType);
+		}
+	}
+	if (ascii < 0) {
+		fprintf(stderr, "Error: the header of %s has no format.\n", mesh->file);
+		exit(1);
+	}
+
+	long indexCapacity = 0, triangleCount = 0;
+	uint32_t* indices = NULL;
+	float* vertices = NULL;
+	long vertexCount = 0;
+	for (e = 0; e < elementCount; e++) {
+		PLYElement* element = &elements[e];
+		int isVertex = strcmp(element->name, "vertex") == 0;
+		int isFace = strcmp(element->name, "face") == 0;
+		if (isVertex) {
+			vertexCount = element->count;
+			vertices = malloc(sizeof(float) * 3 * (vertexCount + 1));
+			if (vertices == NULL) {
+				fprintf(stderr, "Error: Could not allocate memory for the mesh.\n");
+				exit(1);
+			}
+		}
+		long r;
+		for (r = 0; r < element->count; r++) {
+			for (k = 0; k < element->propertyCount; k++) {
+				if (element->countType[k][0] == 0) {
+					double value = plyValue(file, ascii, element->type[k]);
+					if (isVertex && element->property[k][1] == 0 && element->property[k][0] >= 'x' && element->property[k][0] <= 'z') {
+						vertices[r * 3 + element->property[k][0] - 'x'] = (float)value;
+					}
+					continue;
+				}
+				int n = (int)plyValue(file, ascii, element->countType[k]);
+				int corners = isFace && (strcmp(element->property[k], "vertex_indices") == 0 || strcmp(element->property[k], "vertex_index") == 0);
+				if (corners && n < 3) {
+					fprintf(stderr, "Error: a face of %s has less than 3 vertices.\n", mesh->file);
+					exit(1);
+				}
+				if (corners) {
+					indices = growArray(indices, &indexCapacity, (triangleCount + n - 2) * 3, sizeof(uint32_t));
+				}
+				uint32_t first = 0, previous = 0;
+				int c;
+				for (c = 0; c < n; c++) {
+					uint32_t index = (uint32_t)plyValue(file, ascii, element->type[k]);
+					if (!corners) continue;
+					// a fan of triangles around the first corner
+					if (c >= 2) {
+						indices[triangleCount * 3] = first;
+						indices[triangleCount * 3 + 1] = previous;
+						indices[triangleCount * 3 + 2] = index;
+						triangleCount += 1;
+					}
+					if (c == 0) first = index;
+					previous = index;
+				}
+			}
+		}
+	}
+	mesh->vertexCount = (int)vertexCount;
+	mesh->triangleCount = (int)triangleCount;
+	mesh->vertices = vertices;
+	mesh->indices = indices;
+}
+
+// bounds of triangle i of the mesh data
+static void triangleBounds(void* data, int i, double* lo, double* hi) {
+	Mesh* mesh = data;
+	int a, c;
+	for (a = 0; a < 3; a++) {
+		lo[a] = INFINITY;
+		hi[a] = -INFINITY;
+	}
+	for (c = 0; c < 3; c++) {
+		float* v = &mesh->vertices[mesh->indices[i * 3 + c] * 3];
+		for (a = 0; a < 3; a++) {
+			if (v[a] < lo[a]) lo[a] = v[a];
+			if (v[a] > hi[a]) hi[a] = v[a];
+		}
+	}
+}
+
+// the leaf test of the mesh data (Moller-Trumbore), the ray is in the space of the mesh
+static inline int triangleLeaf(void* data, int i, double* Ro, double* Rd, double* bestT, int skip) {
+	Mesh* mesh = data;
+	if (i == skip) {
+		return -1;
+	}
+	float* v0 = &mesh->vertices[mesh->indices[i * 3] * 3];
+	float* v1 = &mesh->vertices[mesh->indices[i * 3 + 1] * 3];
+	float* v2 = &mesh->vertices[mesh->indices[i * 3 + 2] * 3];
+	double e1[3] = { v1[0] - v0[0], v1[1] - v0[1], v1[2] - v0[2] };
+	double e2[3] = { v2[0] - v0[0], v2[1] - v0[1], v2[2] - v0[2] };
+	double p[3] = { Rd[1] * e2[2] - Rd[2] * e2[1], Rd[2] * e2[0] - Rd[0] * e2[2], Rd[0] * e2[1] - Rd[1] * e2[0] };
+	double det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+	if (fabs(det) < 1e-18) {
+		return -1;
+	}
+	double inverse = 1 / det;
+	double s[3] = { Ro[0] - v0[0], Ro[1] - v0[1], Ro[2] - v0[2] };
+	double u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inverse;
+	if (u < 0 || u > 1) {
+		return -1;
+	}
+	double q[3] = { s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0] };
+	double v = (Rd[0] * q[0] + Rd[1] * q[1] + Rd[2] * q[2]) * inverse;
+	if (v < 0 || u + v > 1) {
+		return -1;
+	}
+	double t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inverse;
+	if (t > 0 && t < *bestT) {
+		*bestT = t;
+		return i;
+	}
+	return -1;
+}
+
+// writeMeshCache() stores the arrays and the bvh of the mesh in the cache file. A mesh still
+// renders when the cache cannot be written, it is only read again next time.
+static void writeMeshCache(Mesh* mesh, char* cacheName, struct stat* source) {
+	BVH* bvh = mesh->bvh;
+	MeshCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MESH_CACHE_MAGIC, 8);
+	header.sourceSize = source->st_size;
+	header.sourceTime = source->st_mtime;
+	header.vertexCount = mesh->vertexCount;
+	header.triangleCount = mesh->triangleCount;
+	header.nodeCount = bvh->nodeCount;
+	header.wideCount = bvh->wideCount;
+	void* arrays[5] = { mesh->vertices, mesh->indices, bvh->prims, bvh->nodes, bvh->wide };
+	long long sizes[5] = {
+		sizeof(float) * 3 * (long long)mesh->vertexCount, sizeof(uint32_t) * 3 * (long long)mesh->triangleCount,
+		sizeof(int) * (long long)bvh->count, sizeof(BVHNode) * (long long)bvh->nodeCount, sizeof(WideNode) * (long long)bvh->wideCount
+	};
+	long long* offsets[5] = { &header.vertexOffset, &header.indexOffset, &header.primOffset, &header.nodeOffset, &header.wideOffset };
+	long long offset = sizeof(header);
+	int i;
+	for (i = 0; i < 5; i++) {
+		offset = (offset + 63) / 64 * 64;
+		*offsets[i] = offset;
+		offset += sizes[i];
+	}
+	header.size = offset;
+	FILE* file = fopen(cacheName, "wb");
+	if (file == NULL) {
+		fprintf(stderr, "Warning: could not write the mesh cache %s.\n", cacheName);
+		return;
+	}
+	static const char zero[64] = { 0 };
+	int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	long long written = sizeof(header);
+	for (i = 0; i < 5 && ok; i++) {
+		ok = fwrite(zero, 1, *offsets[i] - written, file) == (size_t)(*offsets[i] - written);
+		ok = ok && fwrite(arrays[i], 1, sizes[i], file) == (size_t)sizes[i];
+		written = *offsets[i] + sizes[i];
+	}
+	if (fclose(file) != 0 || !ok) {
+		fprintf(stderr, "Warning: could not write the mesh cache %s.\n", cacheName);
+		remove(cacheName);
+	}
+}
+
+// meshCacheValid() checks that every array of a mapped cache lies inside the file and that the
+// triangles and the bvh only point at vertices, triangles and nodes that exist, so a cut short
+// or damaged cache is made again instead of being read out of bounds
+static int meshCacheValid(MeshCacheHeader* header) {
+	char* base = (char*)header;
+	if (header->vertexCount < 0 || header->triangleCount < 0 || header->nodeCount < 0 || header->wideCount < 0) {
+		return 0;
+	}
+	long long offsets[5] = { header->vertexOffset, header->indexOffset, header->primOffset, header->nodeOffset, header->wideOffset };
+	long long sizes[5] = {
+		sizeof(float) * 3 * (long long)header->vertexCount, sizeof(uint32_t) * 3 * (long long)header->triangleCount,
+		sizeof(int) * (long long)header->triangleCount, sizeof(BVHNode) * (long long)header->nodeCount,
+		sizeof(WideNode) * (long long)header->wideCount
+	};
+	long long i;
+	for (i = 0; i < 5; i++) {
+		if (offsets[i] < (long long)sizeof(MeshCacheHeader) || offsets[i] % 64 != 0 || offsets[i] > header->size ||
+			sizes[i] > header->size - offsets[i]) {
+			return 0;
+		}
+	}
+	uint32_t* indices = (uint32_t*)(base + header->indexOffset);
+	for (i = 0; i < 3LL * header->triangleCount; i++) {
+		if (indices[i] >= (uint32_t)header->vertexCount) return 0;
+	}
+	int* prims = (int*)(base + header->primOffset);
+	for (i = 0; i < header->triangleCount; i++) {
+		if (prims[i] < 0 || prims[i] >= header->triangleCount) return 0;
+	}
+	WideNode* wide = (WideNode*)(base + header->wideOffset);
+	for (i = 0; i < header->wideCount; i++) {
+		int c;
+		for (c = 0; c < 4; c++) {
+			int count = wide[i].count[c];
+			if (count == WIDE_EMPTY) continue;
+			if (count > 0 ? (long long)wide[i].child[c] + count > header->triangleCount : wide[i].child[c] >= (uint32_t)header->wideCount) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+// mapMeshCache() maps the cache file of the mesh and points the mesh and a new bvh into it.
+// Returns 0 when there is no cache, it does not belong to the mesh file any more or it is damaged.
+static int mapMeshCache(Mesh* mesh, char* cacheName, struct stat* source) {
+	int fd = open(cacheName, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(MeshCacheHeader)) {
+		close(fd);
+		return 0;
+	}
+	void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		return 0;
+	}
+	MeshCacheHeader* header = mapping;
+	if (memcmp(header->magic, MESH_CACHE_MAGIC, 8) != 0 || header->size != st.st_size ||
+		header->sourceSize != source->st_size || header->sourceTime != source->st_mtime || !meshCacheValid(header)) {
+		munmap(mapping, st.st_size);
+		return 0;
+	}
+	// start reading the whole file, the bvh is touched all over the place right away
+	madvise(mapping, st.st_size, MADV_WILLNEED);
+	char* base = mapping;
+	mesh->mapping = mapping;
+	mesh->mappingSize = st.st_size;
+	mesh->vertexCount = header->vertexCount;
+	mesh->triangleCount = header->triangleCount;
+	mesh->vertices = (float*)(base + header->vertexOffset);
+	mesh->indices = (uint32_t*)(base + header->indexOffset);
+	BVH* bvh = calloc(1, sizeof(BVH));
+	bvh->mapped = 1;
+	bvh->count = header->triangleCount;
+	bvh->bounds = triangleBounds;
+	bvh->data = mesh;
+	bvh->prims = (int*)(base + header->primOffset);
+	bvh->nodes = (BVHNode*)(base + header->nodeOffset);
+	bvh->nodeCount = header->nodeCount;
+	bvh->wide = (WideNode*)(base + header->wideOffset);
+	bvh->wideCount = header->wideCount;
+	mesh->bvh = bvh;
+	return 1;
+}
+
+// loadMesh() maps the cache of the mesh, or reads the mesh file, builds its bvh and writes the cache
+static void loadMesh(Mesh* mesh) {
+	struct stat source;
+	if (stat(mesh->file, &source) != 0) {
+		fprintf(stderr, "Error: Could not open the mesh file %s.\n", mesh->file);
+		exit(1);
+	}
+	char cacheName[1100];
+	// a cut off name could be the cache of another mesh, such a mesh is read without a cache
+	int nameLength = snprintf(cacheName, sizeof(cacheName), "%s.cache", mesh->file);
+	int cached = nameLength >= 0 && nameLength < (int)sizeof(cacheName);
+	if (cached && mapMeshCache(mesh, cacheName, &source)) {
+		meshCacheHits += 1;
+		return;
+	}
+	FILE* file = fopen(mesh->file, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "Error: Could not open the mesh file %s.\n", mesh->file);
+		exit(1);
+	}
+	size_t length = strlen(mesh->file);
+	if (length > 4 && strcasecmp(mesh->file + length - 4, ".ply") == 0) {
+		readPLY(file, mesh);
+	}
+	else if (length > 4 && strcasecmp(mesh->file + length - 4, ".obj") == 0) {
+		readOBJ(file, mesh);
+	}
+	else {
+		fprintf(stderr, "Error: the mesh file %s has to be .obj or .ply.\n", mesh->file);
+		exit(1);
+	}
+	fclose(file);
+	int i;
+	for (i = 0; i < mesh->triangleCount * 3; i++) {
+		if (mesh->indices[i] >= (uint32_t)mesh->vertexCount) {
+			fprintf(stderr, "Error: a triangle of %s uses a missing vertex.\n", mesh->file);
+			exit(1);
+		}
+	}
+	mesh->bvh = buildPrimitiveBVH(mesh->triangleCount, triangleBounds, mesh);
+	if (mesh->bvh != NULL && cached) {
+		writeMeshCache(mesh, cacheName, &source);
+	}
+}
+
+// loadMeshes() loads the triangles of every mesh of the scene and numbers them
+void loadMeshes(Scene* scene) {
+	struct timespec start, end;
+	int m;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	scene->meshFirst[0] = 0;
+	for (m = 0; m < scene->meshCount; m++) {
+		loadMesh(&scene->meshes[m]);
+		scene->meshFirst[m + 1] = scene->meshFirst[m] + scene->meshes[m].triangleCount;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	meshLoadSeconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+void freeMeshes(Scene* scene) {
+	int m;
+	for (m = 0; m < scene->meshCount; m++) {
+		Mesh* mesh = &scene->meshes[m];
+		freeBVH(mesh->bvh);
+		if (mesh->mapping != NULL) {
+			munmap(mesh->mapping, mesh->mappingSize);
+		}
+		else {
+			free(mesh->vertices);
+			free(mesh->indices);
+		}
+	}
+}
+
+// the ray Ro + t * Rd in the space of the mesh, t stays the same
+static inline void meshRay(Mesh* mesh, double* Ro, double* Rd, double* localRo, double* localRd) {
+	int a;
+	for (a = 0; a < 3; a++) {
+		localRo[a] = (Ro[a] - mesh->position[a]) / mesh->scale;
+		localRd[a] = Rd[a] / mesh->scale;
+	}
+}
+
+// closest triangle that the ray hits before bestT, returns its primitive or -1
+int meshIntersect(Scene* scene, double* Ro, double* Rd, double* bestT) {
+	int m, closest = -1;
+	for (m = 0; m < scene->meshCount; m++) {
+		Mesh* mesh = &scene->meshes[m];
+		if (mesh->bvh == NULL) continue;
+		double localRo[3], localRd[3];
+		meshRay(mesh, Ro, Rd, localRo, localRd);
+		int t = wideTraverse(mesh->bvh, localRo, localRd, bestT, -1, 0, triangleLeaf, mesh);
+		if (t >= 0) {
+			closest = triangleBase(scene) + scene->meshFirst[m] + t;
+		}
+	}
+	return closest;
+}
+
+// any triangle other than the primitive skip between Ro and maxT along Rd, returns its
+// primitive or -1
+int meshOccluded(Scene* scene, double* Ro, double* Rd, double maxT, int skip) {
+	int m;
+	for (m = 0; m < scene->meshCount; m++) {
+		Mesh* mesh = &scene->meshes[m];
+		if (mesh->bvh == NULL) continue;
+		double localRo[3], localRd[3];
+		meshRay(mesh, Ro, Rd, localRo, localRd);
+		int base = triangleBase(scene) + scene->meshFirst[m];
+		double t = maxT;
+		int hit = wideTraverse(mesh->bvh, localRo, localRd, &t, skip - base, 1, triangleLeaf, mesh);
+		if (hit >= 0) {
+			return base + hit;
+		}
+	}
+	return -1;
+}
+
+// the distance to the triangle primitive p along the ray, -1 for a miss
+double triangleIntersection(Scene* scene, int p, double* Ro, double* Rd) {
+	int m = primitiveMesh(scene, p);
+	Mesh* mesh = &scene->meshes[m];
+	double localRo[3], localRd[3];
+	double t = INFINITY;
+	meshRay(mesh, Ro, Rd, localRo, localRd);
+	return triangleLeaf(mesh, p - triangleBase(scene) - scene->meshFirst[m], localRo, localRd, &t, -1) >= 0 ? t : -1;
+}
+
+// the normal of the triangle primitive p, not normalized. The scale of a mesh is uniform, so
+// the normal in the space of the mesh points the same way in the world.
+void triangleNormal(Scene* scene, int p, double* N) {
+	int m = primitiveMesh(scene, p);
+	Mesh* mesh = &scene->meshes[m];
+	int i = p - triangleBase(scene) - scene->meshFirst[m];
+	float* v0 = &mesh->vertices[mesh->indices[i * 3] * 3];
+	float* v1 = &mesh->vertices[mesh->indices[i * 3 + 1] * 3];
+	float* v2 = &mesh->vertices[mesh->indices[i * 3 + 2] * 3];
+	double e1[3] = { v1[0] - v0[0], v1[1] - v0[1], v1[2] - v0[2] };
+	double e2[3] = { v2[0] - v0[0], v2[1] - v0[1], v2[2] - v0[2] };
+	N[0] = e1[1] * e2[2] - e1[2] * e2[1];
+	N[1] = e1[2] * e2[0] - e1[0] * e2[2];
+	N[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
@@ -111,9 +111,109 @@ double* nextVector(FILE* json) {
 	return v;
 }
 
+// the material table, every sphere and plane keeps the index of its material in here
+Material* materials = NULL;
+int materialCount = 0;
+int materialCapacity = 0;
+// open addressing hash table of material indices, -1 for an empty slot
+int* materialHash = NULL;
+int materialHashSize = 0;
+
+// the names of the prototypes in the order they were first used, spheres and instances keep
+// the index of their prototype
+char** prototypeNames = NULL;
+int prototypeCount = 0;
+// the image files of the textures, materials keep the index of their texture
+char** textureNames = NULL;
+int textureCount = 0;
+// the names of the light layers, lights with the same "layer" share one layer of -layers
+char** layerNames = NULL;
+int layerNameCount = 0;
+
+// nameIndex() returns the index of name in the table, a new name is added at the end
+int nameIndex(char*** names, int* count, char* name) {
+	int i;
+	for (i = 0; i < *count; i++) {
+		if (strcmp((*names)[i], name) == 0) {
+			return i;
+		}
+	}
+	*names = realloc(*names, sizeof(char*) * (*count + 1));
+	if (*names == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the names.\n");
+		exit(1);
+	}
+	(*names)[*count] = strdup(name);
+	return (*count)++;
+}
+
+// prototypeIndex() returns the index of the prototype with the given name, a new name is added
+int prototypeIndex(char* name) {
+	return nameIndex(&prototypeNames, &prototypeCount, name);
+}
+
+// hash of the bytes of a material (FNV-1a)
+unsigned int hashMaterial(Material* m) {
+	unsigned char* bytes = (unsigned char*)m;
+	unsigned int h = 2166136261u;
+	size_t i;
+	for (i = 0; i < sizeof(Material); i++) {
+		h = (h ^ bytes[i]) * 16777619u;
+	}
+	return h;
+}
+
+// addMaterial() returns the index of the material in the table, objects with the same
+// colors, reflectivity, refractivity and ior share one entry
+int addMaterial(Material* m) {
+	int i;
+	// keep the hash table at most half full
+	if (2 * (materialCount + 1) > materialHashSize) {
+		free(materialHash);
+		materialHashSize = materialHashSize == 0 ? 64 : materialHashSize * 2;
+		materialHash = malloc(sizeof(int) * materialHashSize);
+		if (materialHash == NULL) {
+			fprintf(stderr, "Error: Could not allocate memory for the materials.\n");
+			exit(1);
+		}
+		for (i = 0; i < materialHashSize; i++) {
+			materialHash[i] = -1;
+		}
+		for (i = 0; i < materialCount; i++) {
+			unsigned int slot = hashMaterial(&materials[i]) & (materialHashSize - 1);
+			while (materialHash[slot] >= 0) {
+				slot = (slot + 1) & (materialHashSize - 1);
+			}
+			materialHash[slot] = i;
+		}
+	}
+	unsigned int slot = hashMaterial(m) & (materialHashSize - 1);
+	while (materialHash[slot] >= 0) {
+		if (memcmp(&materials[materialHash[slot]], m, sizeof(Material)) == 0) {
+			return materialHash[slot];
+		}
+		slot = (slot + 1) & (materialHashSize - 1);
+	}
+	if (materialCount == materialCapacity) {
+		materialCapacity = materialCapacity == 0 ? 16 : materialCapacity * 2;
+		materials = realloc(materials, sizeof(Material) * materialCapacity);
+		if (materials == NULL) {
+			fprintf(stderr, "Error: Could not allocate memory for the materials.\n");
+			exit(1);
+		}
+	}
+	materials[materialCount] = *m;
+	materialHash[slot] = materialCount;
+	return materialCount++;
+}
+
 // I modified a little bit in this readScene() function
-void readScene(char* filename, Object** objects) {
+// it returns a NULL terminated list of objects, the list grows while the file is read
+// so scenes with thousands of lights are fine
+Object** readScene(char* filename) {
 	int c;
+	int capacity = 128;
+	Object** objects = malloc(sizeof(Object*) * capacity);
 	FILE* json = fopen(filename, "r");
 	if (json == NULL) {
 		fprintf(stderr, "Error: Could not open the file %s.\n", filename);
@@ -128,7 +228,18 @@ void readScene(char* filename, Object** objects) {
 	// Find the objects
 	int i = 0;
 	while (1) {
-		Object* object = malloc(sizeof(Object));
+		// keep room for this object and the NULL at the end
+		if (i + 2 > capacity) {
+			capacity *= 2;
+			objects = realloc(objects, sizeof(Object*) * capacity);
+			if (objects == NULL) {
+				fprintf(stderr, "Error: Could not allocate memory for the objects.\n");
+				fclose(json);
+				exit(1);
+			}
+		}
+		// calloc so the properties which are not in the file start from 0
+		Object* object = calloc(1, sizeof(Object));
 		objects[i] = object;
 		c = fgetc(json);
 		if (c == ']') {
@@ -156,25 +267,40 @@ void readScene(char* filename, Object** objects) {
 
 			// this tempKey is used to check if it is a sphere position or plane position, and sphere color or plane color
 			char* tempKey = value;
+			// the material of a sphere or plane is read here and put in the material table
+			// when the object is done
+			Material material;
+			memset(&material, 0, sizeof(Material));
+			material.ior = 1;
+			material.textureScale = 1;
+			material.texture = -1;
 			// save the kind value for the object
 			if (strcmp(value, "camera") == 0) {
 				objects[i]->kind = 0;
 			}
 			else if (strcmp(value, "sphere") == 0) {
 				objects[i]->kind = 1;
-				objects[i]->sphere.reflectivity = 0;
-				objects[i]->sphere.refractivity = 0;
-				objects[i]->sphere.ior = 1;
 			}
 			else if (strcmp(value, "plane") == 0) {
 				objects[i]->kind = 2;
-				objects[i]->plane.reflectivity = 0;
-				objects[i]->plane.refractivity = 0;
-				objects[i]->plane.ior = 1;
 			}
 			else if (strcmp(value, "light") == 0){
 				objects[i]->kind = 3;
 				objects[i]->light.ns = 20;
+				objects[i]->light.layer = -1;
+			}
+			else if (strcmp(value, "instance") == 0) {
+				objects[i]->kind = 4;
+				objects[i]->instance.prototype = -1;
+				objects[i]->instance.scale = 1;
+			}
+			else if (strcmp(value, "mesh") == 0) {
+				objects[i]->kind = 5;
+				objects[i]->mesh.scale = 1;
+			}
+			else if (strcmp(value, "points") == 0) {
+				objects[i]->kind = 6;
+				objects[i]->points.scale = 1;
 			}
 			else {
 				fprintf(stderr, "Error: Unknown type, \"%s\", on line number %d.\n", value, line);
@@ -189,6 +315,30 @@ void readScene(char* filename, Object** objects) {
 				c = nextC(json);
 				if (c == '}') {
 					// stop parsing this object
+					if (objects[i]->kind == 1) {
+						objects[i]->sphere.material = addMaterial(&material);
+					}
+					else if (objects[i]->kind == 5) {
+						if (objects[i]->mesh.file == NULL) {
+							fprintf(stderr, "Error: a mesh needs a \"file\" on line %d.\n", line);
+							fclose(json);
+							exit(1);
+						}
+						objects[i]->mesh.material = addMaterial(&material);
+					}
+					else if (objects[i]->kind == 6 && objects[i]->points.file == NULL) {
+						fprintf(stderr, "Error: a points object needs a \"file\" on line %d.\n", line);
+						fclose(json);
+						exit(1);
+					}
+					else if (objects[i]->kind == 4 && objects[i]->instance.prototype < 0) {
+						fprintf(stderr, "Error: an instance needs a \"prototype\" on line %d.\n", line);
+						fclose(json);
+						exit(1);
+					}
+					else if (objects[i]->kind == 2) {
+						objects[i]->plane.material = addMaterial(&material);
+					}
 					break;
 				}
 				else if (c == ',') {
@@ -203,7 +353,8 @@ void readScene(char* filename, Object** objects) {
 					// a good choice to get those values
 					if ((strcmp(key, "width") == 0) || (strcmp(key, "height") == 0) ||
 						(strcmp(key, "radius") == 0) || (strcmp(key, "reflectivity") == 0) ||
-						(strcmp(key, "refractivity") == 0) || (strcmp(key, "ior") == 0)) {
+						(strcmp(key, "refractivity") == 0) || (strcmp(key, "ior") == 0) ||
+						(strcmp(key, "scale") == 0) || (strcmp(key, "texture_scale") == 0)) {
 						double value = nextNumber(json);
 						// Also, object[i]->someObject.property = value would be the solution for
 						// saving value into the object.
@@ -229,6 +380,11 @@ void readScene(char* filename, Object** objects) {
 							if (strcmp(tempKey, "sphere") == 0){
 								objects[i]->sphere.radius = value;
 							}
+							else if (strcmp(tempKey, "light") == 0 && value > 0) {
+								// a sphere light
+								objects[i]->light.radius = value;
+								objects[i]->light.shape = 1;
+							}
 							else{
 								fprintf(stderr, "Error: Unknown type!\n");
 								exit(1);
@@ -236,10 +392,10 @@ void readScene(char* filename, Object** objects) {
 						}
 						else if (strcmp(key, "reflectivity") == 0){
 							if (strcmp(tempKey, "sphere") == 0){
-								objects[i]->sphere.reflectivity = value;
+								material.reflectivity = value;
 							}
-							else if (strcmp(tempKey, "plane") == 0){
-								objects[i]->plane.reflectivity = value;
+							else if (strcmp(tempKey, "plane") == 0 || strcmp(tempKey, "mesh") == 0){
+								material.reflectivity = value;
 							}
 							else{
 								fprintf(stderr, "Error: Unknow type!\n");
@@ -248,22 +404,46 @@ void readScene(char* filename, Object** objects) {
 						}
 						else if (strcmp(key, "refractivity") == 0){
 							if (strcmp(tempKey, "sphere") == 0){
-								objects[i]->sphere.refractivity = value;
+								material.refractivity = value;
 							}
-							else if (strcmp(tempKey, "plane") == 0){
-								objects[i]->plane.refractivity = value;
+							else if (strcmp(tempKey, "plane") == 0 || strcmp(tempKey, "mesh") == 0){
+								material.refractivity = value;
 							}
 							else{
 								fprintf(stderr, "Error: Unknown type!\n");
 								exit(1);
 							}
 						}
+						else if (strcmp(key, "texture_scale") == 0) {
+							if (strcmp(tempKey, "plane") == 0 && value > 0) {
+								material.textureScale = value;
+							}
+							else {
+								fprintf(stderr, "Error: \"texture_scale\" has to be above 0 and belongs to a plane!\n");
+								exit(1);
+							}
+						}
+						else if (strcmp(key, "scale") == 0) {
+							if (strcmp(tempKey, "instance") == 0 && value > 0) {
+								objects[i]->instance.scale = value;
+							}
+							else if (strcmp(tempKey, "mesh") == 0 && value > 0) {
+								objects[i]->mesh.scale = value;
+							}
+							else if (strcmp(tempKey, "points") == 0 && value > 0) {
+								objects[i]->points.scale = value;
+							}
+							else {
+								fprintf(stderr, "Error: \"scale\" has to be above 0 and belongs to an instance, a mesh or points!\n");
+								exit(1);
+							}
+						}
 						else{
 							if (strcmp(tempKey, "sphere") == 0){
-								objects[i]->sphere.ior = value;
+								material.ior = value;
 							}
-							else if (strcmp(tempKey, "plane") == 0){
-								objects[i]->plane.ior = value;
+							else if (strcmp(tempKey, "plane") == 0 || strcmp(tempKey, "mesh") == 0){
+								material.ior = value;
 							}
 							else{
 								fprintf(stderr, "Error: Unknow type!\n");
@@ -275,7 +455,8 @@ void readScene(char* filename, Object** objects) {
 					// so we would like to read that as a 3d vector, and saving the values into sphere object or plane object.
 					else if ((strcmp(key, "color") == 0) || (strcmp(key, "position") == 0) ||
 						(strcmp(key, "normal") == 0) || (strcmp(key, "diffuse_color") == 0) ||
-						(strcmp(key, "specular_color") == 0) || (strcmp(key, "direction") == 0)) {
+						(strcmp(key, "specular_color") == 0) || (strcmp(key, "direction") == 0) ||
+						(strcmp(key, "rotation") == 0) || (strcmp(key, "edge_u") == 0) || (strcmp(key, "edge_v") == 0)) {
 						double* value = nextVector(json);
 						if (strcmp(key, "color") == 0){
 							if (strcmp(tempKey, "light") == 0){
@@ -316,6 +497,21 @@ void readScene(char* filename, Object** objects) {
 								objects[i]->light.position[1] = value[1];
 								objects[i]->light.position[2] = value[2];
 							}
+							else if (strcmp(tempKey, "instance") == 0) {
+								objects[i]->instance.position[0] = value[0];
+								objects[i]->instance.position[1] = value[1];
+								objects[i]->instance.position[2] = value[2];
+							}
+							else if (strcmp(tempKey, "mesh") == 0) {
+								objects[i]->mesh.position[0] = value[0];
+								objects[i]->mesh.position[1] = value[1];
+								objects[i]->mesh.position[2] = value[2];
+							}
+							else if (strcmp(tempKey, "points") == 0) {
+								objects[i]->points.position[0] = value[0];
+								objects[i]->points.position[1] = value[1];
+								objects[i]->points.position[2] = value[2];
+							}
 							else {
 								fprintf(stderr, "Error: Unknown type!\n");
 								exit(1);
@@ -323,14 +519,14 @@ void readScene(char* filename, Object** objects) {
 						}
 						else if (strcmp(key, "diffuse_color") == 0){
 							if (strcmp(tempKey, "sphere") == 0){
-								objects[i]->sphere.diffuseColor[0] = value[0];
-								objects[i]->sphere.diffuseColor[1] = value[1];
-								objects[i]->sphere.diffuseColor[2] = value[2];
+								material.diffuseColor[0] = value[0];
+								material.diffuseColor[1] = value[1];
+								material.diffuseColor[2] = value[2];
 							}
-							else if (strcmp(tempKey, "plane") == 0){
-								objects[i]->plane.diffuseColor[0] = value[0];
-								objects[i]->plane.diffuseColor[1] = value[1];
-								objects[i]->plane.diffuseColor[2] = value[2];
+							else if (strcmp(tempKey, "plane") == 0 || strcmp(tempKey, "mesh") == 0){
+								material.diffuseColor[0] = value[0];
+								material.diffuseColor[1] = value[1];
+								material.diffuseColor[2] = value[2];
 							}
 							else{
 								fprintf(stderr, "Error: Unknown type!\n");
@@ -339,20 +535,45 @@ void readScene(char* filename, Object** objects) {
 						}
 						else if (strcmp(key, "specular_color") == 0){
 							if (strcmp(tempKey, "sphere") == 0){
-								objects[i]->sphere.specularColor[0] = value[0];
-								objects[i]->sphere.specularColor[1] = value[1];
-								objects[i]->sphere.specularColor[2] = value[2];
+								material.specularColor[0] = value[0];
+								material.specularColor[1] = value[1];
+								material.specularColor[2] = value[2];
 							}
-							else if (strcmp(tempKey, "plane") == 0){
-								objects[i]->plane.specularColor[0] = value[0];
-								objects[i]->plane.specularColor[1] = value[1];
-								objects[i]->plane.specularColor[2] = value[2];
+							else if (strcmp(tempKey, "plane") == 0 || strcmp(tempKey, "mesh") == 0){
+								material.specularColor[0] = value[0];
+								material.specularColor[1] = value[1];
+								material.specularColor[2] = value[2];
 							}
 							else{
 								fprintf(stderr, "Error: Unknown type!\n");
 								exit(1);
 							}
 						}
+						else if (strcmp(key, "rotation") == 0) {
+							if (strcmp(tempKey, "instance") == 0) {
+								objects[i]->instance.rotation[0] = value[0];
+								objects[i]->instance.rotation[1] = value[1];
+								objects[i]->instance.rotation[2] = value[2];
+							}
+							else {
+								fprintf(stderr, "Error: Unknown type!\n");
+								exit(1);
+							}
+						}
+						else if (strcmp(key, "edge_u") == 0 || strcmp(key, "edge_v") == 0) {
+							// a rectangle light with these edges
+							if (strcmp(tempKey, "light") == 0) {
+								double* edge = strcmp(key, "edge_u") == 0 ? objects[i]->light.edgeU : objects[i]->light.edgeV;
+								edge[0] = value[0];
+								edge[1] = value[1];
+								edge[2] = value[2];
+								objects[i]->light.shape = 2;
+							}
+							else {
+								fprintf(stderr, "Error: only lights can have edges, line %d.\n", line);
+								exit(1);
+							}
+						}
 						else if (strcmp(key, "normal") == 0){
 							if (strcmp(tempKey, "plane") == 0){
 								objects[i]->plane.normal[0] = value[0];
@@ -428,6 +649,55 @@ void readScene(char* filename, Object** objects) {
 								exit(1);
 							}
 						}
+					else if (strcmp(key, "file") == 0) {
+						if (strcmp(tempKey, "mesh") == 0) {
+							objects[i]->mesh.file = nextString(json);
+						}
+						else if (strcmp(tempKey, "points") == 0) {
+							objects[i]->points.file = nextString(json);
+						}
+						else {
+							fprintf(stderr, "Error: only a mesh or points can have a file, line %d.\n", line);
+							fclose(json);
+							exit(1);
+						}
+					}
+					// a sphere with a prototype is only drawn through the instances of that prototype
+					else if (strcmp(key, "prototype") == 0) {
+						char* name = nextString(json);
+						if (strcmp(tempKey, "sphere") == 0) {
+							objects[i]->sphere.prototype = prototypeIndex(name) + 1;
+						}
+						else if (strcmp(tempKey, "instance") == 0) {
+							objects[i]->instance.prototype = prototypeIndex(name);
+						}
+						else {
+							fprintf(stderr, "Error: only spheres and instances can have a prototype, line %d.\n", line);
+							fclose(json);
+							exit(1);
+						}
+						free(name);
+					}
+					else if (strcmp(key, "texture") == 0) {
+						char* name = nextString(json);
+						if (strcmp(tempKey, "sphere") != 0 && strcmp(tempKey, "plane") != 0) {
+							fprintf(stderr, "Error: only spheres and planes can have a texture, line %d.\n", line);
+							fclose(json);
+							exit(1);
+						}
+						material.texture = nameIndex(&textureNames, &textureCount, name);
+						free(name);
+					}
+					else if (strcmp(key, "layer") == 0) {
+						char* name = nextString(json);
+						if (strcmp(tempKey, "light") != 0) {
+							fprintf(stderr, "Error: only lights can have a layer, line %d.\n", line);
+							fclose(json);
+							exit(1);
+						}
+						objects[i]->light.layer = nameIndex(&layerNames, &layerNameCount, name);
+						free(name);
+					}
 					else {
 						fprintf(stderr, "Error: Unkonwn property, %s, on line %d.\n", key, line);
 						fclose(json);
@@ -452,7 +722,7 @@ void readScene(char* filename, Object** objects) {
 				// the file does not have object anymore, so that I set the next object to NULL
 				// for easy use in  the future.
 				objects[i + 1] = NULL;
-				return;
+				return objects;
 			}
 			else {
 				fprintf(stderr, "Error: Expecting ',' or ']' on line %d.\n", line);
@@ -464,3 +734,12 @@ void readScene(char* filename, Object** objects) {
 		i = i + 1;
 	}
 }
+
+// freeObjects() frees a list that readScene() returned
+void freeObjects(Object** objects) {
+	int i;
+	for (i = 0; objects[i] != NULL; i++) {
+		free(objects[i]);
+	}
+	free(objects);
+}
@@ -1,5 +1,22 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// the surface of a sphere or plane, objects with the same values share one material
 typedef struct {
-  int kind; // 0 = camera, 1 = sphere, 2 = plane, 3 = light
+  double diffuseColor[3];
+  double specularColor[3];
+  double reflectivity;
+  double refractivity;
+  double ior;
+  double textureScale; // size of one repeat of the texture on a plane
+  int texture;         // index in the texture table, -1 for none
+} Material;
+
+typedef struct {
+  int kind; // 0 = camera, 1 = sphere, 2 = plane, 3 = light, 4 = instance, 5 = mesh, 6 = points
   union {
     struct {
       double width;
@@ -8,20 +25,13 @@ typedef struct {
     struct {
       double position[3];
       double radius;
-      double diffuseColor[3];
-      double specularColor[3];
-      double reflectivity;
-      double refractivity;
-      double ior;
+      int material; // index in the material table
+      int prototype; // 0 for a sphere of the world, j + 1 for a sphere of prototype j
     } sphere;
     struct {
       double position[3];
       double normal[3];
-      double diffuseColor[3];
-      double specularColor[3];
-      double reflectivity;
-      double refractivity;
-      double ior;
+      int material;
     } plane;
     struct {
       double position[3];
@@ -33,6 +43,132 @@ typedef struct {
       double radialA2;
       double angularA0;
       double ns;
+      int layer; // named layer of -layers the light shares with others, -1 for a layer of its own
+      int shape; // 0 = point, 1 = sphere of the radius, 2 = rectangle with the edges edgeU and edgeV around position
+      double radius;
+      double edgeU[3];
+      double edgeV[3];
     } light;
+    struct {
+      int prototype; // index in the prototype table of the parser
+      double position[3];
+      double rotation[3]; // degrees around x, then y, then z
+      double scale;
+    } instance;
+    struct {
+      char* file;  // OBJ or PLY file with the triangles
+      double position[3];
+      double scale;
+      int material;
+    } mesh;
+    struct {
+      char* file;  // binary file of sphere records, see pointCloud.c
+      double position[3];
+      double scale;
+    } points;
   };
 } Object;
+
+// an indexed triangle mesh, scaled and then moved to position. The vertices are float32 and
+// the indices uint32 so big meshes stay compact, they are either allocated by the loader or
+// point into the mapped mesh cache file.
+typedef struct {
+  char* file;
+  int vertexCount;
+  int triangleCount;
+  float* vertices;    // x, y, z of each vertex
+  uint32_t* indices;  // 3 vertices per triangle
+  double position[3];
+  double scale;
+  int material;
+  struct BVH* bvh;
+  void* mapping;      // the mapped cache file, NULL when the arrays were allocated
+  size_t mappingSize;
+} Mesh;
+
+// the geometry that rays are traced against, copied out of the objects after the scene is
+// read so the intersection loops only touch positions. Primitive p is sphere p for
+// p < sphereCount and plane p - sphereCount after that.
+typedef struct {
+  int sphereCount;
+  double* spheres;     // center x, y, z and radius of each sphere
+  int* sphereMaterial;
+  int planeCount;
+  double* planes;      // position x, y, z and normal x, y, z of each plane
+  int* planeMaterial;
+  int materialCount;
+  Material* materials;
+  // two-level instancing: the spheres of a prototype are stored once and every instance places
+  // them in the world with a rotation, uniform scale and translation, so they stay spheres.
+  // Sphere k of instance i is primitive sphereCount + planeCount + instanceFirst[i] + k.
+  int prototypeCount;
+  int* prototypeStart;      // prototype j has the spheres prototypeStart[j] ... prototypeStart[j + 1] - 1
+  double* prototypeSpheres; // center and radius in the space of the prototype
+  int* prototypeMaterial;
+  int instanceCount;
+  int* instancePrototype;
+  double* instanceTransform; // 12 per instance: scale * rotation (3 x 3, by rows) and the translation
+  double* instanceInverse;   // 9 per instance: the inverse of scale * rotation
+  int* instanceFirst;        // instanceCount + 1 entries, first instanced primitive of every instance
+  // triangle t of mesh m is primitive triangleBase + meshFirst[m] + t, after the instanced spheres
+  int meshCount;
+  Mesh* meshes;
+  int* meshFirst;            // meshCount + 1 entries, filled when the meshes are loaded
+} Scene;
+
+// options given after the required arguments on the command line
+typedef struct {
+  double cutoff; // lights are ignored where their luminance falls below this, 0 = never
+  int stats;     // print the render statistics when the frame is done
+  int raster;    // find the primary hits with the visibility buffer instead of rays
+  int bvh;       // 0 = test every sphere, 1 = binary bvh, 2 = wide quantized bvh
+  int bvhBench;  // time the primary rays through both bvh layouts after the render
+  int lightBudget; // lights sampled from the light tree per shading point, 0 = shade every light
+  int occluderGrid; // cells per cube face side of the per light occluder grid, 0 = no grid
+  int frames;    // number of frames of an animation, 0 = one image from plain file names
+  double sahLimit; // the bvh of an animation frame is rebuilt when its cost grows past this ratio
+  char* gbufferFile; // save the primary hits of the render to this file, NULL = do not save
+  char* relightFile;  // shade the primary hits saved in this file instead of tracing them, NULL = trace
+  char* layersFile;   // save the contribution of every light layer to this file, NULL = do not save
+  char* recomposeFile; // make the image from the layers in this file and the light colors, NULL = render
+  int incremental;     // only trace the tiles of a frame that the edits since the last frame can change
+  double shadeCache;   // cell size of the shading cache kept over the frames, 0 = no cache
+  double reproject;    // share of the pixels shaded again every frame when reusing the last frame, 0 = off
+  char* aovPrefix;     // write the depth, normal, albedo and id images with this prefix, NULL = do not write
+  int denoise;         // passes of the edge-avoiding filter over the image, 0 = no filter
+  int pathSamples;     // most paths traced per pixel by the path tracer, 0 = trace with recursiveShoot()
+  int sampler;         // 0 = independent random numbers, 1 = scrambled Sobol points where sample2D() is used
+  double pathError;    // a pixel stops sampling when the error of its mean falls below this share of it
+  int areaSamples;     // shadow rays added for an area light at a point in its penumbra
+  int caustics;        // photons emitted towards the refractive spheres every frame, 0 = no caustics
+  double textureCache; // MB of texture tiles kept in memory
+  int supersample;     // primary rays per pixel along each axis
+  double sampleCell;   // size in pixels of the cells whose rays share their direct light, 0 = shade every ray
+  int variableRate;    // side of the blocks whose inside is interpolated from their corners when it is flat, 1 = trace every pixel
+  char* hdrFile;       // save the colors before the tone mapping to this PFM file, NULL = do not save
+  char* fromHdrFile;   // tone map the colors saved in this PFM file instead of rendering, NULL = render
+  double exposure;     // stops the colors are scaled by before the tone curve
+  int toneCurve;       // 0 = clamp, 1 = Reinhard, 2 = ACES
+  int srgb;            // encode the output with the sRGB curve instead of linearly
+  int dither;          // add ordered dither before the colors are cut to 8 bits
+  int pngFilter;       // PNG filter of every row, 0 to 4, or 5 = the best of them per row
+  double pngChunk;     // KB of rows that the threads compress apart in a PNG file, 0 = one stream
+} RenderOptions;
+
+// counters that are printed with -stats
+typedef struct {
+  long primaryRays;
+  long backgroundPixels; // pixels that -raster did not shade at all
+  long shadowRays;
+  long shadowedRays;      // shadow rays that found an occluder
+  long occluderCacheHits; // shadow rays blocked by the last occluder of their light
+  long shadingPoints;
+  long lightsConsidered; // lights that passed the culling test at a shading point
+  long areaLightPoints;  // area lights shaded at a point
+  long penumbraPoints;   // of them, the ones whose first shadow rays disagreed
+  long areaShadowRays;
+  long causticLookups;   // photon map searches
+  long causticPhotons;   // photons they found
+} RenderStats;
+
+#endif
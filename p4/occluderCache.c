@@ -0,0 +1,205 @@
+// Shadow ray occluders
+// Shading points next to each other are usually blocked from a light by the same object, so
+// every thread remembers the last occluder it found for each light and tests that one first.
+// With -occludergrid n each light also gets a cube map of n x n cells per face around it,
+// and every cell lists the spheres that cover it as seen from the light. A shadow ray then
+// only tests the spheres in the cell it leaves the light through, plus the planes.
+
+typedef struct {
+	int res;          // cells along each side of a cube face
+	int cells;        // 6 * res * res
+	double* cellDir;  // unit direction through the center of each cell
+	double* cellCos;  // cosine and sine of the half angle of the cone around each cell
+	double* cellSin;
+	int* start;       // the candidates of light n and cell c are list[start[n * cells + c]] ...
+	int* list;
+	int planeCount;   // planes have no bounds, so they are tested for every light
+	int* planes;
+} OccluderGrid;
+
+// last occluder per light slot for this thread, -1 when there is none yet
+_Thread_local int* occluderCache;
+
+// the entry of light n in the cache of this thread
+static inline int* cachedOccluder(int n, int lightCount) {
+	if (occluderCache == NULL) {
+		int i;
+		occluderCache = malloc(sizeof(int) * (lightCount + 1));
+		for (i = 0; i < lightCount + 1; i++) {
+			occluderCache[i] = -1;
+		}
+	}
+	return &occluderCache[n];
+}
+
+// the cube map cell that the direction d goes through
+static int cubeCell(OccluderGrid* grid, double* d) {
+	int axis = 0;
+	if (fabs(d[1]) > fabs(d[axis])) axis = 1;
+	if (fabs(d[2]) > fabs(d[axis])) axis = 2;
+	int face = axis * 2 + (d[axis] < 0);
+	double m = fabs(d[axis]);
+	double u = d[(axis + 1) % 3] / m;
+	double v = d[(axis + 2) % 3] / m;
+	int i = (int)((u + 1) / 2 * grid->res);
+	int j = (int)((v + 1) / 2 * grid->res);
+	if (i < 0) i = 0;
+	if (i >= grid->res) i = grid->res - 1;
+	if (j < 0) j = 0;
+	if (j >= grid->res) j = grid->res - 1;
+	return (face * grid->res + j) * grid->res + i;
+}
+
+// the direction through the point (u, v) on a cube face
+static void cubeDirection(int face, double u, double v, double* d) {
+	int axis = face / 2;
+	d[axis] = face % 2 ? -1 : 1;
+	d[(axis + 1) % 3] = u;
+	d[(axis + 2) % 3] = v;
+	normalize(d);
+}
+
+// does the cone (dir, cos/sin of the half angle) overlap a sphere seen at direction c under
+// the half angle with cosine cosA and sine sinA
+static inline int conesOverlap(double* dir, double cosB, double sinB, double* c, double cosA, double sinA) {
+	// cosine and sine of the sum of both half angles
+	double cosAB = cosA * cosB - sinA * sinB;
+	double sinAB = sinA * cosB + cosA * sinB;
+	if (sinAB <= 0 && cosAB < 0) {
+		// the angles add up to PI or more, the cones overlap in every direction
+		return 1;
+	}
+	return dir[0] * c[0] + dir[1] * c[1] + dir[2] * c[2] >= cosAB;
+}
+
+// adds every sphere to the cells of light n that it covers as seen from the light.
+// pass 0 only counts the spheres of each cell, pass 1 writes them to the list
+static void fillOccluderCells(OccluderGrid* grid, Scene* scene, double* light, int n, int pass, int* fill) {
+	// the cone around a whole cube face
+	double faceCos = 1 / sqrt(3);
+	double faceSin = sqrt(2.0 / 3.0);
+	int w, face, c;
+	for (w = 0; w < scene->sphereCount; w++) {
+		double dir[3];
+		int a;
+		for (a = 0; a < 3; a++) {
+			dir[a] = scene->spheres[w * 4 + a] - light[a];
+		}
+		double d = sqrt(sqr(dir[0]) + sqr(dir[1]) + sqr(dir[2]));
+		double r = scene->spheres[w * 4 + 3];
+		double cosA, sinA;
+		if (d <= r) {
+			// the light is inside the sphere, it blocks every direction
+			cosA = -1;
+			sinA = 0;
+			dir[0] = 1;
+			dir[1] = 0;
+			dir[2] = 0;
+		}
+		else {
+			dir[0] /= d;
+			dir[1] /= d;
+			dir[2] /= d;
+			sinA = r / d;
+			cosA = sqrt(1 - sqr(sinA));
+		}
+		for (face = 0; face < 6; face++) {
+			double faceDir[3] = { 0, 0, 0 };
+			faceDir[face / 2] = face % 2 ? -1 : 1;
+			if (cosA > -1 && !conesOverlap(faceDir, faceCos, faceSin, dir, cosA, sinA)) continue;
+			int first = face * grid->res * grid->res;
+			for (c = first; c < first + grid->res * grid->res; c++) {
+				if (cosA > -1 && !conesOverlap(&grid->cellDir[c * 3], grid->cellCos[c], grid->cellSin[c], dir, cosA, sinA)) continue;
+				long slot = (long)n * grid->cells + c;
+				if (pass == 0) grid->start[slot + 1] += 1;
+				else grid->list[fill[slot]++] = w;
+			}
+		}
+	}
+}
+
+// build the occluder grid for every light of the light table
+OccluderGrid* buildOccluderGrid(Scene* scene, LightGrid* lights, int res) {
+	OccluderGrid* grid = calloc(1, sizeof(OccluderGrid));
+	int i, j, face, n, w;
+	grid->res = res;
+	grid->cells = 6 * res * res;
+	grid->cellDir = malloc(sizeof(double) * 3 * grid->cells);
+	grid->cellCos = malloc(sizeof(double) * grid->cells);
+	grid->cellSin = malloc(sizeof(double) * grid->cells);
+	for (face = 0; face < 6; face++) {
+		for (j = 0; j < res; j++) {
+			for (i = 0; i < res; i++) {
+				int c = (face * res + j) * res + i;
+				double u0 = -1 + 2.0 * i / res;
+				double v0 = -1 + 2.0 * j / res;
+				double step = 2.0 / res;
+				cubeDirection(face, u0 + step / 2, v0 + step / 2, &grid->cellDir[c * 3]);
+				// the widest corner gives the half angle of the cell
+				double cosB = 1;
+				int k;
+				for (k = 0; k < 4; k++) {
+					double corner[3];
+					cubeDirection(face, u0 + step * (k & 1), v0 + step * (k >> 1), corner);
+					double d = corner[0] * grid->cellDir[c * 3] + corner[1] * grid->cellDir[c * 3 + 1] + corner[2] * grid->cellDir[c * 3 + 2];
+					if (d < cosB) cosB = d;
+				}
+				grid->cellCos[c] = cosB;
+				grid->cellSin[c] = sqrt(1 - sqr(cosB));
+			}
+		}
+	}
+
+	grid->planeCount = scene->planeCount;
+	grid->planes = malloc(sizeof(int) * (scene->planeCount + 1));
+	for (w = 0; w < scene->planeCount; w++) {
+		grid->planes[w] = scene->sphereCount + w;
+	}
+
+	long slots = (long)lights->count * grid->cells;
+	grid->start = calloc(slots + 1, sizeof(int));
+	if (grid->start == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the occluder grid.\n");
+		exit(1);
+	}
+	for (n = 0; n < lights->count; n++) {
+		fillOccluderCells(grid, scene, &lights->position[n * 3], n, 0, NULL);
+	}
+	long s;
+	for (s = 0; s < slots; s++) {
+		grid->start[s + 1] += grid->start[s];
+	}
+	grid->list = malloc(sizeof(int) * (grid->start[slots] + 1));
+	int* fill = malloc(sizeof(int) * (slots + 1));
+	if (grid->list == NULL || fill == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the occluder grid.\n");
+		exit(1);
+	}
+	memcpy(fill, grid->start, sizeof(int) * slots);
+	for (n = 0; n < lights->count; n++) {
+		fillOccluderCells(grid, scene, &lights->position[n * 3], n, 1, fill);
+	}
+	free(fill);
+	return grid;
+}
+
+void freeOccluderGrid(OccluderGrid* grid) {
+	if (grid == NULL) {
+		return;
+	}
+	free(grid->cellDir);
+	free(grid->cellCos);
+	free(grid->cellSin);
+	free(grid->start);
+	free(grid->list);
+	free(grid->planes);
+	free(grid);
+}
+
+// the spheres that may block light n from a point in the direction d from the light,
+// count is set to the length of the list
+static inline int* occluderCandidates(OccluderGrid* grid, int n, double* d, int* count) {
+	long slot = (long)n * grid->cells + cubeCell(grid, d);
+	*count = grid->start[slot + 1] - grid->start[slot];
+	return &grid->list[grid->start[slot]];
+}
@@ -0,0 +1,242 @@
+// Path tracing
+// With -pathtrace n the image is rendered with a Monte Carlo path tracer instead of
+// recursiveShoot(), so light that bounces off diffuse and glossy surfaces lights the scene too.
+// Every path starts at a random point of its pixel. At every hit the lights are shaded like in
+// shadeSurface() (next event estimation, the lights are points and cannot be hit by chance),
+// then one way on is picked with a chance in proportion to what it carries: the mirror
+// reflection, the refraction, the diffuse lobe sampled by the cosine, or a Phong lobe around
+// the mirror direction for the specular color. When the weights add up to less than 1 the path
+// ends with the rest of the chance, so dark surfaces end their paths early without bias.
+// Every pixel keeps the mean and the variance of the brightness of its paths and stops after
+// at least PATH_MIN_SAMPLES paths once the standard error of the mean is below -patherror e
+// times the mean (times PATH_ERROR_FLOOR for dark pixels), at most n paths are traced. The pixels are handed out in 16 x 16 tiles to
+// all threads. The random numbers of random.c are keyed by the pixel, the path and the bounce,
+// so the image does not depend on the number of threads, and with -sampler sobol (the default)
+// the position in the pixel and the lobe of every bounce are stratified over the paths.
+
+#define PATH_MIN_SAMPLES 16
+#define PATH_MAX_DEPTH 8
+// Phong exponent of the specular lobe of bounced light, as the ns of the lights
+#define PATH_GLOSS 20
+// dark pixels are compared with this brightness instead of their own
+#define PATH_ERROR_FLOOR 0.5
+
+// what the path tracer did in the last frame, for -stats
+long pathSamples;
+long pathConverged;
+
+// addStats() adds the counters of a thread to total
+static void addStats(RenderStats* total, RenderStats* part) {
+	total->primaryRays += part->primaryRays;
+	total->backgroundPixels += part->backgroundPixels;
+	total->shadowRays += part->shadowRays;
+	total->shadowedRays += part->shadowedRays;
+	total->occluderCacheHits += part->occluderCacheHits;
+	total->shadingPoints += part->shadingPoints;
+	total->lightsConsidered += part->lightsConsidered;
+	total->areaLightPoints += part->areaLightPoints;
+	total->penumbraPoints += part->penumbraPoints;
+	total->areaShadowRays += part->areaShadowRays;
+	total->causticLookups += part->causticLookups;
+	total->causticPhotons += part->causticPhotons;
+}
+
+// lobeDirection() sets d to the direction around the unit axis for the uniform numbers u and v,
+// random directions have the density cos^exponent of the angle to the axis, exponent 1 gives
+// the cosine weighted hemisphere
+static void lobeDirection(double* axis, double exponent, double u, double v, double* d) {
+	double cosTheta = pow(1 - u, 1 / (exponent + 1));
+	double sinTheta = sqrt(fmax(0, 1 - sqr(cosTheta)));
+	double phi = 2 * M_PI * v;
+	double t[3], b[3];
+	orthonormalBasis(axis, t, b);
+	int a;
+	for (a = 0; a < 3; a++) {
+		d[a] = axis[a] * cosTheta + (t[a] * cos(phi) + b[a] * sin(phi)) * sinTheta;
+	}
+}
+
+static inline double largestComponent(double* c) {
+	return fmax(c[0], fmax(c[1], c[2]));
+}
+
+// tracePath() sets color to the light that one path from Ro along the unit direction Rd brings
+// back
+static void tracePath(double* Ro, double* Rd, Object** objects, double* color) {
+	double throughput[3] = { 1, 1, 1 };
+	double origin[3] = { Ro[0], Ro[1], Ro[2] };
+	double direction[3] = { Rd[0], Rd[1], Rd[2] };
+	int insideSphere = 0;
+	int bounce, a;
+	color[0] = 0;
+	color[1] = 0;
+	color[2] = 0;
+	for (bounce = 0; bounce < PATH_MAX_DEPTH; bounce++) {
+		randomBounce(bounce);
+		double t;
+		int intersection = intersect(origin, direction, &t);
+		if (intersection < 0) {
+			return;
+		}
+		double Ron[3], N[3];
+		for (a = 0; a < 3; a++) {
+			Ron[a] = origin[a] + t * direction[a];
+		}
+		surfaceNormal(intersection, Ron, direction, N);
+		Material textured;
+		Material* material = textureMaterial(intersection, Ron, N, direction, &textured);
+		double reflectivity = clamp(material->reflectivity);
+		double refractivity = clamp(material->refractivity);
+		double kept = fmax(0, 1 - reflectivity - refractivity);
+		stats.shadingPoints += 1;
+		// the direct light, weighted like in shadeSurface()
+		if (kept > 0) {
+			double direct[3] = { 0, 0, 0 };
+			shadeLights(intersection, material, N, direction, Ron, objects, direct);
+			for (a = 0; a < 3; a++) {
+				color[a] += throughput[a] * kept * direct[a];
+			}
+		}
+		// pick the way on, with the 2D dimensions 1 + 2 * bounce and 2 + 2 * bounce
+		double lobe[2], choice[2];
+		sample2D(1 + 2 * bounce, &lobe[0], &lobe[1]);
+		sample2D(2 + 2 * bounce, &choice[0], &choice[1]);
+		double diffuseWeight = kept * largestComponent(material->diffuseColor);
+		double glossWeight = kept * largestComponent(material->specularColor);
+		double total = fmax(1, reflectivity + refractivity + diffuseWeight + glossWeight);
+		double u = choice[0] * total;
+		double next[3], weight[3];
+		double NRd = N[0] * direction[0] + N[1] * direction[1] + N[2] * direction[2];
+		double mirror[3];
+		for (a = 0; a < 3; a++) {
+			mirror[a] = direction[a] - 2 * NRd * N[a];
+		}
+		// the normal on the side the path came from
+		double facing[3];
+		for (a = 0; a < 3; a++) {
+			facing[a] = NRd > 0 ? -N[a] : N[a];
+		}
+		if (u < reflectivity) {
+			memcpy(next, mirror, sizeof(next));
+			weight[0] = weight[1] = weight[2] = total;
+		}
+		else if ((u -= reflectivity) < refractivity) {
+			double ior = material->ior;
+			if (insideSphere == 1) {
+				ior = 1 / ior;
+			}
+			if (refractionDirection(direction, N, ior, next)) {
+				if (isSpherePrimitive(scene, intersection)) {
+					insideSphere = !insideSphere;
+				}
+			}
+			else {
+				memcpy(next, mirror, sizeof(next));
+			}
+			weight[0] = weight[1] = weight[2] = total;
+		}
+		else if ((u -= refractivity) < diffuseWeight) {
+			lobeDirection(facing, 1, lobe[0], lobe[1], next);
+			for (a = 0; a < 3; a++) {
+				weight[a] = kept * material->diffuseColor[a] * total / diffuseWeight;
+			}
+		}
+		else if ((u -= diffuseWeight) < glossWeight) {
+			normalize(mirror);
+			lobeDirection(mirror, PATH_GLOSS, lobe[0], lobe[1], next);
+			// the normalized Phong lobe times the cosine over its density
+			double cosine = next[0] * facing[0] + next[1] * facing[1] + next[2] * facing[2];
+			if (cosine <= 0) {
+				return;
+			}
+			for (a = 0; a < 3; a++) {
+				weight[a] = kept * material->specularColor[a] * (PATH_GLOSS + 2.0) / (PATH_GLOSS + 1.0) * cosine * total / glossWeight;
+			}
+		}
+		else {
+			return;
+		}
+		normalize(next);
+		for (a = 0; a < 3; a++) {
+			throughput[a] *= weight[a];
+			// avoid intersecting with the same object again
+			origin[a] = Ron[a] + next[a] * 0.0001;
+			direction[a] = next[a];
+		}
+	}
+}
+
+// pathTrace() renders the w x h image with the camera size width x height into the float colors
+// hdr, the rows from the top like rayCasting()
+void pathTrace(float* hdr, int w, int h, double width, double height, Object** objects) {
+	int tilesX = (w + TILE_SIZE - 1) / TILE_SIZE;
+	int tileCount = tilesX * ((h + TILE_SIZE - 1) / TILE_SIZE);
+	long samples = 0, converged = 0;
+	RenderStats* total = &stats;
+	#pragma omp parallel
+	{
+		// the occluder cache of a thread is sized for the lights of the frame it was made in
+		free(occluderCache);
+		occluderCache = NULL;
+		if (&stats != total) {
+			memset(&stats, 0, sizeof(stats));
+		}
+		int tile;
+		#pragma omp for schedule(dynamic) reduction(+:samples, converged)
+		for (tile = 0; tile < tileCount; tile++) {
+			int j0 = (tile % tilesX) * TILE_SIZE, k0 = (tile / tilesX) * TILE_SIZE, j, k, a;
+			double Ro[3] = { 0, 0, 0 };
+			for (k = k0; k < k0 + TILE_SIZE && k < h; k++) {
+				for (j = j0; j < j0 + TILE_SIZE && j < w; j++) {
+					seedRandom((unsigned long long)k * w + j);
+					double sum[3] = { 0, 0, 0 };
+					double mean = 0, squares = 0; // of the brightness, by Welford's method
+					int n;
+					for (n = 1; n <= options.pathSamples; n++) {
+						double Rd[3], color[3], jitter[2];
+						randomSample(n - 1);
+						sample2D(0, &jitter[0], &jitter[1]);
+						Rd[0] = -width / 2 + width / w * (j + jitter[0]);
+						Rd[1] = -height / 2 + height / h * (k + jitter[1]);
+						Rd[2] = 1;
+						normalize(Rd);
+						stats.primaryRays += 1;
+						tracePath(Ro, Rd, objects, color);
+						for (a = 0; a < 3; a++) {
+							sum[a] += color[a];
+						}
+						double brightness = (color[0] + color[1] + color[2]) / 3;
+						double delta = brightness - mean;
+						mean += delta / n;
+						squares += delta * (brightness - mean);
+						if (n >= PATH_MIN_SAMPLES && n < options.pathSamples &&
+							sqrt(squares / (n - 1) / n) <= options.pathError * fmax(mean, PATH_ERROR_FLOOR)) {
+							converged += 1;
+							break;
+						}
+					}
+					n = n > options.pathSamples ? options.pathSamples : n;
+					samples += n;
+					double color[3] = { sum[0] / n, sum[1] / n, sum[2] / n };
+					int count = ((h - k - 1) * w + j) * 3;
+					for (a = 0; a < 3; a++) {
+						hdr[count + a] = (float)color[a];
+					}
+					if (aovs != NULL) {
+						// the guides of the filter come from the ray through the center
+						double Rd[3], depth;
+						pixelDirection(width, height, w, h, j, k, Rd);
+						int id = intersect(Ro, Rd, &depth);
+						storeAovs(aovs, (h - k - 1) * w + j, id, Rd, depth, color);
+					}
+				}
+			}
+		}
+		if (&stats != total) {
+			#pragma omp critical
+			addStats(total, &stats);
+		}
+	}
+	pathSamples = samples;
+	pathConverged = converged;
+}
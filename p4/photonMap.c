@@ -0,0 +1,495 @@
+// Caustics
+// The lights are points and cannot be seen through a glass sphere, so neither recursiveShoot()
+// nor the path tracer ever brings the light a refractive sphere focuses onto a diffuse surface.
+// With -caustics n a photon pass does: n photons are emitted from the lights into the cones of
+// directions that hold the refractive spheres, every light and sphere pair gets a share of the
+// photons in proportion to the luminance of the light and the solid angle of the sphere. A
+// photon follows the mirror and refraction rays, picked with the chance of the reflectivity and
+// the refractivity of each surface it hits, and when it hits a surface that keeps some diffuse
+// light after at least one of them it is stored there. The stored photons go into a balanced
+// kd-tree and shadeLights() adds the light of the PHOTON_NEIGHBOURS photons nearest to every
+// shading point, the photon density over the disk that holds them.
+// The tree is left balanced and stored like a heap, the children of node i are 2i + 1 and
+// 2i + 2, so it needs no pointers; the positions and split axes that the search reads are kept
+// apart from the power and direction of the photons that only the found photons need, 4 nodes
+// to a cache line. The split planes alone cannot tell that a point above a flat caustic is far
+// from it, the photons on a plane are never split across it, so the nodes with large subtrees
+// also keep the bounding box of their photons, which the search tests before it goes in.
+// The photons are emitted in blocks by all threads, every photon has its own
+// random numbers and the blocks are joined in order, and the two halves of every large subtree
+// are built as separate tasks, so the map does not depend on the number of threads.
+
+#define PHOTON_NEIGHBOURS 50
+#define PHOTON_MAX_DEPTH 8
+// photons traced by a thread at a time
+#define PHOTON_BLOCK 1024
+// subtrees with fewer photons are built by one task
+#define PHOTON_TASK_SIZE 8192
+// the neighbours are searched at most this share of the radius of the largest refractive
+// sphere away, the size of the caustics it can make
+#define PHOTON_RADIUS_SHARE 0.25
+// nodes with at least this many photons below them keep a bounding box
+#define PHOTON_BOUNDED_SIZE 32
+// the random numbers of the photons are keyed after the pixels
+#define PHOTON_KEY (1ULL << 48)
+
+typedef struct {
+	float position[3];
+	int axis;          // the split axis of the node
+} PhotonNode;
+
+typedef struct {
+	float power[3];
+	float direction[3]; // the direction the photon came from
+} PhotonPower;
+
+typedef struct {
+	int count;
+	PhotonNode* nodes;
+	PhotonPower* powers; // of the photon of the node with the same index
+	int boundedCount;    // the first nodes, the ones that have a bounding box
+	float* bounds;       // 6 floats per node, the lower and the upper corner
+	float maxDistance2;  // squared search radius
+	int emitted;
+	double traceSeconds;
+	double buildSeconds;
+} PhotonMap;
+
+// a photon while the tree is built
+typedef struct {
+	PhotonNode node;
+	PhotonPower power;
+} PhotonRecord;
+
+typedef struct {
+	int count;
+	int capacity;
+	PhotonRecord* records;
+} PhotonBlock;
+
+PhotonMap* photonMap = NULL;
+
+void freePhotonMap(PhotonMap* map) {
+	if (map == NULL) {
+		return;
+	}
+	free(map->nodes);
+	free(map->powers);
+	free(map->bounds);
+	free(map);
+}
+
+static void storePhoton(PhotonBlock* block, double* position, double* direction, double* power) {
+	if (block->count == block->capacity) {
+		block->capacity = block->capacity == 0 ? 256 : block->capacity * 2;
+		block->records = realloc(block->records, sizeof(PhotonRecord) * block->capacity);
+		if (block->records == NULL) {
+			fprintf(stderr, "Error: cannot allocate the photon map!");
+			exit(1);
+		}
+	}
+	PhotonRecord* record = &block->records[block->count++];
+	int a;
+	for (a = 0; a < 3; a++) {
+		record->node.position[a] = (float)position[a];
+		record->power.direction[a] = (float)direction[a];
+		record->power.power[a] = (float)power[a];
+	}
+	record->node.axis = 0;
+}
+
+// tracePhoton() follows the photon of the given power from Ro along the unit direction Rd and
+// stores it in block at every diffuse surface it reaches after a mirror or refraction ray.
+// light is the light it comes from, for the radial attenuation of the light over the path
+static void tracePhoton(double* Ro, double* Rd, double* power, Object* light, PhotonBlock* block) {
+	double origin[3] = { Ro[0], Ro[1], Ro[2] };
+	double direction[3] = { Rd[0], Rd[1], Rd[2] };
+	double traveled = 0;
+	int depth, a;
+	for (depth = 0; depth < PHOTON_MAX_DEPTH; depth++) {
+		double t;
+		int intersection = intersect(origin, direction, &t);
+		if (intersection < 0) {
+			return;
+		}
+		traveled += t;
+		double Ron[3], N[3];
+		for (a = 0; a < 3; a++) {
+			Ron[a] = origin[a] + t * direction[a];
+		}
+		surfaceNormal(intersection, Ron, direction, N);
+		Material* material = primitiveMaterial(scene, intersection);
+		double reflectivity = clamp(material->reflectivity);
+		double refractivity = clamp(material->refractivity);
+		double NRd = N[0] * direction[0] + N[1] * direction[1] + N[2] * direction[2];
+		// causticLight() only counts photons on the side of the normal
+		if (depth > 0 && 1 - reflectivity - refractivity > 0 && NRd < 0) {
+			// the light of a point light falls off with frad() instead of the square of the
+			// distance, the photon is scaled to match the direct light of the same light
+			double falloff = sqr(traveled) / (light->light.radialA2 * sqr(traveled) + light->light.radialA1 * traveled + light->light.radialA0);
+			double stored[3] = { power[0] * falloff, power[1] * falloff, power[2] * falloff };
+			storePhoton(block, Ron, direction, stored);
+		}
+		double next[3];
+		double u = random01();
+		if (u < reflectivity) {
+			for (a = 0; a < 3; a++) {
+				next[a] = direction[a] - 2 * NRd * N[a];
+			}
+		}
+		else if (u < reflectivity + refractivity) {
+			// the photon refracts at the normal on its own side, and the ior of the material is
+			// the one inside of it: sin(out) = sin(in) / ior on the way in, times ior on the way out
+			double facing[3] = { NRd > 0 ? -N[0] : N[0], NRd > 0 ? -N[1] : N[1], NRd > 0 ? -N[2] : N[2] };
+			double ior = NRd > 0 ? material->ior : 1 / material->ior;
+			if (!refractionDirection(direction, facing, ior, next)) {
+				for (a = 0; a < 3; a++) {
+					next[a] = direction[a] - 2 * NRd * N[a];
+				}
+			}
+		}
+		else {
+			return;
+		}
+		normalize(next);
+		for (a = 0; a < 3; a++) {
+			// avoid intersecting with the same object again
+			origin[a] = Ron[a] + next[a] * 0.0001;
+			direction[a] = next[a];
+		}
+	}
+}
+
+// leftBalancedSize() returns the number of nodes in the left subtree of a left balanced tree
+// of count nodes: the levels above the last are full and the last one is filled from the left
+static int leftBalancedSize(int count) {
+	if (count <= 1) {
+		return 0;
+	}
+	int levels = 0;
+	while ((2 << levels) <= count) {
+		levels += 1;
+	}
+	// levels is the depth of the last level
+	int last = count - ((1 << levels) - 1);
+	int half = 1 << (levels - 1);
+	return half - 1 + (last < half ? last : half);
+}
+
+// selectPhotons() moves the photon that is k-th along the axis into records[k], with the smaller
+// ones before it and the larger ones after it
+static void selectPhotons(PhotonRecord* records, int count, int k, int axis) {
+	int lo = 0, hi = count - 1;
+	while (lo < hi) {
+		float pivot = records[(lo + hi) / 2].node.position[axis];
+		int i = lo, j = hi;
+		while (i <= j) {
+			while (records[i].node.position[axis] < pivot) i++;
+			while (records[j].node.position[axis] > pivot) j--;
+			if (i <= j) {
+				PhotonRecord swap = records[i];
+				records[i] = records[j];
+				records[j] = swap;
+				i++;
+				j--;
+			}
+		}
+		if (k <= j) hi = j;
+		else if (k >= i) lo = i;
+		else break;
+	}
+}
+
+// buildPhotonTree() puts the count photons of records into the subtree of the given node, split
+// at the median of the axis along which they spread the most
+static void buildPhotonTree(PhotonMap* map, PhotonRecord* records, int count, int node) {
+	if (count == 0) {
+		return;
+	}
+	float lo[3] = { INFINITY, INFINITY, INFINITY }, hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+	int i, a;
+	for (i = 0; i < count; i++) {
+		for (a = 0; a < 3; a++) {
+			lo[a] = fminf(lo[a], records[i].node.position[a]);
+			hi[a] = fmaxf(hi[a], records[i].node.position[a]);
+		}
+	}
+	int axis = 0;
+	for (a = 1; a < 3; a++) {
+		if (hi[a] - lo[a] > hi[axis] - lo[axis]) axis = a;
+	}
+	int left = leftBalancedSize(count);
+	selectPhotons(records, count, left, axis);
+	if (node < map->boundedCount) {
+		memcpy(&map->bounds[node * 6], lo, sizeof(lo));
+		memcpy(&map->bounds[node * 6 + 3], hi, sizeof(hi));
+	}
+	map->nodes[node] = records[left].node;
+	map->nodes[node].axis = axis;
+	map->powers[node] = records[left].power;
+	if (count > PHOTON_TASK_SIZE) {
+		#pragma omp task
+		buildPhotonTree(map, records, left, 2 * node + 1);
+	}
+	else {
+		buildPhotonTree(map, records, left, 2 * node + 1);
+	}
+	buildPhotonTree(map, records + left + 1, count - left - 1, 2 * node + 2);
+}
+
+// buildPhotonMap() emits count photons from the lights of the light table towards the
+// refractive spheres and returns the map of the photons that were stored
+PhotonMap* buildPhotonMap(Object** objects, int count) {
+	struct timespec start, traced, built;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	PhotonMap* map = calloc(1, sizeof(PhotonMap));
+	if (map == NULL) {
+		fprintf(stderr, "Error: cannot allocate the photon map!");
+		exit(1);
+	}
+	// every light and refractive sphere it reaches is a pair that gets photons
+	int sphereEnd = triangleBase(scene);
+	int pairCount = 0, pairCapacity = 0, n, p;
+	int* pairLight = NULL;
+	int* pairSphere = NULL;
+	double* pairWeight = NULL; // added up over the pairs
+	double total = 0, largest = 0;
+	for (n = 0; n < lightGrid->count; n++) {
+		Object* light = objects[lightGrid->index[n]];
+		double luminance = lightLuminance(light);
+		if (luminance <= 0) {
+			continue;
+		}
+		for (p = 0; p < sphereEnd; p++) {
+			if (!isSpherePrimitive(scene, p) || clamp(primitiveMaterial(scene, p)->refractivity) <= 0) {
+				continue;
+			}
+			double buffer[4];
+			double* sphere = primitiveSphere(scene, p, buffer);
+			double distance2 = sqr(sphere[0] - lightGrid->position[n * 3]) + sqr(sphere[1] - lightGrid->position[n * 3 + 1]) +
+				sqr(sphere[2] - lightGrid->position[n * 3 + 2]);
+			if (lightGrid->radius2[n] != INFINITY && sqrt(distance2) - sphere[3] > sqrt(lightGrid->radius2[n])) {
+				continue;
+			}
+			largest = fmax(largest, sphere[3]);
+			double solidAngle = distance2 > sqr(sphere[3]) ? 2 * M_PI * (1 - sqrt(1 - sqr(sphere[3]) / distance2)) : 4 * M_PI;
+			if (pairCount == pairCapacity) {
+				pairCapacity = pairCapacity == 0 ? 64 : pairCapacity * 2;
+				pairLight = realloc(pairLight, sizeof(int) * pairCapacity);
+				pairSphere = realloc(pairSphere, sizeof(int) * pairCapacity);
+				pairWeight = realloc(pairWeight, sizeof(double) * pairCapacity);
+				if (pairLight == NULL || pairSphere == NULL || pairWeight == NULL) {
+					fprintf(stderr, "Error: cannot allocate the photon map!");
+					exit(1);
+				}
+			}
+			total += luminance * solidAngle;
+			pairLight[pairCount] = n;
+			pairSphere[pairCount] = p;
+			pairWeight[pairCount] = total;
+			pairCount += 1;
+		}
+	}
+	if (pairCount == 0) {
+		count = 0;
+	}
+	map->emitted = count;
+	int blockCount = (count + PHOTON_BLOCK - 1) / PHOTON_BLOCK;
+	PhotonBlock* blocks = calloc(blockCount + 1, sizeof(PhotonBlock));
+	if (blocks == NULL) {
+		fprintf(stderr, "Error: cannot allocate the photon map!");
+		exit(1);
+	}
+	int b;
+	#pragma omp parallel for schedule(dynamic)
+	for (b = 0; b < blockCount; b++) {
+		int i;
+		for (i = b * PHOTON_BLOCK; i < (b + 1) * PHOTON_BLOCK && i < count; i++) {
+			seedRandom(PHOTON_KEY + i);
+			// the photons are spread over the pairs in order, by the added up weights
+			double target = (i + 0.5) / count * total;
+			int lo = 0, hi = pairCount - 1;
+			while (lo < hi) {
+				int middle = (lo + hi) / 2;
+				if (pairWeight[middle] < target) lo = middle + 1;
+				else hi = middle;
+			}
+			double share = (pairWeight[lo] - (lo > 0 ? pairWeight[lo - 1] : 0)) / total;
+			int z = lightGrid->index[pairLight[lo]];
+			Object* light = objects[z];
+			double buffer[4];
+			double* sphere = primitiveSphere(scene, pairSphere[lo], buffer);
+			double Ro[3] = { light->light.position[0], light->light.position[1], light->light.position[2] };
+			if (light->light.shape != 0) {
+				double u = random01(), v = random01();
+				areaLightPoint(light, sphere, u, v, Ro);
+			}
+			// a direction in the cone of the sphere seen from Ro
+			double axis[3] = { sphere[0] - Ro[0], sphere[1] - Ro[1], sphere[2] - Ro[2] };
+			double distance2 = sqr(axis[0]) + sqr(axis[1]) + sqr(axis[2]);
+			double cosMax = distance2 > sqr(sphere[3]) ? sqrt(1 - sqr(sphere[3]) / distance2) : -1;
+			normalize(axis);
+			double t[3], s[3], Rd[3];
+			orthonormalBasis(axis, t, s);
+			double cosTheta = 1 - random01() * (1 - cosMax);
+			double sinTheta = sqrt(fmax(0, 1 - sqr(cosTheta)));
+			double phi = 2 * M_PI * random01();
+			int a;
+			for (a = 0; a < 3; a++) {
+				Rd[a] = axis[a] * cosTheta + (t[a] * cos(phi) + s[a] * sin(phi)) * sinTheta;
+			}
+			normalize(Rd);
+			// the light of the cone over the number of photons it gets, times the spot falloff
+			double ahead[3] = { light->light.position[0] + Rd[0], light->light.position[1] + Rd[1], light->light.position[2] + Rd[2] };
+			double scale = fang(z, ahead, objects) * 2 * M_PI * (1 - cosMax) / (share * count);
+			if (scale <= 0) {
+				continue;
+			}
+			double power[3] = { light->light.color[0] * scale, light->light.color[1] * scale, light->light.color[2] * scale };
+			tracePhoton(Ro, Rd, power, light, &blocks[b]);
+		}
+	}
+	map->maxDistance2 = sqr(PHOTON_RADIUS_SHARE * largest);
+	free(pairLight);
+	free(pairSphere);
+	free(pairWeight);
+	// the blocks are joined in the order of their photons
+	int stored = 0;
+	for (b = 0; b < blockCount; b++) {
+		stored += blocks[b].count;
+	}
+	PhotonRecord* records = malloc(sizeof(PhotonRecord) * (stored + 1));
+	map->nodes = malloc(sizeof(PhotonNode) * (stored + 1));
+	map->powers = malloc(sizeof(PhotonPower) * (stored + 1));
+	// a node below the first count / size ones has fewer photons below it than the size
+	map->boundedCount = stored / PHOTON_BOUNDED_SIZE;
+	map->bounds = malloc(sizeof(float) * 6 * (map->boundedCount + 1));
+	if (records == NULL || map->nodes == NULL || map->powers == NULL || map->bounds == NULL) {
+		fprintf(stderr, "Error: cannot allocate the photon map!");
+		exit(1);
+	}
+	stored = 0;
+	for (b = 0; b < blockCount; b++) {
+		memcpy(records + stored, blocks[b].records, sizeof(PhotonRecord) * blocks[b].count);
+		stored += blocks[b].count;
+		free(blocks[b].records);
+	}
+	free(blocks);
+	map->count = stored;
+	clock_gettime(CLOCK_MONOTONIC, &traced);
+	#pragma omp parallel
+	#pragma omp single
+	buildPhotonTree(map, records, stored, 0);
+	free(records);
+	clock_gettime(CLOCK_MONOTONIC, &built);
+	map->traceSeconds = (traced.tv_sec - start.tv_sec) + (traced.tv_nsec - start.tv_nsec) * 1e-9;
+	map->buildSeconds = (built.tv_sec - traced.tv_sec) + (built.tv_nsec - traced.tv_nsec) * 1e-9;
+	return map;
+}
+
+// the nearest photons found so far, a max heap on the distance
+typedef struct {
+	int count;
+	float maxDistance2; // of the farthest photon once the heap is full, the search radius before
+	float distance2[PHOTON_NEIGHBOURS];
+	int node[PHOTON_NEIGHBOURS];
+} PhotonQuery;
+
+static void addNeighbour(PhotonQuery* query, int node, float distance2) {
+	int i;
+	if (query->count < PHOTON_NEIGHBOURS) {
+		// sift up
+		i = query->count++;
+		while (i > 0 && query->distance2[(i - 1) / 2] < distance2) {
+			query->distance2[i] = query->distance2[(i - 1) / 2];
+			query->node[i] = query->node[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+	}
+	else {
+		// replace the farthest and sift down
+		i = 0;
+		for (;;) {
+			int child = 2 * i + 1;
+			if (child >= PHOTON_NEIGHBOURS) break;
+			if (child + 1 < PHOTON_NEIGHBOURS && query->distance2[child + 1] > query->distance2[child]) child += 1;
+			if (query->distance2[child] <= distance2) break;
+			query->distance2[i] = query->distance2[child];
+			query->node[i] = query->node[child];
+			i = child;
+		}
+	}
+	query->distance2[i] = distance2;
+	query->node[i] = node;
+	if (query->count == PHOTON_NEIGHBOURS) {
+		query->maxDistance2 = query->distance2[0];
+	}
+}
+
+// locatePhotons() adds the photons of the subtree of node that are closer to q than the search
+// radius to query, the side of q first so the radius shrinks early
+static void locatePhotons(PhotonMap* map, int node, float* q, PhotonQuery* query) {
+	if (node >= map->count) {
+		return;
+	}
+	if (node < map->boundedCount) {
+		float* box = &map->bounds[node * 6];
+		float outside = 0;
+		int a;
+		for (a = 0; a < 3; a++) {
+			if (q[a] < box[a]) outside += sqr(box[a] - q[a]);
+			else if (q[a] > box[3 + a]) outside += sqr(q[a] - box[3 + a]);
+		}
+		if (outside >= query->maxDistance2) {
+			return;
+		}
+	}
+	PhotonNode* photon = &map->nodes[node];
+	float delta = q[photon->axis] - photon->position[photon->axis];
+	locatePhotons(map, delta < 0 ? 2 * node + 1 : 2 * node + 2, q, query);
+	float distance2 = sqr(q[0] - photon->position[0]) + sqr(q[1] - photon->position[1]) + sqr(q[2] - photon->position[2]);
+	if (distance2 < query->maxDistance2) {
+		addNeighbour(query, node, distance2);
+	}
+	if (delta * delta < query->maxDistance2) {
+		locatePhotons(map, delta < 0 ? 2 * node + 2 : 2 * node + 1, q, query);
+	}
+}
+
+// causticLight() adds the diffuse light of the photons around the point Ron with the material
+// and the unit normal N to color. The photons are weighted with a cone filter,
+// 1 - d / r, which keeps the edges of a caustic sharper than the flat average
+void causticLight(PhotonMap* map, Material* material, double* Ron, double* N, double* color) {
+	if (map->count == 0) {
+		return;
+	}
+	PhotonQuery query;
+	query.count = 0;
+	query.maxDistance2 = map->maxDistance2;
+	float q[3] = { (float)Ron[0], (float)Ron[1], (float)Ron[2] };
+	locatePhotons(map, 0, q, &query);
+	stats.causticLookups += 1;
+	stats.causticPhotons += query.count;
+	if (query.count == 0) {
+		return;
+	}
+	// the disk holds the neighbours, or the whole search radius when fewer were found
+	double radius2 = query.count == PHOTON_NEIGHBOURS ? query.maxDistance2 : map->maxDistance2;
+	double flux[3] = { 0, 0, 0 };
+	int k, a;
+	for (k = 0; k < query.count; k++) {
+		PhotonPower* photon = &map->powers[query.node[k]];
+		// photons that came from behind the surface do not light this side of it
+		if (photon->direction[0] * N[0] + photon->direction[1] * N[1] + photon->direction[2] * N[2] >= 0) {
+			continue;
+		}
+		double weight = 1 - sqrt(query.distance2[k] / radius2);
+		for (a = 0; a < 3; a++) {
+			flux[a] += weight * photon->power[a];
+		}
+	}
+	// the cone filter keeps a third of the light of a flat one
+	for (a = 0; a < 3; a++) {
+		color[a] += material->diffuseColor[a] * flux[a] * 3 / (M_PI * radius2);
+	}
+}
@@ -0,0 +1,96 @@
+// Point clouds
+// A "points" object names a binary file of spheres, so scenes with millions of spheres from a
+// simulation do not have to be written as JSON objects. The file starts with the 8 characters
+// SPHERES1 and the number of spheres as a little endian uint64, followed by one 20 byte record
+// per sphere: the center x, y, z and the radius as float32 and the material as a uint32 index
+// into the material table, where materials are numbered in the order they first appear in the
+// scene file. The file is mapped with mmap() and all threads convert the records straight into
+// the sphere arrays of the scene, so a load is as fast as the disk can deliver the file.
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define POINT_CLOUD_MAGIC "SPHERES1"
+
+typedef struct {
+	float center[3];
+	float radius;
+	uint32_t material;
+} PointRecord;
+
+typedef struct {
+	void* mapping;
+	size_t size;
+	long count;
+	PointRecord* records;
+} PointCloud;
+
+// what the point clouds of the last scene cost, for -stats
+long pointCloudSpheres;
+double pointCloudBytes;
+double pointCloudSeconds;
+
+// openPointCloud() maps the file of a points object and checks that its size fits the header
+static PointCloud openPointCloud(char* file) {
+	PointCloud cloud;
+	struct stat st;
+	int fd = open(file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "Error: Could not open the point cloud %s.\n", file);
+		exit(1);
+	}
+	if (st.st_size < 16) {
+		fprintf(stderr, "Error: %s is not a point cloud.\n", file);
+		exit(1);
+	}
+	cloud.size = st.st_size;
+	cloud.mapping = mmap(NULL, cloud.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cloud.mapping == MAP_FAILED) {
+		fprintf(stderr, "Error: Could not map the point cloud %s.\n", file);
+		exit(1);
+	}
+	// the records are read once from start to end
+	madvise(cloud.mapping, cloud.size, MADV_SEQUENTIAL | MADV_WILLNEED);
+	uint64_t count;
+	memcpy(&count, (char*)cloud.mapping + 8, sizeof(count));
+	if (memcmp(cloud.mapping, POINT_CLOUD_MAGIC, 8) != 0 || count > (uint64_t)(cloud.size - 16) / sizeof(PointRecord) ||
+		count > INT_MAX) {
+		fprintf(stderr, "Error: %s is not a point cloud or is cut short.\n", file);
+		exit(1);
+	}
+	cloud.count = (long)count;
+	cloud.records = (PointRecord*)((char*)cloud.mapping + 16);
+	return cloud;
+}
+
+// copyPointCloud() writes the spheres of the cloud, scaled and moved like the points object,
+// into spheres and sphereMaterial
+static void copyPointCloud(PointCloud* cloud, Object* points, double* spheres, int* sphereMaterial, int materialCount) {
+	long i;
+	uint32_t largest = 0;
+	double scale = points->points.scale;
+	double* position = points->points.position;
+	#pragma omp parallel for schedule(static) reduction(max:largest)
+	for (i = 0; i < cloud->count; i++) {
+		PointRecord* record = &cloud->records[i];
+		spheres[i * 4] = record->center[0] * scale + position[0];
+		spheres[i * 4 + 1] = record->center[1] * scale + position[1];
+		spheres[i * 4 + 2] = record->center[2] * scale + position[2];
+		spheres[i * 4 + 3] = record->radius * scale;
+		sphereMaterial[i] = (int)record->material;
+		if (record->material > largest) largest = record->material;
+	}
+	if (cloud->count > 0 && largest >= (uint32_t)materialCount) {
+		fprintf(stderr, "Error: the point cloud %s uses material %u, the scene has %d.\n", points->points.file, largest, materialCount);
+		exit(1);
+	}
+	pointCloudSpheres += cloud->count;
+	pointCloudBytes += cloud->size;
+}
+
+static void closePointCloud(PointCloud* cloud) {
+	munmap(cloud->mapping, cloud->size);
+}
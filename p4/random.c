@@ -0,0 +1,156 @@
+// Random numbers for the stochastic parts of the renderer.
+// The numbers come from the counter based generator Philox4x32-10: a number is a hash of its
+// key, the pixel, and of its counter, the sample of the pixel, the bounce of the path and how
+// many numbers that bounce drew before. Nothing is carried from one number to the next but
+// these counts, so an image does not depend on the order the pixels are rendered in or on the
+// number of threads, every thread keeps the counts of its own pixel and no lock is taken. The
+// numbers of a bounce also do not move when an earlier bounce draws more or fewer of them.
+// On top of that sample2D() gives pairs that are spread evenly over the samples of a pixel:
+// the first two dimensions of the Sobol sequence, scrambled by Owen's method with a hash of the
+// pixel and the dimension so that the pixels and the dimensions are not correlated.
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+// 2D dimensions of sample2D() whose scrambles are kept for the whole pixel
+#define RANDOM_DIMENSIONS 32
+
+typedef struct {
+	uint32_t key[2];   // the pixel
+	uint32_t sample;
+	uint32_t bounce;
+	uint32_t block;    // blocks of 4 numbers drawn in this bounce
+	uint32_t buffer[4];
+	int buffered;      // numbers of the buffer not used yet
+	uint32_t seeds[RANDOM_DIMENSIONS][3]; // the scrambles of sample2D() for the pixel
+	uint32_t seeded;   // bit d is set when the scrambles of dimension d are known
+} RandomStream;
+
+_Thread_local RandomStream randomStream;
+
+// philox() hashes the counter with the key into 4 random words
+static inline void philox(uint32_t* counter, uint32_t* key, uint32_t* out) {
+	uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+	uint32_t k0 = key[0], k1 = key[1];
+	int round;
+	for (round = 0; round < 10; round++) {
+		uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+		uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+		c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+		c1 = (uint32_t)p1;
+		c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+		c3 = (uint32_t)p0;
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+	out[0] = c0;
+	out[1] = c1;
+	out[2] = c2;
+	out[3] = c3;
+}
+
+// seedRandom() starts the numbers of the given pixel, at sample 0 and bounce 0
+void seedRandom(unsigned long long pixel) {
+	randomStream.key[0] = (uint32_t)pixel;
+	randomStream.key[1] = (uint32_t)(pixel >> 32);
+	randomStream.sample = 0;
+	randomStream.bounce = 0;
+	randomStream.block = 0;
+	randomStream.buffered = 0;
+	randomStream.seeded = 0;
+}
+
+// randomSample() goes on with sample s of the pixel, at bounce 0
+void randomSample(int s) {
+	randomStream.sample = (uint32_t)s;
+	randomStream.bounce = 0;
+	randomStream.block = 0;
+	randomStream.buffered = 0;
+}
+
+// randomBounce() goes on with bounce b of the path of the current sample
+void randomBounce(int b) {
+	randomStream.bounce = (uint32_t)b;
+	randomStream.block = 0;
+	randomStream.buffered = 0;
+}
+
+// random01() returns a uniform number in [0, 1)
+double random01() {
+	if (randomStream.buffered == 0) {
+		uint32_t counter[4] = { randomStream.block++, randomStream.sample, randomStream.bounce, 0 };
+		philox(counter, randomStream.key, randomStream.buffer);
+		randomStream.buffered = 4;
+	}
+	return randomStream.buffer[--randomStream.buffered] * (1.0 / 4294967296.0);
+}
+
+static inline uint32_t reverseBits(uint32_t x) {
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00FF00FFu) << 8) | ((x & 0xFF00FF00u) >> 8);
+	x = ((x & 0x0F0F0F0Fu) << 4) | ((x & 0xF0F0F0F0u) >> 4);
+	x = ((x & 0x33333333u) << 2) | ((x & 0xCCCCCCCCu) >> 2);
+	x = ((x & 0x55555555u) << 1) | ((x & 0xAAAAAAAAu) >> 1);
+	return x;
+}
+
+// laineKarras() is Laine and Karras' hash of the reversed bits x: every bit only depends on
+// the bits below it, which are the bits above it before the reversal
+static inline uint32_t laineKarras(uint32_t x, uint32_t seed) {
+	x += seed;
+	x ^= x * 0x6C50B47Cu;
+	x ^= x * 0xB82F1E52u;
+	x ^= x * 0xC7AFE638u;
+	x ^= x * 0x8D22F6E6u;
+	return x;
+}
+
+// owenScramble() flips every bit of x with a chance that depends on the bits above it
+static inline uint32_t owenScramble(uint32_t x, uint32_t seed) {
+	return reverseBits(laineKarras(reverseBits(x), seed));
+}
+
+// sobolReversed() returns the reversed bits of point i of the second dimension of the Sobol
+// sequence, the first dimension is reverseBits(i). Bit k of the point is set by every bit j of
+// i with (j & k) == k, as the direction numbers are Pascal's triangle modulo 2, so the bits
+// are summed in 5 steps instead of a loop over the 32 bits of i
+static inline uint32_t sobolReversed(uint32_t i) {
+	i ^= (i >> 1) & 0x55555555u;
+	i ^= (i >> 2) & 0x33333333u;
+	i ^= (i >> 4) & 0x0F0F0F0Fu;
+	i ^= (i >> 8) & 0x00FF00FFu;
+	i ^= (i >> 16) & 0x0000FFFFu;
+	return i;
+}
+
+// sample2D() sets u and v to the pair of the current sample in the 2D dimension d. With
+// -sampler random the pair is two numbers of random01(), otherwise the samples of the pixel
+// are scrambled Sobol points
+void sample2D(int d, double* u, double* v) {
+	if (options.sampler == 0) {
+		*u = random01();
+		*v = random01();
+		return;
+	}
+	// the seeds of the pixel and dimension, from a counter no bounce uses
+	uint32_t counter[4] = { (uint32_t)d, 0, 0, 0xFFFFFFFFu };
+	uint32_t buffer[4];
+	uint32_t* seeds = buffer;
+	if (d < RANDOM_DIMENSIONS) {
+		seeds = randomStream.seeds[d];
+		if (!(randomStream.seeded >> d & 1)) {
+			philox(counter, randomStream.key, buffer);
+			memcpy(seeds, buffer, sizeof(uint32_t) * 3);
+			randomStream.seeded |= 1u << d;
+		}
+	}
+	else {
+		philox(counter, randomStream.key, buffer);
+	}
+	// the order of the points is shuffled per dimension, so the dimensions are not correlated
+	uint32_t i = owenScramble(randomStream.sample, seeds[0]);
+	// both points are scrambled in their reversed form
+	*u = reverseBits(laineKarras(i, seeds[1])) * (1.0 / 4294967296.0);
+	*v = reverseBits(laineKarras(sobolReversed(i), seeds[2])) * (1.0 / 4294967296.0);
+}
@@ -0,0 +1,298 @@
+// Temporal reprojection
+// For preview animations most pixels of a frame show the same thing as in the frame before.
+// With -reproject f every pixel keeps the primitive, the point and the color it was shaded
+// with. In the next frame the primary ray is still traced, which is cheap next to the shading,
+// and its hit is projected into the camera of the last frame. When the pixel there saw the same
+// primitive within about one pixel of the hit, its color is reused, with the same camera only
+// the pixel itself is looked at. Otherwise the surface was hidden or off screen before (a
+// disocclusion) and the pixel is shaded, as is a pixel that saw another primitive itself.
+// A reused color also has to be shaded again when the light on the point can have changed:
+// when the primitive itself changed, when a changed light reaches the point, when a changed
+// sphere or instance comes near the way from the point to a light that reaches it, or when the
+// primitive reflects or refracts and anything in the scene changed. On top of that a fraction
+// f of the pixels is shaded again every frame in a fixed pattern, so no pixel is older than
+// 1 / f frames and long sequences cannot drift. With a still camera every reused pixel is the
+// one a full render would give.
+
+// more changed spheres and instances than this shade the whole frame
+#define REPROJECT_EDITS 64
+
+typedef struct {
+	float position[3];  // the point the color was shaded at
+	int id;             // primitive of the primary hit, -1 for the background
+	float color[3];     // before the tone mapping
+	int age;            // frames since the color was shaded
+} ReprojectSample;
+
+typedef struct {
+	int width;
+	int height;
+	int valid;           // 0 when the next frame has to be shaded in full
+	double viewWidth;    // the camera of the samples
+	double viewHeight;
+	double frameWidth;   // the camera of the frame that is being rendered
+	double frameHeight;
+	ReprojectSample* samples; // the last frame
+	ReprojectSample* next;    // the frame that is being rendered
+	int period;          // every pixel is shaded again at least once in this many frames
+	int frame;
+	// the changes since the last frame: primitives [first, last) at their old and new bounds
+	int editCount;
+	int* editRange;
+	double* editSphere;
+	// the old and new influence spheres of the lights that changed
+	int lightEditCount;
+	double* lightSphere;
+	int anyChange;
+	// counters of the current frame
+	int traced;
+	int disoccluded;
+	int shadingChanged;
+	int refreshed;
+} Reprojection;
+
+// the reprojection of -reproject, NULL otherwise
+Reprojection* reprojection;
+
+Reprojection* newReprojection(double fraction, int w, int h) {
+	Reprojection* r = calloc(1, sizeof(Reprojection));
+	r->width = w;
+	r->height = h;
+	r->period = (int)(1 / fraction + 0.5);
+	r->period = r->period < 1 ? 1 : r->period;
+	r->samples = malloc(sizeof(ReprojectSample) * (size_t)w * h);
+	r->next = malloc(sizeof(ReprojectSample) * (size_t)w * h);
+	r->editRange = malloc(sizeof(int) * 2 * REPROJECT_EDITS * 2);
+	r->editSphere = malloc(sizeof(double) * 4 * REPROJECT_EDITS * 2);
+	if (r->samples == NULL || r->next == NULL || r->editRange == NULL || r->editSphere == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the reprojection.\n");
+		exit(1);
+	}
+	return r;
+}
+
+void freeReprojection(Reprojection* r) {
+	if (r == NULL) {
+		return;
+	}
+	free(r->samples);
+	free(r->next);
+	free(r->editRange);
+	free(r->editSphere);
+	free(r->lightSphere);
+	free(r);
+}
+
+// addReprojectEdit() notes that primitives [first, last) changed, at both of their bounds
+static int addReprojectEdit(Reprojection* r, int first, int last, double* oldSphere, double* sphere) {
+	if (r->editCount + 2 > REPROJECT_EDITS * 2) {
+		return 0;
+	}
+	int k;
+	for (k = 0; k < 2; k++) {
+		r->editRange[r->editCount * 2] = first;
+		r->editRange[r->editCount * 2 + 1] = last;
+		memcpy(&r->editSphere[r->editCount * 4], k == 0 ? oldSphere : sphere, sizeof(double) * 4);
+		r->editCount += 1;
+	}
+	return 1;
+}
+
+// editReprojection() notes the edits from the last frame and the lights that changed, or marks
+// the whole next frame for shading
+void editReprojection(Reprojection* r, SceneEdits* edits, Object** oldObjects, Object** objects) {
+	int i, count = 0, ok = 1;
+	r->editCount = 0;
+	r->lightEditCount = 0;
+	if (!edits->valid) {
+		r->valid = 0;
+		return;
+	}
+	while (objects[count] != 0) count++;
+	free(r->lightSphere);
+	r->lightSphere = malloc(sizeof(double) * 4 * 2 * (count + 1));
+	for (i = 0; i < count && ok; i++) {
+		if (objects[i]->kind == 3 && memcmp(&oldObjects[i]->light, &objects[i]->light, sizeof(objects[i]->light)) != 0) {
+			// -lightbudget picks every light by the power of all the others
+			ok = options.lightBudget == 0;
+			Object* lights[2] = { oldObjects[i], objects[i] };
+			int k;
+			for (k = 0; k < 2; k++) {
+				double* sphere = &r->lightSphere[r->lightEditCount++ * 4];
+				memcpy(sphere, lights[k]->light.position, sizeof(double) * 3);
+				sphere[3] = lightInfluenceRadius(lights[k], options.cutoff);
+			}
+		}
+	}
+	for (i = 0; i < edits->count && ok; i++) {
+		SceneEdit* edit = &edits->edits[i];
+		ok = addReprojectEdit(r, edit->first, edit->last, edit->oldSphere, edit->sphere);
+	}
+	if (!ok) {
+		r->valid = 0;
+	}
+	r->anyChange = r->editCount > 0 || r->lightEditCount > 0;
+}
+
+// beginReprojection() starts a frame of a w x h image with the camera size width x height
+void beginReprojection(Reprojection* r, int w, int h, double width, double height) {
+	if (w != r->width || h != r->height) {
+		r->valid = 0;
+	}
+	r->frame += 1;
+	r->traced = 0;
+	r->disoccluded = 0;
+	r->shadingChanged = 0;
+	r->refreshed = 0;
+	r->frameWidth = width;
+	r->frameHeight = height;
+}
+
+// endReprojection() keeps the samples of the frame for the next one
+void endReprojection(Reprojection* r) {
+	ReprojectSample* swap = r->samples;
+	r->samples = r->next;
+	r->next = swap;
+	r->viewWidth = r->frameWidth;
+	r->viewHeight = r->frameHeight;
+	r->valid = 1;
+	r->anyChange = 0;
+	r->editCount = 0;
+	r->lightEditCount = 0;
+}
+
+// shadingChanged() returns 1 if the light at the point q of primitive id can be other than in
+// the last frame
+static int shadingChanged(Reprojection* r, int id, float* q, Object** objects) {
+	int i, k;
+	if (!r->anyChange) {
+		return 0;
+	}
+	Material* material = primitiveMaterial(scene, id);
+	if (material->reflectivity > 0 || material->refractivity > 0) {
+		return 1;
+	}
+	for (i = 0; i < r->editCount; i++) {
+		if (id >= r->editRange[i * 2] && id < r->editRange[i * 2 + 1]) {
+			return 1;
+		}
+	}
+	for (i = 0; i < r->lightEditCount; i++) {
+		double* sphere = &r->lightSphere[i * 4];
+		if (sqr(q[0] - sphere[0]) + sqr(q[1] - sphere[1]) + sqr(q[2] - sphere[2]) <= sqr(sphere[3])) {
+			return 1;
+		}
+	}
+	if (r->editCount == 0) {
+		return 0;
+	}
+	// the shadow rays of the lights that reach the point
+	double p[3] = { q[0], q[1], q[2] };
+	int cellCount = 0;
+	int* cell = lightTree != NULL ? NULL : lightGridCell(lightGrid, p, &cellCount);
+	int count = lightTree != NULL ? lightGrid->count : lightGrid->globalCount + cellCount;
+	for (k = 0; k < count; k++) {
+		int n = lightTree != NULL || k < lightGrid->globalCount ? (lightTree != NULL ? k : lightGrid->global[k]) : cell[k - lightGrid->globalCount];
+		if (lightTree == NULL && !lightReaches(lightGrid, n, p)) {
+			continue;
+		}
+		double* light = objects[lightGrid->index[n]]->light.position;
+		for (i = 0; i < r->editCount; i++) {
+			// the rays to an area light stay within its shape radius of the ray to its center
+			double* edit = &r->editSphere[i * 4];
+			double sphere[4] = { edit[0], edit[1], edit[2], edit[3] + lightGrid->shapeRadius[n] };
+			if (segmentNearSphere(q, light, sphere)) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+// reprojectPixel() looks for the color of pixel j of row k in the last frame, the primary ray
+// Rd hit primitive id at t = depth. It returns 1 and sets color when the pixel does not have
+// to be shaded, the sample of the pixel is then already kept for the next frame.
+int reprojectPixel(Reprojection* r, int j, int k, int id, double* Rd, double depth, Object** objects, float* color) {
+	int p = k * r->width + j;
+	ReprojectSample* sample = &r->next[p];
+	if (id < 0) {
+		// the background costs no shading
+		memset(sample, 0, sizeof(ReprojectSample));
+		sample->id = -1;
+		memset(color, 0, sizeof(float) * 3);
+		return 1;
+	}
+	if (!r->valid) {
+		return 0;
+	}
+	// a fixed scramble of the pixels decides which frame of the period shades them again
+	if (((unsigned)p * 2654435761u >> 8) % r->period == (unsigned)r->frame % r->period) {
+		r->refreshed += 1;
+		return 0;
+	}
+	double hit[3] = { depth * Rd[0], depth * Rd[1], depth * Rd[2] };
+	double footprint = depth * fmax(r->frameWidth / r->width, r->frameHeight / r->height);
+	// a pixel that saw another primitive in the last frame is at a silhouette that moved, the
+	// colors of its neighbours were shaded at other points of the surface
+	if (r->samples[p].id != id) {
+		r->disoccluded += 1;
+		return 0;
+	}
+	ReprojectSample* old = NULL;
+	double best = sqr(footprint);
+	if (r->viewWidth == r->frameWidth && r->viewHeight == r->frameHeight) {
+		// with the same camera only the pixel itself shaded the same point
+		ReprojectSample* candidate = &r->samples[p];
+		if (sqr(candidate->position[0] - hit[0]) + sqr(candidate->position[1] - hit[1]) + sqr(candidate->position[2] - hit[2]) <= best) {
+			old = candidate;
+		}
+	}
+	else if (hit[2] > 0) {
+		// of the 4 pixels of the last frame around the hit, the one that saw the same primitive
+		// closest to it
+		double x = (hit[0] / hit[2] + r->viewWidth / 2) / (r->viewWidth / r->width) - 0.5;
+		double y = (hit[1] / hit[2] + r->viewHeight / 2) / (r->viewHeight / r->height) - 0.5;
+		int x0 = (int)floor(x), y0 = (int)floor(y), a, b;
+		for (b = y0; b <= y0 + 1; b++) {
+			for (a = x0; a <= x0 + 1; a++) {
+				if (a < 0 || a >= r->width || b < 0 || b >= r->height) continue;
+				ReprojectSample* candidate = &r->samples[b * r->width + a];
+				double distance = sqr(candidate->position[0] - hit[0]) + sqr(candidate->position[1] - hit[1]) +
+					sqr(candidate->position[2] - hit[2]);
+				if (candidate->id == id && distance <= best) {
+					old = candidate;
+					best = distance;
+				}
+			}
+		}
+	}
+	if (old == NULL) {
+		r->disoccluded += 1;
+		return 0;
+	}
+	// the light is checked at the point the pixel sees now, not where the old color was shaded
+	float q[3] = { (float)hit[0], (float)hit[1], (float)hit[2] };
+	if (shadingChanged(r, id, q, objects)) {
+		r->shadingChanged += 1;
+		return 0;
+	}
+	memcpy(sample->position, q, sizeof(float) * 3);
+	sample->id = id;
+	memcpy(sample->color, old->color, sizeof(float) * 3);
+	sample->age = old->age + 1;
+	memcpy(color, old->color, sizeof(float) * 3);
+	return 1;
+}
+
+// keepSample() keeps the color of a pixel that was shaded for the next frame
+void keepSample(Reprojection* r, int j, int k, int id, double* Rd, double depth, float* color) {
+	ReprojectSample* sample = &r->next[k * r->width + j];
+	int a;
+	for (a = 0; a < 3; a++) {
+		sample->position[a] = depth * Rd[a];
+	}
+	sample->id = id;
+	memcpy(sample->color, color, sizeof(float) * 3);
+	sample->age = 0;
+	r->traced += 1;
+}
@@ -0,0 +1,266 @@
+// instanceMatrix() sets m to scale * the rotation of the instance, the rotation goes around
+// x first, then y and then z
+static void instanceMatrix(Object* instance, double* m) {
+	double rx = instance->instance.rotation[0] * M_PI / 180;
+	double ry = instance->instance.rotation[1] * M_PI / 180;
+	double rz = instance->instance.rotation[2] * M_PI / 180;
+	double cx = cos(rx), sx = sin(rx), cy = cos(ry), sy = sin(ry), cz = cos(rz), sz = sin(rz);
+	double r[9] = {
+		cz * cy, cz * sy * sx - sz * cx, cz * sy * cx + sz * sx,
+		sz * cy, sz * sy * sx + cz * cx, sz * sy * cx - cz * sx,
+		-sy, cy * sx, cy * cx
+	};
+	int i;
+	for (i = 0; i < 9; i++) {
+		m[i] = instance->instance.scale * r[i];
+	}
+}
+
+// buildInstances() copies the prototype spheres and the instances of the object list into the
+// scene. Every prototype keeps one copy of its spheres, however many instances it has.
+static void buildInstances(Scene* s, Object** objects) {
+	int i, j, a;
+	s->prototypeCount = prototypeCount;
+	s->prototypeStart = calloc(prototypeCount + 1, sizeof(int));
+	s->instanceCount = 0;
+	for (i = 0; objects[i] != 0; i++) {
+		if (objects[i]->kind == 1 && objects[i]->sphere.prototype > 0) {
+			s->prototypeStart[objects[i]->sphere.prototype] += 1;
+		}
+		else if (objects[i]->kind == 4) {
+			s->instanceCount += 1;
+		}
+	}
+	for (j = 0; j < prototypeCount; j++) {
+		s->prototypeStart[j + 1] += s->prototypeStart[j];
+	}
+	int sphereCount = s->prototypeStart[prototypeCount];
+	s->prototypeSpheres = malloc(sizeof(double) * 4 * (sphereCount + 1));
+	s->prototypeMaterial = malloc(sizeof(int) * (sphereCount + 1));
+	s->instancePrototype = malloc(sizeof(int) * (s->instanceCount + 1));
+	s->instanceTransform = malloc(sizeof(double) * 12 * (s->instanceCount + 1));
+	s->instanceInverse = malloc(sizeof(double) * 9 * (s->instanceCount + 1));
+	s->instanceFirst = malloc(sizeof(int) * (s->instanceCount + 1));
+	int* fill = malloc(sizeof(int) * (prototypeCount + 1));
+	if (s->prototypeStart == NULL || s->prototypeSpheres == NULL || s->prototypeMaterial == NULL || s->instancePrototype == NULL ||
+		s->instanceTransform == NULL || s->instanceInverse == NULL || s->instanceFirst == NULL || fill == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the instances.\n");
+		exit(1);
+	}
+	memcpy(fill, s->prototypeStart, sizeof(int) * (prototypeCount + 1));
+	int instance = 0;
+	s->instanceFirst[0] = 0;
+	for (i = 0; objects[i] != 0; i++) {
+		if (objects[i]->kind == 1 && objects[i]->sphere.prototype > 0) {
+			int k = fill[objects[i]->sphere.prototype - 1]++;
+			for (a = 0; a < 3; a++) {
+				s->prototypeSpheres[k * 4 + a] = objects[i]->sphere.position[a];
+			}
+			s->prototypeSpheres[k * 4 + 3] = objects[i]->sphere.radius;
+			s->prototypeMaterial[k] = objects[i]->sphere.material;
+		}
+		else if (objects[i]->kind == 4) {
+			j = objects[i]->instance.prototype;
+			int size = s->prototypeStart[j + 1] - s->prototypeStart[j];
+			if (size == 0) {
+				fprintf(stderr, "Error: the prototype %s has no spheres.\n", prototypeNames[j]);
+				exit(1);
+			}
+			double* m = &s->instanceTransform[instance * 12];
+			double* inverse = &s->instanceInverse[instance * 9];
+			instanceMatrix(objects[i], m);
+			for (a = 0; a < 3; a++) {
+				m[9 + a] = objects[i]->instance.position[a];
+			}
+			// the inverse of scale * rotation is the transposed rotation / scale
+			double scale2 = sqr(objects[i]->instance.scale);
+			for (a = 0; a < 9; a++) {
+				inverse[a] = m[(a % 3) * 3 + a / 3] / scale2;
+			}
+			s->instancePrototype[instance] = j;
+			s->instanceFirst[instance + 1] = s->instanceFirst[instance] + size;
+			instance += 1;
+		}
+	}
+	free(fill);
+}
+
+// buildScene() copies the spheres and planes of the object list into the compact arrays of
+// the scene, the materials come from the table that readScene() filled. The spheres of point
+// clouds are copied in the place of their points object.
+Scene* buildScene(Object** objects) {
+	Scene* s = calloc(1, sizeof(Scene));
+	int i, a;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int cloudCount = 0, cloud = 0;
+	for (i = 0; objects[i] != 0; i++) {
+		if (objects[i]->kind == 6) cloudCount += 1;
+	}
+	PointCloud* clouds = malloc(sizeof(PointCloud) * (cloudCount + 1));
+	long sphereCount = 0;
+	for (i = 0; objects[i] != 0; i++) {
+		if (objects[i]->kind == 1 && objects[i]->sphere.prototype == 0) sphereCount += 1;
+		else if (objects[i]->kind == 2) s->planeCount += 1;
+		else if (objects[i]->kind == 6) {
+			clouds[cloud] = openPointCloud(objects[i]->points.file);
+			sphereCount += clouds[cloud++].count;
+		}
+	}
+	if (sphereCount > INT_MAX / 4) {
+		fprintf(stderr, "Error: the scene has too many spheres.\n");
+		exit(1);
+	}
+	s->sphereCount = (int)sphereCount;
+	s->spheres = malloc(sizeof(double) * 4 * ((long)s->sphereCount + 1));
+	s->sphereMaterial = malloc(sizeof(int) * (s->sphereCount + 1));
+	s->planes = malloc(sizeof(double) * 6 * (s->planeCount + 1));
+	s->planeMaterial = malloc(sizeof(int) * (s->planeCount + 1));
+	if (s->spheres == NULL || s->sphereMaterial == NULL || s->planes == NULL || s->planeMaterial == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the scene.\n");
+		exit(1);
+	}
+	int sphere = 0;
+	int plane = 0;
+	cloud = 0;
+	pointCloudSpheres = 0;
+	pointCloudBytes = 0;
+	for (i = 0; objects[i] != 0; i++) {
+		if (objects[i]->kind == 1 && objects[i]->sphere.prototype == 0) {
+			for (a = 0; a < 3; a++) {
+				s->spheres[sphere * 4 + a] = objects[i]->sphere.position[a];
+			}
+			s->spheres[sphere * 4 + 3] = objects[i]->sphere.radius;
+			s->sphereMaterial[sphere] = objects[i]->sphere.material;
+			sphere += 1;
+		}
+		else if (objects[i]->kind == 2) {
+			for (a = 0; a < 3; a++) {
+				s->planes[plane * 6 + a] = objects[i]->plane.position[a];
+				s->planes[plane * 6 + 3 + a] = objects[i]->plane.normal[a];
+			}
+			s->planeMaterial[plane] = objects[i]->plane.material;
+			plane += 1;
+		}
+		else if (objects[i]->kind == 6) {
+			PointCloud* c = &clouds[cloud++];
+			copyPointCloud(c, objects[i], &s->spheres[(long)sphere * 4], &s->sphereMaterial[sphere], materialCount);
+			closePointCloud(c);
+			sphere += c->count;
+		}
+	}
+	free(clouds);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pointCloudSeconds = cloudCount > 0 ? (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9 : 0;
+	s->materialCount = materialCount;
+	s->materials = materials;
+	buildInstances(s, objects);
+	// the triangles of the meshes are read later by loadMeshes()
+	for (i = 0; objects[i] != 0; i++) {
+		if (objects[i]->kind == 5) s->meshCount += 1;
+	}
+	s->meshes = calloc(s->meshCount + 1, sizeof(Mesh));
+	s->meshFirst = calloc(s->meshCount + 1, sizeof(int));
+	if (s->meshes == NULL || s->meshFirst == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the meshes.\n");
+		exit(1);
+	}
+	int mesh = 0;
+	for (i = 0; objects[i] != 0; i++) {
+		if (objects[i]->kind == 5) {
+			Mesh* m = &s->meshes[mesh++];
+			m->file = objects[i]->mesh.file;
+			memcpy(m->position, objects[i]->mesh.position, sizeof(m->position));
+			m->scale = objects[i]->mesh.scale;
+			m->material = objects[i]->mesh.material;
+		}
+	}
+	return s;
+}
+
+// freeScene() frees the arrays of a scene, the material table belongs to the parser
+void freeScene(Scene* s) {
+	free(s->spheres);
+	free(s->sphereMaterial);
+	free(s->planes);
+	free(s->planeMaterial);
+	free(s->prototypeStart);
+	free(s->prototypeSpheres);
+	free(s->prototypeMaterial);
+	free(s->instancePrototype);
+	free(s->instanceTransform);
+	free(s->instanceInverse);
+	free(s->instanceFirst);
+	free(s->meshes);
+	free(s->meshFirst);
+	free(s);
+}
+
+// the instance of the instanced primitive p, found by a binary search of instanceFirst
+static inline int primitiveInstance(Scene* s, int p) {
+	int k = p - s->sphereCount - s->planeCount;
+	int lo = 0, hi = s->instanceCount - 1;
+	while (lo < hi) {
+		int middle = (lo + hi + 1) / 2;
+		if (s->instanceFirst[middle] <= k) lo = middle;
+		else hi = middle - 1;
+	}
+	return lo;
+}
+
+// the first primitive of the triangles, they come after the instanced spheres
+static inline int triangleBase(Scene* s) {
+	return s->sphereCount + s->planeCount + s->instanceFirst[s->instanceCount];
+}
+
+// the mesh of the triangle primitive p, found by a binary search of meshFirst
+static inline int primitiveMesh(Scene* s, int p) {
+	int k = p - triangleBase(s);
+	int lo = 0, hi = s->meshCount - 1;
+	while (lo < hi) {
+		int middle = (lo + hi + 1) / 2;
+		if (s->meshFirst[middle] <= k) lo = middle;
+		else hi = middle - 1;
+	}
+	return lo;
+}
+
+// is primitive p a sphere, placed in the world or by an instance
+static inline int isSpherePrimitive(Scene* s, int p) {
+	return p < s->sphereCount || (p >= s->sphereCount + s->planeCount && p < triangleBase(s));
+}
+
+// the center and radius of the sphere primitive p in world space. World spheres are returned
+// from the scene, instanced spheres are transformed into buffer
+static inline double* primitiveSphere(Scene* s, int p, double* buffer) {
+	if (p < s->sphereCount) {
+		return &s->spheres[p * 4];
+	}
+	int i = primitiveInstance(s, p);
+	int j = s->instancePrototype[i];
+	double* local = &s->prototypeSpheres[(s->prototypeStart[j] + p - s->sphereCount - s->planeCount - s->instanceFirst[i]) * 4];
+	double* m = &s->instanceTransform[i * 12];
+	int a;
+	for (a = 0; a < 3; a++) {
+		buffer[a] = m[a * 3] * local[0] + m[a * 3 + 1] * local[1] + m[a * 3 + 2] * local[2] + m[9 + a];
+	}
+	// the rows of scale * rotation have the length of the scale
+	buffer[3] = local[3] * sqrt(sqr(m[0]) + sqr(m[1]) + sqr(m[2]));
+	return buffer;
+}
+
+// the material of primitive p
+static inline Material* primitiveMaterial(Scene* s, int p) {
+	if (p < s->sphereCount) {
+		return &s->materials[s->sphereMaterial[p]];
+	}
+	if (p < s->sphereCount + s->planeCount) {
+		return &s->materials[s->planeMaterial[p - s->sphereCount]];
+	}
+	if (p >= triangleBase(s)) {
+		return &s->materials[s->meshes[primitiveMesh(s, p)].material];
+	}
+	int i = primitiveInstance(s, p);
+	int j = s->instancePrototype[i];
+	return &s->materials[s->prototypeMaterial[s->prototypeStart[j] + p - s->sphereCount - s->planeCount - s->instanceFirst[i]]];
+}
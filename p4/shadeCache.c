@@ -0,0 +1,348 @@
+// Shading cache
+// Most of the time of a frame goes into the shadow rays, and when only a few objects of an
+// animation move, almost all of them give the same answer as in the frame before. With
+// -shadecache r the answers of the shadow rays of every shading point are kept in a hash table
+// that lives for all the frames. A point is found by its primitive, its position and its
+// normal rounded to cells of size r in world space, so it does not matter where the camera is,
+// and it keeps for every light it was shaded with the primitive that blocked the light, or -1
+// when the light reached it. The lights of a point lie next to each other in one pool, so a
+// point costs one lookup in the table however many lights it has.
+// Between frames the scenes are compared and the changes go into a log: a light that moved has
+// to be traced again everywhere, a sphere or an instance that changed has to be traced again
+// for the lights it blocked and the lights whose way to the point it now crosses. A point is
+// checked against the log when it is shaded again, so a frame only pays for the points it
+// uses. Changes that cannot be bounded, like a plane or a mesh, empty the cache.
+// Only the visibility is kept, the diffuse and specular terms are always computed again, so
+// light colors and materials can change freely. With a small r, like 1e-6, only the very same
+// point is found again and the image is exact; a larger r reuses the shadows of nearby points
+// when the camera moves, which can make the edges of the shadows as coarse as r.
+
+#define SHADE_CACHE_BITS 20
+#define SHADE_CACHE_PROBES 4
+// frames that the log goes back, older points are traced again
+#define SHADE_CACHE_HISTORY 16
+// more changes than this in one frame empty the cache
+#define SHADE_CACHE_EDITS 256
+// one traced shadow ray in this many is timed for the time saved
+#define SHADE_CACHE_TIMING 16
+
+// the answer for a light that has to be traced again
+#define SHADE_CACHE_UNKNOWN -2
+
+typedef struct {
+	uint64_t key;       // 0 for a free slot
+	float position[3];  // the point the shadow rays were traced from
+	int frame;          // the last frame the point was checked against the log
+	int first;          // its lights are pool[first .. first + count)
+	int count;
+} ShadeCacheEntry;
+
+typedef struct {
+	int light;          // object index of the light
+	int occluder;       // primitive that blocked it, -1 when it reached the point
+} ShadeCacheLight;
+
+typedef struct {
+	int frame;          // frame the change was made in
+	int first;          // primitives [first, last) of the changed sphere or instance
+	int last;
+	double sphere[4];   // bounds of the new place
+} ShadeCacheEdit;
+
+typedef struct {
+	double cellSize;
+	ShadeCacheEntry* entries;
+	ShadeCacheLight* pool;
+	int poolCount;
+	int poolCapacity;
+	int garbage;        // lights in the pool that no point uses any more
+	int frame;
+	int flushFrame;     // points checked before this frame are traced again
+	int objectCount;
+	int* lightMoved;    // frame every object last moved in, for the lights
+	ShadeCacheEdit* edits;
+	int editCount;
+	int editCapacity;
+	// the point that is being shaded and the light of it that was looked up last
+	ShadeCacheEntry* point;
+	int fresh;          // 1 when the point is new, it has nothing to look up
+	int cursor;
+	int found;
+	// counters of the current frame
+	long lookups;
+	long hits;
+	long stale;         // lights that were found but had to be traced again
+	// the shadow rays traced after a miss in all frames, for what a hit saves
+	long tracedRays;
+	long timedRays;
+	double timedSeconds;
+} ShadeCache;
+
+// the cache of -shadecache, NULL otherwise
+ShadeCache* shadeCache;
+
+ShadeCache* newShadeCache(double cellSize, int objectCount) {
+	ShadeCache* cache = calloc(1, sizeof(ShadeCache));
+	cache->cellSize = cellSize;
+	cache->entries = calloc((size_t)1 << SHADE_CACHE_BITS, sizeof(ShadeCacheEntry));
+	cache->objectCount = objectCount;
+	cache->lightMoved = calloc(objectCount + 1, sizeof(int));
+	if (cache->entries == NULL || cache->lightMoved == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the shading cache.\n");
+		exit(1);
+	}
+	return cache;
+}
+
+// addShadeCacheEdit() logs that primitives [first, last) changed and now lie in sphere
+static void addShadeCacheEdit(ShadeCache* cache, int first, int last, double* sphere) {
+	if (cache->editCount == cache->editCapacity) {
+		cache->editCapacity = cache->editCapacity * 2 + 64;
+		cache->edits = realloc(cache->edits, sizeof(ShadeCacheEdit) * cache->editCapacity);
+		if (cache->edits == NULL) {
+			fprintf(stderr, "Error: Could not allocate memory for the shading cache.\n");
+			exit(1);
+		}
+	}
+	ShadeCacheEdit* edit = &cache->edits[cache->editCount++];
+	edit->frame = cache->frame;
+	edit->first = first;
+	edit->last = last;
+	memcpy(edit->sphere, sphere, sizeof(edit->sphere));
+}
+
+// flushShadeCache() forgets every point
+static void flushShadeCache(ShadeCache* cache) {
+	memset(cache->entries, 0, sizeof(ShadeCacheEntry) << SHADE_CACHE_BITS);
+	cache->poolCount = 0;
+	cache->garbage = 0;
+	cache->editCount = 0;
+}
+
+// compactShadeCache() moves the lights of the points that are still used to the front of a
+// new pool
+static void compactShadeCache(ShadeCache* cache) {
+	size_t i;
+	int count = 0, capacity = cache->poolCount - cache->garbage + 1;
+	ShadeCacheLight* pool = malloc(sizeof(ShadeCacheLight) * capacity);
+	if (pool == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the shading cache.\n");
+		exit(1);
+	}
+	for (i = 0; i < (size_t)1 << SHADE_CACHE_BITS; i++) {
+		ShadeCacheEntry* entry = &cache->entries[i];
+		if (entry->key == 0) continue;
+		memcpy(&pool[count], &cache->pool[entry->first], sizeof(ShadeCacheLight) * entry->count);
+		entry->first = count;
+		count += entry->count;
+	}
+	free(cache->pool);
+	cache->pool = pool;
+	cache->poolCount = count;
+	cache->poolCapacity = capacity;
+	cache->garbage = 0;
+}
+
+// editShadeCache() starts the next frame: it notes the lights that moved since the last frame
+// and logs the edits of the spheres and instances
+void editShadeCache(ShadeCache* cache, SceneEdits* sceneEdits, Object** oldObjects, Object** objects) {
+	int i, count = 0;
+	cache->frame += 1;
+	cache->lookups = 0;
+	cache->hits = 0;
+	cache->stale = 0;
+	if (cache->garbage > cache->poolCount / 2) {
+		compactShadeCache(cache);
+	}
+	// the log only goes back SHADE_CACHE_HISTORY frames
+	if (cache->frame - SHADE_CACHE_HISTORY > cache->flushFrame) {
+		cache->flushFrame = cache->frame - SHADE_CACHE_HISTORY;
+	}
+	int kept = 0;
+	for (i = 0; i < cache->editCount; i++) {
+		if (cache->edits[i].frame >= cache->flushFrame) {
+			cache->edits[kept++] = cache->edits[i];
+		}
+	}
+	cache->editCount = kept;
+	while (objects[count] != 0) count++;
+	if (count != cache->objectCount || !sceneEdits->valid) {
+		// the primitives and lights are numbered in another way
+		free(cache->lightMoved);
+		cache->objectCount = count;
+		cache->lightMoved = calloc(count + 1, sizeof(int));
+		flushShadeCache(cache);
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		if (objects[i]->kind == 3 && memcmp(oldObjects[i]->light.position, objects[i]->light.position, sizeof(objects[i]->light.position)) != 0) {
+			cache->lightMoved[i] = cache->frame;
+		}
+	}
+	// the cache only keeps which lights are blocked, a new material of a sphere does not change that
+	int edits = 0;
+	for (i = 0; i < sceneEdits->count && edits <= SHADE_CACHE_EDITS; i++) {
+		SceneEdit* edit = &sceneEdits->edits[i];
+		if (!edit->moved) continue;
+		addShadeCacheEdit(cache, edit->first, edit->last, edit->sphere);
+		edits += 1;
+	}
+	if (edits > SHADE_CACHE_EDITS) {
+		flushShadeCache(cache);
+	}
+}
+
+// segmentNearSphere() returns 1 if the segment from p to q comes within the radius of sphere
+static int segmentNearSphere(float* p, double* q, double* sphere) {
+	double d[3], c[3];
+	int a;
+	for (a = 0; a < 3; a++) {
+		d[a] = q[a] - p[a];
+		c[a] = sphere[a] - p[a];
+	}
+	double dd = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+	double t = dd > 0 ? (c[0] * d[0] + c[1] * d[1] + c[2] * d[2]) / dd : 0;
+	t = t < 0 ? 0 : (t > 1 ? 1 : t);
+	double distance = sqr(c[0] - t * d[0]) + sqr(c[1] - t * d[1]) + sqr(c[2] - t * d[2]);
+	return distance <= sqr(sphere[3]);
+}
+
+// checkShadeCachePoint() marks the lights of a point that the changes since it was last
+// checked can make different
+static void checkShadeCachePoint(ShadeCache* cache, ShadeCacheEntry* entry, Object** objects) {
+	int i, k;
+	if (entry->frame == cache->frame) {
+		return;
+	}
+	for (k = 0; k < entry->count; k++) {
+		ShadeCacheLight* light = &cache->pool[entry->first + k];
+		if (light->occluder == SHADE_CACHE_UNKNOWN) continue;
+		if (cache->lightMoved[light->light] > entry->frame) {
+			light->occluder = SHADE_CACHE_UNKNOWN;
+			continue;
+		}
+		// the log is in the order of the frames
+		for (i = cache->editCount - 1; i >= 0 && cache->edits[i].frame > entry->frame; i--) {
+			ShadeCacheEdit* edit = &cache->edits[i];
+			if (light->occluder >= 0 ? light->occluder >= edit->first && light->occluder < edit->last :
+				segmentNearSphere(entry->position, objects[light->light]->light.position, edit->sphere)) {
+				light->occluder = SHADE_CACHE_UNKNOWN;
+				break;
+			}
+		}
+	}
+	entry->frame = cache->frame;
+}
+
+// beginShadeCachePoint() finds the point Ron with the normal N of primitive id in the cache,
+// or makes a new point, before its lights are shaded
+void beginShadeCachePoint(ShadeCache* cache, int id, double* Ron, double* N, Object** objects) {
+	int64_t words[7];
+	int a, k;
+	words[0] = id;
+	for (a = 0; a < 3; a++) {
+		words[1 + a] = (int64_t)floor(Ron[a] / cache->cellSize);
+		words[4 + a] = (int64_t)floor(N[a] * 8 + 0.5);
+	}
+	uint64_t key = 0;
+	for (a = 0; a < 7; a++) {
+		key = (key ^ (uint64_t)words[a]) * 0x9E3779B97F4A7C15ULL;
+		key ^= key >> 29;
+	}
+	// 0 marks a free slot
+	key = key == 0 ? 1 : key;
+	size_t mask = ((size_t)1 << SHADE_CACHE_BITS) - 1;
+	ShadeCacheEntry* victim = NULL;
+	cache->cursor = 0;
+	for (k = 0; k < SHADE_CACHE_PROBES; k++) {
+		ShadeCacheEntry* entry = &cache->entries[(key + k) & mask];
+		if (entry->key == key) {
+			if (entry->frame >= cache->flushFrame) {
+				checkShadeCachePoint(cache, entry, objects);
+				cache->point = entry;
+				cache->fresh = 0;
+				return;
+			}
+			victim = entry;
+			break;
+		}
+		// a free slot or else the one that was checked the longest time ago
+		if (victim == NULL || (victim->key != 0 && (entry->key == 0 || entry->frame < victim->frame))) {
+			victim = entry;
+		}
+	}
+	cache->garbage += victim->count;
+	victim->key = key;
+	victim->position[0] = Ron[0];
+	victim->position[1] = Ron[1];
+	victim->position[2] = Ron[2];
+	victim->frame = cache->frame;
+	victim->first = cache->poolCount;
+	victim->count = 0;
+	cache->point = victim;
+	cache->fresh = 1;
+}
+
+// lookupShadeCache() returns 1 if the light (an object index) was blocked at the current point,
+// 0 if it reached it and -1 if it has to be traced
+int lookupShadeCache(ShadeCache* cache, int light) {
+	ShadeCacheEntry* entry = cache->point;
+	int k;
+	cache->lookups += 1;
+	cache->found = -1;
+	// the lights mostly come in the same order as the last time
+	for (k = 0; k < entry->count && !cache->fresh; k++) {
+		int i = cache->cursor + k < entry->count ? cache->cursor + k : cache->cursor + k - entry->count;
+		if (cache->pool[entry->first + i].light != light) continue;
+		cache->found = i;
+		cache->cursor = i + 1;
+		int occluder = cache->pool[entry->first + i].occluder;
+		if (occluder == SHADE_CACHE_UNKNOWN) {
+			cache->stale += 1;
+			return -1;
+		}
+		cache->hits += 1;
+		return occluder >= 0;
+	}
+	return -1;
+}
+
+// storeShadeCache() keeps the answer of the shadow ray of the light that lookupShadeCache() missed
+void storeShadeCache(ShadeCache* cache, int light, int occluder) {
+	ShadeCacheEntry* entry = cache->point;
+	if (cache->found >= 0) {
+		cache->pool[entry->first + cache->found].occluder = occluder;
+		return;
+	}
+	// a new light goes at the end of the pool, so the lights of the point have to end there
+	int moved = entry->first + entry->count != cache->poolCount;
+	if (cache->poolCount + entry->count + 1 > cache->poolCapacity) {
+		cache->poolCapacity = (cache->poolCount + entry->count + 1) * 2;
+		cache->pool = realloc(cache->pool, sizeof(ShadeCacheLight) * cache->poolCapacity);
+		if (cache->pool == NULL) {
+			fprintf(stderr, "Error: Could not allocate memory for the shading cache.\n");
+			exit(1);
+		}
+	}
+	if (moved) {
+		memcpy(&cache->pool[cache->poolCount], &cache->pool[entry->first], sizeof(ShadeCacheLight) * entry->count);
+		cache->garbage += entry->count;
+		entry->first = cache->poolCount;
+		cache->poolCount += entry->count;
+	}
+	cache->pool[cache->poolCount].light = light;
+	cache->pool[cache->poolCount].occluder = occluder;
+	cache->poolCount += 1;
+	entry->count += 1;
+}
+
+void freeShadeCache(ShadeCache* cache) {
+	if (cache == NULL) {
+		return;
+	}
+	free(cache->entries);
+	free(cache->pool);
+	free(cache->lightMoved);
+	free(cache->edits);
+	free(cache);
+}
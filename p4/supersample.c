@@ -0,0 +1,119 @@
+// Supersampling
+// With -supersample n every pixel traces n x n primary rays, one through the center of every
+// cell of an n x n grid over the pixel, and gets their mean. Most of these rays hit the same
+// primitive at almost the same point as their neighbours, so the shading is decoupled from the
+// visibility: every ray still finds its own hit, reflection and refraction, but the direct
+// light of a primary hit is kept in a cache and the next rays that hit the same primitive in
+// the same cell reuse it instead of shading the lights and tracing the shadow rays again. The
+// cells are cubes of -samplecell c pixels (default 1) at the distance of the hit, rounded down
+// to a power of 2 so the rays of one surface agree on the grid; 0 shades every ray.
+// The cache only holds the cells of one tile of TILE_SIZE x TILE_SIZE pixels, the image is
+// rendered tile by tile, and a slot is free when its stamp is not the one of the current tile,
+// so starting a tile costs nothing.
+
+#define SAMPLE_CACHE_SLOTS 4096
+#define SAMPLE_CACHE_PROBES 8
+
+typedef struct {
+	int stamp;       // the tile the cell was shaded in
+	int id;          // the primitive
+	int level;       // the cell size is 2^level
+	int cell[3];
+	double color[3]; // the direct light of the first ray that hit the cell
+} SampleCell;
+
+typedef struct {
+	int stamp;        // of the current tile, slots with another stamp are free
+	SampleCell* cells;
+	long samples;     // primary rays of the frame
+	long shaded;      // of them, the ones whose lights were shaded
+} SampleCache;
+
+// the cache of -supersample, NULL when every pixel traces one ray
+SampleCache* sampleCache = NULL;
+
+SampleCache* newSampleCache() {
+	SampleCache* cache = calloc(1, sizeof(SampleCache));
+	if (cache == NULL || (cache->cells = calloc(SAMPLE_CACHE_SLOTS, sizeof(SampleCell))) == NULL) {
+		fprintf(stderr, "Error: cannot allocate the sample cache!");
+		exit(1);
+	}
+	return cache;
+}
+
+// beginSampleTile() empties the cache for the next tile
+void beginSampleTile(SampleCache* cache) {
+	cache->stamp += 1;
+}
+
+// sampleLights() adds the direct light at the primary hit Ron of the primitive intersection to
+// color like shadeLights(), from the cache when a ray of the tile already hit the same cell
+void sampleLights(SampleCache* cache, int intersection, Material* material, double* N, double* V, double* Ron, Object** objects, double* color) {
+	if (options.sampleCell <= 0) {
+		cache->shaded += 1;
+		shadeLights(intersection, material, N, V, Ron, objects, color);
+		return;
+	}
+	double distance = sqrt(sqr(Ron[0]) + sqr(Ron[1]) + sqr(Ron[2]));
+	int level = (int)floor(log2(fmax(1e-12, distance * pixelAngle * options.sampleCell)));
+	double size = ldexp(1, level);
+	int cell[3] = { (int)floor(Ron[0] / size), (int)floor(Ron[1] / size), (int)floor(Ron[2] / size) };
+	uint32_t hash = (uint32_t)intersection * 0x9E3779B1u ^ (uint32_t)level * 0x85EBCA77u ^ (uint32_t)cell[0] * 0xC2B2AE3Du ^
+		(uint32_t)cell[1] * 0x27D4EB2Fu ^ (uint32_t)cell[2] * 0x165667B1u;
+	hash ^= hash >> 15;
+	SampleCell* empty = NULL;
+	int probe;
+	for (probe = 0; probe < SAMPLE_CACHE_PROBES; probe++) {
+		SampleCell* slot = &cache->cells[(hash + probe) & (SAMPLE_CACHE_SLOTS - 1)];
+		if (slot->stamp != cache->stamp) {
+			empty = slot;
+			break;
+		}
+		if (slot->id == intersection && slot->level == level && slot->cell[0] == cell[0] && slot->cell[1] == cell[1] && slot->cell[2] == cell[2]) {
+			color[0] += slot->color[0];
+			color[1] += slot->color[1];
+			color[2] += slot->color[2];
+			return;
+		}
+	}
+	cache->shaded += 1;
+	double direct[3] = { 0, 0, 0 };
+	shadeLights(intersection, material, N, V, Ron, objects, direct);
+	color[0] += direct[0];
+	color[1] += direct[1];
+	color[2] += direct[2];
+	// a full run of probes shades without keeping the cell
+	if (empty != NULL) {
+		empty->stamp = cache->stamp;
+		empty->id = intersection;
+		empty->level = level;
+		memcpy(empty->cell, cell, sizeof(cell));
+		memcpy(empty->color, direct, sizeof(direct));
+	}
+}
+
+// supersamplePixel() sets color to the mean of the n x n rays of the pixel j, k of the w x h
+// image with the camera size width x height
+void supersamplePixel(double width, double height, int w, int h, int j, int k, Object** objects, double* color) {
+	int n = options.supersample, sx, sy, a;
+	double Ro[3] = { 0, 0, 0 };
+	color[0] = 0;
+	color[1] = 0;
+	color[2] = 0;
+	for (sy = 0; sy < n; sy++) {
+		for (sx = 0; sx < n; sx++) {
+			double Rd[3];
+			Rd[0] = -width / 2 + width / w * (j + (sx + 0.5) / n);
+			Rd[1] = -height / 2 + height / h * (k + (sy + 0.5) / n);
+			Rd[2] = 1;
+			normalize(Rd);
+			stats.primaryRays += 1;
+			sampleCache->samples += 1;
+			double* sample = recursiveShoot(Rd, Ro, objects, 0, 0);
+			for (a = 0; a < 3; a++) {
+				color[a] += sample[a] / (n * n);
+			}
+			free(sample);
+		}
+	}
+}
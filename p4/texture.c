@@ -0,0 +1,411 @@
+// Textures
+// A sphere or plane with "texture": "file.ppm" multiplies its diffuse color by the image. A
+// sphere wraps the image around once, by longitude and latitude, and a plane repeats it every
+// "texture_scale" units along two directions of the plane.
+// The images are not kept in memory. The first time a texture is used its PPM file is read
+// with PPMRead(), the mip levels are made by averaging 2 x 2 texels, and every level is cut in
+// tiles of TEXTURE_TILE x TEXTURE_TILE texels that are written to file.tiles next to it. A
+// tile also holds the first column and row of the tiles after it, so a bilinear lookup never
+// needs a second tile. The tile file is mapped with mmap() and only the tiles that are looked
+// up are read from it, the next time it is used as it is while the size and the modification
+// time of the image match the ones stored in it (like the mesh cache).
+// The tiles that were looked up are kept as floats in a cache of at most -texturecache MB. The
+// cache is split in TEXTURE_SHARDS shards by a hash of the tile, each with its own lock, hash
+// table and least recently used list, so the threads rarely wait for each other. The mip level
+// comes from the width of a pixel at the point, the distance to the camera times the angle of a
+// pixel, and two levels are blended.
+#include <omp.h>
+
+#define TEXTURE_CACHE_MAGIC "RCTILE1"
+#define TEXTURE_TILE 32
+// a tile with the border of the next tiles
+#define TEXTURE_TILE_SIDE (TEXTURE_TILE + 1)
+#define TEXTURE_MAX_LEVELS 24
+#define TEXTURE_SHARDS 16
+// the normal is not allowed to get flatter to the view than this when the footprint is stretched
+#define TEXTURE_MIN_COSINE 0.25
+
+typedef struct {
+	char magic[8];
+	long long sourceSize;  // size and modification time of the image the tiles were made from
+	long long sourceTime;
+	int width;             // of level 0
+	int height;
+	int levels;
+	int pad;
+	long long levelOffset[TEXTURE_MAX_LEVELS]; // where the tiles of each level start
+	long long size;        // size of the whole tile file
+} TextureHeader;
+
+typedef struct {
+	char* file;
+	void* mapping;
+	size_t mappingSize;
+	int levels;
+	int width[TEXTURE_MAX_LEVELS];
+	int height[TEXTURE_MAX_LEVELS];
+	int tilesX[TEXTURE_MAX_LEVELS];
+	unsigned char* tiles[TEXTURE_MAX_LEVELS]; // the tiles of each level in the mapping, by rows
+} Texture;
+
+// a tile in the cache
+typedef struct TileEntry {
+	long long key;
+	struct TileEntry* next;   // in the hash chain of the shard
+	struct TileEntry* newer;  // in the least recently used list of the shard
+	struct TileEntry* older;
+	float texels[TEXTURE_TILE_SIDE * TEXTURE_TILE_SIDE * 3];
+} TileEntry;
+
+typedef struct {
+	omp_lock_t lock;
+	TileEntry** buckets;
+	int bucketMask;
+	TileEntry* newest;
+	TileEntry* oldest;
+	int count;
+	int capacity;
+	long lookups;
+	long hits;
+	char pad[64];   // keep the locks of two shards off one cache line
+} TileShard;
+
+Texture* textures = NULL;
+int loadedTextures = 0;
+TileShard* tileShards = NULL;
+// the width of a pixel at distance 1 from the camera, set by prepareFrame()
+double pixelAngle;
+// what loadTextures() did, for -stats
+int textureCacheHits;
+double textureLoadSeconds;
+
+// writeTextureTiles() makes the mip levels of the image and writes their tiles to cacheName
+static void writeTextureTiles(PPMimage* image, char* cacheName, struct stat* source) {
+	TextureHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TEXTURE_CACHE_MAGIC, 8);
+	header.sourceSize = source->st_size;
+	header.sourceTime = source->st_mtime;
+	header.width = image->width;
+	header.height = image->height;
+	FILE* file = fopen(cacheName, "wb");
+	if (file == NULL) {
+		fprintf(stderr, "Error: could not write the texture tiles %s.\n", cacheName);
+		exit(1);
+	}
+	int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	long long offset = sizeof(header);
+	int w = image->width, h = image->height, level;
+	unsigned char* texels = image->data;
+	unsigned char* tile = malloc(TEXTURE_TILE_SIDE * TEXTURE_TILE_SIDE * 3);
+	for (level = 0; level < TEXTURE_MAX_LEVELS && ok; level++) {
+		header.levelOffset[level] = offset;
+		header.levels = level + 1;
+		int tilesX = (w + TEXTURE_TILE - 1) / TEXTURE_TILE, tilesY = (h + TEXTURE_TILE - 1) / TEXTURE_TILE;
+		int tx, ty, i, j;
+		for (ty = 0; ty < tilesY; ty++) {
+			for (tx = 0; tx < tilesX; tx++) {
+				// the texels past the edge of the image wrap around, the textures repeat
+				for (j = 0; j < TEXTURE_TILE_SIDE; j++) {
+					int y = (ty * TEXTURE_TILE + j) % h;
+					for (i = 0; i < TEXTURE_TILE_SIDE; i++) {
+						int x = (tx * TEXTURE_TILE + i) % w;
+						memcpy(&tile[(j * TEXTURE_TILE_SIDE + i) * 3], &texels[((size_t)y * w + x) * 3], 3);
+					}
+				}
+				ok = ok && fwrite(tile, TEXTURE_TILE_SIDE * TEXTURE_TILE_SIDE * 3, 1, file) == 1;
+				offset += TEXTURE_TILE_SIDE * TEXTURE_TILE_SIDE * 3;
+			}
+		}
+		if (w == 1 && h == 1) {
+			break;
+		}
+		// the next level averages 2 x 2 texels, the last one of an odd row or column alone
+		int nextW = (w + 1) / 2, nextH = (h + 1) / 2, a;
+		unsigned char* next = malloc((size_t)nextW * nextH * 3);
+		if (next == NULL) {
+			fprintf(stderr, "Error: cannot allocate the texture levels!");
+			exit(1);
+		}
+		for (j = 0; j < nextH; j++) {
+			for (i = 0; i < nextW; i++) {
+				int x1 = 2 * i + 1 < w ? 2 * i + 1 : 2 * i, y1 = 2 * j + 1 < h ? 2 * j + 1 : 2 * j;
+				for (a = 0; a < 3; a++) {
+					int sum = texels[((size_t)2 * j * w + 2 * i) * 3 + a] + texels[((size_t)2 * j * w + x1) * 3 + a] +
+						texels[((size_t)y1 * w + 2 * i) * 3 + a] + texels[((size_t)y1 * w + x1) * 3 + a];
+					next[((size_t)j * nextW + i) * 3 + a] = (unsigned char)((sum + 2) / 4);
+				}
+			}
+		}
+		if (texels != image->data) {
+			free(texels);
+		}
+		texels = next;
+		w = nextW;
+		h = nextH;
+	}
+	if (texels != image->data) {
+		free(texels);
+	}
+	free(tile);
+	header.size = offset;
+	ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+	if (fclose(file) != 0 || !ok) {
+		remove(cacheName);
+		fprintf(stderr, "Error: could not write the texture tiles %s.\n", cacheName);
+		exit(1);
+	}
+}
+
+// textureTilesValid() checks that the tiles of every level lie inside the mapped tile file, so a
+// cut short or damaged file is made again instead of being read out of bounds
+static int textureTilesValid(TextureHeader* header) {
+	if (header->width < 1 || header->height < 1 || header->levels < 1 || header->levels > TEXTURE_MAX_LEVELS) {
+		return 0;
+	}
+	long long w = header->width, h = header->height;
+	int level;
+	for (level = 0; level < header->levels; level++) {
+		long long offset = header->levelOffset[level];
+		long long bytes = (w + TEXTURE_TILE - 1) / TEXTURE_TILE * ((h + TEXTURE_TILE - 1) / TEXTURE_TILE) *
+			TEXTURE_TILE_SIDE * TEXTURE_TILE_SIDE * 3;
+		if (offset < (long long)sizeof(TextureHeader) || offset > header->size || bytes > header->size - offset) {
+			return 0;
+		}
+		w = (w + 1) / 2;
+		h = (h + 1) / 2;
+	}
+	return 1;
+}
+
+// mapTextureTiles() maps the tile file of the texture. Returns 0 when there is none, it does
+// not belong to the image any more or it is damaged.
+static int mapTextureTiles(Texture* texture, char* cacheName, struct stat* source) {
+	int fd = open(cacheName, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(TextureHeader)) {
+		close(fd);
+		return 0;
+	}
+	void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		return 0;
+	}
+	TextureHeader* header = mapping;
+	if (memcmp(header->magic, TEXTURE_CACHE_MAGIC, 8) != 0 || header->size != st.st_size ||
+		header->sourceSize != source->st_size || header->sourceTime != source->st_mtime || !textureTilesValid(header)) {
+		munmap(mapping, st.st_size);
+		return 0;
+	}
+	// the tiles are read when they are looked up, in no order
+	madvise(mapping, st.st_size, MADV_RANDOM);
+	texture->mapping = mapping;
+	texture->mappingSize = st.st_size;
+	texture->levels = header->levels;
+	int w = header->width, h = header->height, level;
+	for (level = 0; level < header->levels; level++) {
+		texture->width[level] = w;
+		texture->height[level] = h;
+		texture->tilesX[level] = (w + TEXTURE_TILE - 1) / TEXTURE_TILE;
+		texture->tiles[level] = (unsigned char*)mapping + header->levelOffset[level];
+		w = (w + 1) / 2;
+		h = (h + 1) / 2;
+	}
+	return 1;
+}
+
+// loadTextures() maps the tiles of the textures the scene files named since the last call,
+// and makes the tile cache the first time
+void loadTextures() {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int t;
+	if (tileShards == NULL) {
+		tileShards = calloc(TEXTURE_SHARDS, sizeof(TileShard));
+		if (tileShards == NULL) {
+			fprintf(stderr, "Error: cannot allocate the texture cache!");
+			exit(1);
+		}
+		long capacity = (long)(options.textureCache * 1e6 / sizeof(TileEntry) / TEXTURE_SHARDS);
+		for (t = 0; t < TEXTURE_SHARDS; t++) {
+			TileShard* shard = &tileShards[t];
+			omp_init_lock(&shard->lock);
+			shard->capacity = capacity > 1 ? (int)capacity : 1;
+			int buckets = 1;
+			while (buckets < 2 * shard->capacity) buckets *= 2;
+			shard->buckets = calloc(buckets, sizeof(TileEntry*));
+			shard->bucketMask = buckets - 1;
+			if (shard->buckets == NULL) {
+				fprintf(stderr, "Error: cannot allocate the texture cache!");
+				exit(1);
+			}
+		}
+	}
+	textures = realloc(textures, sizeof(Texture) * (textureCount + 1));
+	if (textures == NULL) {
+		fprintf(stderr, "Error: cannot allocate the textures!");
+		exit(1);
+	}
+	for (t = loadedTextures; t < textureCount; t++) {
+		Texture* texture = &textures[t];
+		memset(texture, 0, sizeof(Texture));
+		texture->file = textureNames[t];
+		struct stat source;
+		if (stat(texture->file, &source) != 0) {
+			fprintf(stderr, "Error: Could not open the texture %s.\n", texture->file);
+			exit(1);
+		}
+		char cacheName[1100];
+		snprintf(cacheName, sizeof(cacheName), "%s.tiles", texture->file);
+		if (mapTextureTiles(texture, cacheName, &source)) {
+			textureCacheHits += 1;
+			continue;
+		}
+		PPMimage image;
+		PPMRead(texture->file, &image);
+		writeTextureTiles(&image, cacheName, &source);
+		free(image.data);
+		if (!mapTextureTiles(texture, cacheName, &source)) {
+			fprintf(stderr, "Error: could not map the texture tiles %s.\n", cacheName);
+			exit(1);
+		}
+	}
+	loadedTextures = textureCount;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	textureLoadSeconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+// bilinearTexel() adds weight times the color of level of texture t at the texel position
+// x, y (texel centers at .5) to color, the tile is found in or brought into the cache
+static void bilinearTexel(int t, int level, double x, double y, double weight, double* color) {
+	Texture* texture = &textures[t];
+	int w = texture->width[level], h = texture->height[level];
+	x -= 0.5;
+	y -= 0.5;
+	double fx = floor(x), fy = floor(y);
+	double sx = x - fx, sy = y - fy;
+	// the texture repeats
+	int x0 = (int)(fx - floor(fx / w) * w), y0 = (int)(fy - floor(fy / h) * h);
+	if (x0 >= w) x0 = w - 1;
+	if (y0 >= h) y0 = h - 1;
+	int tx = x0 / TEXTURE_TILE, ty = y0 / TEXTURE_TILE;
+	int tile = ty * texture->tilesX[level] + tx;
+	long long key = ((long long)t << 40) | ((long long)level << 32) | tile;
+	uint32_t hash = (uint32_t)(key ^ (key >> 29)) * 0x9E3779B1u;
+	TileShard* shard = &tileShards[hash % TEXTURE_SHARDS];
+	omp_set_lock(&shard->lock);
+	shard->lookups += 1;
+	TileEntry** bucket = &shard->buckets[(hash / TEXTURE_SHARDS) & shard->bucketMask];
+	TileEntry* entry = *bucket;
+	while (entry != NULL && entry->key != key) {
+		entry = entry->next;
+	}
+	if (entry != NULL) {
+		shard->hits += 1;
+		// move it to the front of the list
+		if (entry != shard->newest) {
+			entry->newer->older = entry->older;
+			if (entry->older != NULL) entry->older->newer = entry->newer;
+			else shard->oldest = entry->newer;
+			entry->older = shard->newest;
+			entry->newer = NULL;
+			shard->newest->newer = entry;
+			shard->newest = entry;
+		}
+	}
+	else {
+		if (shard->count < shard->capacity) {
+			entry = malloc(sizeof(TileEntry));
+			if (entry == NULL) {
+				fprintf(stderr, "Error: cannot allocate the texture cache!");
+				exit(1);
+			}
+			shard->count += 1;
+		}
+		else {
+			// reuse the least recently used tile
+			entry = shard->oldest;
+			shard->oldest = entry->newer;
+			if (shard->oldest != NULL) shard->oldest->older = NULL;
+			else shard->newest = NULL;
+			uint32_t oldHash = (uint32_t)(entry->key ^ (entry->key >> 29)) * 0x9E3779B1u;
+			TileEntry** chain = &shard->buckets[(oldHash / TEXTURE_SHARDS) & shard->bucketMask];
+			while (*chain != entry) chain = &(*chain)->next;
+			*chain = entry->next;
+		}
+		entry->key = key;
+		unsigned char* bytes = texture->tiles[level] + (size_t)tile * TEXTURE_TILE_SIDE * TEXTURE_TILE_SIDE * 3;
+		int i;
+		for (i = 0; i < TEXTURE_TILE_SIDE * TEXTURE_TILE_SIDE * 3; i++) {
+			entry->texels[i] = bytes[i] * (1.0f / 255);
+		}
+		entry->next = *bucket;
+		*bucket = entry;
+		entry->older = shard->newest;
+		entry->newer = NULL;
+		if (shard->newest != NULL) shard->newest->newer = entry;
+		else shard->oldest = entry;
+		shard->newest = entry;
+	}
+	float* texel = &entry->texels[((y0 - ty * TEXTURE_TILE) * TEXTURE_TILE_SIDE + x0 - tx * TEXTURE_TILE) * 3];
+	int a;
+	for (a = 0; a < 3; a++) {
+		double top = texel[a] * (1 - sx) + texel[3 + a] * sx;
+		double bottom = texel[TEXTURE_TILE_SIDE * 3 + a] * (1 - sx) + texel[TEXTURE_TILE_SIDE * 3 + 3 + a] * sx;
+		color[a] += weight * (top * (1 - sy) + bottom * sy);
+	}
+	omp_unset_lock(&shard->lock);
+}
+
+// textureMaterial() returns the material of the primitive intersection, with the diffuse color
+// multiplied by the texture at the point Ron with the unit normal N seen along Rd. A textured
+// material is copied into buffer.
+Material* textureMaterial(int intersection, double* Ron, double* N, double* Rd, Material* buffer) {
+	Material* material = primitiveMaterial(scene, intersection);
+	if (material->texture < 0) {
+		return material;
+	}
+	Texture* texture = &textures[material->texture];
+	double u, v, texelsPerUnit;
+	if (isSpherePrimitive(scene, intersection)) {
+		double sphere[4];
+		double* center = primitiveSphere(scene, intersection, sphere);
+		double n[3] = { (Ron[0] - center[0]) / center[3], (Ron[1] - center[1]) / center[3], (Ron[2] - center[2]) / center[3] };
+		u = 0.5 + atan2(n[2], n[0]) / (2 * M_PI);
+		v = 0.5 - asin(fmax(-1, fmin(1, n[1]))) / M_PI;
+		texelsPerUnit = texture->width[0] / (2 * M_PI * center[3]);
+	}
+	else {
+		double* plane = &scene->planes[(intersection - scene->sphereCount) * 6];
+		double t[3], b[3];
+		orthonormalBasis(&plane[3], t, b);
+		double d[3] = { Ron[0] - plane[0], Ron[1] - plane[1], Ron[2] - plane[2] };
+		u = (d[0] * t[0] + d[1] * t[1] + d[2] * t[2]) / material->textureScale;
+		v = (d[0] * b[0] + d[1] * b[1] + d[2] * b[2]) / material->textureScale;
+		texelsPerUnit = texture->width[0] / material->textureScale;
+	}
+	// the width of the pixel on the surface in texels of level 0
+	double cosine = fmax(TEXTURE_MIN_COSINE, fabs(N[0] * Rd[0] + N[1] * Rd[1] + N[2] * Rd[2]));
+	double distance = sqrt(sqr(Ron[0]) + sqr(Ron[1]) + sqr(Ron[2]));
+	double lod = log2(fmax(1, distance * pixelAngle / cosine * texelsPerUnit));
+	if (lod > texture->levels - 1) {
+		lod = texture->levels - 1;
+	}
+	int level = (int)lod;
+	double blend = lod - level;
+	double color[3] = { 0, 0, 0 };
+	bilinearTexel(material->texture, level, u * texture->width[level], v * texture->height[level], 1 - blend, color);
+	if (blend > 0 && level + 1 < texture->levels) {
+		bilinearTexel(material->texture, level + 1, u * texture->width[level + 1], v * texture->height[level + 1], blend, color);
+	}
+	*buffer = *material;
+	int a;
+	for (a = 0; a < 3; a++) {
+		buffer->diffuseColor[a] *= color[a];
+	}
+	return buffer;
+}
@@ -0,0 +1,426 @@
+// Incremental frames
+// With -incremental every 16 x 16 tile of the image remembers what its rays depended on: the
+// cells of a uniform grid over the scene that any of its rays went through, and the lights it
+// was shaded with, both as bitsets. When the next frame of -frames only differs in a few
+// objects or lights, the grid cells around the old and the new place of every changed object
+// are looked up and only the tiles that went through them are traced again, the other tiles are
+// copied from the last frame. The cells stand in for the primitives, so a sphere that moves
+// into the view of a tile is found as well as one that moves out of it. Edits that cannot be
+// bounded, like a plane, a camera, a mesh or a different number of objects, trace every tile.
+// A tile that is traced again gives exactly the pixels a full render would.
+
+#define TILE_SIZE 16
+#define TILE_GRID 32
+
+typedef struct {
+	int width;
+	int height;
+	int tilesX;
+	int tilesY;
+	int tileCount;
+	int valid;             // 0 until the dependencies of a full frame are recorded
+	char* dirty;           // tiles to trace in the next frame
+	int dirtyCount;
+	float* previous;       // the colors of the last image, 3 floats per pixel in the order of rayCasting()
+	double lo[3];          // bounds of the cell grid
+	double cellSize[3];
+	int cellWords;         // 64 bit words of the cell bitset of a tile
+	uint64_t* cells;       // cell bitset of every tile
+	int lightWords;
+	int lightCount;
+	uint64_t* lights;      // light bitset of every tile, by slot of the light table
+} TileDependencies;
+
+// the dependencies of -incremental, NULL otherwise
+TileDependencies* tileDeps;
+// the tile of the pixel that is being shaded
+int tileCurrent;
+
+// bounds of a sphere
+static void sphereBox(double* sphere, double* lo, double* hi) {
+	int a;
+	for (a = 0; a < 3; a++) {
+		lo[a] = sphere[a] - sphere[3];
+		hi[a] = sphere[a] + sphere[3];
+	}
+}
+
+// the bounding sphere of instance i of the scene with the given prototype bounds
+static void instanceSphere(Scene* s, double* prototypeBounds, int i, double* sphere) {
+	double* m = &s->instanceTransform[i * 12];
+	double* local = &prototypeBounds[s->instancePrototype[i] * 4];
+	int a;
+	for (a = 0; a < 3; a++) {
+		sphere[a] = m[a * 3] * local[0] + m[a * 3 + 1] * local[1] + m[a * 3 + 2] * local[2] + m[9 + a];
+	}
+	sphere[3] = local[3] * sqrt(sqr(m[0]) + sqr(m[1]) + sqr(m[2]));
+}
+
+// resetTileDependencies() places the cell grid around the spheres and instances of the scene,
+// forgets all dependencies and marks every tile for tracing
+void resetTileDependencies(TileDependencies* deps, Scene* s, InstanceTree* tree, int w, int h) {
+	int i, a;
+	if (deps->width != w || deps->height != h) {
+		free(deps->dirty);
+		free(deps->previous);
+		free(deps->cells);
+		deps->width = w;
+		deps->height = h;
+		deps->tilesX = (w + TILE_SIZE - 1) / TILE_SIZE;
+		deps->tilesY = (h + TILE_SIZE - 1) / TILE_SIZE;
+		deps->tileCount = deps->tilesX * deps->tilesY;
+		deps->cellWords = (TILE_GRID * TILE_GRID * TILE_GRID + 63) / 64;
+		deps->dirty = malloc(deps->tileCount);
+		deps->previous = malloc(sizeof(float) * w * h * 3);
+		deps->cells = malloc(sizeof(uint64_t) * deps->cellWords * deps->tileCount);
+		if (deps->dirty == NULL || deps->previous == NULL || deps->cells == NULL) {
+			fprintf(stderr, "Error: Could not allocate memory for the tile dependencies.\n");
+			exit(1);
+		}
+	}
+	free(deps->lights);
+	deps->lightCount = lightGrid != NULL ? lightGrid->count : 0;
+	deps->lightWords = (deps->lightCount + 64) / 64;
+	deps->lights = malloc(sizeof(uint64_t) * deps->lightWords * deps->tileCount);
+	if (deps->lights == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the tile dependencies.\n");
+		exit(1);
+	}
+	memset(deps->cells, 0, sizeof(uint64_t) * deps->cellWords * deps->tileCount);
+	memset(deps->lights, 0, sizeof(uint64_t) * deps->lightWords * deps->tileCount);
+	memset(deps->dirty, 1, deps->tileCount);
+	deps->dirtyCount = deps->tileCount;
+	deps->valid = 1;
+
+	double lo[3] = { INFINITY, INFINITY, INFINITY };
+	double hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+	double boxLo[3], boxHi[3], sphere[4];
+	for (i = 0; i < s->sphereCount + s->instanceCount; i++) {
+		if (i < s->sphereCount) {
+			sphereBox(&s->spheres[i * 4], boxLo, boxHi);
+		}
+		else {
+			instanceSphere(s, tree->prototypeBounds, i - s->sphereCount, sphere);
+			sphereBox(sphere, boxLo, boxHi);
+		}
+		for (a = 0; a < 3; a++) {
+			if (boxLo[a] < lo[a]) lo[a] = boxLo[a];
+			if (boxHi[a] > hi[a]) hi[a] = boxHi[a];
+		}
+	}
+	// some room for the objects to move, and a unit box when there are no spheres
+	for (a = 0; a < 3; a++) {
+		if (lo[a] > hi[a]) {
+			lo[a] = -1;
+			hi[a] = 1;
+		}
+		double margin = (hi[a] - lo[a]) * 0.1 + 1e-3;
+		deps->lo[a] = lo[a] - margin;
+		deps->cellSize[a] = (hi[a] - lo[a] + 2 * margin) / TILE_GRID;
+	}
+}
+
+TileDependencies* newTileDependencies() {
+	return calloc(1, sizeof(TileDependencies));
+}
+
+// beginTiles() prepares the dependencies for a frame of w x h pixels: after a full frame or an
+// edit that cannot be tracked every tile is traced, otherwise the tiles to trace again forget
+// their old dependencies
+void beginTiles(TileDependencies* deps, Scene* s, InstanceTree* tree, int w, int h) {
+	int t;
+	if (!deps->valid || deps->width != w || deps->height != h) {
+		resetTileDependencies(deps, s, tree, w, h);
+		return;
+	}
+	for (t = 0; t < deps->tileCount; t++) {
+		if (!deps->dirty[t]) continue;
+		memset(&deps->cells[(size_t)t * deps->cellWords], 0, sizeof(uint64_t) * deps->cellWords);
+		memset(&deps->lights[(size_t)t * deps->lightWords], 0, sizeof(uint64_t) * deps->lightWords);
+	}
+}
+
+// endTiles() keeps the image of the frame for the tiles that the next frame does not trace
+void endTiles(TileDependencies* deps, float* hdr) {
+	memcpy(deps->previous, hdr, sizeof(float) * deps->width * deps->height * 3);
+	memset(deps->dirty, 0, deps->tileCount);
+}
+
+// recordSegment() marks the cells that the ray Ro + t * Rd for 0 < t < tMax goes through as
+// dependencies of the current tile
+static void recordSegment(double* Ro, double* Rd, double tMax) {
+	TileDependencies* deps = tileDeps;
+	double t0 = 0, t1 = tMax;
+	int a;
+	// clip the ray to the grid
+	for (a = 0; a < 3; a++) {
+		double lo = deps->lo[a], hi = deps->lo[a] + deps->cellSize[a] * TILE_GRID;
+		if (Rd[a] == 0) {
+			if (Ro[a] < lo || Ro[a] > hi) return;
+			continue;
+		}
+		double ta = (lo - Ro[a]) / Rd[a], tb = (hi - Ro[a]) / Rd[a];
+		if (ta > tb) {
+			double swap = ta;
+			ta = tb;
+			tb = swap;
+		}
+		if (ta > t0) t0 = ta;
+		if (tb < t1) t1 = tb;
+	}
+	if (t0 > t1) {
+		return;
+	}
+	// walk the cells from t0 to t1 (Amanatides and Woo)
+	int cell[3], step[3];
+	double next[3], delta[3];
+	for (a = 0; a < 3; a++) {
+		double p = (Ro[a] + t0 * Rd[a] - deps->lo[a]) / deps->cellSize[a];
+		cell[a] = (int)p;
+		if (cell[a] < 0) cell[a] = 0;
+		if (cell[a] > TILE_GRID - 1) cell[a] = TILE_GRID - 1;
+		step[a] = Rd[a] > 0 ? 1 : -1;
+		delta[a] = Rd[a] != 0 ? fabs(deps->cellSize[a] / Rd[a]) : INFINITY;
+		double border = deps->lo[a] + (cell[a] + (Rd[a] > 0)) * deps->cellSize[a];
+		next[a] = Rd[a] != 0 ? (border - Ro[a]) / Rd[a] : INFINITY;
+	}
+	uint64_t* bits = &deps->cells[(size_t)tileCurrent * deps->cellWords];
+	while (1) {
+		int c = (cell[2] * TILE_GRID + cell[1]) * TILE_GRID + cell[0];
+		bits[c >> 6] |= 1ULL << (c & 63);
+		a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+		if (next[a] > t1) break;
+		cell[a] += step[a];
+		if (cell[a] < 0 || cell[a] >= TILE_GRID) break;
+		next[a] += delta[a];
+	}
+}
+
+// recordLight() marks light n of the light table as a dependency of the current tile
+static inline void recordLight(int n) {
+	tileDeps->lights[(size_t)tileCurrent * tileDeps->lightWords + (n >> 6)] |= 1ULL << (n & 63);
+}
+
+// markBox() marks the tiles that went through a cell of the box [lo, hi], returns 0 when the
+// box is not inside the grid and the tiles cannot tell
+static int markBox(TileDependencies* deps, double* lo, double* hi) {
+	int from[3], to[3], a, x, y, z, t;
+	for (a = 0; a < 3; a++) {
+		// a little more than the box, a ray that ends on its surface is not lost to rounding
+		double a0 = (lo[a] - deps->lo[a]) / deps->cellSize[a] - 1e-4;
+		double a1 = (hi[a] - deps->lo[a]) / deps->cellSize[a] + 1e-4;
+		if (a0 < 0 || a1 >= TILE_GRID) {
+			return 0;
+		}
+		from[a] = (int)a0;
+		to[a] = (int)a1;
+	}
+	for (t = 0; t < deps->tileCount; t++) {
+		uint64_t* bits = &deps->cells[(size_t)t * deps->cellWords];
+		for (z = from[2]; z <= to[2] && !deps->dirty[t]; z++) {
+			for (y = from[1]; y <= to[1] && !deps->dirty[t]; y++) {
+				for (x = from[0]; x <= to[0]; x++) {
+					int c = (z * TILE_GRID + y) * TILE_GRID + x;
+					if (bits[c >> 6] & (1ULL << (c & 63))) {
+						deps->dirty[t] = 1;
+						break;
+					}
+				}
+			}
+		}
+	}
+	return 1;
+}
+
+// markSphere() marks the tiles that went through the cells of a sphere
+static int markSphere(TileDependencies* deps, double* sphere) {
+	double lo[3], hi[3];
+	sphereBox(sphere, lo, hi);
+	return markBox(deps, lo, hi);
+}
+
+// markLight() marks the tiles that a change of light n of the light table can reach: the ones
+// shaded with it and, when the light is culled by distance, the ones with rays near it
+static int markLight(TileDependencies* deps, int n, Object* light) {
+	int t;
+	for (t = 0; t < deps->tileCount; t++) {
+		if (deps->lights[(size_t)t * deps->lightWords + (n >> 6)] & (1ULL << (n & 63))) {
+			deps->dirty[t] = 1;
+		}
+	}
+	double r = lightInfluenceRadius(light, options.cutoff);
+	if (r == INFINITY) {
+		// it is already a dependency of every tile it can reach
+		return 1;
+	}
+	double sphere[4] = { light->light.position[0], light->light.position[1], light->light.position[2], r };
+	return markSphere(deps, sphere);
+}
+
+// the objects of a kind in the order of the scene file
+static int objectsOfKind(Object** objects, int kind, Object** found, int capacity) {
+	int i, n = 0;
+	for (i = 0; objects[i] != 0; i++) {
+		if (objects[i]->kind != kind) continue;
+		if (n < capacity) found[n] = objects[i];
+		n += 1;
+	}
+	return n;
+}
+
+// sameFixedGeometry() returns 1 when the two scenes have as many primitives of every kind and
+// the same planes, prototypes and meshes, the parts of a scene that no grid can bound
+static int sameFixedGeometry(Scene* old, Scene* now) {
+	int i;
+	if (old->sphereCount != now->sphereCount || old->planeCount != now->planeCount ||
+		old->instanceCount != now->instanceCount || old->prototypeCount != now->prototypeCount ||
+		old->meshCount != now->meshCount) {
+		return 0;
+	}
+	if (memcmp(old->planes, now->planes, sizeof(double) * 6 * now->planeCount) != 0 ||
+		memcmp(old->planeMaterial, now->planeMaterial, sizeof(int) * now->planeCount) != 0 ||
+		memcmp(old->prototypeStart, now->prototypeStart, sizeof(int) * (now->prototypeCount + 1)) != 0 ||
+		memcmp(old->prototypeSpheres, now->prototypeSpheres, sizeof(double) * 4 * now->prototypeStart[now->prototypeCount]) != 0 ||
+		memcmp(old->prototypeMaterial, now->prototypeMaterial, sizeof(int) * now->prototypeStart[now->prototypeCount]) != 0) {
+		return 0;
+	}
+	for (i = 0; i < now->meshCount; i++) {
+		Mesh* a = &old->meshes[i];
+		Mesh* b = &now->meshes[i];
+		if (strcmp(a->file, b->file) != 0 || memcmp(a->position, b->position, sizeof(a->position)) != 0 ||
+			a->scale != b->scale || a->material != b->material) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// a sphere or an instance that changed from one frame to the next: primitives [first, last) at
+// their old and their new bounds
+typedef struct {
+	int first;
+	int last;
+	double oldSphere[4];
+	double sphere[4];
+	int moved;           // 0 when only the material of a sphere changed
+} SceneEdit;
+
+// the changes between two frames that -incremental, -shadecache and -reproject look at
+typedef struct {
+	int valid;           // 0 when the fixed geometry or the numbering changed, then nothing can be compared
+	int count;
+	int capacity;
+	SceneEdit* edits;
+} SceneEdits;
+
+static void addSceneEdit(SceneEdits* e, int first, int last, double* oldSphere, double* sphere, int moved) {
+	if (e->count == e->capacity) {
+		e->capacity = e->capacity == 0 ? 64 : e->capacity * 2;
+		e->edits = realloc(e->edits, sizeof(SceneEdit) * e->capacity);
+		if (e->edits == NULL) {
+			fprintf(stderr, "Error: Could not allocate memory for the scene edits.\n");
+			exit(1);
+		}
+	}
+	SceneEdit* edit = &e->edits[e->count++];
+	edit->first = first;
+	edit->last = last;
+	memcpy(edit->oldSphere, oldSphere, sizeof(double) * 4);
+	memcpy(edit->sphere, sphere, sizeof(double) * 4);
+	edit->moved = moved;
+}
+
+// findSceneEdits() compares the scene of the next frame with the one of the last frame once and
+// lists the spheres and instances that changed, for all the caches that carry over frames
+SceneEdits* findSceneEdits(Scene* old, Scene* now, InstanceTree* oldTree, Object** oldObjects, Object** objects) {
+	SceneEdits* e = calloc(1, sizeof(SceneEdits));
+	int i, count = 0, oldCount = 0;
+	while (objects[count] != 0) count++;
+	while (oldObjects[oldCount] != 0) oldCount++;
+	e->valid = count == oldCount && sameFixedGeometry(old, now);
+	for (i = 0; i < count && e->valid; i++) {
+		e->valid = oldObjects[i]->kind == objects[i]->kind;
+	}
+	if (!e->valid) {
+		return e;
+	}
+	for (i = 0; i < now->sphereCount; i++) {
+		int moved = memcmp(&old->spheres[i * 4], &now->spheres[i * 4], sizeof(double) * 4) != 0;
+		if (!moved && old->sphereMaterial[i] == now->sphereMaterial[i]) continue;
+		addSceneEdit(e, i, i + 1, &old->spheres[i * 4], &now->spheres[i * 4], moved);
+	}
+	int base = now->sphereCount + now->planeCount;
+	for (i = 0; i < now->instanceCount; i++) {
+		if (memcmp(&old->instanceTransform[i * 12], &now->instanceTransform[i * 12], sizeof(double) * 12) == 0 &&
+			old->instancePrototype[i] == now->instancePrototype[i]) continue;
+		double oldSphere[4], sphere[4];
+		// the prototypes are the same in both frames, so are their bounds
+		instanceSphere(old, oldTree->prototypeBounds, i, oldSphere);
+		instanceSphere(now, oldTree->prototypeBounds, i, sphere);
+		addSceneEdit(e, base + now->instanceFirst[i], base + now->instanceFirst[i + 1], oldSphere, sphere, 1);
+	}
+	return e;
+}
+
+void freeSceneEdits(SceneEdits* e) {
+	if (e == NULL) {
+		return;
+	}
+	free(e->edits);
+	free(e);
+}
+
+// markEditedTiles() marks the tiles that the edits from the last frame to the next one reach
+// and have to be traced again. It returns 0 when every tile has to be traced.
+int markEditedTiles(TileDependencies* deps, SceneEdits* edits, Object** oldObjects, Object** objects) {
+	int i, ok = 1;
+	if (!edits->valid) {
+		return 0;
+	}
+	// without a camera in either scene there is nothing to compare
+	Object* camera[2] = { NULL, NULL };
+	Object* camera2[2] = { NULL, NULL };
+	int cameras = objectsOfKind(oldObjects, 0, camera, 1);
+	if (cameras != objectsOfKind(objects, 0, camera2, 1) ||
+		(cameras > 0 && memcmp(&camera[0]->camera, &camera2[0]->camera, sizeof(camera[0]->camera)) != 0)) {
+		return 0;
+	}
+	// the lights, by their slot in the light table
+	int lightCount = objectsOfKind(objects, 3, NULL, 0);
+	if (objectsOfKind(oldObjects, 3, NULL, 0) != lightCount || lightCount != deps->lightCount) {
+		return 0;
+	}
+	Object** oldLights = malloc(sizeof(Object*) * (lightCount + 1));
+	Object** lights = malloc(sizeof(Object*) * (lightCount + 1));
+	objectsOfKind(oldObjects, 3, oldLights, lightCount);
+	objectsOfKind(objects, 3, lights, lightCount);
+	int areaLights = 0;
+	for (i = 0; i < lightCount; i++) {
+		areaLights |= oldLights[i]->light.shape != 0 || lights[i]->light.shape != 0;
+	}
+	for (i = 0; i < lightCount && ok; i++) {
+		if (memcmp(&oldLights[i]->light, &lights[i]->light, sizeof(lights[i]->light)) == 0) continue;
+		// -lightbudget picks every light by the power of all the others
+		if (options.lightBudget > 0) {
+			ok = 0;
+			break;
+		}
+		ok = markLight(deps, i, oldLights[i]) && markLight(deps, i, lights[i]);
+	}
+	free(oldLights);
+	free(lights);
+	// the spheres and instances, at their old and their new place. The shadow rays of an area
+	// light go to random points of it, so the cells of the last frame do not bound what a
+	// moving object can shade
+	for (i = 0; i < edits->count && ok; i++) {
+		ok = !areaLights && markSphere(deps, edits->edits[i].oldSphere) && markSphere(deps, edits->edits[i].sphere);
+	}
+	if (!ok) {
+		return 0;
+	}
+	deps->dirtyCount = 0;
+	for (i = 0; i < deps->tileCount; i++) {
+		deps->dirtyCount += deps->dirty[i];
+	}
+	return 1;
+}
@@ -0,0 +1,204 @@
+// HDR output and tone mapping
+// The renderers write the color of every pixel as it comes out of the shading, not clamped,
+// into the float buffer hdr of the image, and the 8-bit image is made from it in one pass by
+// toneMap(). -hdr file.pfm saves the float buffer as a PFM file, and -fromhdr file.pfm makes the
+// output from such a file instead of rendering, so the tone mapping can be tried again without
+// tracing a ray. The pass scales the colors by 2^exposure, maps them into [0, 1] with the
+// -tonemap curve: clamp (the default), Reinhard's x / (1 + x) or Narkowicz's fit of the ACES
+// curve, encodes them linearly or with -srgb through a table of the sRGB curve, and with
+// -dither adds the 4 x 4 Bayer matrix before the colors are cut to 8 bits. The defaults give
+// the same bytes as clamping every channel. The channels are all treated alike, so with SSE2 the
+// pass goes through the interleaved rows 4 floats at a time, 12 floats being 4 whole pixels.
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define TONE_TABLE_SIZE 4096
+
+// 255 times the sRGB curve at i / (TONE_TABLE_SIZE - 1)
+float srgbTable[TONE_TABLE_SIZE];
+int srgbTableReady = 0;
+// how long the last toneMap() took, for -stats
+double toneMapSeconds;
+
+static const int bayer[4][4] = { { 0, 8, 2, 10 }, { 12, 4, 14, 6 }, { 3, 11, 1, 9 }, { 15, 7, 13, 5 } };
+
+// newImage() returns a w x h image with room for the 8-bit colors and the float colors
+PPMimage* newImage(int w, int h) {
+	PPMimage* image = malloc(sizeof(PPMimage));
+	if (image == NULL) {
+		fprintf(stderr, "Error: allocate the memory un successfully. \n");
+		exit(1);
+	}
+	image->width = w;
+	image->height = h;
+	image->maxColorValue = 255;
+	image->data = malloc((size_t)w * h * 3);
+	image->hdr = malloc(sizeof(float) * w * h * 3);
+	if (image->data == NULL || image->hdr == NULL) {
+		fprintf(stderr, "Error: allocate the memory un successfully. \n");
+		exit(1);
+	}
+	return image;
+}
+
+void freeImage(PPMimage* image) {
+	free(image->data);
+	free(image->hdr);
+	free(image);
+}
+
+// PFMWrite() writes the float colors of the image as a PFM file, which keeps the rows from the bottom
+void PFMWrite(char* filename, PPMimage* image) {
+	FILE* file = fopen(filename, "wb");
+	if (file == NULL) {
+		fprintf(stderr, "Error: open the file %s unsuccessfully. \n", filename);
+		exit(1);
+	}
+	// a negative scale tells that the floats are little endian
+	uint16_t one = 1;
+	fprintf(file, "PF\n%d %d\n%s\n", image->width, image->height, *(unsigned char*)&one ? "-1.0" : "1.0");
+	int k;
+	for (k = image->height - 1; k >= 0; k--) {
+		fwrite(&image->hdr[(size_t)k * image->width * 3], sizeof(float) * 3, image->width, file);
+	}
+	fclose(file);
+}
+
+// PFMRead() reads a color PFM file into an image whose 8-bit colors are not made yet
+PPMimage* PFMRead(char* filename) {
+	FILE* file = fopen(filename, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "Error: open the file %s unsuccessfully. \n", filename);
+		exit(1);
+	}
+	int w, h;
+	double scale;
+	if (fgetc(file) != 'P' || fgetc(file) != 'F' || fscanf(file, "%d %d %lf", &w, &h, &scale) != 3 || w <= 0 || h <= 0 || scale == 0) {
+		fprintf(stderr, "Error: %s is not a color PFM file. \n", filename);
+		exit(1);
+	}
+	// the single whitespace after the scale
+	fgetc(file);
+	PPMimage* image = newImage(w, h);
+	int k;
+	for (k = h - 1; k >= 0; k--) {
+		if (fread(&image->hdr[(size_t)k * w * 3], sizeof(float) * 3, w, file) != (size_t)w) {
+			fprintf(stderr, "Error: read size and real size are not match");
+			exit(1);
+		}
+	}
+	fclose(file);
+	uint16_t one = 1;
+	if ((scale < 0) != (*(unsigned char*)&one != 0)) {
+		size_t i, size = (size_t)w * h * 3;
+		for (i = 0; i < size; i++) {
+			uint32_t bits;
+			memcpy(&bits, &image->hdr[i], 4);
+			bits = bits >> 24 | (bits >> 8 & 0xFF00) | (bits << 8 & 0xFF0000) | bits << 24;
+			memcpy(&image->hdr[i], &bits, 4);
+		}
+	}
+	return image;
+}
+
+// toneCurve() maps the color x, scaled by scale, into [0, 1]
+static inline float toneCurve(float x, float scale) {
+	x = x * scale;
+	x = x > 0 ? x : 0;
+	if (options.toneCurve == 1) {
+		x = x / (x + 1.0f);
+	}
+	else if (options.toneCurve == 2) {
+		x = x * (x * 2.51f + 0.03f) / (x * (x * 2.43f + 0.59f) + 0.14f);
+	}
+	return x < 1 ? x : 1;
+}
+
+// toneByte() encodes x of [0, 1] in 8 bits, offset is the dither
+static inline unsigned char toneByte(float x, float offset) {
+	float v = options.srgb ? srgbTable[(int)(x * (TONE_TABLE_SIZE - 1) + 0.5f)] : x * 255.0f;
+	int q = (int)(v + offset);
+	return (unsigned char)(q > 255 ? 255 : q);
+}
+
+#ifdef __SSE2__
+static inline __m128 toneCurve4(__m128 x, __m128 scale) {
+	__m128 one = _mm_set1_ps(1.0f);
+	x = _mm_max_ps(_mm_mul_ps(x, scale), _mm_setzero_ps());
+	if (options.toneCurve == 1) {
+		x = _mm_div_ps(x, _mm_add_ps(x, one));
+	}
+	else if (options.toneCurve == 2) {
+		__m128 numerator = _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(2.51f)), _mm_set1_ps(0.03f)));
+		__m128 denominator = _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(2.43f)), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f));
+		x = _mm_div_ps(numerator, denominator);
+	}
+	// the NaN of an infinite color becomes 1
+	return _mm_min_ps(x, one);
+}
+
+// toneBytes4() writes the 4 colors x of [0, 1] with the dither offset as 4 bytes to out
+static inline void toneBytes4(__m128 x, __m128 offset, unsigned char* out) {
+	__m128 v;
+	if (options.srgb) {
+		int index[4];
+		__m128i i = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(TONE_TABLE_SIZE - 1)), _mm_set1_ps(0.5f)));
+		_mm_storeu_si128((__m128i*)index, i);
+		v = _mm_setr_ps(srgbTable[index[0]], srgbTable[index[1]], srgbTable[index[2]], srgbTable[index[3]]);
+	}
+	else {
+		v = _mm_mul_ps(x, _mm_set1_ps(255.0f));
+	}
+	__m128i q = _mm_cvttps_epi32(_mm_add_ps(v, offset));
+	q = _mm_packs_epi32(q, q);
+	q = _mm_packus_epi16(q, q);
+	int bytes = _mm_cvtsi128_si32(q);
+	memcpy(out, &bytes, 4);
+}
+#endif
+
+// toneMap() makes the 8-bit colors of the image from its float colors
+void toneMap(PPMimage* image) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int i, k;
+	if (options.srgb && !srgbTableReady) {
+		for (i = 0; i < TONE_TABLE_SIZE; i++) {
+			double x = (double)i / (TONE_TABLE_SIZE - 1);
+			srgbTable[i] = (float)(255 * (x <= 0.0031308 ? 12.92 * x : 1.055 * pow(x, 1 / 2.4) - 0.055));
+		}
+		srgbTableReady = 1;
+	}
+	float scale = (float)pow(2, options.exposure);
+	int w = image->width, h = image->height;
+	for (k = 0; k < h; k++) {
+		float* from = &image->hdr[(size_t)k * w * 3];
+		unsigned char* to = &image->data[(size_t)k * w * 3];
+		// the dither of the 4 pixels of the row that repeat, 0 without -dither
+		float offsets[4] = { 0, 0, 0, 0 };
+		if (options.dither) {
+			for (i = 0; i < 4; i++) {
+				offsets[i] = (bayer[k & 3][i] + 0.5f) / 16;
+			}
+		}
+		i = 0;
+#ifdef __SSE2__
+		__m128 scales = _mm_set1_ps(scale);
+		__m128 o0 = _mm_setr_ps(offsets[0], offsets[0], offsets[0], offsets[1]);
+		__m128 o1 = _mm_setr_ps(offsets[1], offsets[1], offsets[2], offsets[2]);
+		__m128 o2 = _mm_setr_ps(offsets[2], offsets[3], offsets[3], offsets[3]);
+		for (; i + 12 <= w * 3; i += 12) {
+			toneBytes4(toneCurve4(_mm_loadu_ps(&from[i]), scales), o0, &to[i]);
+			toneBytes4(toneCurve4(_mm_loadu_ps(&from[i + 4]), scales), o1, &to[i + 4]);
+			toneBytes4(toneCurve4(_mm_loadu_ps(&from[i + 8]), scales), o2, &to[i + 8]);
+		}
+#endif
+		for (; i < w * 3; i++) {
+			to[i] = toneByte(toneCurve(from[i], scale), offsets[(i / 3) & 3]);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	toneMapSeconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
@@ -0,0 +1,150 @@
+// Variable rate rendering
+// With -variablerate n the image is traced in blocks of n x n pixels (n is 2 or 4) instead of
+// ray by ray. A block first traces the 4 pixels at its corners, which it shares with the blocks
+// around it. When all 4 hit the same primitive, the primitive does not reflect or refract, and
+// no channel of their colors differs by more than VARIABLE_RATE_CONTRAST, the pixels in between
+// are interpolated from the corners. Otherwise the block is split into 4 blocks of half the size
+// until the blocks are single pixels, so silhouettes, shadow edges and mirrors are traced at the
+// full rate. The interpolation never crosses an edge between primitives, as a block that spans
+// one is always split, and a pixel on the edge of two blocks only depends on the 2 corners of
+// that edge, so it comes out the same from both sides. A pixel that one block traced is never
+// overwritten by an interpolation of another block.
+
+// largest difference of a channel between the corners of a block that is interpolated
+#define VARIABLE_RATE_CONTRAST 0.03
+
+// what the last frame did, for -stats
+long variableRays;
+long variableBlocks;
+long variableFlat;
+
+typedef struct {
+	int w, h;
+	double width, height;
+	Object** objects;
+	float* hdr;
+	char* state;    // 0 = not done, 1 = interpolated, 2 = traced
+	int* id;        // the primitive of the traced pixels
+} RateImage;
+
+// rateColor() returns the color of the pixel j, k in the image
+static inline float* rateColor(RateImage* image, int j, int k) {
+	return &image->hdr[((size_t)(image->h - k - 1) * image->w + j) * 3];
+}
+
+// ratePixel() traces the pixel j, k unless it was traced already
+static void ratePixel(RateImage* image, int j, int k) {
+	int p = k * image->w + j;
+	if (image->state[p] == 2) {
+		return;
+	}
+	double Ro[3] = { 0, 0, 0 };
+	double Rd[3], depth;
+	pixelDirection(image->width, image->height, image->w, image->h, j, k, Rd);
+	seedRandom((unsigned long long)k * image->w + j);
+	stats.primaryRays += 1;
+	variableRays += 1;
+	int id = intersect(Ro, Rd, &depth);
+	double* color = shadeHit(Rd, Ro, image->objects, 0, 0, id, depth);
+	float* to = rateColor(image, j, k);
+	int a;
+	for (a = 0; a < 3; a++) {
+		to[a] = (float)color[a];
+	}
+	free(color);
+	image->id[p] = id;
+	image->state[p] = 2;
+}
+
+// flatCorners() tells if the block between the corners j0, k0 and j1, k1 can be interpolated
+static int flatCorners(RateImage* image, int j0, int k0, int j1, int k1) {
+	int corners[4] = { k0 * image->w + j0, k0 * image->w + j1, k1 * image->w + j0, k1 * image->w + j1 };
+	float* colors[4] = { rateColor(image, j0, k0), rateColor(image, j1, k0), rateColor(image, j0, k1), rateColor(image, j1, k1) };
+	int id = image->id[corners[0]], i, a;
+	if (id >= 0) {
+		Material* material = primitiveMaterial(scene, id);
+		if (material->reflectivity > 0 || material->refractivity > 0) {
+			return 0;
+		}
+	}
+	for (i = 1; i < 4; i++) {
+		if (image->id[corners[i]] != id) {
+			return 0;
+		}
+		for (a = 0; a < 3; a++) {
+			double c0 = clamp(colors[0][a]);
+			double ci = clamp(colors[i][a]);
+			if (fabs(ci - c0) > VARIABLE_RATE_CONTRAST) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+// rateBlock() renders the pixels j0..j0+size, k0..k0+size of the image, clipped to its edges
+static void rateBlock(RateImage* image, int j0, int k0, int size) {
+	int j1 = j0 + size < image->w ? j0 + size : image->w - 1;
+	int k1 = k0 + size < image->h ? k0 + size : image->h - 1;
+	ratePixel(image, j0, k0);
+	ratePixel(image, j1, k0);
+	ratePixel(image, j0, k1);
+	ratePixel(image, j1, k1);
+	if (j1 - j0 <= 1 && k1 - k0 <= 1) {
+		return;
+	}
+	variableBlocks += 1;
+	if (!flatCorners(image, j0, k0, j1, k1)) {
+		int half = size / 2;
+		rateBlock(image, j0, k0, half);
+		if (j0 + half < j1) {
+			rateBlock(image, j0 + half, k0, half);
+		}
+		if (k0 + half < k1) {
+			rateBlock(image, j0, k0 + half, half);
+		}
+		if (j0 + half < j1 && k0 + half < k1) {
+			rateBlock(image, j0 + half, k0 + half, half);
+		}
+		return;
+	}
+	variableFlat += 1;
+	float* corners[4] = { rateColor(image, j0, k0), rateColor(image, j1, k0), rateColor(image, j0, k1), rateColor(image, j1, k1) };
+	int j, k, a;
+	for (k = k0; k <= k1; k++) {
+		for (j = j0; j <= j1; j++) {
+			int p = k * image->w + j;
+			if (image->state[p] != 0) {
+				continue;
+			}
+			double u = j1 > j0 ? (double)(j - j0) / (j1 - j0) : 0;
+			double v = k1 > k0 ? (double)(k - k0) / (k1 - k0) : 0;
+			float* to = rateColor(image, j, k);
+			for (a = 0; a < 3; a++) {
+				to[a] = (float)((1 - v) * ((1 - u) * corners[0][a] + u * corners[1][a]) + v * ((1 - u) * corners[2][a] + u * corners[3][a]));
+			}
+			image->state[p] = 1;
+		}
+	}
+}
+
+// variableRate() renders the w x h image into the float colors hdr with the camera size width x height
+void variableRate(float* hdr, int w, int h, double width, double height, Object** objects) {
+	size_t size = (size_t)w * h;
+	RateImage image = { w, h, width, height, objects, hdr, calloc(size, 1), malloc(sizeof(int) * size) };
+	if (image.state == NULL || image.id == NULL) {
+		fprintf(stderr, "Error: allocate the memory un successfully. \n");
+		exit(1);
+	}
+	variableRays = 0;
+	variableBlocks = 0;
+	variableFlat = 0;
+	int j, k, n = options.variableRate;
+	for (k = 0; k < h - 1 || k == 0; k += n) {
+		for (j = 0; j < w - 1 || j == 0; j += n) {
+			rateBlock(&image, j, k, n);
+		}
+	}
+	free(image.state);
+	free(image.id);
+}
@@ -0,0 +1,32 @@
+#ifndef VECTOR_H
+#define VECTOR_H
+#include <math.h>
+
+// return the square value of v
+static inline double sqr(double v) {
+	return v*v;
+}
+
+// normalize the vector to a 3d unit vector
+static inline void normalize(double* v) {
+	double len = sqrt(sqr(v[0]) + sqr(v[1]) + sqr(v[2]));
+	v[0] /= len;
+	v[1] /= len;
+	v[2] /= len;
+}
+
+// set t and b to unit vectors normal to the unit vector axis and to each other
+static inline void orthonormalBasis(double* axis, double* t, double* b) {
+	if (fabs(axis[0]) > 0.9) {
+		t[0] = axis[1]; t[1] = -axis[0]; t[2] = 0;
+	}
+	else {
+		t[0] = 0; t[1] = axis[2]; t[2] = -axis[1];
+	}
+	normalize(t);
+	b[0] = axis[1] * t[2] - axis[2] * t[1];
+	b[1] = axis[2] * t[0] - axis[0] * t[2];
+	b[2] = axis[0] * t[1] - axis[1] * t[0];
+}
+
+#endif
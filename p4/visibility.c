@@ -0,0 +1,104 @@
+// Rasterized primary visibility
+// Every primary ray starts at the pinhole in the origin, so with -raster the first hit of each
+// pixel is found by drawing the objects instead of tracing rays: a sphere only tests the
+// pixels inside its projected bounds and a plane is solved once per pixel. The buffer keeps
+// the primitive and the distance of the closest hit, shading starts from there and only
+// the shadow, reflection and refraction rays are traced. Background pixels are never shaded.
+
+typedef struct {
+	int width;
+	int height;
+	int* id;       // primitive of the closest hit, -1 for the background
+	double* depth; // distance along the normalized primary ray
+} VisibilityBuffer;
+
+// pixelDirection() sets Rd to the normalized primary ray through pixel j of row k
+static inline void pixelDirection(double width, double height, int w, int h, int j, int k, double* Rd) {
+	double pixwidth = width / w;
+	double pixheight = height / h;
+	Rd[0] = -width / 2 + pixwidth * (j + 0.5);
+	Rd[1] = -height / 2 + pixheight * (k + 0.5);
+	Rd[2] = 1;
+	normalize(Rd);
+}
+
+// the range of pixels [lo, hi] that the sphere can cover on one image axis, the axis is x
+// for a = 0 and y for a = 1. The sphere has to be in front of the camera plane.
+static void sphereScreenRange(double* center, double r, int a, double size, int pixels, int* lo, int* hi) {
+	// in the plane of the axis and z the sphere is a disk, the tangent lines from the origin
+	// give the exact edges of its projection on the image plane z = 1
+	double d = sqrt(sqr(center[a]) + sqr(center[2]));
+	double angle = atan2(center[a], center[2]);
+	double half = asin(r / d);
+	double from = tan(angle - half);
+	double to = tan(angle + half);
+	double pixsize = size / pixels;
+	// one pixel of slack on both sides covers the rounding of the tangents
+	*lo = (int)floor((from + size / 2) / pixsize - 0.5) - 1;
+	*hi = (int)ceil((to + size / 2) / pixsize - 0.5) + 1;
+	if (*lo < 0) *lo = 0;
+	if (*hi > pixels - 1) *hi = pixels - 1;
+}
+
+// rasterizeVisibility() fills the visibility buffer for a w x h image of the camera with the
+// given width and height. The primitives are drawn in order with the same tests as intersect(),
+// so every pixel gets exactly the primitive that the primary ray would have found.
+VisibilityBuffer* rasterizeVisibility(Scene* scene, int w, int h, double width, double height) {
+	VisibilityBuffer* vis = malloc(sizeof(VisibilityBuffer));
+	double* directions = malloc(sizeof(double) * 3 * w * h);
+	vis->width = w;
+	vis->height = h;
+	vis->id = malloc(sizeof(int) * w * h);
+	vis->depth = malloc(sizeof(double) * w * h);
+	if (vis->id == NULL || vis->depth == NULL || directions == NULL) {
+		fprintf(stderr, "Error: Could not allocate memory for the visibility buffer.\n");
+		exit(1);
+	}
+	int j, k, p, o;
+	double Ro[3] = { 0, 0, 0 };
+	for (k = 0; k < h; k++) {
+		for (j = 0; j < w; j++) {
+			p = k * w + j;
+			pixelDirection(width, height, w, h, j, k, &directions[p * 3]);
+			vis->id[p] = -1;
+			vis->depth[p] = INFINITY;
+		}
+	}
+
+	for (o = 0; o < scene->sphereCount + scene->planeCount; o++) {
+		int x0 = 0, x1 = w - 1, y0 = 0, y1 = h - 1;
+		int isSphere = o < scene->sphereCount;
+		double* plane = &scene->planes[(o - scene->sphereCount) * 6];
+		if (isSphere) {
+			double* c = &scene->spheres[o * 4];
+			double r = c[3];
+			if (c[2] + r <= 0) {
+				// behind the camera
+				continue;
+			}
+			// a sphere that reaches the camera plane can cover any pixel
+			if (c[2] - r > 0) {
+				sphereScreenRange(c, r, 0, width, w, &x0, &x1);
+				sphereScreenRange(c, r, 1, height, h, &y0, &y1);
+			}
+		}
+		for (k = y0; k <= y1; k++) {
+			for (j = x0; j <= x1; j++) {
+				p = k * w + j;
+				double t;
+				if (isSphere) {
+					t = sphereIntersection(Ro, &directions[p * 3], &scene->spheres[o * 4], scene->spheres[o * 4 + 3]);
+				}
+				else {
+					t = planeIntersection(Ro, &directions[p * 3], plane, &plane[3]);
+				}
+				if (t > 0 && t <= vis->depth[p]) {
+					vis->depth[p] = t;
+					vis->id[p] = o;
+				}
+			}
+		}
+	}
+	free(directions);
+	return vis;
+}